@@ -0,0 +1,231 @@
+#include "sds/sds.h"
+#include "tinyvm.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Ahead-of-time compiler from bytecode to C.
+ *
+ * The top level and every function body become C functions made of calls to
+ * the helpers in aot_runtime.h; branches become gotos. Operands are created
+ * once at startup into the table K, so a constant is the same TValue on every
+ * execution just like in the interpreter.
+ */
+
+typedef struct {
+  FILE *out;      // function bodies, copied after the declarations
+  Vector *consts; // operand of every K index
+  Vector *funcs;  // tOpFunctionDeclare Inst of every fn_<index>
+} AOTContext;
+
+/* Helper of every opcode but those emit_body compiles itself */
+static const char *const helper_names[tOpCount] = {
+#define VM_CONTROL(op_name, ...)
+#define VM_HANDLER(op_name, ...) [op_name] = "aot_" #op_name,
+#include "vm_handlers.h"
+#undef VM_HANDLER
+#undef VM_CONTROL
+    [tOpCall] = "aot_call",
+};
+
+static const char *helper_name(Opcode op) {
+  return op >= 0 && op < tOpCount ? helper_names[op] : NULL;
+}
+
+static long long int constant(AOTContext *ctx, TValue *tv) {
+  vec_push(ctx->consts, tv);
+  return ctx->consts->len - 1;
+}
+
+static void emit_string(FILE *out, sds s) {
+  fputc('"', out);
+  for (size_t i = 0; i < sdslen(s); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c >= 0x20 && c < 0x7f) {
+      fputc(c, out);
+    } else {
+      fprintf(out, "\\%03o", c);
+    }
+  }
+  fputc('"', out);
+}
+
+/**
+ * Print a C expression creating a copy of tv. Returns false for values that
+ * cannot appear as operands.
+ */
+static bool emit_value(FILE *out, TValue *tv) {
+  switch (tv->tt) {
+  case Long:
+    if (tv->value.integer == LLONG_MIN) {
+      fprintf(out, "new_TValue_with_integer(LLONG_MIN)");
+    } else {
+      fprintf(out, "new_TValue_with_integer(%lldLL)", tv->value.integer);
+    }
+    return true;
+  case String:
+    fprintf(out, "new_TValue_with_str(sdsnewlen(");
+    emit_string(out, tv->value.str);
+    fprintf(out, ", %zu))", sdslen(tv->value.str));
+    return true;
+  case Bool:
+    fprintf(out, "new_TValue_with_bool(%s)",
+            tv->value.boolean ? "true" : "false");
+    return true;
+  case Array: {
+    TArray *array = tv->value.array;
+    fprintf(out, "aot_array(%lld", array->len);
+    for (long long int i = 0; i < array->len; i++) {
+      fprintf(out, ", ");
+      if (!emit_value(out, ta_get(array, i))) {
+        return false;
+      }
+    }
+    fprintf(out, ")");
+    return true;
+  }
+  case Null:
+    fprintf(out, "new_TValue()");
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * Emit the statements of a function body. Nested declarations are queued in
+ * ctx->funcs and emitted as functions of their own.
+ */
+static bool emit_body(AOTContext *ctx, Vector *insts) {
+  FILE *out = ctx->out;
+  bool *is_target = xmalloc(sizeof(bool) * (insts->len + 1));
+  memset(is_target, 0, sizeof(bool) * (insts->len + 1));
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (op_is_branch(inst->op)) {
+      is_target[inst->target != NULL ? inst->target->idx : insts->len] = true;
+    }
+  }
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    long long int target =
+        inst->target != NULL ? inst->target->idx : insts->len;
+
+    if (is_target[i]) {
+      fprintf(out, "L%lld:;\n", i);
+    }
+
+    switch (inst->op) {
+    case tOpNop:
+      break;
+    case tOpJumpRel:
+    case tOpJumpAbs:
+      fprintf(out, "  goto L%lld;\n", target);
+      break;
+    case tOpIFStatement:
+      fprintf(out, "  if (!aot_if(vm))\n    goto L%lld;\n", target);
+      break;
+    case tOpReturn:
+      fprintf(out, "  return aot_peek(vm);\n");
+      break;
+    case tOpFunctionDeclare:
+      fprintf(out, "  aot_declare(vm, K[%lld], fn_%lld);\n",
+              constant(ctx, inst->operand), ctx->funcs->len);
+      vec_push(ctx->funcs, inst);
+      break;
+    default: {
+      const char *helper = helper_name(inst->op);
+      if (helper == NULL) {
+        return false;
+      }
+      if (inst->operand != NULL) {
+        fprintf(out, "  %s(vm, K[%lld]);\n", helper,
+                constant(ctx, inst->operand));
+      } else {
+        fprintf(out, "  %s(vm, NULL);\n", helper);
+      }
+      break;
+    }
+    }
+  }
+
+  Inst *last = insts->len > 0 ? insts->data[insts->len - 1] : NULL;
+  if (is_target[insts->len]) {
+    fprintf(out, "L%lld:;\n", insts->len);
+  } else if (last != NULL && last->op == tOpReturn) {
+    return true;
+  }
+  fprintf(out, "  return aot_peek(vm);\n");
+  return true;
+}
+
+/**
+ * Translate code to a C program linking against the runtime and write it to
+ * out. Returns false if the code cannot be compiled.
+ */
+bool aot_emit_c(Vector *code, FILE *out, const char *source) {
+  Vector *insts = code_decode(code);
+  if (insts == NULL) {
+    return false;
+  }
+
+  AOTContext ctx;
+  ctx.out = tmpfile();
+  ctx.consts = new_vec();
+  ctx.funcs = new_vec();
+  if (ctx.out == NULL) {
+    return false;
+  }
+
+  fprintf(ctx.out, "static TValue *aot_main(VM *vm) {\n");
+  bool ok = emit_body(&ctx, insts);
+  fprintf(ctx.out, "}\n");
+
+  for (long long int i = 0; ok && i < ctx.funcs->len; i++) {
+    Inst *decl = ctx.funcs->data[i];
+    fprintf(ctx.out, "\n/* %s */\n", tv_getString(decl->operand));
+    fprintf(ctx.out, "static TValue *fn_%lld(VM *vm) {\n", i);
+    ok = emit_body(&ctx, decl->body);
+    fprintf(ctx.out, "}\n");
+  }
+  if (!ok) {
+    fclose(ctx.out);
+    return false;
+  }
+
+  fprintf(out, "/* Generated by tinyvm --emit-c from %s */\n", source);
+  fprintf(out, "#include \"aot_runtime.h\"\n");
+  fprintf(out, "#include <limits.h>\n\n");
+  fprintf(out, "static TValue *K[%lld];\n\n", ctx.consts->len + 1);
+  for (long long int i = 0; i < ctx.funcs->len; i++) {
+    fprintf(out, "static TValue *fn_%lld(VM *vm);\n", i);
+  }
+  fprintf(out, "\n");
+
+  rewind(ctx.out);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), ctx.out)) > 0) {
+    fwrite(buf, 1, n, out);
+  }
+  fclose(ctx.out);
+
+  fprintf(out, "\nint main(void) {\n");
+  fprintf(out, "  VM *vm = aot_new_VM();\n");
+  for (long long int i = 0; i < ctx.consts->len; i++) {
+    fprintf(out, "  K[%lld] = ", i);
+    if (!emit_value(out, ctx.consts->data[i])) {
+      return false;
+    }
+    fprintf(out, ";\n");
+  }
+  fprintf(out, "  aot_main(vm);\n");
+  fprintf(out, "  return 0;\n");
+  fprintf(out, "}\n");
+  return true;
+}
@@ -0,0 +1,108 @@
+#ifndef __TINY_VM_AOT_RUNTIME_INCLUDE_GUARD__
+#define __TINY_VM_AOT_RUNTIME_INCLUDE_GUARD__
+
+/**
+ * Runtime support for C generated by `tinyvm --emit-c`.
+ *
+ * Every function of the program becomes a C function with the signature of
+ * JITCode and is stored in the jit_code of its VMFunction, so calls go
+ * straight to native code. The helpers below are the handlers vm.c runs;
+ * the generated file only needs the runtime (value.c, env.c, util.c, avl.c,
+ * builtins.c, channel.c and sds) to link.
+ */
+
+#include "tinyvm.h"
+
+#ifdef __USE_BOEHM_GC__
+#include <gc.h>
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline TValue *aot_peek(VM *vm) {
+  if (vm->stack->len > 0) {
+    return (TValue *)vec_last(vm->stack);
+  } else {
+    return NULL;
+  }
+}
+
+/**
+ * aot_<opcode>(vm, operand) for every VM_HANDLER of vm_handlers.h, the body
+ * the interpreter runs. Calls and branches are left to the generated code.
+ */
+#define VM_OPERAND() operand
+#define VM_CONTROL(op_name, ...)
+#define VM_HANDLER(op_name, ...)                                               \
+  static inline void aot_##op_name(VM *vm, TValue *operand) {                  \
+    (void)vm;                                                                  \
+    (void)operand;                                                             \
+    __VA_ARGS__;                                                               \
+  }
+#include "vm_handlers.h"
+#undef VM_HANDLER
+#undef VM_CONTROL
+#undef VM_OPERAND
+
+static inline void aot_call(VM *vm, TValue *fname) {
+  TValue *func_tv = env_get(vm->env, tv_getString(fname));
+  VM_ASSERT(func_tv != NULL &&
+                (func_tv->tt == Function || func_tv->tt == Native),
+            "Execute Error on tOpCall");
+  if (func_tv->tt == Native) {
+    tv_getNative(func_tv)->func(vm);
+    return;
+  }
+  VMFunction *func = tv_getFunction(func_tv);
+
+  Env *cpyEnv = vm->env;
+  vm->env = env_dup(func->env);
+  ((JITCode)func->jit_code)(vm);
+  vm->env = cpyEnv;
+}
+
+static inline bool aot_if(VM *vm) {
+  TValue *cond = (TValue *)vec_pop(vm->stack);
+  bool taken = false;
+  VM_CONDITION(taken, cond);
+  return taken;
+}
+
+static inline void aot_declare(VM *vm, TValue *symbol, JITCode code) {
+  sds func_name = tv_getString(symbol);
+  VMFunction *func = new_VMFunction(func_name, new_vec(), env_dup(vm->env));
+  func->jit_code = (void *)code;
+  env_def(vm->env, func_name, new_TValue_with_func(func));
+}
+
+/* Array constant with n elements */
+static inline TValue *aot_array(int n, ...) {
+  Vector *array = new_vec();
+  va_list ap;
+  va_start(ap, n);
+  for (int i = 0; i < n; i++) {
+    vec_push(array, va_arg(ap, TValue *));
+  }
+  va_end(ap);
+  return new_TValue_with_array(array);
+}
+
+static inline VM *aot_new_VM(void) {
+#ifdef __USE_BOEHM_GC__
+  GC_INIT();
+#endif
+
+  VM *vm = new_bare_VM();
+  vm->jit_threshold = -1;
+  vm->trace_threshold = -1;
+
+  /* the builtins of the runtime, parallel and coroutine ones need vm.c */
+  env_def_builtins(vm->env);
+  env_def_channels(vm->env);
+
+  return vm;
+}
+
+#endif
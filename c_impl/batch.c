@@ -0,0 +1,235 @@
+#include "tinyvm.h"
+
+#include <pthread.h>
+
+#ifdef __USE_BOEHM_GC__
+#include <gc.h>
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * `tinyvm --batch`, many jobs in one process.
+ *
+ * A job is either a compiled file or one input of a program shared by the
+ * whole batch as a Module. Every job runs in a VM of its own on a pool of
+ * worker threads. Jobs are dealt round-robin to per-worker queues; a worker
+ * takes its jobs from the front, in the order they were given, and when its
+ * queue runs dry steals from the back of the others, so a few slow jobs do
+ * not leave the rest of the pool idle.
+ *
+ * Each job prints to a buffer of its own. The calling thread writes the
+ * buffers out in job order as soon as every job before them has finished.
+ */
+
+typedef struct {
+  pthread_mutex_t lock;
+  long long int *jobs; // indexes into the batch
+  long long int front;
+  long long int back;
+} WorkQueue;
+
+typedef struct {
+  BatchConfig *config;
+  Module *module;
+  BatchJob *jobs;
+  WorkQueue *queues;
+  int workers;
+  pthread_mutex_t lock; // guards done of the jobs
+  pthread_cond_t done;
+} Batch;
+
+typedef struct {
+  Batch *batch;
+  int id;
+} Worker;
+
+static long long int take(WorkQueue *q, bool steal) {
+  long long int job = -1;
+  pthread_mutex_lock(&q->lock);
+  if (q->front < q->back) {
+    job = steal ? q->jobs[--q->back] : q->jobs[q->front++];
+  }
+  pthread_mutex_unlock(&q->lock);
+  return job;
+}
+
+static long long int next_job(Batch *batch, int id) {
+  long long int job = take(&batch->queues[id], false);
+  for (int i = 1; job < 0 && i < batch->workers; i++) {
+    job = take(&batch->queues[(id + i) % batch->workers], true);
+  }
+  return job;
+}
+
+/* A VM set up by config printing to out, for a job of a pool of threads */
+VM *batch_open_vm(BatchConfig *config, FILE *out) {
+  VM *vm = vm_open();
+  vm->jit_threshold = config->jit_threshold;
+  vm->trace_threshold = config->trace_threshold;
+  vm->engine = config->engine;
+  vm->dispatch = config->dispatch;
+  vm->out = out;
+  vm->workers = 1; // the pool keeps the cores busy already
+  return vm;
+}
+
+static void run_job(Batch *batch, BatchJob *job) {
+  BatchConfig *config = batch->config;
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&buf, &len);
+
+  VM *vm = batch_open_vm(config, out);
+  if (job->input != NULL) {
+    env_def(vm->env, sdsnew("input"), job->input);
+  }
+
+  int status = job->filename != NULL
+                   ? vm_load_file(vm, job->filename, config->opt_level)
+                   : vm_load_module(vm, batch->module);
+  job->error = status == VMOk ? NULL : vm->error;
+  vm_close(vm);
+
+  fclose(out);
+  job->output = sdsnewlen(buf, len);
+  free(buf);
+}
+
+static void *work(void *arg) {
+  Worker *worker = arg;
+  Batch *batch = worker->batch;
+  long long int i;
+  while ((i = next_job(batch, worker->id)) >= 0) {
+    run_job(batch, &batch->jobs[i]);
+    pthread_mutex_lock(&batch->lock);
+    batch->jobs[i].done = true;
+    pthread_cond_broadcast(&batch->done);
+    pthread_mutex_unlock(&batch->lock);
+  }
+  return NULL;
+}
+
+static int pool_size(BatchConfig *config, long long int n) {
+  long long int workers = config->workers;
+  if (workers <= 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers > n) {
+    workers = n;
+  }
+  return workers < 1 ? 1 : (int)workers;
+}
+
+/**
+ * Run n jobs, those without a filename run module. Outputs are written to
+ * out and errors to err in job order, unless they are NULL. Returns the
+ * number of jobs that failed.
+ */
+long long int batch_run(BatchConfig *config, Module *module, BatchJob *jobs,
+                        long long int n, FILE *out, FILE *err) {
+  Batch batch;
+  batch.config = config;
+  batch.module = module;
+  batch.jobs = jobs;
+  batch.workers = pool_size(config, n);
+  batch.queues = xmalloc(sizeof(WorkQueue) * batch.workers);
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.done, NULL);
+
+  for (int w = 0; w < batch.workers; w++) {
+    WorkQueue *q = &batch.queues[w];
+    pthread_mutex_init(&q->lock, NULL);
+    q->jobs = xmalloc(sizeof(long long int) * (n / batch.workers + 1));
+    q->front = 0;
+    q->back = 0;
+  }
+  for (long long int i = 0; i < n; i++) {
+    jobs[i].output = NULL;
+    jobs[i].error = NULL;
+    jobs[i].done = false;
+    WorkQueue *q = &batch.queues[i % batch.workers];
+    q->jobs[q->back++] = i;
+  }
+
+  pthread_t *threads = xmalloc(sizeof(pthread_t) * batch.workers);
+  Worker *workers = xmalloc(sizeof(Worker) * batch.workers);
+  int started = 0;
+  for (int w = 0; w < batch.workers; w++) {
+    workers[w].batch = &batch;
+    workers[w].id = w;
+    if (pthread_create(&threads[w], NULL, work, &workers[w]) != 0) {
+      /* out of threads, help the ones running steal everything left */
+      work(&workers[w]);
+      break;
+    }
+    started++;
+  }
+
+  long long int failed = 0;
+  for (long long int i = 0; i < n; i++) {
+    pthread_mutex_lock(&batch.lock);
+    while (!jobs[i].done) {
+      pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+
+    if (out != NULL) {
+      fwrite(jobs[i].output, 1, sdslen(jobs[i].output), out);
+      fflush(out);
+    }
+    if (jobs[i].error != NULL) {
+      failed++;
+      if (err != NULL) {
+        fprintf(err, "<VM-ERROR> job %lld%s%s: %s\n", i,
+                jobs[i].filename != NULL ? " " : "",
+                jobs[i].filename != NULL ? jobs[i].filename : "",
+                jobs[i].error);
+      }
+    }
+  }
+
+  for (int w = 0; w < started; w++) {
+    pthread_join(threads[w], NULL);
+  }
+  return failed;
+}
+
+/* A Long if s is a number and a String otherwise */
+TValue *batch_parse_input(char *s, size_t len) {
+  char *end;
+  long long int x = strtoll(s, &end, 10);
+  if (len > 0 && end == s + len) {
+    return new_TValue_with_integer(x);
+  }
+  return new_TValue_with_str(sdsnewlen(s, len));
+}
+
+/**
+ * The lines of filename as inputs of a batch, Longs where a line is a
+ * number and Strings otherwise. NULL if the file can not be opened.
+ */
+Vector *batch_read_inputs(char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (fp == NULL) {
+    return NULL;
+  }
+
+  Vector *inputs = new_vec();
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, fp)) >= 0) {
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    vec_push(inputs, batch_parse_input(line, len));
+  }
+  free(line);
+  fclose(fp);
+  return inputs;
+}
@@ -0,0 +1,188 @@
+#include "sds/sds.h"
+#include "tinyvm.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Array indexing on the stack and bounds-check elimination.
+ *
+ * tOpGetArrayElement t and tOpSetArrayElement t are lowered to
+ * `tOpGetVariable t; tOpArrayLoad` and `tOpGetVariable t; tOpArrayStore`, so
+ * the array is an ordinary stack value, and calls to the len builtin become
+ * tOpArrayLength.
+ *
+ * A loop whose header is `i < len(a)` proves a[i] below the length of a in
+ * its body up to the first instruction that may change i or a: a store to
+ * either, a call or the target of a branch from elsewhere. Those accesses
+ * lose their upper bound check. They still check that i is not negative:
+ * nothing in the code tells what a host, a batch input or another module
+ * binds to a global before the loop runs.
+ */
+
+static bool is_store(Opcode op) {
+  return op == tOpVariableDeclareOnlySymbol ||
+         op == tOpVariableDeclareWithAssign || op == tOpSetVariablePop ||
+         op == tOpAssignExpression;
+}
+
+static bool binds(Vector *insts, char *name) {
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpFunctionDeclare && binds(inst->body, name)) {
+      return true;
+    }
+    if ((is_store(inst->op) || inst->op == tOpFunctionDeclare) &&
+        !strcmp(tv_getString(inst->operand), name)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static Vector *lower(Vector *insts, bool len_builtin) {
+  Vector *ret = new_vec();
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    Opcode op = inst->op;
+
+    if (op == tOpFunctionDeclare) {
+      inst->body = lower(inst->body, len_builtin);
+    }
+    vec_push(ret, inst);
+
+    /* the first instruction is kept, branches may target it */
+    if (op == tOpGetArrayElement || op == tOpSetArrayElement) {
+      inst->op = tOpGetVariable;
+      vec_push(ret, new_Inst(op == tOpGetArrayElement ? tOpArrayLoad
+                                                      : tOpArrayStore,
+                             NULL));
+    } else if (op == tOpCall && len_builtin &&
+               !strcmp(tv_getString(inst->operand), "len")) {
+      inst->op = tOpArrayLength;
+      inst->operand = NULL;
+    }
+  }
+
+  for (long long int i = 0; i < ret->len; i++) {
+    ((Inst *)ret->data[i])->idx = i;
+  }
+  return ret;
+}
+
+static bool is_get(Inst *inst, sds name) {
+  return inst->op == tOpGetVariable &&
+         !strcmp(tv_getString(inst->operand), name);
+}
+
+/**
+ * The loop condition at header, `i < len(a)` or `len(a) > i`. Returns the
+ * tOpIFStatement and sets *index and *array.
+ */
+static Inst *loop_condition(Vector *insts, long long int header, sds *index,
+                            sds *array) {
+  if (header + 5 > insts->len) {
+    return NULL;
+  }
+  Inst **c = (Inst **)insts->data + header;
+  Opcode cmp = op_generic(c[3]->op);
+  if (c[4]->op != tOpIFStatement) {
+    return NULL;
+  }
+  if (cmp == tOpLtExpression && c[0]->op == tOpGetVariable &&
+      c[1]->op == tOpArrayLength && c[2]->op == tOpGetVariable) {
+    *array = tv_getString(c[0]->operand);
+    *index = tv_getString(c[2]->operand);
+    return c[4];
+  }
+  if (cmp == tOpGtExpression && c[0]->op == tOpGetVariable &&
+      c[1]->op == tOpGetVariable && c[2]->op == tOpArrayLength) {
+    *index = tv_getString(c[0]->operand);
+    *array = tv_getString(c[1]->operand);
+    return c[4];
+  }
+  return NULL;
+}
+
+static bool changes(Inst *inst, sds index, sds array) {
+  if (is_store(inst->op) || inst->op == tOpFunctionDeclare) {
+    sds name = tv_getString(inst->operand);
+    return !strcmp(name, index) || !strcmp(name, array);
+  }
+  return inst->op == tOpCall;
+}
+
+/* Drop the checks of the loop from header to the back edge at latch */
+static void eliminate_loop(Vector *insts, long long int *first_source,
+                           long long int *last_source, long long int header,
+                           long long int latch) {
+  sds index, array;
+  Inst *cond = loop_condition(insts, header, &index, &array);
+  if (cond == NULL || (cond->target != NULL && cond->target->idx <= latch)) {
+    return;
+  }
+  for (long long int i = header + 1; i <= cond->idx; i++) {
+    if (first_source[i] >= 0) {
+      return;
+    }
+  }
+
+  for (long long int i = cond->idx + 1; i < latch; i++) {
+    Inst *inst = insts->data[i];
+    /* only forward branches from the body since the condition reach i */
+    if ((first_source[i] >= 0 && first_source[i] <= cond->idx) ||
+        last_source[i] >= i || changes(inst, index, array)) {
+      return;
+    }
+    if ((inst->op == tOpArrayLoad || inst->op == tOpArrayStore) &&
+        i - 2 > cond->idx && is_get(insts->data[i - 1], array) &&
+        is_get(insts->data[i - 2], index)) {
+      inst->op = inst->op == tOpArrayLoad ? tOpArrayLoadUnchecked
+                                          : tOpArrayStoreUnchecked;
+    }
+  }
+}
+
+static void eliminate(Vector *insts) {
+  long long int n = insts->len;
+  long long int *first_source = xmalloc(sizeof(long long int) * (n + 1));
+  long long int *last_source = xmalloc(sizeof(long long int) * (n + 1));
+  for (long long int i = 0; i <= n; i++) {
+    first_source[i] = -1;
+    last_source[i] = -1;
+  }
+  for (long long int i = 0; i < n; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpFunctionDeclare) {
+      eliminate(inst->body);
+    }
+    if (op_is_branch(inst->op)) {
+      long long int t = inst->target != NULL ? inst->target->idx : n;
+      if (first_source[t] < 0) {
+        first_source[t] = i;
+      }
+      last_source[t] = i;
+    }
+  }
+
+  for (long long int i = 0; i < n; i++) {
+    Inst *inst = insts->data[i];
+    if ((inst->op == tOpJumpRel || inst->op == tOpJumpAbs) &&
+        inst->target != NULL && inst->target->idx <= i) {
+      eliminate_loop(insts, first_source, last_source,
+                     inst->target->idx, i);
+    }
+  }
+}
+
+/**
+ * Lower the named array accesses to stack operands and drop the bounds
+ * checks that loop conditions already prove.
+ */
+Vector *eliminate_bounds_checks(Vector *insts) {
+  insts = lower(insts, !binds(insts, "len"));
+  eliminate(insts);
+  return insts;
+}
@@ -0,0 +1,579 @@
+#include "tinyvm.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BUILTINS_X86
+#endif
+
+/**
+ * Builtin functions, bound as Native values by new_VM and aot_new_VM.
+ *
+ * The array kernels below work on unboxed Long arrays with AVX2 or SSE when
+ * the CPU has them, checked on every call, and a scalar loop otherwise.
+ * Boxed arrays take the scalar path element by element.
+ */
+
+//////////////////  scalar kernels  //////////////////
+
+static long long int sum_scalar(const long long int *xs, long long int n) {
+  unsigned long long int s = 0; // wraps like tOpAdd
+  for (long long int i = 0; i < n; i++) {
+    s += (unsigned long long int)xs[i];
+  }
+  return (long long int)s;
+}
+
+static long long int extreme_scalar(const long long int *xs, long long int n,
+                                    bool max) {
+  long long int m = xs[0];
+  for (long long int i = 1; i < n; i++) {
+    if (max ? xs[i] > m : xs[i] < m) {
+      m = xs[i];
+    }
+  }
+  return m;
+}
+
+static void fill_scalar(long long int *xs, long long int n, long long int v) {
+  for (long long int i = 0; i < n; i++) {
+    xs[i] = v;
+  }
+}
+
+static long long int index_of_scalar(const long long int *xs, long long int n,
+                                     long long int v) {
+  for (long long int i = 0; i < n; i++) {
+    if (xs[i] == v) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool equal_scalar(const long long int *xs, const long long int *ys,
+                         long long int n) {
+  for (long long int i = 0; i < n; i++) {
+    if (xs[i] != ys[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#ifdef BUILTINS_X86
+
+//////////////////  AVX2 kernels  //////////////////
+
+__attribute__((target("avx2"))) static long long int
+sum_avx2(const long long int *xs, long long int n) {
+  __m256i acc = _mm256_setzero_si256();
+  long long int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *)(xs + i)));
+  }
+  long long int lanes[4];
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return sum_scalar(lanes, 4) + sum_scalar(xs + i, n - i);
+}
+
+__attribute__((target("avx2"))) static long long int
+extreme_avx2(const long long int *xs, long long int n, bool max) {
+  __m256i m = _mm256_set1_epi64x(xs[0]);
+  long long int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(xs + i));
+    __m256i take = max ? _mm256_cmpgt_epi64(v, m) : _mm256_cmpgt_epi64(m, v);
+    m = _mm256_blendv_epi8(m, v, take);
+  }
+  long long int lanes[5];
+  _mm256_storeu_si256((__m256i *)lanes, m);
+  lanes[4] = i < n ? extreme_scalar(xs + i, n - i, max) : lanes[0];
+  return extreme_scalar(lanes, 5, max);
+}
+
+__attribute__((target("avx2"))) static void
+fill_avx2(long long int *xs, long long int n, long long int v) {
+  __m256i vs = _mm256_set1_epi64x(v);
+  long long int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_si256((__m256i *)(xs + i), vs);
+  }
+  fill_scalar(xs + i, n - i, v);
+}
+
+__attribute__((target("avx2"))) static long long int
+index_of_avx2(const long long int *xs, long long int n, long long int v) {
+  __m256i vs = _mm256_set1_epi64x(v);
+  long long int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i eq =
+        _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(xs + i)), vs);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  long long int k = index_of_scalar(xs + i, n - i, v);
+  return k < 0 ? -1 : i + k;
+}
+
+__attribute__((target("avx2"))) static bool
+equal_avx2(const long long int *xs, const long long int *ys, long long int n) {
+  long long int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i eq =
+        _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(xs + i)),
+                           _mm256_loadu_si256((const __m256i *)(ys + i)));
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(eq)) != 0xf) {
+      return false;
+    }
+  }
+  return equal_scalar(xs + i, ys + i, n - i);
+}
+
+//////////////////  SSE kernels  //////////////////
+
+// SSE2 is part of x86-64, the 64-bit compares need SSE4.1 and SSE4.2
+
+static long long int sum_sse2(const long long int *xs, long long int n) {
+  __m128i acc = _mm_setzero_si128();
+  long long int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i *)(xs + i)));
+  }
+  long long int lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  return sum_scalar(lanes, 2) + sum_scalar(xs + i, n - i);
+}
+
+__attribute__((target("sse4.2"))) static long long int
+extreme_sse42(const long long int *xs, long long int n, bool max) {
+  __m128i m = _mm_set1_epi64x(xs[0]);
+  long long int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(xs + i));
+    __m128i take = max ? _mm_cmpgt_epi64(v, m) : _mm_cmpgt_epi64(m, v);
+    m = _mm_blendv_epi8(m, v, take);
+  }
+  long long int lanes[3];
+  _mm_storeu_si128((__m128i *)lanes, m);
+  lanes[2] = i < n ? extreme_scalar(xs + i, n - i, max) : lanes[0];
+  return extreme_scalar(lanes, 3, max);
+}
+
+static void fill_sse2(long long int *xs, long long int n, long long int v) {
+  __m128i vs = _mm_set1_epi64x(v);
+  long long int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    _mm_storeu_si128((__m128i *)(xs + i), vs);
+  }
+  fill_scalar(xs + i, n - i, v);
+}
+
+__attribute__((target("sse4.1"))) static long long int
+index_of_sse41(const long long int *xs, long long int n, long long int v) {
+  __m128i vs = _mm_set1_epi64x(v);
+  long long int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i eq =
+        _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i *)(xs + i)), vs);
+    int mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  long long int k = index_of_scalar(xs + i, n - i, v);
+  return k < 0 ? -1 : i + k;
+}
+
+__attribute__((target("sse4.1"))) static bool
+equal_sse41(const long long int *xs, const long long int *ys, long long int n) {
+  long long int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i eq = _mm_cmpeq_epi64(_mm_loadu_si128((const __m128i *)(xs + i)),
+                                 _mm_loadu_si128((const __m128i *)(ys + i)));
+    if (_mm_movemask_pd(_mm_castsi128_pd(eq)) != 0x3) {
+      return false;
+    }
+  }
+  return equal_scalar(xs + i, ys + i, n - i);
+}
+
+#define HAS(feature) __builtin_cpu_supports(feature)
+
+#endif
+
+//////////////////  dispatch  //////////////////
+
+long long int longs_sum(const long long int *xs, long long int n) {
+#ifdef BUILTINS_X86
+  return HAS("avx2") ? sum_avx2(xs, n) : sum_sse2(xs, n);
+#else
+  return sum_scalar(xs, n);
+#endif
+}
+
+/* Smallest or largest of n > 0 Longs */
+long long int longs_extreme(const long long int *xs, long long int n,
+                            bool max) {
+#ifdef BUILTINS_X86
+  if (HAS("avx2")) {
+    return extreme_avx2(xs, n, max);
+  }
+  if (HAS("sse4.2")) {
+    return extreme_sse42(xs, n, max);
+  }
+#endif
+  return extreme_scalar(xs, n, max);
+}
+
+void longs_fill(long long int *xs, long long int n, long long int v) {
+#ifdef BUILTINS_X86
+  if (HAS("avx2")) {
+    fill_avx2(xs, n, v);
+  } else {
+    fill_sse2(xs, n, v);
+  }
+#else
+  fill_scalar(xs, n, v);
+#endif
+}
+
+long long int longs_index_of(const long long int *xs, long long int n,
+                             long long int v) {
+#ifdef BUILTINS_X86
+  if (HAS("avx2")) {
+    return index_of_avx2(xs, n, v);
+  }
+  if (HAS("sse4.1")) {
+    return index_of_sse41(xs, n, v);
+  }
+#endif
+  return index_of_scalar(xs, n, v);
+}
+
+bool longs_equal(const long long int *xs, const long long int *ys,
+                 long long int n) {
+#ifdef BUILTINS_X86
+  if (HAS("avx2")) {
+    return equal_avx2(xs, ys, n);
+  }
+  if (HAS("sse4.1")) {
+    return equal_sse41(xs, ys, n);
+  }
+#endif
+  return equal_scalar(xs, ys, n);
+}
+
+//////////////////  sorting  //////////////////
+
+// Shorter ranges are insertion sorted
+#define SORT_CUTOFF 32
+
+static void insertion_sort_longs(long long int *xs, long long int n) {
+  for (long long int i = 1; i < n; i++) {
+    long long int x = xs[i];
+    long long int k = i;
+    for (; k > 0 && xs[k - 1] > x; k--) {
+      xs[k] = xs[k - 1];
+    }
+    xs[k] = x;
+  }
+}
+
+/**
+ * LSD radix sort, one byte per pass with the sign bit flipped so negative
+ * numbers come first. A pass whose byte is the same in every key is skipped.
+ */
+void longs_sort(long long int *xs, long long int n) {
+  if (n < SORT_CUTOFF) {
+    insertion_sort_longs(xs, n);
+    return;
+  }
+
+  const unsigned long long int sign = 1ULL << 63;
+  unsigned long long int *keys = (unsigned long long int *)xs;
+  long long int counts[8][256];
+  memset(counts, 0, sizeof(counts));
+  for (long long int i = 0; i < n; i++) {
+    unsigned long long int key = keys[i] ^ sign;
+    for (int b = 0; b < 8; b++) {
+      counts[b][(key >> (8 * b)) & 0xff]++;
+    }
+  }
+
+  unsigned long long int *src = keys;
+  unsigned long long int *dst =
+      xmalloc_atomic(sizeof(unsigned long long int) * n);
+  unsigned long long int *tmp = dst;
+  for (int b = 0; b < 8; b++) {
+    long long int *count = counts[b];
+    if (count[((src[0] ^ sign) >> (8 * b)) & 0xff] == n) {
+      continue;
+    }
+    long long int offset = 0;
+    for (int d = 0; d < 256; d++) {
+      long long int c = count[d];
+      count[d] = offset;
+      offset += c;
+    }
+    for (long long int i = 0; i < n; i++) {
+      dst[count[((src[i] ^ sign) >> (8 * b)) & 0xff]++] = src[i];
+    }
+    unsigned long long int *swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != keys) {
+    memcpy(keys, src, sizeof(unsigned long long int) * n);
+  }
+  xfree(tmp);
+}
+
+static void swap_values(TValue **vs, long long int i, long long int k) {
+  TValue *v = vs[i];
+  vs[i] = vs[k];
+  vs[k] = v;
+}
+
+/* The d-th character, 0 past the end like strcmp sees it */
+static int char_at(TValue *v, size_t d) {
+  return (unsigned char)v->value.str[d];
+}
+
+/* Strings known to share their first d characters */
+static void insertion_sort_strings(TValue **vs, long long int n, size_t d) {
+  for (long long int i = 1; i < n; i++) {
+    TValue *v = vs[i];
+    long long int k = i;
+    for (; k > 0 && strcmp(vs[k - 1]->value.str + d, v->value.str + d) > 0;
+         k--) {
+      vs[k] = vs[k - 1];
+    }
+    vs[k] = v;
+  }
+}
+
+/**
+ * Multikey quicksort: a three way partition on the d-th character, then the
+ * equal part moves on to the next character. Orders like tv_cmp.
+ */
+static void multikey_sort(TValue **vs, long long int n, size_t d) {
+  while (n >= SORT_CUTOFF) {
+    swap_values(vs, 0, n / 2);
+    int pivot = char_at(vs[0], d);
+    long long int lt = 0;
+    long long int gt = n - 1;
+    for (long long int i = 1; i <= gt;) {
+      int c = char_at(vs[i], d);
+      if (c < pivot) {
+        swap_values(vs, lt++, i++);
+      } else if (c > pivot) {
+        swap_values(vs, i, gt--);
+      } else {
+        i++;
+      }
+    }
+    multikey_sort(vs, lt, d);
+    multikey_sort(vs + gt + 1, n - gt - 1, d);
+    if (pivot == 0) {
+      return; // the equal part ended here, all of them are the same
+    }
+    vs += lt;
+    n = gt - lt + 1;
+    d++;
+  }
+  insertion_sort_strings(vs, n, d);
+}
+
+void strings_sort(TValue **vs, long long int n) { multikey_sort(vs, n, 0); }
+
+static int compare_values(const void *a, const void *b) {
+  return tv_cmp(*(TValue **)a, *(TValue **)b);
+}
+
+static bool all_of_type(Vector *vs, int tt) {
+  for (long long int i = 0; i < vs->len; i++) {
+    if (((TValue *)vs->data[i])->tt != tt) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//////////////////  builtins  //////////////////
+
+static TValue *push(VM *vm, TValue *v) {
+  vec_push(vm->stack, v);
+  return v;
+}
+
+static TValue *peek(VM *vm) {
+  return vm->stack->len > 0 ? (TValue *)vec_last(vm->stack) : NULL;
+}
+
+/* print(v), leaves the stack below as the bytecode body did */
+static TValue *builtin_print(VM *vm) {
+  tv_fprint(vm->out, (TValue *)vec_pop(vm->stack));
+  return peek(vm);
+}
+
+/* println(v) */
+static TValue *builtin_println(VM *vm) {
+  tv_fprint(vm->out, (TValue *)vec_pop(vm->stack));
+  fputc('\n', vm->out);
+  return peek(vm);
+}
+
+/* len(a) */
+static TValue *builtin_len(VM *vm) {
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  return push(vm, new_TValue_with_integer(array->len));
+}
+
+static long long int long_at(VM *vm, TArray *array, long long int idx) {
+  TValue *v = ta_get(array, idx);
+  VM_ASSERT(v->tt == Long, "Execute Error Array element is not a Long");
+  return v->value.integer;
+}
+
+/* sum(a) */
+static TValue *builtin_sum(VM *vm) {
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  if (array->kind == ArrayLong) {
+    return push(vm, new_TValue_with_integer(
+                        longs_sum(array->elems.longs, array->len)));
+  }
+  unsigned long long int s = 0;
+  for (long long int i = 0; i < array->len; i++) {
+    s += (unsigned long long int)long_at(vm, array, i);
+  }
+  return push(vm, new_TValue_with_integer((long long int)s));
+}
+
+static TValue *extreme(VM *vm, bool max) {
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  VM_ASSERT(array->len > 0, "Execute Error min/max of an empty array");
+  if (array->kind == ArrayLong) {
+    return push(vm, new_TValue_with_integer(longs_extreme(
+                        array->elems.longs, array->len, max)));
+  }
+  long long int m = long_at(vm, array, 0);
+  for (long long int i = 1; i < array->len; i++) {
+    long long int x = long_at(vm, array, i);
+    if (max ? x > m : x < m) {
+      m = x;
+    }
+  }
+  return push(vm, new_TValue_with_integer(m));
+}
+
+/* min(a) */
+static TValue *builtin_min(VM *vm) { return extreme(vm, false); }
+
+/* max(a) */
+static TValue *builtin_max(VM *vm) { return extreme(vm, true); }
+
+/* fill(a, v), sets every element of a to v and returns a */
+static TValue *builtin_fill(VM *vm) {
+  TValue *v = (TValue *)vec_pop(vm->stack);
+  TValue *tv = (TValue *)vec_pop(vm->stack);
+  TArray *array = tv_getTArray(tv);
+  if (array->kind == ArrayLong && v->tt == Long) {
+    longs_fill(array->elems.longs, array->len, v->value.integer);
+  } else if (array->kind == ArrayBool && v->tt == Bool) {
+    memset(array->elems.bools, v->value.boolean, sizeof(bool) * array->len);
+  } else {
+    Vector *boxed = ta_box(array);
+    for (long long int i = 0; i < array->len; i++) {
+      boxed->data[i] = v;
+    }
+  }
+  return push(vm, tv);
+}
+
+/* index_of(a, v), the first index holding v or -1 */
+static TValue *builtin_index_of(VM *vm) {
+  TValue *v = (TValue *)vec_pop(vm->stack);
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  if (array->kind == ArrayLong && v->tt == Long) {
+    return push(vm, new_TValue_with_integer(longs_index_of(
+                        array->elems.longs, array->len, v->value.integer)));
+  }
+  for (long long int i = 0; i < array->len; i++) {
+    TValue *e = ta_get(array, i);
+    if (e->tt == v->tt && tv_equals(e, v)) {
+      return push(vm, new_TValue_with_integer(i));
+    }
+  }
+  return push(vm, new_TValue_with_integer(-1));
+}
+
+/* equals(a, b) */
+static TValue *builtin_equals(VM *vm) {
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TArray *x = tv_getTArray(a);
+  TArray *y = tv_getTArray(b);
+  if (x->kind == ArrayLong && y->kind == ArrayLong) {
+    return push(vm,
+                new_TValue_with_bool(x->len == y->len &&
+                                     longs_equal(x->elems.longs,
+                                                 y->elems.longs, x->len)));
+  }
+  return push(vm, new_TValue_with_bool(tv_equals(a, b)));
+}
+
+/* sort(a), sorts a in place and returns it */
+static TValue *builtin_sort(VM *vm) {
+  TValue *tv = (TValue *)vec_pop(vm->stack);
+  TArray *array = tv_getTArray(tv);
+  if (array->kind == ArrayLong) {
+    longs_sort(array->elems.longs, array->len);
+  } else {
+    Vector *boxed = ta_box(array);
+    if (all_of_type(boxed, String)) {
+      strings_sort((TValue **)boxed->data, boxed->len);
+    } else {
+      qsort(boxed->data, boxed->len, sizeof(TValue *), compare_values);
+    }
+  }
+  return push(vm, tv);
+}
+
+typedef struct {
+  char *name;
+  long long int arity;
+  NativeFunc func;
+} Builtin;
+
+static const Builtin builtins[] = {
+    {"print", 1, builtin_print},
+    {"println", 1, builtin_println},
+    {"len", 1, builtin_len},
+    {"sum", 1, builtin_sum},
+    {"min", 1, builtin_min},
+    {"max", 1, builtin_max},
+    {"fill", 2, builtin_fill},
+    {"index_of", 2, builtin_index_of},
+    {"equals", 2, builtin_equals},
+    {"sort", 1, builtin_sort},
+};
+
+void env_def_native(Env *env, char *name, long long int arity,
+                    NativeFunc func) {
+  NativeFunction *native = new_NativeFunction(sdsnew(name), arity, func);
+  env_def(env, sdsnew(name), new_TValue_with_native(native));
+}
+
+void env_def_builtins(Env *env) {
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+    env_def_native(env, builtins[i].name, builtins[i].arity, builtins[i].func);
+  }
+}
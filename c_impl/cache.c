@@ -0,0 +1,320 @@
+#include "tinyvm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * On-disk cache of optimized code.
+ *
+ * cache_load_file deserializes and optimizes a compiled file the first time
+ * it sees it and keeps the result in the cache directory, under a name made
+ * of the hash of the file's bytes and the optimization level. Later loads
+ * of the same bytes map that entry and rebuild the code from it in one pass,
+ * with neither deserializing nor optimizing.
+ *
+ * An entry is a header, the bytes of the source padded to a word, then the
+ * slots of the code, all of them words:
+ *
+ *   CACHE_MAGIC, CACHE_VERSION, tOpCount, opt_level, source length,
+ *   source hash, number of slots
+ *
+ * An opcode is a word of its own; each of its operands is a type then a
+ * Long or a Bool, nothing for a Null, or a length then the bytes of a
+ * String padded to a word. The header has to match exactly, so a VM with
+ * other opcodes or another CACHE_VERSION recompiles instead of reading
+ * entries it would misunderstand. Bump CACHE_VERSION whenever the
+ * optimizer changes what it emits.
+ *
+ * The hash only names the entry: a load compares the source bytes too, so
+ * files whose hashes collide never share code, and the code has to decode
+ * with its branches and function bodies in range before it is used. Any
+ * mismatch falls back to compiling the file again.
+ *
+ * Entries are written to a temporary file renamed into place, so processes
+ * sharing the directory never read a partial one.
+ */
+
+#define CACHE_MAGIC 0x4548434143565454LL // "TTVCACHE"
+#define CACHE_VERSION 2
+#define CACHE_HEADER 7
+
+static char *cache_dir = NULL;
+
+/**
+ * Keep optimized code in dir from now on, creating it if needed, or stop
+ * caching if dir is NULL. Returns false if dir can not be used. Not to be
+ * called while other threads load code.
+ */
+bool cache_set_dir(char *dir) {
+  if (dir == NULL) {
+    cache_dir = NULL;
+    return true;
+  }
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    return false;
+  }
+  struct stat st;
+  if (stat(dir, &st) != 0) {
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return false;
+  }
+  cache_dir = sdsnew(dir);
+  return true;
+}
+
+/* FNV-1a */
+static uint64_t hash_bytes(const char *bytes, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)bytes[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static sds read_bytes(char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  sds bytes = sdsempty();
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    bytes = sdscatlen(bytes, buf, n);
+  }
+  fclose(fp);
+  return bytes;
+}
+
+static void push_word(Vector *words, long long int w) {
+  vec_push(words, (void *)w);
+}
+
+/* Words holding len bytes */
+static size_t words_of(size_t len) {
+  return (len + sizeof(long long int) - 1) / sizeof(long long int);
+}
+
+/* Push bytes padded to a word */
+static void push_bytes(Vector *words, const char *bytes, size_t len) {
+  for (size_t j = 0; j < len; j += sizeof(long long int)) {
+    long long int w = 0;
+    size_t n = len - j < sizeof(w) ? len - j : sizeof(w);
+    memcpy(&w, bytes + j, n);
+    push_word(words, w);
+  }
+}
+
+/* Words of an entry for code, NULL if it has operands an entry can not hold */
+static Vector *encode(Vector *code, int opt_level, sds source, uint64_t hash) {
+  Vector *words = new_vec();
+  push_word(words, CACHE_MAGIC);
+  push_word(words, CACHE_VERSION);
+  push_word(words, tOpCount);
+  push_word(words, opt_level);
+  push_word(words, sdslen(source));
+  push_word(words, (long long int)hash);
+  push_word(words, code->len);
+  push_bytes(words, source, sdslen(source));
+
+  for (long long int pc = 0; pc < code->len;) {
+    Opcode op = (Opcode)code->data[pc++];
+    push_word(words, op);
+    for (long long int i = 0; i < op_operand_count(op); i++) {
+      TValue *v = code->data[pc++];
+      push_word(words, v->tt);
+      switch (v->tt) {
+      case Long:
+        push_word(words, tv_getLong(v));
+        break;
+      case Bool:
+        push_word(words, tv_getBool(v));
+        break;
+      case Null:
+        break;
+      case String: {
+        sds s = tv_getString(v);
+        push_word(words, sdslen(s));
+        push_bytes(words, s, sdslen(s));
+        break;
+      }
+      default:
+        return NULL;
+      }
+    }
+  }
+  return words;
+}
+
+/**
+ * Whether code can run: branches and function declarations have the
+ * operands the interpreters expect and land inside the code.
+ */
+static bool valid_code(Vector *code) {
+  for (long long int pc = 0; pc < code->len;) {
+    Opcode op = (Opcode)code->data[pc];
+    TValue **operands = (TValue **)&code->data[pc + 1];
+    if (op_is_branch(op) && operands[0]->tt != Long) {
+      return false;
+    }
+    if (op == tOpFunctionDeclare &&
+        (operands[0]->tt != String || operands[1]->tt != Long)) {
+      return false;
+    }
+    pc += 1 + op_operand_count(op);
+  }
+  return code_decode(code) != NULL;
+}
+
+/**
+ * Code of the words of an entry, NULL unless they are a valid entry of
+ * source at opt_level.
+ */
+static Vector *decode(const long long int *words, size_t n, int opt_level,
+                      sds source, uint64_t hash) {
+  if (n < CACHE_HEADER || words[0] != CACHE_MAGIC ||
+      words[1] != CACHE_VERSION || words[2] != tOpCount ||
+      words[3] != opt_level || words[4] != (long long int)sdslen(source) ||
+      words[5] != (long long int)hash || words[6] < 0 ||
+      (size_t)words[6] > n ||
+      words_of(sdslen(source)) > n - CACHE_HEADER ||
+      memcmp(&words[CACHE_HEADER], source, sdslen(source)) != 0) {
+    return NULL;
+  }
+
+  Vector *code = new_vec();
+  size_t p = CACHE_HEADER + words_of(sdslen(source));
+  while (code->len < words[6]) {
+    if (p >= n || words[p] < 0 || words[p] >= tOpCount) {
+      return NULL;
+    }
+    Opcode op = words[p++];
+    vec_pushi(code, op);
+    for (long long int i = 0; i < op_operand_count(op); i++) {
+      if (p >= n) {
+        return NULL;
+      }
+      switch (words[p++]) {
+      case Long:
+        if (p >= n) {
+          return NULL;
+        }
+        vec_push(code, new_TValue_with_integer(words[p++]));
+        break;
+      case Bool:
+        if (p >= n) {
+          return NULL;
+        }
+        vec_push(code, new_TValue_with_bool(words[p++]));
+        break;
+      case Null:
+        vec_push(code, new_TValue());
+        break;
+      case String: {
+        if (p >= n) {
+          return NULL;
+        }
+        size_t len = words[p++];
+        if (len > (n - p) * sizeof(long long int)) {
+          return NULL;
+        }
+        size_t w = words_of(len);
+        vec_push(code, new_TValue_with_str(sdsnewlen(&words[p], len)));
+        p += w;
+        break;
+      }
+      default:
+        return NULL;
+      }
+    }
+  }
+  return code->len == words[6] && p == n && valid_code(code) ? code : NULL;
+}
+
+/* The code of the entry at path, NULL if there is no valid one */
+static Vector *read_entry(sds path, int opt_level, sds source,
+                          uint64_t hash) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  Vector *code = NULL;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *words = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (words != MAP_FAILED) {
+      code = decode(words, st.st_size / sizeof(long long int), opt_level,
+                    source, hash);
+      munmap(words, st.st_size);
+    }
+  }
+  close(fd);
+  return code;
+}
+
+static void write_entry(sds path, Vector *words) {
+  sds tmp = sdscat(sdsdup(path), ".XXXXXX");
+  int fd = mkstemp(tmp);
+  if (fd < 0) {
+    return;
+  }
+  FILE *fp = fdopen(fd, "wb");
+  if (fp == NULL) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  bool ok = true;
+  for (long long int i = 0; i < words->len; i++) {
+    long long int w = (long long int)words->data[i];
+    ok = ok && fwrite(&w, sizeof(w), 1, fp) == 1;
+  }
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+  }
+}
+
+/**
+ * The code of a compiled file optimized at opt_level, through the cache when
+ * cache_set_dir gave one. NULL if the file can not be read; errors in its
+ * code are raised like those of deserialize.
+ */
+Vector *cache_load_file(char *filename, int opt_level) {
+  sds source = read_bytes(filename);
+  if (source == NULL) {
+    return NULL;
+  }
+  uint64_t hash = hash_bytes(source, sdslen(source));
+  sds path = NULL;
+  if (cache_dir != NULL) {
+    path = sdscatprintf(sdsempty(), "%s/%016llx-O%d.tvmc", cache_dir,
+                        (unsigned long long)hash, opt_level);
+    Vector *code = read_entry(path, opt_level, source, hash);
+    if (code != NULL) {
+      return code;
+    }
+  }
+
+  Vector *code = deserialize(wordsFromBytes(source, sdslen(source)));
+  code = optimize(code, opt_passes_for_level(opt_level));
+  if (path != NULL) {
+    Vector *words = encode(code, opt_level, source, hash);
+    if (words != NULL) {
+      write_entry(path, words);
+    }
+  }
+  return code;
+}
@@ -0,0 +1,440 @@
+#include "tinyvm.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Channels, bounded queues of values between VMs on any threads.
+ *
+ *   channel(capacity)  a new channel of 1 to CHANNEL_CAPACITY_MAX values,
+ *                      returns its id
+ *   send(ch, v)        queues v, waits while ch is full
+ *   recv(ch)           the oldest value of ch, waits while ch is empty;
+ *                      null once ch is closed and empty
+ *   close(ch)          no more sends, wakes everyone waiting
+ *
+ * A task, see coroutine.c, never waits on the thread: a send or recv that
+ * would wait suspends it instead, and it tries again when it is resumed, so
+ * tasks on one thread can hand values to each other through a full or empty
+ * channel. Only when every task run_tasks has queued waits on a channel does
+ * the next one wait on the thread, for other threads to serve it.
+ *
+ * The workers of parallel_map and parallel_reduce are threads too, but
+ * each runs its chunk of the array one element after the other and a small
+ * array is a single chunk, see parallel.c, so fn calls waiting on one
+ * another through a channel may wait forever. Use tasks for those.
+ *
+ * A channel is an id, a Long, into the table of channels of the VM, which
+ * the workers of parallel_map and parallel_reduce use too and hosts hand
+ * to other VMs with vm_share_channels. VMs with tables of their own, like
+ * the programs of other --serve requests, can not reach it. Values are
+ * handed over as they are: an array or a string is not copied, the sender
+ * gives it away and must not change it afterwards.
+ *
+ * A channel closed and drained leaves the table and the collector frees
+ * it. Its id keeps the slot it had, and a generation in its upper bits
+ * telling it from the ids of later channels in that slot, so it still
+ * reads as a closed channel: recv gives null, send fails, close does
+ * nothing.
+ *
+ * The ring is the bounded MPMC queue of Dmitry Vyukov. Each cell carries a
+ * sequence number telling which lap of the ring may use it next, so senders
+ * and receivers claim cells with one compare-and-swap and never lock. Only a
+ * sender finding the ring full or a receiver finding it empty takes the
+ * mutex, to sleep until the other side wakes it up.
+ */
+
+// Channels per block of the table of channels
+#define CHANNEL_BLOCK 1024
+#define CHANNEL_BLOCKS (CHANNELS_MAX / CHANNEL_BLOCK)
+
+// An id is the generation of its slot above CHANNEL_SLOT_BITS bits of slot
+#define CHANNEL_SLOT_BITS 32
+#define CHANNEL_SLOT_MASK ((1LL << CHANNEL_SLOT_BITS) - 1)
+#define CHANNEL_GENERATION_MAX ((1LL << (62 - CHANNEL_SLOT_BITS)) - 1)
+
+typedef struct {
+  size_t seq;
+  TValue *value;
+} Cell;
+
+typedef struct {
+  long long int id;
+  Cell *cells;
+  size_t mask; // capacity - 1, the capacity is a power of 2
+  bool closed;
+  int waiters; // threads sleeping on wakeup
+  int senders; // threads in channel_send
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  char pad0[64]; // senders and receivers do not share a cache line
+  size_t send_pos;
+  char pad1[64];
+  size_t recv_pos;
+} Channel;
+
+typedef struct {
+  Channel *ch;              // NULL once freed
+  long long int generation; // of the last channel in the slot
+} Slot;
+
+struct Channels_t {
+  Slot *blocks[CHANNEL_BLOCKS];
+  long long int len; // slots ever used
+  Vector *free;      // slots to use again
+  pthread_mutex_t lock;
+};
+
+Channels *new_Channels(void) {
+  Channels *channels = xmalloc(sizeof(Channels));
+  for (int i = 0; i < CHANNEL_BLOCKS; i++) {
+    channels->blocks[i] = NULL;
+  }
+  channels->len = 0;
+  channels->free = new_vec();
+  pthread_mutex_init(&channels->lock, NULL);
+  return channels;
+}
+
+/* Make vm use the table of channels of from, dropping its own */
+void vm_share_channels(VM *vm, VM *from) { vm->channels = from->channels; }
+
+static Slot *slot_of(Channels *channels, long long int id) {
+  long long int slot = id & CHANNEL_SLOT_MASK;
+  if (id < 0 || slot >= __atomic_load_n(&channels->len, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &channels->blocks[slot / CHANNEL_BLOCK][slot % CHANNEL_BLOCK];
+}
+
+/* The channel id, NULL if there is no such channel or it was freed */
+static Channel *channel_of(Channels *channels, long long int id) {
+  Slot *slot = slot_of(channels, id);
+  if (slot == NULL) {
+    return NULL;
+  }
+  Channel *ch = __atomic_load_n(&slot->ch, __ATOMIC_ACQUIRE);
+  return ch != NULL && ch->id == id ? ch : NULL;
+}
+
+/* Whether id was returned by channel_open, freed since or not */
+static bool channel_issued(Channels *channels, long long int id) {
+  Slot *slot = slot_of(channels, id);
+  return slot != NULL &&
+         id >> CHANNEL_SLOT_BITS <=
+             __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Take ch out of the table once it is closed, empty and no sender can
+ * queue anything more.
+ */
+static void free_drained(Channels *channels, Channel *ch) {
+  if (!__atomic_load_n(&ch->closed, __ATOMIC_SEQ_CST) ||
+      __atomic_load_n(&ch->senders, __ATOMIC_SEQ_CST) > 0 ||
+      __atomic_load_n(&ch->recv_pos, __ATOMIC_SEQ_CST) !=
+          __atomic_load_n(&ch->send_pos, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+  pthread_mutex_lock(&channels->lock);
+  Slot *slot = slot_of(channels, ch->id);
+  if (slot->ch == ch) {
+    __atomic_store_n(&slot->ch, NULL, __ATOMIC_RELEASE);
+    if (ch->id >> CHANNEL_SLOT_BITS < CHANNEL_GENERATION_MAX) {
+      vec_pushi(channels->free, ch->id & CHANNEL_SLOT_MASK);
+    }
+  }
+  pthread_mutex_unlock(&channels->lock);
+}
+
+static bool try_send(Channel *ch, TValue *v) {
+  size_t pos = __atomic_load_n(&ch->send_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    Cell *cell = &ch->cells[pos & ch->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ch->send_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->value = v;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false; // full
+    } else {
+      pos = __atomic_load_n(&ch->send_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static TValue *try_recv(Channel *ch) {
+  size_t pos = __atomic_load_n(&ch->recv_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    Cell *cell = &ch->cells[pos & ch->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ch->recv_pos, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        TValue *v = cell->value;
+        cell->value = NULL;
+        __atomic_store_n(&cell->seq, pos + ch->mask + 1, __ATOMIC_RELEASE);
+        return v;
+      }
+    } else if (diff < 0) {
+      return NULL; // empty
+    } else {
+      pos = __atomic_load_n(&ch->recv_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Wake the threads waiting on ch after a send or a receive */
+static void wake(Channel *ch) {
+  /* the value stored before waiters is loaded, see channel_recv */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ch->waiters, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&ch->lock);
+    pthread_cond_broadcast(&ch->wakeup);
+    pthread_mutex_unlock(&ch->lock);
+  }
+}
+
+/**
+ * A channel of at least capacity values in the table of vm, returns its id
+ * or -1 if capacity is out of range or there are too many channels.
+ */
+long long int channel_open(VM *vm, long long int capacity) {
+  if (capacity < 1 || capacity > CHANNEL_CAPACITY_MAX) {
+    return -1;
+  }
+  size_t cap = 2;
+  while (cap < (size_t)capacity) {
+    cap *= 2;
+  }
+
+  Channel *ch = xmalloc(sizeof(Channel));
+  ch->cells = xmalloc(sizeof(Cell) * cap);
+  for (size_t i = 0; i < cap; i++) {
+    ch->cells[i].seq = i;
+    ch->cells[i].value = NULL;
+  }
+  ch->mask = cap - 1;
+  ch->closed = false;
+  ch->waiters = 0;
+  ch->senders = 0;
+  pthread_mutex_init(&ch->lock, NULL);
+  pthread_cond_init(&ch->wakeup, NULL);
+  ch->send_pos = 0;
+  ch->recv_pos = 0;
+
+  Channels *channels = vm->channels;
+  pthread_mutex_lock(&channels->lock);
+  long long int slot;
+  long long int generation;
+  if (channels->free->len > 0) {
+    slot = (long long int)vec_pop(channels->free);
+    generation = slot_of(channels, slot)->generation + 1;
+  } else if (channels->len < CHANNELS_MAX) {
+    slot = channels->len;
+    generation = 0;
+    if (slot % CHANNEL_BLOCK == 0) {
+      channels->blocks[slot / CHANNEL_BLOCK] =
+          xmalloc(sizeof(Slot) * CHANNEL_BLOCK);
+    }
+  } else {
+    pthread_mutex_unlock(&channels->lock);
+    return -1;
+  }
+  Slot *s = &channels->blocks[slot / CHANNEL_BLOCK][slot % CHANNEL_BLOCK];
+  ch->id = generation << CHANNEL_SLOT_BITS | slot;
+  __atomic_store_n(&s->generation, generation, __ATOMIC_RELEASE);
+  __atomic_store_n(&s->ch, ch, __ATOMIC_RELEASE);
+  if (slot == channels->len) {
+    __atomic_store_n(&channels->len, slot + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&channels->lock);
+  return ch->id;
+}
+
+/* Queue v on ch, waiting for room, returns false if ch is closed */
+static bool send_to(Channel *ch, TValue *v) {
+  while (!__atomic_load_n(&ch->closed, __ATOMIC_SEQ_CST)) {
+    if (try_send(ch, v)) {
+      wake(ch);
+      return true;
+    }
+    pthread_mutex_lock(&ch->lock);
+    __atomic_add_fetch(&ch->waiters, 1, __ATOMIC_SEQ_CST);
+    if (!try_send(ch, v)) {
+      if (!__atomic_load_n(&ch->closed, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&ch->wakeup, &ch->lock);
+      }
+      __atomic_sub_fetch(&ch->waiters, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&ch->lock);
+      continue;
+    }
+    __atomic_sub_fetch(&ch->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ch->lock);
+    wake(ch);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Send v on channel id of the table of vm, waiting for room. Returns false
+ * if there is no such channel or it is closed.
+ */
+bool channel_send(VM *vm, long long int id, TValue *v) {
+  Channel *ch = channel_of(vm->channels, id);
+  if (ch == NULL) {
+    return false;
+  }
+  /* a channel with senders is not freed, see free_drained */
+  __atomic_add_fetch(&ch->senders, 1, __ATOMIC_SEQ_CST);
+  bool sent = send_to(ch, v);
+  __atomic_sub_fetch(&ch->senders, 1, __ATOMIC_SEQ_CST);
+  if (!sent) {
+    free_drained(vm->channels, ch);
+  }
+  return sent;
+}
+
+/**
+ * Receive from channel id of the table of vm, waiting for a value. Returns
+ * NULL if there is no such channel or it is closed and empty.
+ */
+TValue *channel_recv(VM *vm, long long int id) {
+  Channel *ch = channel_of(vm->channels, id);
+  if (ch == NULL) {
+    return NULL;
+  }
+
+  for (;;) {
+    TValue *v = try_recv(ch);
+    if (v != NULL) {
+      wake(ch);
+      return v;
+    }
+    pthread_mutex_lock(&ch->lock);
+    __atomic_add_fetch(&ch->waiters, 1, __ATOMIC_SEQ_CST);
+    v = try_recv(ch);
+    bool closed = __atomic_load_n(&ch->closed, __ATOMIC_ACQUIRE);
+    if (v == NULL && !closed) {
+      pthread_cond_wait(&ch->wakeup, &ch->lock);
+    }
+    __atomic_sub_fetch(&ch->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ch->lock);
+    if (v != NULL) {
+      wake(ch);
+      return v;
+    }
+    if (closed) {
+      free_drained(vm->channels, ch);
+      return NULL;
+    }
+  }
+}
+
+/**
+ * Close channel id of the table of vm, returns false if there is no such
+ * channel.
+ */
+bool channel_close(VM *vm, long long int id) {
+  Channel *ch = channel_of(vm->channels, id);
+  if (ch == NULL) {
+    return channel_issued(vm->channels, id); // freed, closed already
+  }
+  pthread_mutex_lock(&ch->lock);
+  __atomic_store_n(&ch->closed, true, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&ch->wakeup);
+  pthread_mutex_unlock(&ch->lock);
+  free_drained(vm->channels, ch);
+  return true;
+}
+
+static long long int id_of(VM *vm, TValue *ch) {
+  long long int id = tv_getLong(ch);
+  VM_ASSERT(channel_issued(vm->channels, id),
+            "Execute Error No such a channel");
+  return id;
+}
+
+/* channel(capacity) */
+static TValue *builtin_channel(VM *vm) {
+  long long int capacity = tv_getLong((TValue *)vec_pop(vm->stack));
+  VM_ASSERT(capacity >= 1 && capacity <= CHANNEL_CAPACITY_MAX,
+            "Execute Error channel capacity out of range");
+  long long int id = channel_open(vm, capacity);
+  VM_ASSERT(id >= 0, "Execute Error Too many channels");
+  TValue *ret = new_TValue_with_integer(id);
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/* send(ch, v) */
+static TValue *builtin_send(VM *vm) {
+  TValue *v = (TValue *)vec_pop(vm->stack);
+  long long int id = id_of(vm, (TValue *)vec_pop(vm->stack));
+  bool sent = channel_send(vm, id, v);
+  VM_ASSERT(sent, "Execute Error send on a closed channel");
+  TValue *ret = new_TValue();
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/* recv(ch) */
+static TValue *builtin_recv(VM *vm) {
+  TValue *ret = channel_recv(vm, id_of(vm, (TValue *)vec_pop(vm->stack)));
+  if (ret == NULL) {
+    ret = new_TValue();
+  }
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/* close(ch) */
+static TValue *builtin_close(VM *vm) {
+  channel_close(vm, id_of(vm, (TValue *)vec_pop(vm->stack)));
+  TValue *ret = new_TValue();
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/* Whether ch has no cell to receive from if recv, else to send to */
+static bool ring_waits(Channel *ch, bool recv) {
+  size_t pos = __atomic_load_n(recv ? &ch->recv_pos : &ch->send_pos,
+                               __ATOMIC_RELAXED);
+  size_t seq = __atomic_load_n(&ch->cells[pos & ch->mask].seq,
+                               __ATOMIC_ACQUIRE);
+  return (intptr_t)seq - (intptr_t)(pos + recv) < 0;
+}
+
+/**
+ * Whether native with its arguments on the stack of vm is a send or a recv
+ * that would wait, for tasks to yield instead.
+ */
+bool channel_would_wait(VM *vm, NativeFunction *native) {
+  bool recv = native->func == builtin_recv;
+  if (!recv && native->func != builtin_send) {
+    return false;
+  }
+  TValue *id = vm->stack->data[vm->stack->len - (recv ? 1 : 2)];
+  if (id->tt != Long) {
+    return false; // raised by the builtin
+  }
+  Channel *ch = channel_of(vm->channels, tv_getLong(id));
+  return ch != NULL && !__atomic_load_n(&ch->closed, __ATOMIC_ACQUIRE) &&
+         ring_waits(ch, recv);
+}
+
+void env_def_channels(Env *env) {
+  env_def_native(env, "channel", 1, builtin_channel);
+  env_def_native(env, "send", 2, builtin_send);
+  env_def_native(env, "recv", 1, builtin_recv);
+  env_def_native(env, "close", 1, builtin_close);
+}
@@ -0,0 +1,411 @@
+#include "tinyvm.h"
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Coroutines, many tasks interleaved on one VM without native threads.
+ *
+ *   spawn(fn, arg)  a task calling fn(arg), queued to run; returns its id
+ *   yield(v)        suspends the running task with v
+ *   resume(task)    runs task until it yields or returns; returns v or what
+ *                   it returned, null if it ran out of fuel
+ *   finished(task)  whether task has returned
+ *   run_tasks()     runs the queued tasks round-robin, a yield at a time,
+ *                   until every one has returned
+ *
+ * The stack interpreter calls functions on the native stack, which can not
+ * be put aside halfway. Tasks run on an interpreter of their own instead: the
+ * handlers of vm_handlers.h behind a switch, except that a call pushes a
+ * Frame and a return pops one. A task's operand stack and frames live on the
+ * heap, so a yield returns to whoever resumed it and resume carries on from
+ * the top frame. Tasks are never compiled.
+ *
+ * Natives still run on the native stack, so functions they call back, like
+ * those of parallel_map, can not yield. A task calling send or recv when
+ * the channel is not ready is suspended before the call instead, see
+ * channel.c, and makes the call again once resumed.
+ *
+ * Tasks are also preemptible. Every backward jump and every call of a task
+ * takes a unit of vm->fuel, and a task finding none left is suspended right
+ * there, as if it had yielded, to carry on from that jump or call when it
+ * is resumed. run_tasks gives each task TASK_SLICE units a turn, so a task
+ * looping without yielding only delays the others; resume inside a task
+ * draws on the fuel of the task calling it. Hosts run a function with a
+ * budget of their own, and as often as they like:
+ *
+ *   long long int task = vm_spawn(vm, handle, args, 1);
+ *   while (vm_resume(vm, task, 10000, &ret) == VMSuspended) {
+ *     ...serve the other tenants
+ *   }
+ */
+
+// Fuel of step, the task draws on vm->fuel as it is
+#define FUEL_SHARED (-2)
+
+typedef struct {
+  Vector *code;
+  long long int pc; // where it continues
+  Env *env;
+} Frame;
+
+typedef struct {
+  Vector *stack;
+  Vector *frames; // Frame, the running one on top
+  TValue *value;  // yielded or returned last
+  bool yielded;
+  bool preempted; // stopped by the last resume for want of fuel
+  bool blocked;   // likewise, at a channel that was not ready
+  bool running;
+  bool finished;
+} Coroutine;
+
+struct Scheduler_t {
+  Vector *tasks; // Coroutine, indexed by id
+  Vector *queue; // ids of tasks to run, from head on
+  long long int head;
+  Coroutine *current; // running task, NULL outside of tasks
+  long long int natives; // natives tasks called, only they touch channels
+  bool wait; // every queued task is stuck at a channel, the next waits
+};
+
+static TValue *task_yield(VM *vm);
+
+static void push_frame(Coroutine *co, VMFunction *func) {
+  Frame *frame = xmalloc(sizeof(Frame));
+  frame->code = func->func_body;
+  frame->pc = 0;
+  frame->env = env_dup(func->env);
+  vec_push(co->frames, frame);
+}
+
+/**
+ * tOpCall of a task. Returns true if the task called a function or
+ * yielded, so the interpreter has to reload the top frame or stop.
+ */
+static bool call(VM *vm, Coroutine *co, TValue *name) {
+  TValue *fn = env_get(vm->env, tv_getString(name));
+  VM_ASSERT(fn != NULL && (fn->tt == Function || fn->tt == Native),
+            "Execute Error on tOpCall");
+  if (fn->tt == Function) {
+    push_frame(co, tv_getFunction(fn));
+    return true;
+  }
+
+  NativeFunction *native = tv_getNative(fn);
+  VM_ASSERT(vm->stack->len >= native->arity,
+            "Execute Error Too few arguments");
+  if (native->func == task_yield) {
+    co->value = (TValue *)vec_pop(vm->stack);
+    vec_push(vm->stack, new_TValue());
+    co->yielded = true;
+    return true;
+  }
+  if (!vm->scheduler->wait && channel_would_wait(vm, native)) {
+    co->blocked = true;
+    return true;
+  }
+  vm->scheduler->natives++;
+  native->func(vm);
+  return false;
+}
+
+/* Take a unit of fuel, or suspend the task to continue at next */
+#define TASK_FUEL(next)                                                        \
+  {                                                                            \
+    if (vm->fuel == 0) {                                                       \
+      frame->pc = (next);                                                      \
+      goto preempted;                                                          \
+    }                                                                          \
+    if (vm->fuel > 0) {                                                        \
+      vm->fuel--;                                                              \
+    }                                                                          \
+  }
+
+#define TRACE_BACKWARD_JUMP(from)                                              \
+  if (pc + 1 <= (from)) {                                                      \
+    TASK_FUEL(pc + 1);                                                         \
+  }
+
+/**
+ * Interpret co from its top frame until it yields, returns or runs out of
+ * fuel
+ */
+static TValue *interpret(VM *vm, Coroutine *co) {
+  while (co->frames->len > 0) {
+    Frame *frame = vec_last(co->frames);
+    Vector *code = frame->code;
+    long long int pc = frame->pc;
+    bool returned = true;
+    vm->env = frame->env;
+
+    for (; pc < code->len; pc++) {
+      Opcode op = (Opcode)code->data[pc];
+      if (op == tOpReturn) {
+        break;
+      }
+      if (op == tOpCall) {
+        TASK_FUEL(pc);
+        VM_CHECK_HEAP();
+        frame->pc = pc + 2;
+        if (call(vm, co, code->data[pc + 1])) {
+          returned = false;
+          break;
+        }
+        pc++;
+        continue;
+      }
+
+      switch (op) {
+#define VM_HANDLER(op_name, ...)                                               \
+  case op_name: {                                                              \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }
+#include "vm_handlers.h"
+#undef VM_HANDLER
+      default:
+        fprintf(stderr, "<VM error> Invalid op\n");
+      }
+    }
+
+    if (co->yielded) {
+      co->yielded = false;
+      return co->value;
+    }
+    if (co->blocked) {
+      frame->pc -= 2; // at the call again
+      goto preempted;
+    }
+    if (returned) {
+      vec_pop(co->frames);
+    }
+  }
+
+  co->finished = true;
+  co->value = vm_stackPeekTop(vm);
+  if (co->value == NULL) {
+    co->value = new_TValue();
+  }
+  return co->value;
+
+preempted:
+  co->preempted = true;
+  co->value = new_TValue();
+  return co->value;
+}
+
+static Scheduler *scheduler(VM *vm) {
+  if (vm->scheduler == NULL) {
+    vm->scheduler = xmalloc(sizeof(Scheduler));
+    vm->scheduler->tasks = new_vec();
+    vm->scheduler->queue = new_vec();
+    vm->scheduler->head = 0;
+    vm->scheduler->current = NULL;
+    vm->scheduler->natives = 0;
+    vm->scheduler->wait = false;
+  }
+  return vm->scheduler;
+}
+
+static Coroutine *task_of(VM *vm, TValue *id) {
+  Vector *tasks = scheduler(vm)->tasks;
+  long long int i = tv_getLong(id);
+  VM_ASSERT(i >= 0 && i < tasks->len, "Execute Error No such a task");
+  return tasks->data[i];
+}
+
+/**
+ * Run co on vm until it yields, returns or has taken fuel units. An error
+ * ends the task and goes on to the error handler of vm with the state of vm
+ * as it was before.
+ */
+static TValue *step(VM *vm, Coroutine *co, long long int fuel) {
+  VM_ASSERT(!co->finished, "Execute Error resume of a finished task");
+  VM_ASSERT(!co->running, "Execute Error resume of a running task");
+
+  Scheduler *s = scheduler(vm);
+  Coroutine *current = s->current;
+  Vector *stack = vm->stack;
+  Env *env = vm->env;
+  long long int budget = vm->fuel;
+  jmp_buf handler;
+  jmp_buf *outer = vm->error_handler;
+  TValue *volatile ret = NULL;
+
+  if (fuel != FUEL_SHARED) {
+    vm->fuel = fuel;
+  }
+  vm->stack = co->stack;
+  vm->error_handler = &handler;
+  s->current = co;
+  co->running = true;
+  co->preempted = false;
+  co->blocked = false;
+  if (setjmp(handler) == 0) {
+    ret = interpret(vm, co);
+  } else {
+    co->finished = true;
+  }
+  co->running = false;
+  s->current = current;
+  s->wait = false;
+  vm->stack = stack;
+  vm->env = env;
+  vm->error_handler = outer;
+  if (fuel != FUEL_SHARED) {
+    vm->fuel = budget;
+  }
+
+  if (ret == NULL) {
+    VM_ERROR(vm->error);
+  }
+  return ret;
+}
+
+/* Queue a task calling func(args...), returns its id */
+static long long int new_task(VM *vm, VMFunction *func, TValue **args,
+                              long long int argc) {
+  Coroutine *co = xmalloc(sizeof(Coroutine));
+  co->stack = new_vec();
+  co->frames = new_vec();
+  co->value = new_TValue();
+  co->yielded = false;
+  co->preempted = false;
+  co->blocked = false;
+  co->running = false;
+  co->finished = false;
+  for (long long int i = 0; i < argc; i++) {
+    vec_push(co->stack, args[i]);
+  }
+  push_frame(co, func);
+
+  Scheduler *s = scheduler(vm);
+  long long int id = s->tasks->len;
+  vec_push(s->tasks, co);
+  vec_push(s->queue, new_TValue_with_integer(id));
+  return id;
+}
+
+/* spawn(fn, arg) */
+static TValue *task_spawn(VM *vm) {
+  TValue *arg = (TValue *)vec_pop(vm->stack);
+  TValue *fn = (TValue *)vec_pop(vm->stack);
+  VM_ASSERT(fn->tt == Function, "Execute Error spawn takes a function");
+
+  TValue *id = new_TValue_with_integer(new_task(vm, tv_getFunction(fn),
+                                                &arg, 1));
+  vec_push(vm->stack, id);
+  return id;
+}
+
+/* yield(v) reaching here was not called by a task, see call */
+static TValue *task_yield(VM *vm) {
+  VM_ERROR("Execute Error yield outside of a task");
+}
+
+/* resume(task) */
+static TValue *task_resume(VM *vm) {
+  Coroutine *co = task_of(vm, (TValue *)vec_pop(vm->stack));
+  TValue *ret = step(vm, co, FUEL_SHARED);
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/* finished(task) */
+static TValue *task_finished(VM *vm) {
+  Coroutine *co = task_of(vm, (TValue *)vec_pop(vm->stack));
+  TValue *ret = new_TValue_with_bool(co->finished);
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/* run_tasks(), tasks spawned meanwhile join the queue */
+static TValue *task_run(VM *vm) {
+  Scheduler *s = scheduler(vm);
+  VM_ASSERT(s->current == NULL, "Execute Error run_tasks inside a task");
+  long long int stuck = 0; // turns in a row blocked before calling a native
+  while (s->head < s->queue->len) {
+    TValue *id = s->queue->data[s->head++];
+    Coroutine *co = task_of(vm, id);
+    long long int natives = s->natives;
+    if (!co->finished) {
+      step(vm, co, TASK_SLICE);
+    }
+    bool blocked = !co->finished && co->blocked && s->natives == natives;
+    stuck = blocked ? stuck + 1 : 0;
+    if (!co->finished) {
+      vec_push(s->queue, id);
+    }
+    /* no channel gets ready on this thread, only others can serve them */
+    s->wait = stuck > 0 && stuck >= s->queue->len - s->head;
+
+    /* drop the ids run already once they are half of the queue */
+    if (s->head >= 64 && s->head * 2 >= s->queue->len) {
+      long long int left = s->queue->len - s->head;
+      for (long long int i = 0; i < left; i++) {
+        s->queue->data[i] = s->queue->data[s->head + i];
+      }
+      s->queue->len = left;
+      s->head = 0;
+    }
+  }
+
+  TValue *ret = new_TValue();
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/**
+ * Host API, a task calling func(args...) of vm, which vm_resume runs. Returns
+ * its id, or -1 if func is not a function of the program.
+ */
+long long int vm_spawn(VM *vm, TValue *func, TValue **args,
+                       long long int argc) {
+  if (func == NULL || func->tt != Function) {
+    return -1;
+  }
+  return new_task(vm, tv_getFunction(func), args, argc);
+}
+
+/**
+ * Host API, run task until it returns, yields or has taken fuel units, no
+ * limit if fuel is negative. Returns VMOk once it returned, VMSuspended if it
+ * can be resumed and VMErrorRuntime on errors, which end the task. What it
+ * returned or yielded is stored to *ret if ret is not NULL, NULL if it ran
+ * out of fuel.
+ */
+int vm_resume(VM *vm, long long int task, long long int fuel, TValue **ret) {
+  jmp_buf handler;
+  jmp_buf *outer = vm->error_handler;
+  VM *prev = vm_swap_current(vm);
+  TValue *result = NULL;
+  int status = VMErrorRuntime;
+
+  vm->error_handler = &handler;
+  if (setjmp(handler) == 0) {
+    Coroutine *co = task_of(vm, new_TValue_with_integer(task));
+    result = step(vm, co, fuel < 0 ? -1 : fuel);
+    status = co->finished ? VMOk : VMSuspended;
+    if (co->preempted) {
+      result = NULL;
+    }
+  }
+  vm->error_handler = outer;
+  vm_swap_current(prev);
+
+  if (ret != NULL) {
+    *ret = status == VMErrorRuntime ? NULL : result;
+  }
+  return status;
+}
+
+void env_def_coroutines(Env *env) {
+  env_def_native(env, "spawn", 2, task_spawn);
+  env_def_native(env, "yield", 1, task_yield);
+  env_def_native(env, "resume", 1, task_resume);
+  env_def_native(env, "finished", 1, task_finished);
+  env_def_native(env, "run_tasks", 0, task_run);
+}
@@ -0,0 +1,178 @@
+#include "sds/sds.h"
+#include "tinyvm.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Escape analysis and scalar replacement of arrays.
+ *
+ * An array variable t that the whole program only ever uses as
+ * `tOpMakeArray n; tOpVariableDeclareWithAssign t` and as
+ * `tOpPush k; tOpGet/SetArrayElement t` with constant k < n never lets the
+ * array itself escape. Each element then becomes a variable of its own,
+ * `$sra.t.k`, defined, read and written in the same scope t would have
+ * been, so no Vector or TValue is allocated for the array.
+ *
+ * Variables are resolved by name through the scopes of the callers, so a
+ * use anywhere in the program counts, not only in the function defining t.
+ */
+
+typedef struct {
+  Map *sizes;     // name -> smallest array size assigned + 1
+  Map *max_index; // name -> largest constant index used + 1
+  Map *escaped;   // names used in any other way
+} EscapeContext;
+
+static bool is_name_op(Opcode op) {
+  return op == tOpVariableDeclareOnlySymbol ||
+         op == tOpVariableDeclareWithAssign || op == tOpSetVariablePop ||
+         op == tOpAssignExpression || op == tOpGetVariable ||
+         op == tOpSetArrayElement || op == tOpGetArrayElement ||
+         op == tOpCall || op == tOpFunctionDeclare;
+}
+
+static bool is_elem_op(Opcode op) {
+  return op == tOpGetArrayElement || op == tOpSetArrayElement;
+}
+
+static bool *branch_targets(Vector *insts) {
+  bool *is_target = xmalloc(sizeof(bool) * (insts->len + 1));
+  memset(is_target, 0, sizeof(bool) * (insts->len + 1));
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    inst->idx = i;
+  }
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (op_is_branch(inst->op)) {
+      is_target[inst->target != NULL ? inst->target->idx : insts->len] = true;
+    }
+  }
+  return is_target;
+}
+
+/* Array declaration t = [..n elements..] at i, returns n or -1 */
+static long long int array_decl(Vector *insts, bool *is_target,
+                                long long int i) {
+  Inst *inst = insts->data[i];
+  Inst *next = i + 1 < insts->len ? insts->data[i + 1] : NULL;
+  if (inst->op != tOpMakeArray || next == NULL || is_target[i + 1] ||
+      (next->op != tOpVariableDeclareWithAssign &&
+       next->op != tOpAssignExpression)) {
+    return -1;
+  }
+  return tv_getLong(inst->operand);
+}
+
+/* Element access t[k] at i, returns k or -1 */
+static long long int constant_index(Vector *insts, bool *is_target,
+                                    long long int i) {
+  Inst *inst = insts->data[i];
+  Inst *next = i + 1 < insts->len ? insts->data[i + 1] : NULL;
+  if (inst->op != tOpPush || inst->operand->tt != Long || next == NULL ||
+      is_target[i + 1] || !is_elem_op(next->op) ||
+      tv_getLong(inst->operand) < 0) {
+    return -1;
+  }
+  return tv_getLong(inst->operand);
+}
+
+static void record(Map *map, sds name, long long int n, bool smallest) {
+  long long int old = (intptr_t)map_get(map, name);
+  if (old == 0 || (smallest ? n + 1 < old : n + 1 > old)) {
+    map_puti(map, name, n + 1);
+  }
+}
+
+static void scan(EscapeContext *ctx, Vector *insts) {
+  bool *is_target = branch_targets(insts);
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    long long int n = array_decl(insts, is_target, i);
+    long long int k = constant_index(insts, is_target, i);
+    if (n >= 0) {
+      record(ctx->sizes, tv_getString(((Inst *)insts->data[++i])->operand), n,
+             true);
+      continue;
+    }
+    if (k >= 0) {
+      record(ctx->max_index,
+             tv_getString(((Inst *)insts->data[++i])->operand), k, false);
+      continue;
+    }
+
+    if (inst->op == tOpFunctionDeclare) {
+      scan(ctx, inst->body);
+    }
+    if (is_name_op(inst->op)) {
+      map_puti(ctx->escaped, tv_getString(inst->operand), 1);
+    }
+  }
+}
+
+static bool replaceable(EscapeContext *ctx, sds name) {
+  long long int size = (intptr_t)map_get(ctx->sizes, name);
+  long long int max_index = (intptr_t)map_get(ctx->max_index, name);
+  return size > 0 && max_index <= size && map_get(ctx->escaped, name) == NULL;
+}
+
+static TValue *element(sds name, long long int k) {
+  return new_TValue_with_str(sdscatprintf(sdsempty(), "$sra.%s.%lld", name, k));
+}
+
+static Vector *replace(EscapeContext *ctx, Vector *insts) {
+  bool *is_target = branch_targets(insts);
+  Vector *ret = new_vec();
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    long long int n = array_decl(insts, is_target, i);
+    long long int k = constant_index(insts, is_target, i);
+    Inst *next = i + 1 < insts->len ? insts->data[i + 1] : NULL;
+
+    if (inst->op == tOpFunctionDeclare) {
+      inst->body = replace(ctx, inst->body);
+    }
+
+    if (n >= 0 && replaceable(ctx, tv_getString(next->operand))) {
+      /* the first instruction is kept, branches may target it; the top of
+       * the stack is the last element */
+      sds name = tv_getString(next->operand);
+      inst->op = n > 0 ? tOpVariableDeclareWithAssign : tOpNop;
+      inst->operand = n > 0 ? element(name, n - 1) : NULL;
+      vec_push(ret, inst);
+      for (long long int j = n - 2; j >= 0; j--) {
+        vec_push(ret, new_Inst(tOpVariableDeclareWithAssign, element(name, j)));
+      }
+      i++;
+    } else if (k >= 0 && replaceable(ctx, tv_getString(next->operand))) {
+      inst->op = next->op == tOpGetArrayElement ? tOpGetVariable
+                                                : tOpSetVariablePop;
+      inst->operand = element(tv_getString(next->operand), k);
+      vec_push(ret, inst);
+      i++;
+    } else {
+      vec_push(ret, inst);
+    }
+  }
+
+  for (long long int i = 0; i < ret->len; i++) {
+    ((Inst *)ret->data[i])->idx = i;
+  }
+  return ret;
+}
+
+/**
+ * Replace the arrays that never escape with one variable per element.
+ */
+Vector *scalar_replace_arrays(Vector *insts) {
+  EscapeContext ctx;
+  ctx.sizes = new_map();
+  ctx.max_index = new_map();
+  ctx.escaped = new_map();
+  scan(&ctx, insts);
+  return replace(&ctx, insts);
+}
@@ -0,0 +1,295 @@
+#include "tinyvm.h"
+
+#ifdef __USE_BOEHM_GC__
+#include <gc.h>
+#endif
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Host API of libtinyvm, built by `make lib`.
+ *
+ * A host opens a VM and loads a program into it once. Loading runs the top
+ * level, which binds the program's functions in the VM. The host then looks
+ * functions up by name and calls them with its own arguments as often as it
+ * likes:
+ *
+ *   VM *vm = vm_open();
+ *   vm_load_file(vm, "handler.compiled", OPT_LEVEL_MAX);
+ *   TValue *handle = vm_lookup(vm, "handle");
+ *   TValue *args[] = {new_TValue_with_integer(42)};
+ *   TValue *ret;
+ *   if (vm_invoke(vm, handle, args, 1, &ret) != VMOk) {
+ *     fprintf(stderr, "%s\n", vm->error);
+ *   }
+ *
+ * A VM runs one program. The optimizer sees a program as the whole of the
+ * code that can declare and write its globals: escape analysis, bounds
+ * check elimination and inlining all rest on that. Another program would
+ * break their proofs, so vm_load, vm_load_file and vm_load_module return
+ * VMErrorLoad once the VM ran a top level, and hosts open a VM for each
+ * program.
+ *
+ * Calls reuse the loaded code and whatever the JIT compiled from it, and
+ * leave the VM stack as they found it. An error in a call returns
+ * VMErrorRuntime with the message in vm->error and leaves the VM usable.
+ *
+ * A VM keeps all of its state to itself, so VMs on different threads run
+ * concurrently. One VM is used by one thread at a time. Threads that the
+ * host did not create with GC_pthread_create call vm_register_thread before
+ * their first vm_open and vm_unregister_thread when they are done.
+ *
+ * Hosts running one program in many VMs load it once as a Module instead:
+ *
+ *   Module *module = module_load_file("handler.compiled", OPT_LEVEL_MAX);
+ *   ...on each thread:
+ *   VM *vm = vm_open();
+ *   vm_load_module(vm, module);
+ *   ...
+ *   vm_close(vm);
+ *
+ * Deserializing and optimizing happen once, in module_load_file. The code
+ * is never written after that, so every VM executes it in place, function
+ * bodies included, and a VM only adds its global Env and what it compiles
+ * itself.
+ */
+
+VM *vm_open(void) {
+#ifdef __USE_BOEHM_GC__
+  GC_INIT();
+  GC_allow_register_threads();
+#endif
+  return new_VM();
+}
+
+/**
+ * Make the collector scan the calling thread, returns false if that
+ * failed. Threads already known to it are fine.
+ */
+bool vm_register_thread(void) {
+#ifdef __USE_BOEHM_GC__
+  struct GC_stack_base sb;
+  if (GC_get_stack_base(&sb) != GC_SUCCESS) {
+    return false;
+  }
+  GC_register_my_thread(&sb);
+#endif
+  return true;
+}
+
+void vm_unregister_thread(void) {
+#ifdef __USE_BOEHM_GC__
+  GC_unregister_my_thread();
+#endif
+}
+
+/* Whether vm can not load another program, which sets vm->error */
+static bool loaded_already(VM *vm) {
+  if (vm->loaded) {
+    vm->error = sdsnew("The VM has loaded a program already");
+  }
+  return vm->loaded;
+}
+
+/* Run optimized code as the top level of vm */
+static int run_top_level(VM *vm, Vector *code, int opt_level) {
+  if (loaded_already(vm)) {
+    return VMErrorLoad;
+  }
+  vm->loaded = true;
+
+  jmp_buf handler;
+  jmp_buf *outer = vm->error_handler;
+  VM *prev = vm_swap_current(vm);
+  Env *env = vm->env;
+  int status = VMOk;
+
+  vm->error_handler = &handler;
+  if (setjmp(handler) == 0) {
+    vm_run(vm, opt_level >= 0
+                   ? optimize(code, opt_passes_for_level(opt_level))
+                   : code);
+  } else {
+    status = VMErrorRuntime;
+    vm->env = env;
+  }
+  vm->error_handler = outer;
+  vm_swap_current(prev);
+  vm->stack->len = 0;
+  return status;
+}
+
+/**
+ * Optimize deserialized code and run it as the top level of vm, which must
+ * not have loaded a program yet.
+ */
+int vm_load(VM *vm, Vector *code, int opt_level) {
+  return run_top_level(vm, code, opt_level);
+}
+
+/* vm_load of a compiled file */
+int vm_load_file(VM *vm, char *filename, int opt_level) {
+  if (loaded_already(vm)) {
+    return VMErrorLoad;
+  }
+
+  jmp_buf handler;
+  jmp_buf *outer = vm->error_handler;
+  VM *prev = vm_swap_current(vm);
+  Vector *code = NULL;
+
+  vm->error_handler = &handler;
+  if (setjmp(handler) == 0) {
+    code = cache_load_file(filename, opt_level);
+    if (code == NULL) {
+      vm->error = sdscatprintf(sdsempty(), "Failed to open the file - %s",
+                               filename);
+    }
+  } else {
+    code = NULL;
+  }
+  vm->error_handler = outer;
+  vm_swap_current(prev);
+
+  if (code == NULL) {
+    return VMErrorLoad;
+  }
+  return run_top_level(vm, code, -1);
+}
+
+/* The function bound to name, NULL if there is none */
+TValue *vm_lookup(VM *vm, char *name) {
+  TValue *func = env_get(vm->env, sdsnew(name));
+  if (func == NULL || (func->tt != Function && func->tt != Native)) {
+    return NULL;
+  }
+  return func;
+}
+
+/**
+ * Call func with argc arguments. Its result, or NULL, is stored to *ret if
+ * ret is not NULL.
+ */
+int vm_invoke(VM *vm, TValue *func, TValue **args, long long int argc,
+              TValue **ret) {
+  jmp_buf handler;
+  jmp_buf *outer = vm->error_handler;
+  VM *prev = vm_swap_current(vm);
+  Env *env = vm->env;
+  long long int base = vm->stack->len;
+  TValue *result = NULL;
+  int status = VMOk;
+
+  for (long long int i = 0; i < argc; i++) {
+    vec_push(vm->stack, args[i]);
+  }
+  vm->error_handler = &handler;
+  if (setjmp(handler) == 0) {
+    result = vm_apply(vm, func);
+  } else {
+    status = VMErrorRuntime;
+    vm->env = env;
+  }
+  vm->error_handler = outer;
+  vm_swap_current(prev);
+  vm->stack->len = base;
+
+  if (ret != NULL) {
+    *ret = status == VMOk ? result : NULL;
+  }
+  return status;
+}
+
+/**
+ * Deserialize the words of a program unless code is given and optimize the
+ * code, or else load filename through the cache. Returns NULL on errors,
+ * which are reported to a VM of our own to come back here.
+ */
+static Vector *prepare(char *filename, Vector *words, Vector *code,
+                       int opt_level) {
+  VM loader = {0};
+  jmp_buf handler;
+  VM *prev = vm_swap_current(&loader);
+  Vector *volatile ret = NULL;
+
+  loader.error_handler = &handler;
+  if (setjmp(handler) == 0) {
+    if (code == NULL && words == NULL) {
+      ret = cache_load_file(filename, opt_level);
+    } else {
+      ret = optimize(code != NULL ? code : deserialize(words),
+                     opt_passes_for_level(opt_level));
+    }
+  }
+  vm_swap_current(prev);
+  return ret;
+}
+
+static Module *new_Module(Vector *code) {
+  Module *module = xmalloc(sizeof(Module));
+  module->code = code;
+  module->refs = 1;
+  return module;
+}
+
+/* A module of deserialized code, NULL if it could not be optimized */
+Module *module_new(Vector *code, int opt_level) {
+  code = prepare(NULL, NULL, code, opt_level);
+  return code == NULL ? NULL : new_Module(code);
+}
+
+/* A module of a compiled file, NULL if it could not be loaded */
+Module *module_load_file(char *filename, int opt_level) {
+  Vector *code = prepare(filename, NULL, NULL, opt_level);
+  return code == NULL ? NULL : new_Module(code);
+}
+
+/* A module of a compiled program in memory, NULL if it could not be loaded */
+Module *module_load_bytes(const char *bytes, size_t len, int opt_level) {
+  Vector *code = prepare(NULL, wordsFromBytes(bytes, len), NULL, opt_level);
+  return code == NULL ? NULL : new_Module(code);
+}
+
+Module *module_retain(Module *module) {
+  __atomic_add_fetch(&module->refs, 1, __ATOMIC_RELAXED);
+  return module;
+}
+
+/**
+ * Drop a reference. The last one frees the module, its code is left to the
+ * collector since functions a host still holds run in it.
+ */
+void module_release(Module *module) {
+  if (__atomic_sub_fetch(&module->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    xfree(module);
+  }
+}
+
+/* Run the top level of module in vm, which keeps a reference until vm_close */
+int vm_load_module(VM *vm, Module *module) {
+  if (loaded_already(vm)) {
+    return VMErrorLoad;
+  }
+  if (vm->modules == NULL) {
+    vm->modules = new_vec();
+  }
+  vec_push(vm->modules, module_retain(module));
+  return run_top_level(vm, module->code, -1);
+}
+
+/**
+ * Release the modules vm loaded and unmap the native code it compiled, vm
+ * and its functions must not be used afterwards.
+ */
+void vm_close(VM *vm) {
+  jit_release(vm);
+  if (vm->modules != NULL) {
+    for (long long int i = 0; i < vm->modules->len; i++) {
+      module_release(vm->modules->data[i]);
+    }
+    vm->modules = NULL;
+  }
+}
@@ -0,0 +1,288 @@
+#include "sds/sds.h"
+#include "tinyvm.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Load-time inliner.
+ *
+ * A call `tOpCall f` is replaced with a copy of f's body when f is declared
+ * once at the top level, never reassigned, small and not (mutually)
+ * recursive. Arguments are already on the operand stack and the body pops
+ * them itself, so the copy only needs its locals renamed and its returns
+ * turned into jumps to the instruction after the call.
+ */
+
+// Maximum number of instructions in an inlined body
+#ifndef INLINE_BUDGET
+#define INLINE_BUDGET 16
+#endif
+
+#define INLINE_MAX_ROUNDS 4
+
+typedef struct {
+  Map *decl_count; // name -> number of tOpFunctionDeclare
+  Map *decls;      // name -> top-level tOpFunctionDeclare Inst
+  Map *assigned;   // names written by a variable definition anywhere
+  Map *globals;    // names living in the global store
+  long long int sites;
+} InlineContext;
+
+static bool is_def_op(Opcode op) {
+  return op == tOpVariableDeclareOnlySymbol ||
+         op == tOpVariableDeclareWithAssign || op == tOpSetVariablePop ||
+         op == tOpAssignExpression;
+}
+
+static bool is_name_op(Opcode op) {
+  return is_def_op(op) || op == tOpGetVariable || op == tOpSetArrayElement ||
+         op == tOpGetArrayElement || op == tOpCall;
+}
+
+static void mark(Map *map, sds key) {
+  map_puti(map, key, (int)(intptr_t)map_get(map, key) + 1);
+}
+
+static bool marked(Map *map, sds key) { return map_get(map, key) != NULL; }
+
+static void scan(InlineContext *ctx, Vector *insts, bool top_level) {
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpFunctionDeclare) {
+      sds name = tv_getString(inst->operand);
+      mark(ctx->decl_count, name);
+      if (top_level) {
+        map_put(ctx->decls, name, inst);
+        mark(ctx->globals, name);
+      }
+      scan(ctx, inst->body, false);
+    } else if (is_def_op(inst->op)) {
+      sds name = tv_getString(inst->operand);
+      mark(ctx->assigned, name);
+      if (top_level) {
+        mark(ctx->globals, name);
+      }
+    }
+  }
+}
+
+static Map *def_names(Vector *insts) {
+  Map *names = new_map();
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (is_def_op(inst->op) || inst->op == tOpFunctionDeclare) {
+      mark(names, tv_getString(inst->operand));
+    }
+  }
+  return names;
+}
+
+static bool reaches(InlineContext *ctx, Vector *insts, sds fname,
+                    Vector *visited) {
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op != tOpCall) {
+      continue;
+    }
+    sds callee = tv_getString(inst->operand);
+    if (!strcmp(callee, fname)) {
+      return true;
+    }
+    Inst *decl = map_get(ctx->decls, callee);
+    if (decl != NULL && !vec_containss(visited, callee)) {
+      vec_push(visited, callee);
+      if (reaches(ctx, decl->body, fname, visited)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/**
+ * Returns the declaration of fname if calls to it may be inlined.
+ */
+static Inst *inline_candidate(InlineContext *ctx, sds fname) {
+  Inst *decl = map_get(ctx->decls, fname);
+  if (decl == NULL || (intptr_t)map_get(ctx->decl_count, fname) != 1 ||
+      marked(ctx->assigned, fname) || decl->body->len > INLINE_BUDGET) {
+    return NULL;
+  }
+
+  for (long long int i = 0; i < decl->body->len; i++) {
+    Inst *inst = decl->body->data[i];
+    if (inst->op == tOpFunctionDeclare) {
+      return NULL;
+    }
+    /* a write to a global name would define a different variable once the
+     * body runs in the caller's scope */
+    if (is_def_op(inst->op) &&
+        marked(ctx->globals, tv_getString(inst->operand))) {
+      return NULL;
+    }
+  }
+
+  if (reaches(ctx, decl->body, fname, new_vec())) {
+    return NULL;
+  }
+
+  return decl;
+}
+
+/**
+ * Free names of body must resolve to the same variables when it runs in the
+ * caller's scope, i.e. neither the caller nor a function enclosing it may
+ * define any of them. scopes holds the names each of them defines.
+ */
+static bool free_names_visible(Vector *body, Map *body_defs, Vector *scopes) {
+  for (long long int i = 0; i < body->len; i++) {
+    Inst *inst = body->data[i];
+    if (!is_name_op(inst->op)) {
+      continue;
+    }
+    sds name = tv_getString(inst->operand);
+    if (marked(body_defs, name)) {
+      continue;
+    }
+    for (long long int j = 0; j < scopes->len; j++) {
+      if (marked(scopes->data[j], name)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static sds rename_local(InlineContext *ctx, sds fname, sds name) {
+  return sdscatprintf(sdsempty(), "%s.%lld.%s", fname, ctx->sites, name);
+}
+
+/**
+ * Append a copy of body to dst. Returns and falling off the end continue at
+ * cont (NULL for the end of the caller's code).
+ */
+static void splice_body(InlineContext *ctx, Vector *dst, sds fname,
+                        Vector *body, Map *body_defs, Inst *cont) {
+  Map *renamed = new_map();
+  Inst **clones = xmalloc(sizeof(Inst *) * (body->len + 1));
+
+  for (long long int i = 0; i < body->len; i++) {
+    Inst *inst = body->data[i];
+    Inst *clone = new_Inst(inst->op, inst->operand);
+
+    if (is_name_op(inst->op)) {
+      sds name = tv_getString(inst->operand);
+      if (marked(body_defs, name)) {
+        TValue *local = map_get(renamed, name);
+        if (local == NULL) {
+          local = new_TValue_with_str(rename_local(ctx, fname, name));
+          map_put(renamed, name, local);
+        }
+        clone->operand = local;
+      }
+    } else if (inst->op == tOpReturn) {
+      clone->op = tOpJumpRel;
+      clone->operand = NULL;
+      clone->target = cont;
+    }
+
+    clones[i] = clone;
+    vec_push(dst, clone);
+  }
+
+  for (long long int i = 0; i < body->len; i++) {
+    Inst *inst = body->data[i];
+    if (op_is_branch(inst->op)) {
+      clones[i]->target =
+          inst->target != NULL ? clones[inst->target->idx] : cont;
+    }
+  }
+
+  ctx->sites++;
+}
+
+/**
+ * Inline the calls of insts, the body of a function nested in the functions
+ * whose defined names are scopes, or the top level if scopes is empty.
+ */
+static Vector *inline_calls(InlineContext *ctx, Vector *insts, Vector *scopes,
+                            bool *changed) {
+  Vector *ret = new_vec();
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+
+    if (inst->op == tOpFunctionDeclare) {
+      Vector *inner = new_vec();
+      for (long long int j = 0; j < scopes->len; j++) {
+        vec_push(inner, scopes->data[j]);
+      }
+      vec_push(inner, def_names(inst->body));
+      inst->body = inline_calls(ctx, inst->body, inner, changed);
+    }
+
+    Inst *decl = inst->op == tOpCall
+                     ? inline_candidate(ctx, tv_getString(inst->operand))
+                     : NULL;
+    if (decl == NULL) {
+      vec_push(ret, inst);
+      continue;
+    }
+
+    Map *body_defs = def_names(decl->body);
+    if (!free_names_visible(decl->body, body_defs, scopes)) {
+      vec_push(ret, inst);
+      continue;
+    }
+
+    /* The call site becomes a nop entry followed by the copied body. Branches
+     * to the call are moved to the entry below, returns go to the original
+     * next instruction (or to its entry if it is replaced as well). */
+    Inst *cont = i + 1 < insts->len ? insts->data[i + 1] : NULL;
+    Inst *entry = new_Inst(tOpNop, NULL);
+    vec_push(ret, entry);
+    splice_body(ctx, ret, tv_getString(decl->operand), decl->body, body_defs,
+                cont);
+    inst->dead = true;
+    inst->forward = entry;
+    *changed = true;
+  }
+
+  /* retarget branches that pointed at replaced call sites */
+  for (long long int i = 0; i < ret->len; i++) {
+    Inst *inst = ret->data[i];
+    if (op_is_branch(inst->op) && inst->target != NULL &&
+        inst->target->dead) {
+      inst->target = inst->target->forward;
+    }
+    inst->idx = i;
+  }
+
+  return ret;
+}
+
+Vector *inline_functions(Vector *insts) {
+  InlineContext ctx;
+  ctx.sites = 0;
+
+  /* inlined bodies may contain calls that become inlinable in turn */
+  for (int round = 0; round < INLINE_MAX_ROUNDS; round++) {
+    ctx.decl_count = new_map();
+    ctx.decls = new_map();
+    ctx.assigned = new_map();
+    ctx.globals = new_map();
+    mark(ctx.globals, sdsnew("print"));
+    mark(ctx.globals, sdsnew("println"));
+    scan(&ctx, insts, true);
+
+    bool changed = false;
+    insts = inline_calls(&ctx, insts, new_vec(), &changed);
+    if (!changed) {
+      break;
+    }
+  }
+  return insts;
+}
@@ -0,0 +1,871 @@
+#include "sds/sds.h"
+#include "tinyvm.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __ENABLE_JIT__
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Baseline JIT for x86-64.
+ *
+ * Every opcode has a machine code stencil with holes for its operand, the
+ * address of the helper implementing it and branch displacements. Compiling
+ * a function copies the stencils of its instructions one after another into
+ * executable memory and patches the holes, so the dispatch of the
+ * interpreter disappears while the semantics stay in the C helpers below.
+ *
+ * Generated code has the signature of JITCode. The VM pointer lives in rbx
+ * for the whole function.
+ */
+
+//////////////////  helpers  //////////////////
+
+/**
+ * jit_<opcode>(vm, operand) for every VM_HANDLER of vm_handlers.h, the body
+ * the interpreter runs. Calls and branches are compiled below instead.
+ */
+#define VM_OPERAND() operand
+#define VM_CONTROL(op_name, ...)
+#define VM_HANDLER(op_name, ...)                                               \
+  static void jit_##op_name(VM *vm, TValue *operand) {                         \
+    (void)vm;                                                                  \
+    (void)operand;                                                             \
+    __VA_ARGS__;                                                               \
+  }
+#include "vm_handlers.h"
+#undef VM_HANDLER
+
+static void jit_call(VM *vm, TValue *func) {
+  vm_call(vm, tv_getString(func));
+}
+
+static bool jit_if(VM *vm, TValue *operand) {
+  (void)operand;
+  TValue *cond = (TValue *)vec_pop(vm->stack);
+  bool taken = false;
+  VM_CONDITION(taken, cond);
+  return taken;
+}
+
+static void *const helpers[tOpCount] = {
+#define VM_HANDLER(op_name, ...) [op_name] = jit_##op_name,
+#include "vm_handlers.h"
+#undef VM_HANDLER
+    [tOpCall] = jit_call,
+    [tOpIFStatement] = jit_if,
+};
+
+#undef VM_CONTROL
+#undef VM_OPERAND
+
+static void *helper_of(Opcode op) {
+  return op >= 0 && op < tOpCount ? helpers[op] : NULL;
+}
+
+//////////////////  stencils  //////////////////
+
+typedef struct {
+  const unsigned char *code;
+  size_t len;
+  int operand_hole; // imm64, -1 if none
+  int helper_hole;  // imm64, -1 if none
+  int rel32_hole;   // branch displacement, -1 if none
+} Stencil;
+
+/* push rbx; mov rbx, rdi */
+static const unsigned char prologue_code[] = {0x53, 0x48, 0x89, 0xfb};
+
+/* mov rdi, rbx; movabs rsi, <operand>; movabs rax, <helper>; call rax */
+static const unsigned char call_code[] = {
+    0x48, 0x89, 0xdf, 0x48, 0xbe, 0, 0, 0, 0, 0, 0, 0, 0,
+    0x48, 0xb8, 0,    0,    0,    0, 0, 0, 0, 0, 0xff, 0xd0};
+
+/* test al, al; jz <rel32> */
+static const unsigned char branch_false_code[] = {0x84, 0xc0, 0x0f, 0x84,
+                                                  0,    0,    0,    0};
+
+/* jmp <rel32> */
+static const unsigned char jump_code[] = {0xe9, 0, 0, 0, 0};
+
+/* mov rdi, rbx; movabs rax, <vm_stackPeekTop>; call rax; pop rbx; ret */
+static const unsigned char epilogue_code[] = {
+    0x48, 0x89, 0xdf, 0x48, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xd0, 0x5b,
+    0xc3};
+
+static const Stencil prologue = {prologue_code, sizeof(prologue_code), -1, -1,
+                                 -1};
+static const Stencil call = {call_code, sizeof(call_code), 5, 15, -1};
+static const Stencil branch_false = {branch_false_code,
+                                     sizeof(branch_false_code), -1, -1, 4};
+static const Stencil jump = {jump_code, sizeof(jump_code), -1, -1, 1};
+static const Stencil epilogue = {epilogue_code, sizeof(epilogue_code), -1, 5,
+                                 -1};
+
+typedef struct {
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+} CodeBuffer;
+
+typedef struct {
+  size_t at;            // position of the rel32 hole
+  long long int target; // instruction index, insts->len for the epilogue
+} Patch;
+
+static void put_imm64(CodeBuffer *cb, size_t at, uint64_t v) {
+  memcpy(cb->buf + at, &v, sizeof(v));
+}
+
+/**
+ * Copy a stencil to the end of the buffer, fill its operand and helper holes
+ * and return the position of the copy.
+ */
+static size_t emit(CodeBuffer *cb, const Stencil *s, void *operand,
+                   void *helper) {
+  if (cb->len + s->len > cb->cap) {
+    size_t cap = (cb->cap + s->len) * 2;
+    unsigned char *buf = xmalloc(cap);
+    memcpy(buf, cb->buf, cb->len);
+    cb->buf = buf;
+    cb->cap = cap;
+  }
+
+  size_t at = cb->len;
+  memcpy(cb->buf + at, s->code, s->len);
+  cb->len += s->len;
+
+  if (s->operand_hole >= 0) {
+    put_imm64(cb, at + s->operand_hole, (uint64_t)(uintptr_t)operand);
+  }
+  if (s->helper_hole >= 0) {
+    put_imm64(cb, at + s->helper_hole, (uint64_t)(uintptr_t)helper);
+  }
+  return at;
+}
+
+// Bytes in front of the code of a mapping, holding the size of the mapping
+#define NATIVE_HEADER 16
+
+/* Map the code of cb, vm->native keeps the mapping until jit_release */
+static void *make_executable(VM *vm, CodeBuffer *cb) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (NATIVE_HEADER + cb->len + page - 1) / page * page;
+
+  unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+  memcpy(mem, &size, sizeof(size));
+  memcpy(mem + NATIVE_HEADER, cb->buf, cb->len);
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    return NULL;
+  }
+  if (vm->native == NULL) {
+    vm->native = new_vec();
+  }
+  vec_push(vm->native, mem);
+  return mem + NATIVE_HEADER;
+}
+
+/**
+ * Unmap the native code vm compiled, functions and loops of vm must not run
+ * afterwards.
+ */
+void jit_release(VM *vm) {
+  if (vm->native == NULL) {
+    return;
+  }
+  for (long long int i = 0; i < vm->native->len; i++) {
+    size_t size;
+    memcpy(&size, vm->native->data[i], sizeof(size));
+    munmap(vm->native->data[i], size);
+  }
+  vm->native = NULL;
+  vm->loops = NULL;
+}
+
+/**
+ * Compile code to native code owned by vm. Returns NULL if the code contains
+ * an instruction the JIT does not handle; the caller keeps interpreting it.
+ */
+void *jit_compile(VM *vm, Vector *code) {
+  Vector *insts = code_decode(code);
+  if (insts == NULL) {
+    return NULL;
+  }
+
+  CodeBuffer cb = {NULL, 0, 0};
+  size_t *offsets = xmalloc(sizeof(size_t) * (insts->len + 1));
+  Patch *patches = xmalloc(sizeof(Patch) * (insts->len + 1));
+  long long int patches_len = 0;
+
+  emit(&cb, &prologue, NULL, NULL);
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    offsets[i] = cb.len;
+
+    const Stencil *branch = NULL;
+    switch (inst->op) {
+    case tOpNop:
+      break;
+    case tOpReturn:
+    case tOpJumpRel:
+    case tOpJumpAbs:
+      branch = &jump;
+      break;
+    case tOpIFStatement:
+      emit(&cb, &call, inst->operand, helper_of(inst->op));
+      branch = &branch_false;
+      break;
+    default: {
+      void *helper = helper_of(inst->op);
+      if (helper == NULL) {
+        return NULL;
+      }
+      emit(&cb, &call, inst->operand, helper);
+      break;
+    }
+    }
+
+    if (branch != NULL) {
+      size_t at = emit(&cb, branch, NULL, NULL) + branch->rel32_hole;
+      long long int target = insts->len;
+      if (inst->op != tOpReturn && inst->target != NULL) {
+        target = inst->target->idx;
+      }
+      patches[patches_len].at = at;
+      patches[patches_len].target = target;
+      patches_len++;
+    }
+  }
+
+  offsets[insts->len] = cb.len;
+  emit(&cb, &epilogue, NULL, vm_stackPeekTop);
+
+  for (long long int i = 0; i < patches_len; i++) {
+    int32_t rel = (int32_t)(offsets[patches[i].target] - (patches[i].at + 4));
+    memcpy(cb.buf + patches[i].at, &rel, sizeof(rel));
+  }
+
+  return make_executable(vm, &cb);
+}
+
+
+//////////////////  tracing JIT  //////////////////
+
+/**
+ * Tracing JIT for loops of interpreted code.
+ *
+ * The interpreter reports backward jumps with trace_loop. Once a loop header
+ * has been reached trace_threshold times, the recorder runs one iteration
+ * with the helpers above and logs every instruction it executes. Jumps
+ * disappear and each tOpIFStatement becomes a guard on the direction it took,
+ * so the trace is a straight line that is compiled to a native loop.
+ *
+ * Instructions that saw Long operands while recording are specialized: the
+ * arithmetic and comparisons work on raw integers, a comparison feeding a
+ * guard never boxes its Bool, and a constant operand is folded into the
+ * instruction instead of being pushed. Variables that only ever hold Longs
+ * inside the loop are checked once on entry instead of at every use.
+ *
+ * Values are not kept unboxed across instructions though: the trace calls a
+ * helper per instruction and they pass values on vm->stack, so every Long an
+ * arithmetic instruction computes is boxed by new_TValue_with_integer, like
+ * in the interpreter. Only the Bool of a fused comparison is saved. Keeping
+ * results in registers would need code generation beyond the stencils, and
+ * variables hold boxed values anyway.
+ *
+ * A failing guard leaves the loop and returns the bytecode position where the
+ * interpreter continues. Type guards fail before their instruction changes
+ * anything, so the interpreter just executes that instruction again.
+ */
+
+#define TRACE_MAX_LENGTH 256
+#define TRACE_MAX_FAILURES 16 // failed entries before a trace is dropped
+#define LOOP_BUCKETS 64
+
+typedef enum {
+  TrGeneric,  // helper of the opcode, never exits
+  TrGuardIf,  // the condition goes the recorded way
+  TrGuardCmp, // Long comparison fused with the tOpIFStatement after it
+  TrArith,    // Long arithmetic, its result boxed
+  TrGuardVar, // hoisted guard, the variable holds a Long
+} TraceKind;
+
+typedef struct {
+  TraceKind kind;
+  Opcode op;
+  TValue *operand;
+  long long int pc;      // re-executed by the interpreter if a type differs
+  long long int exit_pc; // continuation when a guard takes the other way
+  int types[2];          // recorded types of the stack top and the slot below
+  bool taken;            // recorded direction of tOpIFStatement
+  bool checked;          // operand types are not proven to be Long
+  TValue *imm;           // folded constant replacing the slot below the top
+  bool fused;            // merged into a later instruction
+} TraceInst;
+
+struct LoopProfile_t {
+  Vector *code;
+  long long int header;
+  long long int count;
+  long long int failures;
+  bool recording;
+  bool failed;
+  Vector *trace;  // referenced by native
+  Vector *guards; // likewise
+  void *native;
+  struct LoopProfile_t *next;
+};
+
+typedef void (*JITHelper)(VM *vm, TValue *operand);
+
+static TraceInst *new_TraceInst(TraceKind kind, Opcode op, TValue *operand,
+                                long long int pc) {
+  TraceInst *ti = xmalloc(sizeof(TraceInst));
+  ti->kind = kind;
+  ti->op = op;
+  ti->operand = operand;
+  ti->pc = pc;
+  ti->exit_pc = -1;
+  ti->types[0] = ti->types[1] = -1;
+  ti->taken = false;
+  ti->checked = true;
+  ti->imm = NULL;
+  ti->fused = false;
+  return ti;
+}
+
+static int stack_type(VM *vm, long long int depth) {
+  if (vm->stack->len <= depth) {
+    return -1;
+  }
+  return ((TValue *)vm->stack->data[vm->stack->len - 1 - depth])->tt;
+}
+
+static bool is_arith(Opcode op) { return op >= tOpAdd && op <= tOpMod; }
+
+static bool is_compare(Opcode op) {
+  return op >= tOpEqualExpression && op <= tOpGteExpression;
+}
+
+static bool is_store(Opcode op) {
+  return op == tOpVariableDeclareOnlySymbol ||
+         op == tOpVariableDeclareWithAssign || op == tOpSetVariablePop ||
+         op == tOpAssignExpression;
+}
+
+//////////////////  trace helpers  //////////////////
+
+/* Each returns -1 to stay on trace or the position to continue at. */
+
+static long long int tr_guard_var(VM *vm, TraceInst *ti) {
+  HasPtrResult *ptr = env_has_ptr(vm->env, tv_getString(ti->operand));
+  return ptr->tv != NULL && ptr->tv->tt == Long ? -1 : ti->pc;
+}
+
+static long long int tr_guard_if(VM *vm, TraceInst *ti) {
+  return jit_if(vm, ti->operand) == ti->taken ? -1 : ti->exit_pc;
+}
+
+/**
+ * Pop the operands of a specialized instruction: a is the top of the stack,
+ * b the slot below or the folded constant. Returns false if a checked operand
+ * is not a Long, leaving the stack as the interpreter expects it.
+ */
+static bool tr_operands(VM *vm, TraceInst *ti, long long int *a,
+                        long long int *b) {
+  Vector *stack = vm->stack;
+  TValue *x = stack->data[stack->len - 1];
+  if (ti->imm != NULL) {
+    if (ti->checked && x->tt != Long) {
+      stack->data[stack->len - 1] = ti->imm;
+      vec_push(stack, x);
+      return false;
+    }
+    *a = x->value.integer;
+    *b = ti->imm->value.integer;
+    vec_pop(stack);
+    return true;
+  }
+
+  TValue *y = stack->data[stack->len - 2];
+  if (ti->checked && (x->tt != Long || y->tt != Long)) {
+    return false;
+  }
+  *a = x->value.integer;
+  *b = y->value.integer;
+  vec_pop(stack);
+  vec_pop(stack);
+  return true;
+}
+
+#define TRACE_ARITH(name, operator)                                            \
+  static long long int name(VM *vm, TraceInst *ti) {                           \
+    long long int a, b;                                                        \
+    if (!tr_operands(vm, ti, &a, &b)) {                                        \
+      return ti->pc;                                                           \
+    }                                                                          \
+    vec_push(vm->stack, new_TValue_with_integer(a operator b));                \
+    return -1;                                                                 \
+  }
+
+TRACE_ARITH(tr_add, +)
+TRACE_ARITH(tr_sub, -)
+TRACE_ARITH(tr_mul, *)
+TRACE_ARITH(tr_div, /)
+TRACE_ARITH(tr_mod, %)
+
+#define TRACE_COMPARE(name, operator)                                          \
+  static long long int name(VM *vm, TraceInst *ti) {                           \
+    long long int a, b;                                                        \
+    if (!tr_operands(vm, ti, &a, &b)) {                                        \
+      return ti->pc;                                                           \
+    }                                                                          \
+    return (a operator b) == ti->taken ? -1 : ti->exit_pc;                     \
+  }
+
+TRACE_COMPARE(tr_equal, ==)
+TRACE_COMPARE(tr_not_equal, !=)
+TRACE_COMPARE(tr_lt, <)
+TRACE_COMPARE(tr_lte, <=)
+TRACE_COMPARE(tr_gt, >)
+TRACE_COMPARE(tr_gte, >=)
+
+static void *trace_helper_of(TraceInst *ti) {
+  switch (ti->kind) {
+  case TrGeneric:
+    return helper_of(ti->op);
+  case TrGuardIf:
+    return tr_guard_if;
+  case TrGuardVar:
+    return tr_guard_var;
+  default:
+    break;
+  }
+
+  switch (ti->op) {
+  case tOpAdd:
+    return tr_add;
+  case tOpSub:
+    return tr_sub;
+  case tOpMul:
+    return tr_mul;
+  case tOpDiv:
+    return tr_div;
+  case tOpMod:
+    return tr_mod;
+  case tOpEqualExpression:
+    return tr_equal;
+  case tOpNotEqualExpression:
+    return tr_not_equal;
+  case tOpLtExpression:
+    return tr_lt;
+  case tOpLteExpression:
+    return tr_lte;
+  case tOpGtExpression:
+    return tr_gt;
+  case tOpGteExpression:
+    return tr_gte;
+  default:
+    return NULL;
+  }
+}
+
+//////////////////  recorder  //////////////////
+
+/**
+ * Run one iteration of the loop at header and return its trace, or NULL if
+ * the iteration left the loop or met an instruction that cannot be traced.
+ * Either way *pc is where the interpreter continues.
+ */
+static Vector *trace_record(VM *vm, Vector *code, long long int header,
+                            long long int *pc) {
+  Vector *trace = new_vec();
+  *pc = header;
+
+  do {
+    if (*pc < 0 || *pc >= code->len || trace->len >= TRACE_MAX_LENGTH) {
+      return NULL;
+    }
+
+    Opcode op = (Opcode)code->data[*pc];
+    TValue *operand =
+        op_operand_count(op) == 1 ? (TValue *)code->data[*pc + 1] : NULL;
+
+    switch (op) {
+    case tOpNop:
+      *pc += 1;
+      break;
+    case tOpJumpRel:
+      *pc += 2 + tv_getLong(operand);
+      break;
+    case tOpJumpAbs:
+      *pc = tv_getLong(operand) + 1;
+      break;
+    case tOpIFStatement: {
+      TraceInst *ti = new_TraceInst(TrGuardIf, op, operand, *pc);
+      long long int next = *pc + 2;
+      long long int skip = next + tv_getLong(operand);
+      ti->types[0] = stack_type(vm, 0);
+      ti->taken = jit_if(vm, operand);
+      ti->exit_pc = ti->taken ? skip : next;
+      *pc = ti->taken ? next : skip;
+      vec_push(trace, ti);
+      break;
+    }
+    default: {
+      JITHelper helper = helper_of(op);
+      if (helper == NULL) {
+        return NULL;
+      }
+      /* the trace optimizer specializes on its own */
+      TraceInst *ti = new_TraceInst(TrGeneric, op_generic(op), operand, *pc);
+      ti->types[0] = stack_type(vm, 0);
+      ti->types[1] = stack_type(vm, 1);
+      helper(vm, operand);
+      if (op == tOpGetVariable) {
+        ti->types[0] = stack_type(vm, 0);
+      }
+      *pc += 1 + op_operand_count(op);
+      vec_push(trace, ti);
+      break;
+    }
+    }
+  } while (*pc != header);
+
+  return trace;
+}
+
+//////////////////  trace optimizer  //////////////////
+
+static bool pushes_one(TraceInst *ti) {
+  return ti->kind == TrGeneric &&
+         (ti->op == tOpPush || ti->op == tOpGetVariable);
+}
+
+/**
+ * Specialize instructions that saw Long operands, fuse comparisons into the
+ * guards consuming them and fold constant operands.
+ */
+static Vector *trace_specialize(Vector *trace) {
+  for (long long int i = 0; i < trace->len; i++) {
+    TraceInst *ti = trace->data[i];
+    if (ti->types[0] != Long || ti->types[1] != Long) {
+      continue;
+    }
+    if (is_arith(ti->op)) {
+      ti->kind = TrArith;
+    } else if (is_compare(ti->op) && i + 1 < trace->len &&
+               ((TraceInst *)trace->data[i + 1])->kind == TrGuardIf) {
+      TraceInst *guard = trace->data[i + 1];
+      guard->kind = TrGuardCmp;
+      guard->op = ti->op;
+      guard->pc = ti->pc;
+      guard->types[0] = ti->types[0];
+      guard->types[1] = ti->types[1];
+      ti->fused = true;
+    }
+  }
+
+  Vector *live = new_vec();
+  for (long long int i = 0; i < trace->len; i++) {
+    TraceInst *ti = trace->data[i];
+    if (!ti->fused) {
+      vec_push(live, ti);
+    }
+  }
+
+  /* push k; <push x>; op  =>  <push x>; op with imm k */
+  for (long long int i = 2; i < live->len; i++) {
+    TraceInst *ti = live->data[i];
+    TraceInst *k = live->data[i - 2];
+    if ((ti->kind == TrArith || ti->kind == TrGuardCmp) &&
+        pushes_one(live->data[i - 1]) && k->kind == TrGeneric &&
+        k->op == tOpPush && k->operand->tt == Long && !k->fused) {
+      k->fused = true;
+      ti->imm = k->operand;
+    }
+  }
+
+  Vector *ret = new_vec();
+  for (long long int i = 0; i < live->len; i++) {
+    TraceInst *ti = live->data[i];
+    if (!ti->fused) {
+      vec_push(ret, ti);
+    }
+  }
+  return ret;
+}
+
+/**
+ * Abstractly execute the trace assuming every variable in invariant holds a
+ * Long on entry. Variables stored a value that may not be a Long are added to
+ * rejected. With final set, instructions whose operands are proven Longs drop
+ * their type checks.
+ */
+static bool trace_infer(Vector *trace, Vector *invariant, Vector *rejected,
+                        bool final) {
+  int *stack = xmalloc(sizeof(int) * (trace->len + 1));
+  long long int sp = 0;
+  bool changed = false;
+
+#define T_POP() (sp > 0 ? stack[--sp] : -1)
+#define T_PUSH(t) (stack[sp++] = (t))
+
+  for (long long int i = 0; i < trace->len; i++) {
+    TraceInst *ti = trace->data[i];
+
+    if (ti->kind == TrArith || ti->kind == TrGuardCmp) {
+      int a = T_POP();
+      int b = ti->imm != NULL ? Long : T_POP();
+      if (final) {
+        ti->checked = a != Long || b != Long;
+      }
+      if (ti->kind == TrArith) {
+        T_PUSH(Long);
+      }
+      continue;
+    }
+    if (ti->kind == TrGuardIf) {
+      T_POP();
+      continue;
+    }
+
+    Opcode op = ti->op;
+    if (op == tOpPush) {
+      T_PUSH(ti->operand->tt);
+    } else if (op == tOpGetVariable) {
+      sds name = tv_getString(ti->operand);
+      T_PUSH(vec_containss(invariant, name) && !vec_containss(rejected, name)
+                 ? Long
+                 : -1);
+    } else if (is_store(op)) {
+      int t = op == tOpVariableDeclareOnlySymbol ? Null : T_POP();
+      sds name = tv_getString(ti->operand);
+      if (t != Long && !vec_containss(rejected, name)) {
+        vec_push(rejected, name);
+        changed = true;
+      }
+    } else if (op == tOpCall) {
+      /* arity is unknown, forget the whole stack */
+      sp = 0;
+      T_PUSH(-1);
+    } else if (op == tOpMakeArray) {
+      for (long long int n = tv_getLong(ti->operand); n > 0; n--) {
+        T_POP();
+      }
+      T_PUSH(Array);
+    } else if (op == tOpGetArrayElement) {
+      T_POP();
+      T_PUSH(-1);
+    } else if (op == tOpArrayLength) {
+      T_POP();
+      T_PUSH(Long);
+    } else if (op == tOpArrayLoad) {
+      T_POP();
+      T_POP();
+      T_PUSH(-1);
+    } else if (op == tOpArrayStore) {
+      T_POP();
+      T_POP();
+      T_POP();
+    } else if (is_arith(op) || op == tOpXorExpression) {
+      T_POP();
+      T_POP();
+      T_PUSH(-1);
+    } else if (is_compare(op) || op == tOpAndExpression ||
+               op == tOpOrExpression) {
+      T_POP();
+      T_POP();
+      T_PUSH(Bool);
+    } else if (op == tOpSetArrayElement || op == tOpAssert) {
+      T_POP();
+      T_POP();
+    } else if (op == tOpPop || op == tOpPrint || op == tOpPrintln) {
+      T_POP();
+    }
+  }
+
+#undef T_POP
+#undef T_PUSH
+
+  return changed;
+}
+
+/**
+ * Returns the guards to run once on entry, one per variable that holds a Long
+ * throughout the loop. Calls may write any variable, so a trace containing
+ * one keeps all of its checks.
+ */
+static Vector *trace_hoist_guards(Vector *trace, long long int header) {
+  Vector *invariant = new_vec();
+  Vector *names = new_vec();
+  bool has_call = false;
+
+  for (long long int i = 0; i < trace->len; i++) {
+    TraceInst *ti = trace->data[i];
+    has_call |= ti->kind == TrGeneric && ti->op == tOpCall;
+    if (ti->kind == TrGeneric && ti->op == tOpGetVariable &&
+        ti->types[0] == Long &&
+        !vec_containss(invariant, tv_getString(ti->operand))) {
+      vec_push(invariant, tv_getString(ti->operand));
+      vec_push(names, ti->operand);
+    }
+  }
+  if (has_call) {
+    invariant = new_vec();
+  }
+
+  Vector *rejected = new_vec();
+  while (trace_infer(trace, invariant, rejected, false)) {
+  }
+  trace_infer(trace, invariant, rejected, true);
+
+  Vector *guards = new_vec();
+  for (long long int i = 0; i < names->len && !has_call; i++) {
+    TValue *name = names->data[i];
+    if (!vec_containss(rejected, tv_getString(name))) {
+      vec_push(guards, new_TraceInst(TrGuardVar, tOpGetVariable, name, header));
+    }
+  }
+  return guards;
+}
+
+//////////////////  trace compiler  //////////////////
+
+/* test rax, rax; jns <rel32> */
+static const unsigned char guard_code[] = {0x48, 0x85, 0xc0, 0x0f,
+                                           0x89, 0,    0,    0,    0};
+
+/* pop rbx; ret */
+static const unsigned char trace_exit_code[] = {0x5b, 0xc3};
+
+static const Stencil guard = {guard_code, sizeof(guard_code), -1, -1, 5};
+static const Stencil trace_exit = {trace_exit_code, sizeof(trace_exit_code),
+                                   -1, -1, -1};
+
+static void *trace_compile(VM *vm, Vector *guards, Vector *trace) {
+  CodeBuffer cb = {NULL, 0, 0};
+  size_t *exits = xmalloc(sizeof(size_t) * (guards->len + trace->len + 1));
+  long long int exits_len = 0;
+
+  emit(&cb, &prologue, NULL, NULL);
+
+  for (long long int i = 0; i < guards->len; i++) {
+    emit(&cb, &call, guards->data[i], tr_guard_var);
+    exits[exits_len++] = emit(&cb, &guard, NULL, NULL) + guard.rel32_hole;
+  }
+
+  size_t loop = cb.len;
+  for (long long int i = 0; i < trace->len; i++) {
+    TraceInst *ti = trace->data[i];
+    void *helper = trace_helper_of(ti);
+    if (helper == NULL) {
+      return NULL;
+    }
+    if (ti->kind == TrGeneric) {
+      emit(&cb, &call, ti->operand, helper);
+    } else {
+      emit(&cb, &call, ti, helper);
+      exits[exits_len++] = emit(&cb, &guard, NULL, NULL) + guard.rel32_hole;
+    }
+  }
+
+  size_t back = emit(&cb, &jump, NULL, NULL) + jump.rel32_hole;
+  int32_t rel = (int32_t)(loop - (back + 4));
+  memcpy(cb.buf + back, &rel, sizeof(rel));
+
+  size_t exit = emit(&cb, &trace_exit, NULL, NULL);
+  for (long long int i = 0; i < exits_len; i++) {
+    rel = (int32_t)(exit - (exits[i] + 4));
+    memcpy(cb.buf + exits[i], &rel, sizeof(rel));
+  }
+
+  return make_executable(vm, &cb);
+}
+
+static LoopProfile *loop_profile(VM *vm, Vector *code, long long int header) {
+  if (vm->loops == NULL) {
+    vm->loops = xmalloc(sizeof(LoopProfile *) * LOOP_BUCKETS);
+    memset(vm->loops, 0, sizeof(LoopProfile *) * LOOP_BUCKETS);
+  }
+
+  size_t bucket = (((uintptr_t)code >> 4) + header) % LOOP_BUCKETS;
+  for (LoopProfile *lp = vm->loops[bucket]; lp != NULL; lp = lp->next) {
+    if (lp->code == code && lp->header == header) {
+      return lp;
+    }
+  }
+
+  LoopProfile *lp = xmalloc(sizeof(LoopProfile));
+  memset(lp, 0, sizeof(LoopProfile));
+  lp->code = code;
+  lp->header = header;
+  lp->next = vm->loops[bucket];
+  vm->loops[bucket] = lp;
+  return lp;
+}
+
+/**
+ * Called by the interpreter on a backward jump to header. Returns the
+ * position to continue at, or -1 to keep interpreting from header.
+ */
+long long int trace_loop(VM *vm, Vector *code, long long int header) {
+  LoopProfile *lp = loop_profile(vm, code, header);
+
+  if (lp->native == NULL) {
+    if (lp->failed || lp->recording ||
+        ++lp->count <= vm->trace_threshold) {
+      return -1;
+    }
+
+    long long int pc;
+    lp->recording = true;
+    Vector *trace = trace_record(vm, code, header, &pc);
+    lp->recording = false;
+    if (trace != NULL) {
+      trace = trace_specialize(trace);
+      lp->guards = trace_hoist_guards(trace, header);
+      lp->trace = trace;
+      lp->native = trace_compile(vm, lp->guards, trace);
+    }
+    if (lp->native == NULL) {
+      lp->failed = true;
+      return pc;
+    }
+  }
+
+  long long int exit_pc = ((TraceCode)lp->native)(vm);
+  if (exit_pc == header && ++lp->failures > TRACE_MAX_FAILURES) {
+    lp->native = NULL;
+    lp->failed = true;
+  }
+  return exit_pc;
+}
+
+#else
+
+void *jit_compile(VM *vm, Vector *code) {
+  (void)vm;
+  (void)code;
+  return NULL;
+}
+
+void jit_release(VM *vm) { (void)vm; }
+
+long long int trace_loop(VM *vm, Vector *code, long long int header) {
+  (void)vm;
+  (void)code;
+  (void)header;
+  return -1;
+}
+
+#endif
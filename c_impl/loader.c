@@ -2,6 +2,7 @@
 #include "tinyvm.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 typedef struct {
   Vector *array;
@@ -60,8 +61,8 @@ TValueDeserializeResult *deserialize_to_tva(Vector *serialized,
       break;
     }
     case Function:
-      fprintf(stderr, "Unsupported\n");
-      exit(EXIT_FAILURE);
+    case Native:
+      vm_error(NULL, "<Deserialize> Unsupported");
     case Null:
       vec_push(deserialized, new_TValue());
       break;
@@ -132,8 +133,8 @@ Vector *deserialize(Vector *serialized) {
       procWith1Arg(code, serialized, type, &idx);
       break;
     case tOpPop:
-      fprintf(stderr, "<Deserialize> Not supported %d", type);
-      exit(EXIT_FAILURE);
+      vm_error(NULL, sdscatprintf(sdsempty(), "<Deserialize> Not supported %d",
+                                  type));
     case tOpPush:
       procWith1Arg(code, serialized, type, &idx);
       break;
@@ -187,17 +188,25 @@ Vector *deserialize(Vector *serialized) {
       vec_pushi(code, type);
       break;
     case tIValue:
-      fprintf(stderr, "<Deserialize> Not supported %d", type);
-      exit(EXIT_FAILURE);
+      vm_error(NULL, sdscatprintf(sdsempty(), "<Deserialize> Not supported %d",
+                                  type));
     default:
-      fprintf(stderr, "There is no default!\n");
-      exit(EXIT_FAILURE);
+      vm_error(NULL, "<Deserialize> There is no default!");
     }
   }
 
   return code;
 }
 
+static Vector *read_words(FILE *fp) {
+  Vector *buf = new_vec();
+  long long int v;
+  while (fread(&v, sizeof(long long int), 1, fp)) {
+    vec_push(buf, (void *)v);
+  }
+  return buf;
+}
+
 Vector *readFromFile(char *filename) {
   FILE *fp;
 
@@ -208,11 +217,7 @@ Vector *readFromFile(char *filename) {
     exit(EXIT_FAILURE);
   }
 
-  Vector *buf = new_vec();
-  long long int v;
-  while (fread(&v, sizeof(long long int), 1, fp)) {
-    vec_push(buf, (void *)v);
-  }
+  Vector *buf = read_words(fp);
 
   printf("Loaded byte codes: ");
   printf("[");
@@ -228,3 +233,26 @@ Vector *readFromFile(char *filename) {
 
   return deserialize(buf);
 }
+
+/* Like readFromFile without the dump, NULL if the file can not be opened */
+Vector *loadFromFile(char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    return NULL;
+  }
+  Vector *buf = read_words(fp);
+  fclose(fp);
+  return deserialize(buf);
+}
+
+/* The words of a compiled program in memory, to be deserialized */
+Vector *wordsFromBytes(const char *bytes, size_t len) {
+  Vector *buf = new_vec();
+  for (size_t i = 0; i + sizeof(long long int) <= len;
+       i += sizeof(long long int)) {
+    long long int v;
+    memcpy(&v, bytes + i, sizeof(long long int));
+    vec_push(buf, (void *)v);
+  }
+  return buf;
+}
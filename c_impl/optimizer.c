@@ -0,0 +1,623 @@
+#include "sds/sds.h"
+#include "tinyvm.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+Inst *new_Inst(Opcode op, TValue *operand) {
+  Inst *inst = xmalloc(sizeof(Inst));
+  inst->op = op;
+  inst->operand = operand;
+  inst->body = NULL;
+  inst->target = NULL;
+  inst->forward = NULL;
+  inst->idx = 0;
+  inst->dead = false;
+  return inst;
+}
+
+long long int op_operand_count(Opcode op) {
+  switch (op) {
+  case tOpVariableDeclareOnlySymbol:
+  case tOpVariableDeclareWithAssign:
+  case tOpPush:
+  case tOpGetVariable:
+  case tOpSetVariablePop:
+  case tOpSetArrayElement:
+  case tOpGetArrayElement:
+  case tOpMakeArray:
+  case tOpCall:
+  case tOpJumpRel:
+  case tOpJumpAbs:
+  case tOpIFStatement:
+  case tOpAssignExpression:
+    return 1;
+  case tOpFunctionDeclare:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+bool op_is_branch(Opcode op) {
+  return op == tOpJumpRel || op == tOpJumpAbs || op == tOpIFStatement;
+}
+
+/**
+ * Returns the opcode a specialized opcode was derived from, or op itself.
+ */
+Opcode op_generic(Opcode op) {
+  if (op >= tOpAddLong && op <= tOpModLong) {
+    return tOpAdd + (op - tOpAddLong);
+  }
+  if (op >= tOpEqualLong && op <= tOpGteLong) {
+    return tOpEqualExpression + (op - tOpEqualLong);
+  }
+  if (op == tOpArrayLoadUnchecked || op == tOpArrayStoreUnchecked) {
+    return tOpArrayLoad + (op - tOpArrayLoadUnchecked);
+  }
+  return op;
+}
+
+/**
+ * Returns the variant of op for Long operands, or op itself if there is none.
+ */
+Opcode op_specialize_long(Opcode op) {
+  if (op >= tOpAdd && op <= tOpMod) {
+    return tOpAddLong + (op - tOpAdd);
+  }
+  if (op >= tOpEqualExpression && op <= tOpGteExpression) {
+    return tOpEqualLong + (op - tOpEqualExpression);
+  }
+  return op;
+}
+
+static bool op_is_jump(Opcode op) {
+  return op == tOpJumpRel || op == tOpJumpAbs;
+}
+
+/**
+ * Position the VM continues at after executing the branch at pos.
+ * tOpJumpAbs lands one past its operand since the dispatch loop increments pc
+ * after every instruction.
+ */
+static long long int branch_destination(Opcode op, long long int pos,
+                                        long long int offset) {
+  if (op == tOpJumpAbs) {
+    return offset + 1;
+  }
+  return pos + 2 + offset;
+}
+
+static long long int branch_offset(Opcode op, long long int pos,
+                                   long long int dest) {
+  if (op == tOpJumpAbs) {
+    return dest - 1;
+  }
+  return dest - (pos + 2);
+}
+
+static Vector *decode_range(Vector *code, long long int from,
+                            long long int to) {
+  long long int len = to - from;
+  Vector *insts = new_vec();
+  Inst **at = xmalloc(sizeof(Inst *) * (len + 1));
+  long long int *dest = xmalloc(sizeof(long long int) * (len + 1));
+
+  for (long long int i = 0; i <= len; i++) {
+    at[i] = NULL;
+  }
+
+  for (long long int pos = 0; pos < len;) {
+    Opcode op = (Opcode)code->data[from + pos];
+    if (op < 0 || op >= tOpCount || op == tIValue) {
+      return NULL;
+    }
+
+    Inst *inst = new_Inst(op, NULL);
+    at[pos] = inst;
+    inst->idx = pos;
+    vec_push(insts, inst);
+
+    if (op == tOpFunctionDeclare) {
+      if (pos + 2 >= len) {
+        return NULL;
+      }
+      inst->operand = (TValue *)code->data[from + pos + 1];
+      long long int body_len = tv_getLong((TValue *)code->data[from + pos + 2]);
+      if (body_len < 0 || pos + 3 + body_len > len) {
+        return NULL;
+      }
+      inst->body =
+          decode_range(code, from + pos + 3, from + pos + 3 + body_len);
+      if (inst->body == NULL) {
+        return NULL;
+      }
+      pos += 3 + body_len;
+      continue;
+    }
+
+    if (op_operand_count(op) == 1) {
+      if (pos + 1 >= len) {
+        return NULL;
+      }
+      inst->operand = (TValue *)code->data[from + pos + 1];
+    }
+
+    if (op_is_branch(op)) {
+      dest[pos] = branch_destination(op, pos, tv_getLong(inst->operand));
+    }
+
+    pos += 1 + op_operand_count(op);
+  }
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (!op_is_branch(inst->op)) {
+      continue;
+    }
+    long long int d = dest[inst->idx];
+    if (d < 0 || d > len || (d < len && at[d] == NULL)) {
+      return NULL;
+    }
+    inst->target = d < len ? at[d] : NULL;
+  }
+
+  for (long long int i = 0; i < insts->len; i++) {
+    ((Inst *)insts->data[i])->idx = i;
+  }
+
+  return insts;
+}
+
+/**
+ * Decode flat bytecode into a Vector of Inst*.
+ * Returns NULL if the code is malformed (e.g. a branch into an operand slot).
+ */
+Vector *code_decode(Vector *code) { return decode_range(code, 0, code->len); }
+
+Vector *code_encode(Vector *insts) {
+  Vector *bodies = new_vec();
+  long long int *pos = xmalloc(sizeof(long long int) * (insts->len + 1));
+  long long int p = 0;
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    inst->idx = i;
+    pos[i] = p;
+    if (inst->op == tOpFunctionDeclare) {
+      Vector *body = code_encode(inst->body);
+      vec_push(bodies, body);
+      p += 3 + body->len;
+    } else {
+      p += 1 + op_operand_count(inst->op);
+    }
+  }
+  pos[insts->len] = p;
+
+  Vector *code = new_vec();
+  long long int body_idx = 0;
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    vec_pushi(code, inst->op);
+
+    if (inst->op == tOpFunctionDeclare) {
+      Vector *body = bodies->data[body_idx++];
+      vec_push(code, inst->operand);
+      vec_push(code, new_TValue_with_integer(body->len));
+      for (long long int j = 0; j < body->len; j++) {
+        vec_push(code, body->data[j]);
+      }
+    } else if (op_is_branch(inst->op)) {
+      long long int dest =
+          inst->target != NULL ? pos[inst->target->idx] : pos[insts->len];
+      vec_push(code, new_TValue_with_integer(
+                         branch_offset(inst->op, pos[i], dest)));
+    } else if (op_operand_count(inst->op) == 1) {
+      vec_push(code, inst->operand);
+    }
+  }
+
+  return code;
+}
+
+/**
+ * Drop dead instructions. Branches into a dropped instruction are moved to
+ * the first live instruction after it.
+ */
+static Vector *compact(Vector *insts) {
+  Inst *next = NULL;
+  for (long long int i = insts->len - 1; i >= 0; i--) {
+    Inst *inst = insts->data[i];
+    if (!inst->dead) {
+      next = inst;
+    }
+    inst->forward = next;
+  }
+
+  Vector *ret = new_vec();
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->dead) {
+      continue;
+    }
+    if (op_is_branch(inst->op) && inst->target != NULL) {
+      inst->target = inst->target->forward;
+    }
+    inst->idx = ret->len;
+    vec_push(ret, inst);
+  }
+
+  return ret;
+}
+
+static bool *branch_targets(Vector *insts) {
+  bool *targeted = xmalloc(sizeof(bool) * (insts->len + 1));
+  for (long long int i = 0; i <= insts->len; i++) {
+    targeted[i] = false;
+  }
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (op_is_branch(inst->op)) {
+      targeted[inst->target != NULL ? inst->target->idx : insts->len] = true;
+    }
+  }
+  return targeted;
+}
+
+//////////////////  nop elimination  //////////////////
+
+static bool opt_nop_elimination(Vector *insts) {
+  bool changed = false;
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpNop) {
+      inst->dead = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+//////////////////  constant folding  //////////////////
+
+/**
+ * Evaluate `op` for constant operands the same way the VM would, where a is
+ * the top of the stack. Returns NULL if the operation can not be folded
+ * (division by zero, mismatched types, ...) so the runtime error is kept.
+ */
+static TValue *fold_binary(Opcode op, TValue *a, TValue *b) {
+  switch (op) {
+  case tOpAdd:
+  case tOpSub:
+  case tOpMul:
+  case tOpDiv:
+  case tOpMod: {
+    if (a->tt != Long || b->tt != Long) {
+      return NULL;
+    }
+    /* wrap around like the VM does instead of overflowing at compile time */
+    unsigned long long int x = a->value.integer, y = b->value.integer;
+    if (op == tOpAdd) {
+      return new_TValue_with_integer((long long int)(x + y));
+    }
+    if (op == tOpSub) {
+      return new_TValue_with_integer((long long int)(x - y));
+    }
+    if (op == tOpMul) {
+      return new_TValue_with_integer((long long int)(x * y));
+    }
+    if (y == 0 || (y == -1ULL && x == 1ULL << 63)) {
+      return NULL;
+    }
+    if (op == tOpDiv) {
+      return new_TValue_with_integer(a->value.integer / b->value.integer);
+    }
+    return new_TValue_with_integer(a->value.integer % b->value.integer);
+  }
+  case tOpEqualExpression:
+  case tOpNotEqualExpression:
+    if (a->tt != b->tt || (a->tt != Long && a->tt != String && a->tt != Bool)) {
+      return NULL;
+    }
+    return new_TValue_with_bool(tv_equals(a, b) == (op == tOpEqualExpression));
+  case tOpLtExpression:
+  case tOpLteExpression:
+  case tOpGtExpression:
+  case tOpGteExpression:
+    if (a->tt != b->tt || (a->tt != Long && a->tt != String)) {
+      return NULL;
+    }
+    if (op == tOpLtExpression) {
+      return new_TValue_with_bool(tv_lt(a, b));
+    }
+    if (op == tOpLteExpression) {
+      return new_TValue_with_bool(tv_lte(a, b));
+    }
+    if (op == tOpGtExpression) {
+      return new_TValue_with_bool(tv_gt(a, b));
+    }
+    return new_TValue_with_bool(tv_gte(a, b));
+  case tOpAndExpression:
+  case tOpOrExpression:
+    if (a->tt != Bool || b->tt != Bool) {
+      return NULL;
+    }
+    return new_TValue_with_bool(op == tOpAndExpression ? tv_and(a, b)
+                                                       : tv_or(a, b));
+  default:
+    return NULL;
+  }
+}
+
+/**
+ * Returns 1 if a tOpIFStatement on the constant takes the true block, 0 if it
+ * jumps over it and -1 if the condition is an error at runtime.
+ */
+static int constant_condition(TValue *cond) {
+  switch (cond->tt) {
+  case Long:
+    return cond->value.integer != 0;
+  case Bool:
+    return cond->value.boolean;
+  case Null:
+    return 0;
+  default:
+    return -1;
+  }
+}
+
+static bool opt_constant_folding(Vector *insts) {
+  bool changed = false;
+  bool *targeted = branch_targets(insts);
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->dead || inst->op != tOpPush) {
+      continue;
+    }
+
+    Inst *next = i + 1 < insts->len ? insts->data[i + 1] : NULL;
+    if (next == NULL || next->dead || targeted[i + 1]) {
+      continue;
+    }
+
+    /* push x; pop */
+    if (next->op == tOpPop) {
+      inst->dead = next->dead = true;
+      changed = true;
+      continue;
+    }
+
+    /* push c; if n */
+    if (next->op == tOpIFStatement) {
+      int taken = constant_condition(inst->operand);
+      if (taken == 1) {
+        inst->dead = next->dead = true;
+        changed = true;
+      } else if (taken == 0) {
+        inst->dead = true;
+        next->op = tOpJumpRel;
+        changed = true;
+      }
+      continue;
+    }
+
+    /* push b; push a; op */
+    Inst *third = i + 2 < insts->len ? insts->data[i + 2] : NULL;
+    if (next->op != tOpPush || third == NULL || third->dead ||
+        targeted[i + 2]) {
+      continue;
+    }
+
+    TValue *folded = fold_binary(third->op, next->operand, inst->operand);
+    if (folded != NULL) {
+      inst->operand = folded;
+      next->dead = third->dead = true;
+      changed = true;
+      i += 2;
+    }
+  }
+
+  return changed;
+}
+
+//////////////////  jump threading  //////////////////
+
+static bool opt_jump_threading(Vector *insts) {
+  bool changed = false;
+
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (!op_is_branch(inst->op)) {
+      continue;
+    }
+
+    /* Follow chains of unconditional jumps. Chains ending in a cycle of
+     * jumps are left alone. */
+    Inst *t = inst->target;
+    for (long long int hops = 0;
+         t != NULL && op_is_jump(t->op) && hops < insts->len; hops++) {
+      t = t->target;
+    }
+    if ((t == NULL || !op_is_jump(t->op)) && t != inst->target) {
+      inst->target = t;
+      changed = true;
+    }
+
+    if (!op_is_jump(inst->op)) {
+      continue;
+    }
+
+    /* A jump to the following instruction does nothing */
+    Inst *next = i + 1 < insts->len ? insts->data[i + 1] : NULL;
+    if (inst->target == next) {
+      inst->dead = true;
+      changed = true;
+    } else if (inst->target != NULL && inst->target->op == tOpReturn) {
+      inst->op = tOpReturn;
+      inst->operand = NULL;
+      inst->target = NULL;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+//////////////////  dead code elimination  //////////////////
+
+static bool opt_dead_code_elimination(Vector *insts) {
+  if (insts->len == 0) {
+    return false;
+  }
+
+  bool *reached = xmalloc(sizeof(bool) * insts->len);
+  for (long long int i = 0; i < insts->len; i++) {
+    reached[i] = false;
+  }
+
+  Vector *worklist = new_vec();
+  vec_push(worklist, insts->data[0]);
+  reached[0] = true;
+
+  while (worklist->len > 0) {
+    Inst *inst = vec_pop(worklist);
+    Inst *succ[2] = {NULL, NULL};
+
+    if (op_is_branch(inst->op)) {
+      succ[0] = inst->target;
+    }
+    if (inst->op != tOpReturn && !op_is_jump(inst->op) &&
+        inst->idx + 1 < insts->len) {
+      succ[1] = insts->data[inst->idx + 1];
+    }
+
+    for (int k = 0; k < 2; k++) {
+      if (succ[k] != NULL && !reached[succ[k]->idx]) {
+        reached[succ[k]->idx] = true;
+        vec_push(worklist, succ[k]);
+      }
+    }
+  }
+
+  bool changed = false;
+  for (long long int i = 0; i < insts->len; i++) {
+    if (!reached[i]) {
+      ((Inst *)insts->data[i])->dead = true;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+//////////////////  pipeline  //////////////////
+
+/**
+ * Each level adds one pass on top of the previous one, so the effect of a
+ * single pass can be measured by comparing adjacent levels.
+ */
+int opt_passes_for_level(int level) {
+  int passes = 0;
+  if (level >= 1) {
+    passes |= OptNopElimination;
+  }
+  if (level >= 2) {
+    passes |= OptConstantFolding;
+  }
+  if (level >= 3) {
+    passes |= OptJumpThreading;
+  }
+  if (level >= 4) {
+    passes |= OptDeadCodeElimination;
+  }
+  if (level >= 5) {
+    passes |= OptInlining;
+  }
+  if (level >= 6) {
+    passes |= OptTypeSpecialization;
+  }
+  if (level >= 7) {
+    passes |= OptLoopInvariantCodeMotion;
+  }
+  if (level >= 8) {
+    passes |= OptScalarReplacement;
+  }
+  if (level >= 9) {
+    passes |= OptBoundsCheckElimination;
+  }
+  return passes;
+}
+
+static Vector *optimize_insts(Vector *insts, int passes) {
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpFunctionDeclare) {
+      inst->body = optimize_insts(inst->body, passes);
+    }
+  }
+
+  /* Passes enable each other (folding a condition creates a jump to thread,
+   * threading leaves dead code, ...) so run them until nothing changes. */
+  for (bool changed = true; changed;) {
+    changed = false;
+    if (passes & OptNopElimination) {
+      changed |= opt_nop_elimination(insts);
+      insts = compact(insts);
+    }
+    if (passes & OptConstantFolding) {
+      changed |= opt_constant_folding(insts);
+      insts = compact(insts);
+    }
+    if (passes & OptJumpThreading) {
+      changed |= opt_jump_threading(insts);
+      insts = compact(insts);
+    }
+    if (passes & OptDeadCodeElimination) {
+      changed |= opt_dead_code_elimination(insts);
+      insts = compact(insts);
+    }
+  }
+
+  return insts;
+}
+
+/**
+ * Run the selected passes over code and return the rewritten bytecode.
+ * code is returned as is if no pass is selected or it can not be decoded.
+ */
+Vector *optimize(Vector *code, int passes) {
+  if (passes == 0) {
+    return code;
+  }
+
+  Vector *insts = code_decode(code);
+  if (insts == NULL) {
+    fprintf(stderr, "<Optimizer> Malformed code, skipped optimization\n");
+    return code;
+  }
+
+  /* inline first so the other passes see the flattened bodies */
+  if (passes & OptInlining) {
+    insts = inline_functions(insts);
+  }
+
+  insts = optimize_insts(insts, passes);
+
+  /* after inlining, arrays returned by small functions are local */
+  if (passes & OptScalarReplacement) {
+    insts = scalar_replace_arrays(insts);
+  }
+  if (passes & OptBoundsCheckElimination) {
+    insts = eliminate_bounds_checks(insts);
+  }
+
+  /* specialized opcodes are opaque to the passes above, so these go last */
+  if (passes & (OptTypeSpecialization | OptLoopInvariantCodeMotion)) {
+    insts = ssa_optimize(insts, passes);
+  }
+
+  return code_encode(insts);
+}
@@ -0,0 +1,191 @@
+#include "tinyvm.h"
+
+#include <pthread.h>
+
+#ifdef __USE_BOEHM_GC__
+#include <gc.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * parallel_map(fn, array) and parallel_reduce(fn, array, init).
+ *
+ * The array is cut into up to vm->workers chunks, each at least
+ * PARALLEL_GRAIN elements long. The caller takes the first chunk and a
+ * thread each of the others, and fn runs over every chunk in a VM of its
+ * own: a stack of its own over the globals of the caller, which fn must only
+ * read.
+ *
+ * The worker VMs do not compile, so fn is compiled up front when the caller
+ * would have compiled it; functions it calls run as compiled as they are.
+ * An error in any chunk is raised on the caller once all of them are done.
+ *
+ * A chunk runs fn over its elements one after the other, and an array
+ * shorter than 2 * PARALLEL_GRAIN elements is a single chunk the caller runs
+ * alone. fn calls waiting on one another through a bounded channel, see
+ * channel.c, only get anywhere in different chunks: on a small array the
+ * first to wait does so forever. Tasks hand values around on one thread.
+ *
+ * These call back into the interpreter, so they are bound by new_VM but not
+ * in programs translated by --emit-c.
+ */
+
+#ifndef PARALLEL_GRAIN
+#define PARALLEL_GRAIN 1024
+#endif
+
+typedef struct {
+  VM vm;
+  TValue *fn;
+  TArray *array;
+  long long int begin;
+  long long int end;
+  TValue **results; // of parallel_map, indexed like array
+  TValue *acc;      // of parallel_reduce, the chunk folded with fn
+  pthread_t thread;
+  bool started;
+} Chunk;
+
+/* fn(args...) on the stack of vm, null if it returned nothing */
+static TValue *apply(VM *vm, TValue *fn, TValue *a, TValue *b) {
+  vm->stack->len = 0;
+  vec_push(vm->stack, a);
+  if (b != NULL) {
+    vec_push(vm->stack, b);
+  }
+  TValue *ret = vm_apply(vm, fn);
+  return ret != NULL ? ret : new_TValue();
+}
+
+static void *run_chunk(void *arg) {
+  Chunk *c = arg;
+  jmp_buf handler;
+  VM *prev = vm_swap_current(&c->vm);
+  c->vm.error_handler = &handler;
+  if (setjmp(handler) == 0) {
+    for (long long int i = c->begin; i < c->end; i++) {
+      TValue *x = ta_get(c->array, i);
+      if (c->results != NULL) {
+        c->results[i] = apply(&c->vm, c->fn, x, NULL);
+      } else {
+        c->acc = c->acc == NULL ? x : apply(&c->vm, c->fn, c->acc, x);
+      }
+    }
+  }
+  vm_swap_current(prev);
+  return NULL;
+}
+
+static int chunk_count(VM *vm, long long int len) {
+  long long int workers = vm->workers;
+  if (workers <= 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  long long int chunks = len / PARALLEL_GRAIN;
+  if (chunks > workers) {
+    chunks = workers;
+  }
+  return chunks < 1 ? 1 : (int)chunks;
+}
+
+/* Run fn over array in chunks and wait for them, raising their errors */
+static Chunk *run_chunks(VM *vm, TValue *fn, TArray *array, TValue **results,
+                         int *count) {
+  VM_ASSERT(fn->tt == Function || fn->tt == Native,
+            "Execute Error parallel builtins take a function");
+#ifdef __ENABLE_JIT__
+  if (fn->tt == Function && vm->jit_threshold >= 0) {
+    VMFunction *func = tv_getFunction(fn);
+    if (func->jit_code == NULL && !func->jit_failed) {
+      func->jit_code = jit_compile(vm, func->func_body);
+      func->jit_failed = func->jit_code == NULL;
+    }
+  }
+#endif
+
+  int n = chunk_count(vm, array->len);
+  Chunk *chunks = xmalloc(sizeof(Chunk) * n);
+  for (int i = 0; i < n; i++) {
+    Chunk *c = &chunks[i];
+    c->vm = *vm;
+    c->vm.stack = new_vec();
+    c->vm.engine = EngineStack;
+    c->vm.jit_threshold = -1;
+    c->vm.trace_threshold = -1;
+    c->vm.loops = NULL;
+    c->vm.scheduler = NULL;
+    c->vm.error = NULL;
+    c->fn = fn;
+    c->array = array;
+    c->begin = array->len * i / n;
+    c->end = array->len * (i + 1) / n;
+    c->results = results;
+    c->acc = NULL;
+    c->started = i > 0 && pthread_create(&c->thread, NULL, run_chunk, c) == 0;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!chunks[i].started) {
+      run_chunk(&chunks[i]);
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (chunks[i].started) {
+      pthread_join(chunks[i].thread, NULL);
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (chunks[i].vm.error != NULL) {
+      VM_ERROR(chunks[i].vm.error);
+    }
+  }
+
+  *count = n;
+  return chunks;
+}
+
+/* parallel_map(fn, array), [fn(x) for every x of array] */
+static TValue *parallel_map(VM *vm) {
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  TValue *fn = (TValue *)vec_pop(vm->stack);
+  TValue **results = xmalloc(sizeof(TValue *) * (array->len + 1));
+  int n;
+  run_chunks(vm, fn, array, results, &n);
+
+  TValue *ret = new_TValue_with_elements(results, array->len);
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/**
+ * parallel_reduce(fn, array, init), fn(...fn(fn(init, x0), x1)..., xn) for
+ * an associative fn. Each chunk is folded on its own, then the chunks are
+ * folded into init in order.
+ */
+static TValue *parallel_reduce(VM *vm) {
+  TValue *acc = (TValue *)vec_pop(vm->stack);
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  TValue *fn = (TValue *)vec_pop(vm->stack);
+  int n;
+  Chunk *chunks = run_chunks(vm, fn, array, NULL, &n);
+
+  long long int base = vm->stack->len;
+  for (int i = 0; i < n; i++) {
+    if (chunks[i].acc != NULL) {
+      vec_push(vm->stack, acc);
+      vec_push(vm->stack, chunks[i].acc);
+      acc = vm_apply(vm, fn);
+      acc = acc != NULL ? acc : new_TValue();
+      vm->stack->len = base;
+    }
+  }
+  vec_push(vm->stack, acc);
+  return acc;
+}
+
+void env_def_parallel(Env *env) {
+  env_def_native(env, "parallel_map", 2, parallel_map);
+  env_def_native(env, "parallel_reduce", 3, parallel_reduce);
+}
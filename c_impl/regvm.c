@@ -0,0 +1,639 @@
+#include "sds/sds.h"
+#include "tinyvm.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Register-based interpreter.
+ *
+ * Bytecode is translated to three-address instructions whose operands are
+ * registers, constants or variables, so `push 1; get i; add; set i` becomes
+ * a single add writing a register and a store reading it. Registers are the
+ * slots of vm->stack above a base: register r of a block is the value the
+ * stack VM would keep at depth r, so values still flow through the stack
+ * between blocks, into callees and out of them.
+ *
+ * The depth of the stack is only known within a block. Branches, calls and
+ * falling into a block move the base to the top of the stack, so every block
+ * starts at depth 0 and reaches the values below it through negative
+ * registers.
+ */
+
+// Opcodes of register code besides the ones of the bytecode
+enum {
+  RegMove = tOpCount, // dst = a
+  RegRebase,          // base += rebase
+  RegOpCount
+};
+
+// Kinds of RegOperand
+enum { RegOperandReg, RegOperandConst, RegOperandVar };
+
+typedef struct {
+  int kind;
+  long long int reg;
+  TValue *value; // constant or the name of a variable
+} RegOperand;
+
+struct RegInst_t {
+  Opcode op;
+  long long int dst;
+  RegOperand a; // the top of the stack
+  RegOperand b; // below a
+  TValue *operand;
+  Vector *body;         // bytecode of tOpFunctionDeclare
+  long long int target; // index of the branch destination
+  long long int rebase; // depth at the end of the block
+};
+
+typedef struct {
+  Vector *insts;     // emitted RegInsts
+  RegOperand *slots; // operands on the stack above the base
+  long long int depth;
+  long long int max_depth;
+} RegTranslator;
+
+static RegOperand reg(long long int r) {
+  RegOperand o = {RegOperandReg, r, NULL};
+  return o;
+}
+
+static RegOperand constant(TValue *value) {
+  RegOperand o = {RegOperandConst, 0, value};
+  return o;
+}
+
+static RegOperand variable(TValue *name) {
+  RegOperand o = {RegOperandVar, 0, name};
+  return o;
+}
+
+static RegInst *emit(RegTranslator *t, Opcode op) {
+  RegInst *ri = xmalloc(sizeof(RegInst));
+  memset(ri, 0, sizeof(RegInst));
+  ri->op = op;
+  vec_push(t->insts, ri);
+  return ri;
+}
+
+static void move(RegTranslator *t, long long int dst, RegOperand src) {
+  RegInst *ri = emit(t, RegMove);
+  ri->dst = dst;
+  ri->a = src;
+}
+
+static void push(RegTranslator *t, RegOperand o) {
+  if (t->depth >= 0) {
+    t->slots[t->depth] = o;
+  } else if (o.kind != RegOperandReg || o.reg != t->depth) {
+    move(t, t->depth, o); // below the base only registers are tracked
+  }
+  t->depth++;
+  if (t->depth > t->max_depth) {
+    t->max_depth = t->depth;
+  }
+}
+
+static RegOperand pop(RegTranslator *t) {
+  t->depth--;
+  return t->depth >= 0 ? t->slots[t->depth] : reg(t->depth);
+}
+
+/**
+ * Load the operands from depth `from` up into their registers; only the ones
+ * reading the variable name if it is not NULL.
+ */
+static void materialize(RegTranslator *t, long long int from, TValue *name) {
+  for (long long int i = from > 0 ? from : 0; i < t->depth; i++) {
+    RegOperand o = t->slots[i];
+    if (o.kind == RegOperandReg && o.reg == i) {
+      continue;
+    }
+    if (name != NULL && (o.kind != RegOperandVar ||
+                         strcmp(tv_getString(o.value), tv_getString(name)))) {
+      continue;
+    }
+    move(t, i, o);
+    t->slots[i] = reg(i);
+  }
+}
+
+/* End the block at inst, the next one starts at the top of the stack */
+static void end_block(RegTranslator *t, RegInst *ri) {
+  ri->rebase = t->depth;
+  t->depth = 0;
+}
+
+static bool is_binary(Opcode op) {
+  op = op_generic(op);
+  return (op >= tOpAdd && op <= tOpMod) ||
+         (op >= tOpEqualExpression && op <= tOpXorExpression);
+}
+
+static bool translate(RegTranslator *t, Inst *inst, Vector *branches) {
+  RegInst *ri;
+  switch (inst->op) {
+  case tOpNop:
+    return true;
+  case tOpPush:
+    push(t, constant(inst->operand));
+    return true;
+  case tOpGetVariable:
+    push(t, variable(inst->operand));
+    return true;
+  case tOpPop: {
+    RegOperand o = pop(t);
+    if (o.kind == RegOperandVar) {
+      move(t, t->depth, o); // still fails if there is no such variable
+    }
+    return true;
+  }
+  case tOpVariableDeclareOnlySymbol:
+    materialize(t, 0, inst->operand);
+    emit(t, inst->op)->operand = inst->operand;
+    return true;
+  case tOpVariableDeclareWithAssign:
+  case tOpAssignExpression:
+  case tOpSetVariablePop: {
+    RegOperand v = pop(t);
+    materialize(t, 0, inst->operand);
+    ri = emit(t, inst->op == tOpSetVariablePop ? tOpSetVariablePop
+                                               : tOpVariableDeclareWithAssign);
+    ri->a = v;
+    ri->operand = inst->operand;
+    return true;
+  }
+  case tOpFunctionDeclare:
+    materialize(t, 0, inst->operand);
+    ri = emit(t, inst->op);
+    ri->operand = inst->operand;
+    ri->body = code_encode(inst->body);
+    return true;
+  case tOpGetArrayElement:
+    ri = emit(t, inst->op);
+    ri->a = pop(t);
+    ri->dst = t->depth;
+    ri->operand = inst->operand;
+    push(t, reg(t->depth));
+    return true;
+  case tOpSetArrayElement:
+    ri = emit(t, inst->op);
+    ri->a = pop(t);
+    ri->b = pop(t);
+    ri->operand = inst->operand;
+    return true;
+  case tOpArrayLength:
+    ri = emit(t, inst->op);
+    ri->a = pop(t);
+    ri->dst = t->depth;
+    push(t, reg(t->depth));
+    return true;
+  case tOpArrayLoad:
+  case tOpArrayLoadUnchecked:
+    ri = emit(t, inst->op);
+    ri->a = pop(t);
+    ri->b = pop(t);
+    ri->dst = t->depth;
+    push(t, reg(t->depth));
+    return true;
+  case tOpArrayStore:
+  case tOpArrayStoreUnchecked: {
+    /* the value is the third operand, it is read from its register */
+    RegOperand array = pop(t);
+    RegOperand idx = pop(t);
+    materialize(t, t->depth - 1, NULL);
+    pop(t);
+    ri = emit(t, inst->op);
+    ri->a = array;
+    ri->b = idx;
+    ri->dst = t->depth;
+    return true;
+  }
+  case tOpMakeArray: {
+    long long int count = tv_getLong(inst->operand);
+    materialize(t, t->depth - count, NULL);
+    t->depth -= count;
+    ri = emit(t, inst->op);
+    ri->dst = t->depth;
+    ri->operand = inst->operand;
+    push(t, reg(t->depth));
+    return true;
+  }
+  case tOpCall:
+    materialize(t, 0, NULL);
+    ri = emit(t, inst->op);
+    ri->operand = inst->operand;
+    end_block(t, ri);
+    return true;
+  case tOpReturn:
+    materialize(t, 0, NULL);
+    end_block(t, emit(t, inst->op));
+    return true;
+  case tOpJumpRel:
+  case tOpJumpAbs:
+  case tOpIFStatement: {
+    RegOperand cond = inst->op == tOpIFStatement ? pop(t) : reg(0);
+    materialize(t, 0, NULL);
+    ri = emit(t, inst->op == tOpIFStatement ? tOpIFStatement : tOpJumpAbs);
+    ri->a = cond;
+    ri->target = inst->target != NULL ? inst->target->idx : -1;
+    end_block(t, ri);
+    vec_push(branches, ri);
+    return true;
+  }
+  case tOpPrint:
+  case tOpPrintln:
+    emit(t, inst->op)->a = pop(t);
+    return true;
+  case tOpAssert:
+    ri = emit(t, inst->op);
+    ri->a = pop(t);
+    ri->b = pop(t);
+    return true;
+  default:
+    if (!is_binary(inst->op)) {
+      return false;
+    }
+    ri = emit(t, inst->op);
+    ri->a = pop(t);
+    ri->b = pop(t);
+    ri->dst = t->depth;
+    push(t, reg(t->depth));
+    return true;
+  }
+}
+
+/**
+ * Translate bytecode to register code. Returns NULL if the code is malformed.
+ */
+RegCode *reg_translate(Vector *code) {
+  Vector *insts = code_decode(code);
+  if (insts == NULL) {
+    return NULL;
+  }
+
+  long long int n = insts->len;
+  bool *leader = xmalloc(sizeof(bool) * (n + 1));
+  memset(leader, 0, sizeof(bool) * (n + 1));
+  for (long long int i = 0; i < n; i++) {
+    Inst *inst = insts->data[i];
+    if (op_is_branch(inst->op)) {
+      leader[inst->target != NULL ? inst->target->idx : n] = true;
+    }
+  }
+
+  RegTranslator t;
+  t.insts = new_vec();
+  t.slots = xmalloc(sizeof(RegOperand) * (n + 1));
+  t.depth = 0;
+  t.max_depth = 0;
+
+  Vector *branches = new_vec();
+  long long int *pos = xmalloc(sizeof(long long int) * (n + 1));
+  bool falls_through = true;
+
+  for (long long int i = 0; i <= n; i++) {
+    if (leader[i]) {
+      if (falls_through) {
+        materialize(&t, 0, NULL);
+        if (t.depth != 0) {
+          end_block(&t, emit(&t, RegRebase));
+        }
+      }
+      t.depth = 0;
+    }
+    pos[i] = t.insts->len;
+    if (i == n) {
+      break;
+    }
+
+    Inst *inst = insts->data[i];
+    if (!translate(&t, inst, branches)) {
+      return NULL;
+    }
+    falls_through = inst->op != tOpJumpRel && inst->op != tOpJumpAbs &&
+                    inst->op != tOpReturn;
+  }
+  materialize(&t, 0, NULL);
+  end_block(&t, emit(&t, tOpReturn));
+
+  for (long long int i = 0; i < branches->len; i++) {
+    RegInst *ri = branches->data[i];
+    ri->target = pos[ri->target >= 0 ? ri->target : n];
+  }
+
+  RegCode *reg_code = xmalloc(sizeof(RegCode));
+  reg_code->len = t.insts->len;
+  reg_code->insts = xmalloc(sizeof(RegInst) * reg_code->len);
+  for (long long int i = 0; i < reg_code->len; i++) {
+    reg_code->insts[i] = *(RegInst *)t.insts->data[i];
+  }
+  reg_code->max_depth = t.max_depth;
+  reg_code->stack_len = n;
+  return reg_code;
+}
+
+//////////////////  interpreter  //////////////////
+
+static void reserve(Vector *stack, long long int size) {
+  if (stack->capacity < size) {
+    long long int len = stack->len;
+    vec_expand(stack, size * 2);
+    stack->len = len;
+  }
+}
+
+static inline TValue *value_of(VM *vm, TValue **R, RegOperand *o) {
+  switch (o->kind) {
+  case RegOperandReg:
+    return R[o->reg];
+  case RegOperandConst:
+    return o->value;
+  default: {
+    HasPtrResult *ptr = env_has_ptr(vm->env, tv_getString(o->value));
+    if (ptr->tv == NULL) {
+      VM_ERROR(sdscatprintf(sdsempty(), "No such a variable %s",
+                            tv_getString(o->value)));
+    }
+    return ptr->tv;
+  }
+  }
+}
+
+static bool condition(VM *vm, TValue *cond) {
+  switch (cond->tt) {
+  case Long:
+    return tv_getLong(cond) != 0;
+  case Bool:
+    return tv_getBool(cond);
+  case String:
+    VM_ERROR("Execute Error Invalid Condition <string>");
+  case Array:
+    VM_ERROR("Execute Error Invalid Condition <array>");
+  case Function:
+  case Native:
+    VM_ERROR("Execute Error Invalid Condition <function>");
+  case Null:
+    return false;
+  }
+  return false;
+}
+
+#define A value_of(vm, R, &ip->a)
+#define B value_of(vm, R, &ip->b)
+
+#define REG_NEXT()                                                             \
+  ip++;                                                                        \
+  goto *table[ip->op]
+
+/* The registers of the current block start at the top of the stack */
+#define REG_SYNC()                                                             \
+  stack->len = base;                                                           \
+  reserve(stack, base + code->max_depth + 1);                                  \
+  R = (TValue **)stack->data + base
+
+#define REG_ARITH(op_name, operator)                                           \
+  L_##op_name : {                                                              \
+    TValue *a = A;                                                             \
+    TValue *b = B;                                                             \
+    VM_ASSERT0(a->tt == b->tt && a->tt == Long);                               \
+    R[ip->dst] =                                                               \
+        new_TValue_with_integer(a->value.integer operator b->value.integer);   \
+    REG_NEXT();                                                                \
+  }
+
+#define REG_COMPARE(op_name, expr)                                             \
+  L_##op_name : {                                                              \
+    TValue *a = A;                                                             \
+    TValue *b = B;                                                             \
+    R[ip->dst] = new_TValue_with_bool(expr);                                   \
+    REG_NEXT();                                                                \
+  }
+
+#define REG_LONG(op_name, make, operator)                                      \
+  L_##op_name : {                                                              \
+    TValue *a = A;                                                             \
+    TValue *b = B;                                                             \
+    R[ip->dst] = make(a->value.integer operator b->value.integer);             \
+    REG_NEXT();                                                                \
+  }
+
+TValue *reg_execute(VM *vm, RegCode *code) {
+  static void *const table[RegOpCount] = {
+      [tOpVariableDeclareOnlySymbol] = &&L_tOpVariableDeclareOnlySymbol,
+      [tOpVariableDeclareWithAssign] = &&L_tOpVariableDeclareWithAssign,
+      [tOpSetVariablePop] = &&L_tOpSetVariablePop,
+      [tOpAdd] = &&L_tOpAdd,
+      [tOpSub] = &&L_tOpSub,
+      [tOpMul] = &&L_tOpMul,
+      [tOpDiv] = &&L_tOpDiv,
+      [tOpMod] = &&L_tOpMod,
+      [tOpReturn] = &&L_tOpReturn,
+      [tOpSetArrayElement] = &&L_tOpSetArrayElement,
+      [tOpGetArrayElement] = &&L_tOpGetArrayElement,
+      [tOpMakeArray] = &&L_tOpMakeArray,
+      [tOpCall] = &&L_tOpCall,
+      [tOpFunctionDeclare] = &&L_tOpFunctionDeclare,
+      [tOpEqualExpression] = &&L_tOpEqualExpression,
+      [tOpNotEqualExpression] = &&L_tOpNotEqualExpression,
+      [tOpLtExpression] = &&L_tOpLtExpression,
+      [tOpLteExpression] = &&L_tOpLteExpression,
+      [tOpGtExpression] = &&L_tOpGtExpression,
+      [tOpGteExpression] = &&L_tOpGteExpression,
+      [tOpAndExpression] = &&L_tOpAndExpression,
+      [tOpOrExpression] = &&L_tOpOrExpression,
+      [tOpXorExpression] = &&L_tOpXorExpression,
+      [tOpJumpAbs] = &&L_tOpJumpAbs,
+      [tOpPrint] = &&L_tOpPrint,
+      [tOpPrintln] = &&L_tOpPrintln,
+      [tOpIFStatement] = &&L_tOpIFStatement,
+      [tOpAssert] = &&L_tOpAssert,
+      [tOpAddLong] = &&L_tOpAddLong,
+      [tOpSubLong] = &&L_tOpSubLong,
+      [tOpMulLong] = &&L_tOpMulLong,
+      [tOpDivLong] = &&L_tOpDivLong,
+      [tOpModLong] = &&L_tOpModLong,
+      [tOpEqualLong] = &&L_tOpEqualLong,
+      [tOpNotEqualLong] = &&L_tOpNotEqualLong,
+      [tOpLtLong] = &&L_tOpLtLong,
+      [tOpLteLong] = &&L_tOpLteLong,
+      [tOpGtLong] = &&L_tOpGtLong,
+      [tOpGteLong] = &&L_tOpGteLong,
+      [tOpArrayLength] = &&L_tOpArrayLength,
+      [tOpArrayLoad] = &&L_tOpArrayLoad,
+      [tOpArrayStore] = &&L_tOpArrayStore,
+      [tOpArrayLoadUnchecked] = &&L_tOpArrayLoadUnchecked,
+      [tOpArrayStoreUnchecked] = &&L_tOpArrayStoreUnchecked,
+      [RegMove] = &&L_RegMove,
+      [RegRebase] = &&L_RegRebase,
+  };
+
+  Vector *stack = vm->stack;
+  long long int base = stack->len;
+  TValue **R;
+  REG_SYNC();
+
+  RegInst *ip = code->insts;
+  goto *table[ip->op];
+
+L_tOpVariableDeclareOnlySymbol:
+  env_def(vm->env, tv_getString(ip->operand), new_TValue());
+  REG_NEXT();
+
+L_tOpVariableDeclareWithAssign:
+  env_def(vm->env, tv_getString(ip->operand), A);
+  REG_NEXT();
+
+L_tOpSetVariablePop:
+  env_set(vm->env, tv_getString(ip->operand), A);
+  REG_NEXT();
+
+  REG_ARITH(tOpAdd, +)
+  REG_ARITH(tOpSub, -)
+  REG_ARITH(tOpMul, *)
+  REG_ARITH(tOpDiv, /)
+  REG_ARITH(tOpMod, %)
+
+L_tOpReturn:
+  stack->len = base + ip->rebase;
+  return vm_stackPeekTop(vm);
+
+L_tOpSetArrayElement : {
+  long long int idx = tv_getLong(A);
+  TArray *array =
+      tv_getTArray(env_get(vm->env, tv_getString(ip->operand)));
+  VM_CHECK_INDEX(array, idx);
+  ta_set(array, idx, B);
+  REG_NEXT();
+}
+
+L_tOpGetArrayElement : {
+  long long int idx = tv_getLong(A);
+  TArray *array =
+      tv_getTArray(env_get(vm->env, tv_getString(ip->operand)));
+  VM_CHECK_INDEX(array, idx);
+  R[ip->dst] = ta_get(array, idx);
+  REG_NEXT();
+}
+
+L_tOpMakeArray : {
+  long long int array_size = tv_getLong(ip->operand);
+  R[ip->dst] = new_TValue_with_elements(R + ip->dst, array_size);
+  REG_NEXT();
+}
+
+L_tOpCall:
+  stack->len = base + ip->rebase;
+  vm_call(vm, tv_getString(ip->operand));
+  base = stack->len;
+  REG_SYNC();
+  REG_NEXT();
+
+L_tOpFunctionDeclare : {
+  sds func_name = tv_getString(ip->operand);
+  env_def(vm->env, func_name,
+          new_TValue_with_func(
+              new_VMFunction(func_name, ip->body, env_dup(vm->env))));
+  REG_NEXT();
+}
+
+  REG_COMPARE(tOpEqualExpression, tv_equals(a, b))
+  REG_COMPARE(tOpNotEqualExpression, !tv_equals(a, b))
+  REG_COMPARE(tOpLtExpression, tv_lt(a, b))
+  REG_COMPARE(tOpLteExpression, tv_lte(a, b))
+  REG_COMPARE(tOpGtExpression, tv_gt(a, b))
+  REG_COMPARE(tOpGteExpression, tv_gte(a, b))
+  REG_COMPARE(tOpAndExpression, tv_and(a, b))
+  REG_COMPARE(tOpOrExpression, tv_or(a, b))
+
+L_tOpXorExpression:
+  VM_ERROR("Not implemented <XOR>");
+
+L_tOpJumpAbs:
+  VM_CHECK_HEAP();
+  base += ip->rebase;
+  REG_SYNC();
+  ip = code->insts + ip->target;
+  goto *table[ip->op];
+
+L_tOpPrint:
+  tv_fprint(vm->out, A);
+  REG_NEXT();
+
+L_tOpPrintln:
+  tv_fprint(vm->out, A);
+  fputc('\n', vm->out);
+  REG_NEXT();
+
+L_tOpIFStatement : {
+  bool cond = condition(vm, A);
+  base += ip->rebase;
+  REG_SYNC();
+  if (!cond) {
+    ip = code->insts + ip->target;
+    goto *table[ip->op];
+  }
+  REG_NEXT();
+}
+
+L_tOpAssert : {
+  sds msg = tv_getString(A);
+  if (!tv_getBool(B)) {
+    VM_ERROR(msg);
+  }
+  REG_NEXT();
+}
+
+  REG_LONG(tOpAddLong, new_TValue_with_integer, +)
+  REG_LONG(tOpSubLong, new_TValue_with_integer, -)
+  REG_LONG(tOpMulLong, new_TValue_with_integer, *)
+  REG_LONG(tOpDivLong, new_TValue_with_integer, /)
+  REG_LONG(tOpModLong, new_TValue_with_integer, %)
+  REG_LONG(tOpEqualLong, new_TValue_with_bool, ==)
+  REG_LONG(tOpNotEqualLong, new_TValue_with_bool, !=)
+  REG_LONG(tOpLtLong, new_TValue_with_bool, <)
+  REG_LONG(tOpLteLong, new_TValue_with_bool, <=)
+  REG_LONG(tOpGtLong, new_TValue_with_bool, >)
+  REG_LONG(tOpGteLong, new_TValue_with_bool, >=)
+
+L_tOpArrayLength:
+  R[ip->dst] = new_TValue_with_integer(tv_getTArray(A)->len);
+  REG_NEXT();
+
+L_tOpArrayLoad : {
+  TArray *array = tv_getTArray(A);
+  long long int idx = tv_getLong(B);
+  VM_CHECK_INDEX(array, idx);
+  R[ip->dst] = ta_get(array, idx);
+  REG_NEXT();
+}
+
+L_tOpArrayStore : {
+  TArray *array = tv_getTArray(A);
+  long long int idx = tv_getLong(B);
+  VM_CHECK_INDEX(array, idx);
+  ta_set(array, idx, R[ip->dst]);
+  REG_NEXT();
+}
+
+L_tOpArrayLoadUnchecked:
+  VM_CHECK_INDEX_LOW(B->value.integer);
+  R[ip->dst] = ta_get(A->value.array, B->value.integer);
+  REG_NEXT();
+
+L_tOpArrayStoreUnchecked:
+  VM_CHECK_INDEX_LOW(B->value.integer);
+  ta_set(A->value.array, B->value.integer, R[ip->dst]);
+  REG_NEXT();
+
+L_RegMove:
+  R[ip->dst] = A;
+  REG_NEXT();
+
+L_RegRebase:
+  base += ip->rebase;
+  REG_SYNC();
+  REG_NEXT();
+}
@@ -0,0 +1,412 @@
+#include "tinyvm.h"
+
+#include <pthread.h>
+
+#ifdef __USE_BOEHM_GC__
+#include <gc.h>
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * `tinyvm --serve=<socket>`, programs run on request by a resident process.
+ *
+ * Clients connect to a Unix domain socket and send any number of requests,
+ * each answered before the next is read:
+ *
+ *   RUN <path> <arg>...\n               the compiled file at path
+ *   EXEC <length> <arg>...\n<program>   length bytes of a compiled program
+ *
+ * The arguments are bound to the global args, an array of Longs and
+ * Strings like the inputs of --batch, and the program runs as its top level.
+ * The answer is what it printed:
+ *
+ *   OK <length>\n<output>
+ *   ERROR <length> <message>\n<output>
+ *
+ * The collector, the process and the decoded programs are warm already: a
+ * file is deserialized and optimized once into a Module, which is loaded
+ * again only when the file changes, so a request only costs a fresh VM for
+ * its globals and the native code it compiles, which vm_close unmaps when
+ * the request ends. Every connection is served by a thread of its own.
+ *
+ * Paths and arguments can not contain spaces.
+ *
+ * `tinyvm --serve=<socket> --fork=<n> <file>` isolates clients in processes
+ * instead. The server loads the file and runs its top level once, then
+ * keeps n children forked ahead of time waiting on the socket. A child
+ * serves one connection and exits, and the server forks another. Children
+ * share the decoded code, the globals and the functions of the program with
+ * the server copy-on-write, and answer one more request:
+ *
+ *   CALL <function> <arg>...\n          function(args...) of the program
+ *
+ * whose output ends with what the function returned, unless null, as
+ * println prints it.
+ *
+ * The server collects once before forking and the children pause collection:
+ * marking and sweeping would write to every page of the shared heap and
+ * copy it. A child just grows its heap instead, until it reaches
+ * SERVER_CHILD_HEAP bytes, which the interpreters check at backward jumps
+ * and calls like the fuel of tasks, so a request allocating in a loop can
+ * not grow it unbounded. From there the child collects again and ends its
+ * session after the request, as it does after SERVER_CHILD_REQUESTS
+ * requests, by closing the connection once the last answer is sent.
+ * Clients connect again and a fresh child takes over.
+ */
+
+typedef struct {
+  Module *module;
+  struct timespec mtime;
+  off_t size;
+} CachedModule;
+
+struct Server_t {
+  BatchConfig config;
+  Map *modules; // CachedModule by path
+  pthread_mutex_t lock;
+  VM *vm; // program run by server_preload, for the children of server_fork
+  bool child; // a child of server_fork, which pauses collection
+};
+
+typedef struct {
+  Server *server;
+  int fd;
+} Session;
+
+Server *server_new(BatchConfig *config) {
+  Server *server = xmalloc(sizeof(Server));
+  server->config = *config;
+  server->modules = new_map();
+  pthread_mutex_init(&server->lock, NULL);
+  server->vm = NULL;
+  server->child = false;
+  return server;
+}
+
+/* The module of the file at path, retained, NULL if it can not be loaded */
+static Module *module_of(Server *server, char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return NULL;
+  }
+
+  sds key = sdsnew(path);
+  pthread_mutex_lock(&server->lock);
+  CachedModule *cached = map_get(server->modules, key);
+  if (cached != NULL && cached->size == st.st_size &&
+      cached->mtime.tv_sec == st.st_mtim.tv_sec &&
+      cached->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+    Module *module = module_retain(cached->module);
+    pthread_mutex_unlock(&server->lock);
+    return module;
+  }
+  pthread_mutex_unlock(&server->lock);
+
+  Module *module = module_load_file(path, server->config.opt_level);
+  if (module == NULL) {
+    return NULL;
+  }
+  CachedModule *fresh = xmalloc(sizeof(CachedModule));
+  fresh->module = module_retain(module);
+  fresh->mtime = st.st_mtim;
+  fresh->size = st.st_size;
+
+  pthread_mutex_lock(&server->lock);
+  cached = map_get(server->modules, key);
+  if (cached != NULL) {
+    module_release(cached->module);
+  }
+  map_put(server->modules, key, fresh);
+  pthread_mutex_unlock(&server->lock);
+  return module;
+}
+
+static void answer(FILE *out, int status, char *error, char *buf,
+                   size_t len) {
+  if (status == VMOk) {
+    fprintf(out, "OK %zu\n", len);
+  } else {
+    fprintf(out, "ERROR %zu %s\n", len, error);
+  }
+  fwrite(buf, 1, len, out);
+  free(buf);
+}
+
+/* Run module with args and write the answer */
+static void run(Server *server, Module *module, Vector *args, FILE *out) {
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *output = open_memstream(&buf, &len);
+  VM *vm = batch_open_vm(&server->config, output);
+  env_def(vm->env, sdsnew("args"), new_TValue_with_array(args));
+  int status = vm_load_module(vm, module);
+  sds error = vm->error;
+  vm_close(vm);
+  fclose(output);
+  answer(out, status, error, buf, len);
+}
+
+/* Call the function name of the preloaded program and write the answer */
+static void call(Server *server, char *name, Vector *args, FILE *out) {
+  VM *vm = server->vm;
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *output = open_memstream(&buf, &len);
+  vm->out = output;
+  TValue *func = vm_lookup(vm, name);
+  TValue *ret = NULL;
+  int status = func == NULL ? VMErrorRuntime
+                            : vm_invoke(vm, func, (TValue **)args->data,
+                                        args->len, &ret);
+  if (ret != NULL && ret->tt != Null) {
+    tv_fprint(output, ret);
+    fputc('\n', output);
+  }
+  fclose(output);
+  answer(out, status, func == NULL ? "No such a function" : vm->error, buf,
+         len);
+}
+
+static void fail(FILE *out, char *msg) { fprintf(out, "ERROR 0 %s\n", msg); }
+
+/**
+ * Answer a request, returns false if the connection can not go on after
+ * it.
+ */
+static bool serve_request(Server *server, char *line, FILE *in, FILE *out) {
+  char *save;
+  char *command = strtok_r(line, " ", &save);
+  char *operand = strtok_r(NULL, " ", &save);
+  if (command == NULL || operand == NULL) {
+    fail(out, "Bad request");
+    return true;
+  }
+  Vector *args = new_vec();
+  char *arg;
+  while ((arg = strtok_r(NULL, " ", &save)) != NULL) {
+    vec_push(args, batch_parse_input(arg, strlen(arg)));
+  }
+
+  Module *module;
+  if (!strcmp(command, "CALL") && server->vm != NULL) {
+    call(server, operand, args, out);
+    return true;
+  } else if (!strcmp(command, "RUN")) {
+    module = module_of(server, operand);
+    if (module == NULL) {
+      fail(out, "The program can not be loaded");
+      return true;
+    }
+  } else if (!strcmp(command, "EXEC")) {
+    char *end;
+    long long int size = strtoll(operand, &end, 10);
+    if (*end != '\0' || size < 0) {
+      fail(out, "Bad request");
+      return false;
+    }
+    char *program = malloc(size > 0 ? size : 1);
+    if (program == NULL || fread(program, 1, size, in) != (size_t)size) {
+      free(program);
+      return false;
+    }
+    module = module_load_bytes(program, size, server->config.opt_level);
+    free(program);
+    if (module == NULL) {
+      fail(out, "The program can not be loaded");
+      return true;
+    }
+  } else {
+    fail(out, "Bad request");
+    return true;
+  }
+
+  run(server, module, args, out);
+  module_release(module);
+  return true;
+}
+
+/* Whether a child answered enough requests to end its session */
+static bool child_done(Server *server, long long int served) {
+  if (!server->child) {
+    return false;
+  }
+  vm_check_heap();
+  return vm_heap_limit < 0 || served >= SERVER_CHILD_REQUESTS;
+}
+
+/**
+ * Serve the requests coming on fd until the client hangs up, or a child of
+ * server_fork has served its share, closes fd.
+ */
+void server_session(Server *server, int fd) {
+  FILE *in = fdopen(fd, "r");
+  if (in == NULL) {
+    close(fd);
+    return;
+  }
+  int out_fd = dup(fd);
+  FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+  if (out == NULL) {
+    if (out_fd >= 0) {
+      close(out_fd);
+    }
+    fclose(in);
+    return;
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  long long int served = 0;
+  while ((len = getline(&line, &cap, in)) > 0) {
+    if (line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    bool more = serve_request(server, line, in, out);
+    if (fflush(out) != 0 || !more || child_done(server, ++served)) {
+      break;
+    }
+  }
+  free(line);
+  fclose(in);
+  fclose(out);
+}
+
+static void *run_session(void *arg) {
+  Session *session = arg;
+  server_session(session->server, session->fd);
+  xfree(session);
+  return NULL;
+}
+
+/* A socket listening at path, replacing what is there, -1 on errors */
+static int listen_on(char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  signal(SIGPIPE, SIG_IGN); // a client hanging up only ends its session
+  return fd;
+}
+
+/**
+ * Listen on a Unix domain socket at path, replacing what is there, and serve
+ * whoever connects. Returns -1 with errno set if it can not listen.
+ */
+int server_listen(Server *server, char *path) {
+  int fd = listen_on(path);
+  if (fd < 0) {
+    return -1;
+  }
+
+  for (;;) {
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) {
+      continue;
+    }
+    Session *session = xmalloc(sizeof(Session));
+    session->server = server;
+    session->fd = client;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_session, session) != 0) {
+      run_session(session);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
+
+/**
+ * Load filename and run its top level once in a VM printing to stdout, for
+ * server_fork. Returns the status of vm_load_module.
+ */
+int server_preload(Server *server, char *filename) {
+  Module *module = module_of(server, filename);
+  if (module == NULL) {
+    return VMErrorLoad;
+  }
+  VM *vm = batch_open_vm(&server->config, stdout);
+  int status = vm_load_module(vm, module);
+  module_release(module);
+  if (status != VMOk) {
+    fprintf(stderr, "%s\n", vm->error);
+    return status;
+  }
+  server->vm = vm;
+  return VMOk;
+}
+
+/* A child waiting for a connection to serve, returns its pid or -1 */
+static pid_t fork_child(Server *server, int fd) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  server->child = true;
+  vm_pause_collection(SERVER_CHILD_HEAP);
+  int client = accept(fd, NULL, NULL);
+  if (client < 0) {
+    _exit(EXIT_FAILURE); // the server forks another
+  }
+  close(fd);
+  server_session(server, client);
+  fflush(stdout);
+  _exit(EXIT_SUCCESS);
+}
+
+/**
+ * Listen on a Unix domain socket at path like server_listen, keeping children
+ * forked ahead of time that serve a connection each, one per core if
+ * children is 0. Returns -1 with errno set if it can not listen.
+ */
+int server_fork(Server *server, char *path, int children) {
+  if (children <= 0) {
+    children = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  int fd = listen_on(path);
+  if (fd < 0) {
+    return -1;
+  }
+#ifdef __USE_BOEHM_GC__
+  GC_gcollect();
+#endif
+  fflush(stdout);
+
+  int waiting = 0;
+  for (;;) {
+    while (waiting < children && fork_child(server, fd) > 0) {
+      waiting++;
+    }
+    if (waitpid(-1, NULL, 0) > 0) {
+      waiting--;
+    } else if (waiting == 0) {
+      sleep(1); // out of processes, try again
+    }
+  }
+}
@@ -0,0 +1,844 @@
+#include "sds/sds.h"
+#include "tinyvm.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * SSA form of bytecode and the optimizations built on it.
+ *
+ * A body is split into basic blocks at branch targets and after branches.
+ * Simulating the operand stack turns every instruction into an SSAValue whose
+ * operands are the values it pops; slots living across a block boundary
+ * become phis of the block, matched from the top of the stack. A tOpCall pops
+ * as many arguments as the callee wants, so everything below it is opaque.
+ *
+ * Type inference is a forward dataflow analysis over sets of ValueTypes for
+ * values and variables. A call can change any variable behind the body's
+ * back, so calls reset every variable to TYPE_ANY. So can the other tasks
+ * when a task is preempted at a backward jump, see coroutine.c. They reach
+ * the globals and, through closures of functions declared in the body, the
+ * variables those functions assign, so only the other variables the body
+ * defined itself are safe: loop headers reset the rest and LICM never
+ * hoists their loads. A check that passed narrows the variable it was
+ * loaded from: after `x + 1`, x holds a Long.
+ */
+
+#define DEPTH_UNKNOWN (1LL << 40)
+
+// Rounds of loop-invariant code motion, one loop each
+#define LICM_MAX_ROUNDS 16
+
+typedef struct {
+  bool builtins;
+  long long int temps; // hoisted expressions so far, names the next one
+} SSAContext;
+
+static SSAValue *new_SSAValue(Inst *inst, BasicBlock *block) {
+  SSAValue *v = xmalloc(sizeof(SSAValue));
+  v->inst = inst;
+  v->block = block;
+  v->args[0] = v->args[1] = NULL;
+  v->incoming = NULL;
+  v->types = 0;
+  v->var = -1;
+  v->version = 0;
+  v->first = -1;
+  return v;
+}
+
+static BasicBlock *new_BasicBlock(long long int id, long long int first) {
+  BasicBlock *b = xmalloc(sizeof(BasicBlock));
+  b->id = id;
+  b->first = first;
+  b->last = first;
+  b->preds = new_vec();
+  b->succs = new_vec();
+  b->phis = new_vec();
+  b->exit = new_vec();
+  b->vars_in = NULL;
+  b->vars_out = NULL;
+  b->locals_in = NULL;
+  return b;
+}
+
+static bool is_store(Opcode op) {
+  return op == tOpVariableDeclareOnlySymbol ||
+         op == tOpVariableDeclareWithAssign || op == tOpSetVariablePop ||
+         op == tOpAssignExpression;
+}
+
+static bool is_binary(Opcode op) {
+  op = op_generic(op);
+  return (op >= tOpAdd && op <= tOpMod) ||
+         (op >= tOpEqualExpression && op <= tOpXorExpression);
+}
+
+/**
+ * A call to print or println pops its argument and changes no variable as
+ * long as the program never binds those names itself.
+ */
+static bool is_builtin_call(SSAFunction *f, Inst *inst) {
+  if (!f->builtins || inst->op != tOpCall) {
+    return false;
+  }
+  sds name = tv_getString(inst->operand);
+  return !strcmp(name, "print") || !strcmp(name, "println");
+}
+
+/* Slots inst pops, -1 if unknown */
+static long long int stack_pops(SSAFunction *f, Inst *inst) {
+  if (is_binary(inst->op)) {
+    return 2;
+  }
+  switch (op_generic(inst->op)) {
+  case tOpVariableDeclareWithAssign:
+  case tOpAssignExpression:
+  case tOpSetVariablePop:
+  case tOpPop:
+  case tOpGetArrayElement:
+  case tOpIFStatement:
+  case tOpPrint:
+  case tOpPrintln:
+  case tOpArrayLength:
+    return 1;
+  case tOpSetArrayElement:
+  case tOpAssert:
+  case tOpArrayLoad:
+    return 2;
+  case tOpArrayStore:
+    return 3;
+  case tOpMakeArray:
+    return tv_getLong(inst->operand);
+  case tOpCall:
+    return is_builtin_call(f, inst) ? 1 : -1;
+  default:
+    return 0;
+  }
+}
+
+static bool pushes(Inst *inst) {
+  Opcode op = op_generic(inst->op);
+  return is_binary(op) || op == tOpPush || op == tOpGetVariable ||
+         op == tOpGetArrayElement || op == tOpMakeArray ||
+         op == tOpArrayLength || op == tOpArrayLoad;
+}
+
+static long long int var_id(SSAFunction *f, sds name) {
+  long long int id = (intptr_t)map_get(f->var_ids, name);
+  if (id == 0) {
+    vec_push(f->names, name);
+    id = f->names->len;
+    map_puti(f->var_ids, name, id);
+  }
+  return id - 1;
+}
+
+//////////////////  construction  //////////////////
+
+static void split_blocks(SSAFunction *f) {
+  Vector *insts = f->insts;
+  bool *leader = xmalloc(sizeof(bool) * (insts->len + 1));
+  memset(leader, 0, sizeof(bool) * (insts->len + 1));
+  leader[0] = true;
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (op_is_branch(inst->op) || inst->op == tOpReturn) {
+      leader[i + 1] = true;
+    }
+    if (op_is_branch(inst->op) && inst->target != NULL) {
+      leader[inst->target->idx] = true;
+    }
+  }
+
+  for (long long int i = 0; i < insts->len; i++) {
+    if (leader[i]) {
+      vec_push(f->blocks, new_BasicBlock(f->blocks->len, i));
+    }
+    BasicBlock *b = vec_last(f->blocks);
+    b->last = i + 1;
+    f->block_of[i] = b;
+  }
+
+  for (long long int i = 0; i < f->blocks->len; i++) {
+    BasicBlock *b = f->blocks->data[i];
+    Inst *last = insts->data[b->last - 1];
+    BasicBlock *next = i + 1 < f->blocks->len ? f->blocks->data[i + 1] : NULL;
+
+    if (last->op != tOpJumpRel && last->op != tOpJumpAbs &&
+        last->op != tOpReturn && next != NULL) {
+      vec_union1(b->succs, next);
+    }
+    if (op_is_branch(last->op) && last->target != NULL) {
+      vec_union1(b->succs, f->block_of[last->target->idx]);
+    }
+    for (long long int j = 0; j < b->succs->len; j++) {
+      vec_union1(((BasicBlock *)b->succs->data[j])->preds, b);
+    }
+  }
+}
+
+static long long int exit_depth(SSAFunction *f, BasicBlock *b,
+                                long long int depth) {
+  for (long long int i = b->first; i < b->last; i++) {
+    Inst *inst = f->insts->data[i];
+    long long int pops = stack_pops(f, inst);
+    depth = pops < 0 ? 0 : (depth > pops ? depth - pops : 0);
+    depth += pushes(inst);
+  }
+  return depth;
+}
+
+/**
+ * Number of stack slots every path into each block agrees on. Slots are
+ * counted from the top, so paths with different depths still share the
+ * slots near the top.
+ */
+static long long int *entry_depths(SSAFunction *f) {
+  long long int n = f->blocks->len;
+  long long int *depth = xmalloc(sizeof(long long int) * n);
+  for (long long int i = 0; i < n; i++) {
+    depth[i] = i == 0 ? 0 : DEPTH_UNKNOWN;
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (long long int i = 1; i < n; i++) {
+      BasicBlock *b = f->blocks->data[i];
+      long long int d = b->preds->len == 0 ? 0 : DEPTH_UNKNOWN;
+      for (long long int j = 0; j < b->preds->len; j++) {
+        BasicBlock *p = b->preds->data[j];
+        if (depth[p->id] != DEPTH_UNKNOWN) {
+          long long int e = exit_depth(f, p, depth[p->id]);
+          d = e < d ? e : d;
+        }
+      }
+      if (d < depth[i]) {
+        depth[i] = d;
+        changed = true;
+      }
+    }
+  }
+
+  for (long long int i = 0; i < n; i++) {
+    if (depth[i] == DEPTH_UNKNOWN) {
+      depth[i] = 0;
+    }
+  }
+  return depth;
+}
+
+/* Start of the expression computing v if its instructions are contiguous */
+static long long int expression_start(SSAValue *v) {
+  Inst *inst = v->inst;
+  switch (op_generic(inst->op)) {
+  case tOpPush:
+  case tOpGetVariable:
+    return inst->idx;
+  default:
+    break;
+  }
+  if (!is_binary(inst->op)) {
+    return -1;
+  }
+
+  SSAValue *a = v->args[0], *b = v->args[1];
+  if (a == NULL || b == NULL || a->inst == NULL || b->inst == NULL ||
+      a->block != v->block || b->block != v->block || a->first < 0 ||
+      b->first < 0 || a->inst->idx != inst->idx - 1 ||
+      a->first != b->inst->idx + 1) {
+    return -1;
+  }
+  return b->first;
+}
+
+static void build_values(SSAFunction *f) {
+  long long int *depth = entry_depths(f);
+
+  for (long long int i = 0; i < f->blocks->len; i++) {
+    BasicBlock *b = f->blocks->data[i];
+    for (long long int j = 0; j < depth[i]; j++) {
+      SSAValue *phi = new_SSAValue(NULL, b);
+      phi->incoming = new_vec();
+      vec_push(b->phis, phi);
+    }
+
+    Vector *stack = vec_dup(b->phis);
+    for (long long int k = b->first; k < b->last; k++) {
+      Inst *inst = f->insts->data[k];
+      SSAValue *v = new_SSAValue(inst, b);
+      long long int pops = stack_pops(f, inst);
+
+      for (long long int n = 0; n < pops; n++) {
+        SSAValue *arg = stack->len > 0 ? vec_pop(stack)
+                                       : new_SSAValue(NULL, b); // opaque
+        if (n < 2) {
+          v->args[n] = arg;
+        }
+      }
+      if (pops < 0) {
+        stack->len = 0;
+      }
+      if (pushes(inst)) {
+        vec_push(stack, v);
+      }
+      if (is_store(inst->op) || inst->op == tOpGetVariable ||
+          inst->op == tOpGetArrayElement ||
+          inst->op == tOpSetArrayElement) {
+        v->var = var_id(f, tv_getString(inst->operand));
+      }
+      v->first = expression_start(v);
+      f->nodes[k] = v;
+    }
+    b->exit = stack;
+  }
+
+  for (long long int i = 0; i < f->blocks->len; i++) {
+    BasicBlock *b = f->blocks->data[i];
+    for (long long int j = 0; j < b->phis->len; j++) {
+      SSAValue *phi = b->phis->data[j];
+      long long int from_top = b->phis->len - 1 - j;
+      for (long long int k = 0; k < b->preds->len; k++) {
+        Vector *exit = ((BasicBlock *)b->preds->data[k])->exit;
+        vec_push(phi->incoming, exit->data[exit->len - 1 - from_top]);
+      }
+    }
+  }
+}
+
+/**
+ * Build the SSA form of a decoded body. builtins tells whether print and
+ * println keep their builtin meaning in the whole program.
+ */
+SSAFunction *ssa_build(Vector *insts, bool builtins) {
+  SSAFunction *f = xmalloc(sizeof(SSAFunction));
+  f->insts = insts;
+  f->blocks = new_vec();
+  f->names = new_vec();
+  f->var_ids = new_map();
+  f->nodes = xmalloc(sizeof(SSAValue *) * (insts->len + 1));
+  f->block_of = xmalloc(sizeof(BasicBlock *) * (insts->len + 1));
+  f->builtins = builtins;
+
+  for (long long int i = 0; i < insts->len; i++) {
+    ((Inst *)insts->data[i])->idx = i;
+  }
+  if (insts->len == 0) {
+    return f;
+  }
+
+  split_blocks(f);
+  build_values(f);
+  return f;
+}
+
+//////////////////  type inference  //////////////////
+
+typedef struct {
+  int *vars;
+  long long int *versions;
+  bool changed;
+} TypeState;
+
+static void set_types(TypeState *st, SSAValue *v, int types) {
+  if (v->types != types) {
+    v->types = types;
+    st->changed = true;
+  }
+}
+
+/**
+ * A check on v passed, so the variable it was loaded from holds one of types
+ * if nothing was stored to it since the load.
+ */
+static void narrow(TypeState *st, SSAValue *v, int types) {
+  if (v == NULL || v->inst == NULL || v->inst->op != tOpGetVariable ||
+      st->versions[v->var] != v->version) {
+    return;
+  }
+  st->vars[v->var] &= types; // empty if the check can never pass
+}
+
+static void transfer(SSAFunction *f, TypeState *st, SSAValue *v) {
+  Inst *inst = v->inst;
+  SSAValue *a = v->args[0], *b = v->args[1];
+  Opcode op = op_generic(inst->op);
+
+  switch (op) {
+  case tOpPush:
+    set_types(st, v, TYPE_OF(inst->operand->tt));
+    return;
+  case tOpGetVariable:
+    v->version = st->versions[v->var];
+    set_types(st, v, st->vars[v->var]);
+    return;
+  case tOpVariableDeclareOnlySymbol:
+    st->vars[v->var] = TYPE_OF(Null);
+    st->versions[v->var]++;
+    return;
+  case tOpVariableDeclareWithAssign:
+  case tOpAssignExpression:
+  case tOpSetVariablePop:
+    st->vars[v->var] = a->types;
+    st->versions[v->var]++;
+    return;
+  case tOpAdd:
+  case tOpSub:
+  case tOpMul:
+  case tOpDiv:
+  case tOpMod:
+    narrow(st, a, TYPE_OF(Long));
+    narrow(st, b, TYPE_OF(Long));
+    set_types(st, v, TYPE_OF(Long));
+    return;
+  case tOpAndExpression:
+  case tOpOrExpression:
+    narrow(st, a, TYPE_OF(Bool));
+    narrow(st, b, TYPE_OF(Bool));
+    set_types(st, v, TYPE_OF(Bool));
+    return;
+  case tOpXorExpression:
+    set_types(st, v, TYPE_ANY);
+    return;
+  case tOpGetArrayElement:
+    narrow(st, a, TYPE_OF(Long));
+    st->vars[v->var] &= TYPE_OF(Array);
+    set_types(st, v, TYPE_ANY);
+    return;
+  case tOpSetArrayElement:
+    narrow(st, a, TYPE_OF(Long));
+    st->vars[v->var] &= TYPE_OF(Array);
+    return;
+  case tOpMakeArray:
+    set_types(st, v, TYPE_OF(Array));
+    return;
+  case tOpArrayLength:
+    narrow(st, a, TYPE_OF(Array));
+    set_types(st, v, TYPE_OF(Long));
+    return;
+  case tOpArrayLoad:
+    narrow(st, a, TYPE_OF(Array));
+    narrow(st, b, TYPE_OF(Long));
+    set_types(st, v, TYPE_ANY);
+    return;
+  case tOpArrayStore:
+    narrow(st, a, TYPE_OF(Array));
+    narrow(st, b, TYPE_OF(Long));
+    return;
+  case tOpFunctionDeclare:
+    st->vars[var_id(f, tv_getString(inst->operand))] = TYPE_OF(Function);
+    return;
+  case tOpCall:
+    if (!is_builtin_call(f, inst)) {
+      for (long long int i = 0; i < f->names->len; i++) {
+        st->vars[i] = TYPE_ANY;
+        st->versions[i]++;
+      }
+    }
+    return;
+  default:
+    if (op >= tOpEqualExpression && op <= tOpGteExpression) {
+      set_types(st, v, TYPE_OF(Bool));
+    }
+    return;
+  }
+}
+
+/* Stores binding a variable in the body's own scope */
+static bool defines_local(Opcode op) {
+  return op == tOpVariableDeclareOnlySymbol ||
+         op == tOpVariableDeclareWithAssign || op == tOpAssignExpression ||
+         op == tOpFunctionDeclare;
+}
+
+/* Mark the variables of f that the functions declared in insts assign */
+static void find_captured(SSAFunction *f, Vector *insts, bool nested,
+                          bool *captured) {
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpFunctionDeclare) {
+      find_captured(f, inst->body, true, captured);
+    } else if (nested && inst->op == tOpSetVariablePop) {
+      long long int id =
+          (intptr_t)map_get(f->var_ids, tv_getString(inst->operand));
+      if (id > 0) {
+        captured[id - 1] = true;
+      }
+    }
+  }
+}
+
+/**
+ * Set locals_in of every block, the body defines nothing before entering
+ * and never owns what its closures assign.
+ */
+static void find_locals(SSAFunction *f, long long int n) {
+  long long int blocks = f->blocks->len;
+  bool *captured = xmalloc(sizeof(bool) * (n + 1));
+  memset(captured, 0, sizeof(bool) * (n + 1));
+  find_captured(f, f->insts, false, captured);
+
+  bool **defined = xmalloc(sizeof(bool *) * blocks);
+  for (long long int i = 0; i < blocks; i++) {
+    BasicBlock *b = f->blocks->data[i];
+    bool entry = i == 0 || b->preds->len == 0;
+    defined[i] = xmalloc(sizeof(bool) * (n + 1));
+    b->locals_in = xmalloc(sizeof(bool) * (n + 1));
+    for (long long int k = 0; k < n; k++) {
+      defined[i][k] = false;
+      b->locals_in[k] = !entry;
+    }
+    for (long long int k = b->first; k < b->last; k++) {
+      Inst *inst = f->insts->data[k];
+      if (defines_local(inst->op)) {
+        long long int id = var_id(f, tv_getString(inst->operand));
+        defined[i][id] = !captured[id];
+      }
+    }
+  }
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (long long int i = 1; i < blocks; i++) {
+      BasicBlock *b = f->blocks->data[i];
+      for (long long int k = 0; k < n && b->preds->len > 0; k++) {
+        bool local = true;
+        for (long long int j = 0; j < b->preds->len && local; j++) {
+          BasicBlock *p = b->preds->data[j];
+          local = p->locals_in[k] || defined[p->id][k];
+        }
+        if (local != b->locals_in[k]) {
+          b->locals_in[k] = local;
+          changed = true;
+        }
+      }
+    }
+  }
+}
+
+/* Whether b is entered by a backward jump, where tasks may be preempted */
+static bool is_loop_header(BasicBlock *b) {
+  for (long long int j = 0; j < b->preds->len; j++) {
+    if (((BasicBlock *)b->preds->data[j])->id >= b->id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int *new_types(long long int n, int init) {
+  int *types = xmalloc(sizeof(int) * (n + 1));
+  for (long long int i = 0; i < n; i++) {
+    types[i] = init;
+  }
+  return types;
+}
+
+/**
+ * Compute the types of every value and the types of the variables at the
+ * boundaries of every block.
+ */
+void ssa_infer_types(SSAFunction *f) {
+  /* tOpFunctionDeclare names get their ids on the first round */
+  for (long long int i = 0; i < f->insts->len; i++) {
+    Inst *inst = f->insts->data[i];
+    if (inst->op == tOpFunctionDeclare) {
+      var_id(f, tv_getString(inst->operand));
+    }
+  }
+
+  long long int n = f->names->len;
+  for (long long int i = 0; i < f->blocks->len; i++) {
+    BasicBlock *b = f->blocks->data[i];
+    b->vars_in = new_types(n, 0);
+    b->vars_out = new_types(n, 0);
+  }
+  find_locals(f, n);
+
+  TypeState st;
+  st.vars = new_types(n, 0);
+  st.versions = xmalloc(sizeof(long long int) * (n + 1));
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (long long int i = 0; i < f->blocks->len; i++) {
+      BasicBlock *b = f->blocks->data[i];
+      bool header = is_loop_header(b);
+      st.changed = false;
+
+      for (long long int k = 0; k < n; k++) {
+        int t = i == 0 || b->preds->len == 0 ? TYPE_ANY : 0;
+        for (long long int j = 0; j < b->preds->len; j++) {
+          t |= ((BasicBlock *)b->preds->data[j])->vars_out[k];
+        }
+        if (header && !b->locals_in[k]) {
+          t = TYPE_ANY;
+        }
+        b->vars_in[k] = t;
+        st.vars[k] = t;
+        st.versions[k] = 0;
+      }
+
+      for (long long int j = 0; j < b->phis->len; j++) {
+        SSAValue *phi = b->phis->data[j];
+        int t = phi->incoming->len == 0 ? TYPE_ANY : 0;
+        for (long long int k = 0; k < phi->incoming->len; k++) {
+          t |= ((SSAValue *)phi->incoming->data[k])->types;
+        }
+        set_types(&st, phi, t);
+      }
+
+      for (long long int k = b->first; k < b->last; k++) {
+        SSAValue *v = f->nodes[k];
+        for (int j = 0; j < 2; j++) {
+          if (v->args[j] != NULL && v->args[j]->inst == NULL &&
+              v->args[j]->incoming == NULL) {
+            v->args[j]->types = TYPE_ANY; // opaque
+          }
+        }
+        transfer(f, &st, v);
+      }
+
+      for (long long int k = 0; k < n; k++) {
+        if (b->vars_out[k] != st.vars[k]) {
+          b->vars_out[k] = st.vars[k];
+          st.changed = true;
+        }
+      }
+      changed |= st.changed;
+    }
+  }
+}
+
+//////////////////  specialization  //////////////////
+
+static bool is_long(SSAValue *v) {
+  return v != NULL && v->types == TYPE_OF(Long);
+}
+
+/**
+ * Replace arithmetic and comparisons whose operands are proven Longs with
+ * opcodes that skip the type checks.
+ */
+static bool specialize(SSAFunction *f) {
+  bool changed = false;
+  for (long long int i = 0; i < f->insts->len; i++) {
+    Inst *inst = f->insts->data[i];
+    Opcode op = op_specialize_long(inst->op);
+    SSAValue *v = f->nodes[i];
+    if (op != inst->op && is_long(v->args[0]) && is_long(v->args[1])) {
+      inst->op = op;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+//////////////////  loop-invariant code motion  //////////////////
+
+static bool in_loop(BasicBlock *b, BasicBlock *header, BasicBlock *latch) {
+  return b->id >= header->id && b->id <= latch->id;
+}
+
+/**
+ * The blocks from header to latch form a loop we can hoist out of: it is only
+ * entered by falling into the header, and nothing in it can change a
+ * variable without a store we can see.
+ */
+static bool hoistable_loop(SSAFunction *f, BasicBlock *header,
+                           BasicBlock *latch) {
+  for (long long int i = 0; i < f->insts->len; i++) {
+    Inst *inst = f->insts->data[i];
+    BasicBlock *b = f->block_of[i];
+    bool inside = in_loop(b, header, latch);
+
+    if (inside && ((inst->op == tOpCall && !is_builtin_call(f, inst)) ||
+                   inst->op == tOpFunctionDeclare)) {
+      return false;
+    }
+    if (!inside && op_is_branch(inst->op) && inst->target != NULL &&
+        in_loop(f->block_of[inst->target->idx], header, latch)) {
+      return false;
+    }
+  }
+  for (long long int i = 0; i < header->preds->len; i++) {
+    BasicBlock *p = header->preds->data[i];
+    if (!in_loop(p, header, latch) && p->id != header->id - 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool is_invariant(SSAFunction *f, SSAValue *v, BasicBlock *header,
+                         bool *stored) {
+  if (v == NULL || v->inst == NULL || v->first < 0) {
+    return false;
+  }
+  switch (op_generic(v->inst->op)) {
+  case tOpPush:
+    return true;
+  case tOpGetVariable:
+    /* the load moves before the loop, where the variable has to exist, and
+     * other tasks may write it at every iteration unless the body owns it */
+    return !stored[v->var] && header->locals_in[v->var] &&
+           header->vars_in[v->var] == TYPE_OF(Long) && is_long(v);
+  case tOpAdd:
+  case tOpSub:
+  case tOpMul:
+  case tOpEqualExpression:
+  case tOpNotEqualExpression:
+  case tOpLtExpression:
+  case tOpLteExpression:
+  case tOpGtExpression:
+  case tOpGteExpression:
+    /* evaluated even if the loop runs zero times, so it must not fail */
+    return is_long(v->args[0]) && is_long(v->args[1]) &&
+           is_invariant(f, v->args[0], header, stored) &&
+           is_invariant(f, v->args[1], header, stored);
+  default:
+    return false;
+  }
+}
+
+/**
+ * Move the maximal invariant expressions of one loop in front of it. Each is
+ * computed once into a fresh variable that the loop reads instead.
+ */
+static Vector *hoist_loop(SSAContext *ctx, SSAFunction *f, BasicBlock *header,
+                          BasicBlock *latch, bool *changed) {
+  bool *stored = xmalloc(sizeof(bool) * (f->names->len + 1));
+  memset(stored, 0, sizeof(bool) * (f->names->len + 1));
+  for (long long int i = header->first; i < latch->last; i++) {
+    SSAValue *v = f->nodes[i];
+    if (is_store(v->inst->op)) {
+      stored[v->var] = true;
+    }
+  }
+
+  long long int n = f->insts->len;
+  bool *invariant = xmalloc(sizeof(bool) * (n + 1));
+  bool *absorbed = xmalloc(sizeof(bool) * (n + 1));
+  for (long long int i = 0; i < n; i++) {
+    invariant[i] = i >= header->first && i < latch->last &&
+                   is_invariant(f, f->nodes[i], header, stored);
+    absorbed[i] = false;
+  }
+  for (long long int i = header->first; i < latch->last; i++) {
+    if (invariant[i] && is_binary(f->nodes[i]->inst->op)) {
+      absorbed[f->nodes[i]->args[0]->inst->idx] = true;
+      absorbed[f->nodes[i]->args[1]->inst->idx] = true;
+    }
+  }
+
+  Vector *preheader = new_vec();
+  bool *dead = xmalloc(sizeof(bool) * (n + 1));
+  memset(dead, 0, sizeof(bool) * (n + 1));
+
+  for (long long int i = header->first; i < latch->last; i++) {
+    SSAValue *v = f->nodes[i];
+    if (!invariant[i] || absorbed[i] || !is_binary(v->inst->op)) {
+      continue;
+    }
+
+    TValue *temp = new_TValue_with_str(
+        sdscatprintf(sdsempty(), "$licm.%lld", ctx->temps++));
+    for (long long int k = v->first; k <= i; k++) {
+      Inst *inst = f->insts->data[k];
+      vec_push(preheader, new_Inst(inst->op, inst->operand));
+      dead[k] = k != v->first;
+    }
+    vec_push(preheader, new_Inst(tOpVariableDeclareWithAssign, temp));
+
+    /* keep the first instruction, branches may target it */
+    Inst *first = f->insts->data[v->first];
+    first->op = tOpGetVariable;
+    first->operand = temp;
+    *changed = true;
+  }
+
+  Vector *ret = new_vec();
+  for (long long int i = 0; i < n; i++) {
+    if (i == header->first) {
+      for (long long int k = 0; k < preheader->len; k++) {
+        vec_push(ret, preheader->data[k]);
+      }
+    }
+    if (!dead[i]) {
+      vec_push(ret, f->insts->data[i]);
+    }
+  }
+  for (long long int i = 0; i < ret->len; i++) {
+    ((Inst *)ret->data[i])->idx = i;
+  }
+  return ret;
+}
+
+static Vector *licm(SSAContext *ctx, Vector *insts) {
+  for (int round = 0; round < LICM_MAX_ROUNDS; round++) {
+    SSAFunction *f = ssa_build(insts, ctx->builtins);
+    ssa_infer_types(f);
+
+    bool changed = false;
+    for (long long int i = 0; i < f->blocks->len && !changed; i++) {
+      BasicBlock *latch = f->blocks->data[i];
+      for (long long int j = 0; j < latch->succs->len && !changed; j++) {
+        BasicBlock *header = latch->succs->data[j];
+        if (header->id <= latch->id && hoistable_loop(f, header, latch)) {
+          insts = hoist_loop(ctx, f, header, latch, &changed);
+        }
+      }
+    }
+    if (!changed) {
+      break;
+    }
+  }
+  return insts;
+}
+
+static bool binds_builtin(Vector *insts) {
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpFunctionDeclare && binds_builtin(inst->body)) {
+      return true;
+    }
+    if (is_store(inst->op) || inst->op == tOpFunctionDeclare) {
+      sds name = tv_getString(inst->operand);
+      if (!strcmp(name, "print") || !strcmp(name, "println")) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static Vector *optimize_body(SSAContext *ctx, Vector *insts, int passes) {
+  for (long long int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpFunctionDeclare) {
+      inst->body = optimize_body(ctx, inst->body, passes);
+    }
+  }
+
+  if (passes & OptLoopInvariantCodeMotion) {
+    insts = licm(ctx, insts);
+  }
+  if (passes & OptTypeSpecialization) {
+    SSAFunction *f = ssa_build(insts, ctx->builtins);
+    ssa_infer_types(f);
+    specialize(f);
+  }
+  return insts;
+}
+
+/**
+ * Run the SSA based passes over decoded code and every function in it.
+ */
+Vector *ssa_optimize(Vector *insts, int passes) {
+  SSAContext ctx;
+  ctx.builtins = !binds_builtin(insts);
+  ctx.temps = 0;
+  return optimize_body(&ctx, insts, passes);
+}
@@ -0,0 +1,195 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// How `make aot` builds a translated program, given by the Makefile
+#ifndef TVM_CC
+#define TVM_CC "cc"
+#endif
+#ifndef TVM_CFLAGS
+#define TVM_CFLAGS "-lgc -lpthread"
+#endif
+#ifndef TVM_RUNTIME_SRCS
+#define TVM_RUNTIME_SRCS "value.c env.c util.c avl.c builtins.c channel.c"
+#endif
+
+static char *emit_c(Vector *code) {
+  static char buf[8192];
+  FILE *out = tmpfile();
+  if (!aot_emit_c(code, out, "test")) {
+    fclose(out);
+    return NULL;
+  }
+  rewind(out);
+  size_t n = fread(buf, 1, sizeof(buf) - 1, out);
+  buf[n] = '\0';
+  fclose(out);
+  return buf;
+}
+
+TEST_CASE(test_aot_emit_c, {
+  /* function id(x) { return x; } if (id(0)) { println("a\"b") } */
+  Vector *body = new_vec();
+  emit1(body, tOpSetVariablePop, str("x"));
+  emit1(body, tOpGetVariable, str("x"));
+  emit0(body, tOpReturn);
+
+  Vector *code = new_vec();
+  emit1(code, tOpFunctionDeclare, str("id"));
+  vec_push(code, new_TValue_with_integer(body->len));
+  for (int i = 0; i < body->len; i++) {
+    vec_push(code, body->data[i]);
+  }
+  emit1(code, tOpPush, new_TValue_with_integer(0));
+  emit1(code, tOpCall, str("id"));
+  emit1(code, tOpIFStatement, new_TValue_with_integer(4));
+  emit1(code, tOpPush, str("a\"b"));
+  emit1(code, tOpCall, str("println"));
+
+  char *c = emit_c(code);
+  assert(c != NULL);
+  assert(strstr(c, "aot_declare(vm, K[0], fn_0);") != NULL);
+  assert(strstr(c, "static TValue *fn_0(VM *vm) {") != NULL);
+  assert(strstr(c, "goto L6;") != NULL);
+  assert(strstr(c, "L6:;") != NULL);
+  assert(strstr(c, "sdsnewlen(\"a\\\"b\", 3)") != NULL);
+
+  /* malformed code is rejected */
+  Vector *bad = new_vec();
+  emit1(bad, tOpJumpRel, new_TValue_with_integer(-1));
+  assert(emit_c(bad) == NULL);
+})
+
+/* fib(n - k) on the stack */
+static void call_fib(Vector *insts, long long int k) {
+  emit(insts, tOpPush, num(k));
+  emit(insts, tOpGetVariable, str("n"));
+  emit(insts, tOpSub, NULL);
+  emit(insts, tOpCall, str("fib"));
+}
+
+/**
+ * func fib(n) { if (n < 2) { return n; } return fib(n - 2) + fib(n - 1); }
+ * a = [3, 1, 4, 1, 5]; i = 0;
+ * while (i < len(a)) { println(fib(a[i] * 4)); i = 1 + i; }
+ * println(a); println("a\"b\\"); println(1 < 2);
+ */
+static Vector *program(void) {
+  Inst *fib = new_Inst(tOpFunctionDeclare, str("fib"));
+  fib->body = new_vec();
+  emit(fib->body, tOpVariableDeclareWithAssign, str("n"));
+  emit(fib->body, tOpPush, num(2));
+  emit(fib->body, tOpGetVariable, str("n"));
+  emit(fib->body, tOpLtExpression, NULL);
+  Inst *small = emit(fib->body, tOpIFStatement, NULL);
+  emit(fib->body, tOpGetVariable, str("n"));
+  emit(fib->body, tOpReturn, NULL);
+  Inst *big = emit(fib->body, tOpNop, NULL);
+  call_fib(fib->body, 1);
+  call_fib(fib->body, 2);
+  emit(fib->body, tOpAdd, NULL);
+  emit(fib->body, tOpReturn, NULL);
+  small->target = big;
+
+  Vector *insts = new_vec();
+  vec_push(insts, fib);
+  long long int elements[] = {3, 1, 4, 1, 5};
+  for (int k = 0; k < 5; k++) {
+    emit(insts, tOpPush, num(elements[k]));
+  }
+  emit(insts, tOpMakeArray, num(5));
+  emit(insts, tOpVariableDeclareWithAssign, str("a"));
+  emit(insts, tOpPush, num(0));
+  emit(insts, tOpVariableDeclareWithAssign, str("i"));
+
+  Inst *header = emit(insts, tOpGetVariable, str("a"));
+  emit(insts, tOpCall, str("len"));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpLtExpression, NULL);
+  Inst *cond = emit(insts, tOpIFStatement, NULL);
+  emit(insts, tOpPush, num(4));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpGetArrayElement, str("a"));
+  emit(insts, tOpMul, NULL);
+  emit(insts, tOpCall, str("fib"));
+  emit(insts, tOpPrintln, NULL);
+  emit(insts, tOpPush, num(1));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpAdd, NULL);
+  emit(insts, tOpSetVariablePop, str("i"));
+  emit(insts, tOpJumpRel, NULL)->target = header;
+
+  cond->target = emit(insts, tOpGetVariable, str("a"));
+  emit(insts, tOpPrintln, NULL);
+  emit(insts, tOpPush, str("a\"b\\"));
+  emit(insts, tOpPrintln, NULL);
+  emit(insts, tOpPush, num(2));
+  emit(insts, tOpPush, num(1));
+  emit(insts, tOpLtExpression, NULL);
+  emit(insts, tOpPrintln, NULL);
+  return code_encode(insts);
+}
+
+/* What the interpreter prints running code */
+static sds interpret(Vector *code) {
+  char *buf = NULL;
+  size_t len = 0;
+  VM *vm = new_VM();
+  vm->out = open_memstream(&buf, &len);
+  vm_execute(vm, code);
+  fclose(vm->out);
+  sds output = sdsnewlen(buf, len);
+  free(buf);
+  return output;
+}
+
+/* What code translated to C and built like `make aot` prints */
+static sds compile_and_run(Vector *code) {
+  char src[] = "/tmp/tinyvm_aot_testXXXXXX.c";
+  int fd = mkstemps(src, 2);
+  assert(fd >= 0);
+  FILE *out = fdopen(fd, "w");
+  assert(aot_emit_c(code, out, "aot_test"));
+  fclose(out);
+
+  sds exe = sdsnewlen(src, strlen(src) - 2);
+  sds cmd = sdscatprintf(sdsempty(), "%s -o %s %s %s %s -I ./", TVM_CC, exe,
+                         src, TVM_RUNTIME_SRCS, TVM_CFLAGS);
+  assert(system(cmd) == 0);
+  unlink(src);
+
+  FILE *in = popen(exe, "r");
+  assert(in != NULL);
+  sds output = sdsempty();
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    output = sdscatlen(output, buf, n);
+  }
+  assert(pclose(in) == 0);
+  unlink(exe);
+  return output;
+}
+
+/* The translated program prints what the interpreter prints */
+TEST_CASE(test_aot_end_to_end, {
+  for (int level = 0; level <= OPT_LEVEL_MAX; level += OPT_LEVEL_MAX) {
+    Vector *code = optimize(program(), opt_passes_for_level(level));
+    sds expected = interpret(code);
+    assert(!strcmp(expected, "144\n3\n987\n3\n6765\n[3, 1, 4, 1, 5]\n"
+                             "a\"b\\\ntrue\n"));
+    assert(!strcmp(compile_and_run(code), expected));
+  }
+})
+
+void aot_test() {
+  test_aot_emit_c();
+  test_aot_end_to_end();
+
+  printf("[aot_test] All of tests are passed\n");
+}
@@ -0,0 +1,75 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* println(input * 2) */
+static Module *doubler(void) {
+  Vector *code = new_vec();
+  vec_pushi(code, tOpPush);
+  vec_push(code, new_TValue_with_integer(2));
+  vec_pushi(code, tOpGetVariable);
+  vec_push(code, str("input"));
+  vec_pushi(code, tOpMul);
+  vec_pushi(code, tOpPrintln);
+  return module_new(code, OPT_LEVEL_MAX);
+}
+
+static BatchConfig config(int workers) {
+  BatchConfig config = {
+      .opt_level = OPT_LEVEL_MAX,
+      .jit_threshold = JIT_THRESHOLD,
+      .trace_threshold = TRACE_THRESHOLD,
+      .engine = EngineStack,
+      .dispatch = DispatchGoto,
+      .workers = workers,
+  };
+  return config;
+}
+
+/* Every job prints to its own output, the one that fails does not stop the
+   others */
+TEST_CASE(test_batch_inputs, {
+  Module *module = doubler();
+  long long int n = 200;
+  BatchJob *jobs = xmalloc(sizeof(BatchJob) * n);
+  for (long long int i = 0; i < n; i++) {
+    jobs[i].filename = NULL;
+    jobs[i].input = i == 7 ? str("x") : new_TValue_with_integer(i);
+  }
+  for (int workers = 1; workers <= 4; workers++) {
+    BatchConfig c = config(workers);
+    assert(batch_run(&c, module, jobs, n, NULL, NULL) == 1);
+    for (long long int i = 0; i < n; i++) {
+      assert(jobs[i].done);
+      if (i == 7) {
+        assert(jobs[i].error != NULL);
+        continue;
+      }
+      char expected[32];
+      snprintf(expected, sizeof(expected), "%lld\n", 2 * i);
+      assert(jobs[i].error == NULL);
+      assert(!strcmp(jobs[i].output, expected));
+    }
+  }
+  assert(module->refs == 1);
+})
+
+TEST_CASE(test_batch_files, {
+  BatchJob jobs[2];
+  jobs[0].filename = "no/such/file.compiled";
+  jobs[0].input = NULL;
+  jobs[1] = jobs[0];
+  BatchConfig c = config(0);
+  assert(batch_run(&c, NULL, jobs, 2, NULL, NULL) == 2);
+  assert(strstr(jobs[1].error, "no/such/file.compiled") != NULL);
+  assert(batch_run(&c, NULL, jobs, 0, NULL, NULL) == 0);
+})
+
+void batch_test() {
+  test_batch_inputs();
+  test_batch_files();
+
+  printf("[batch_test] All of tests are passed\n");
+}
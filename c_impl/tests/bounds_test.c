@@ -0,0 +1,115 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+enum { SumPlain, SumStoreArray, SumExternalIndex };
+
+/**
+ * a = [1, 2, 3, 4]; s = 0; i = 0;
+ * while (i < len(a)) { s = a[i] + s; i = 1 + i; }
+ * SumStoreArray adds an `a = a` before the access, SumExternalIndex leaves
+ * out `i = 0` for the host to bind i.
+ */
+static Vector *sum_array(int variant) {
+  Vector *insts = new_vec();
+  for (int k = 1; k <= 4; k++) {
+    emit(insts, tOpPush, new_TValue_with_integer(k));
+  }
+  emit(insts, tOpMakeArray, new_TValue_with_integer(4));
+  emit(insts, tOpVariableDeclareWithAssign, str("a"));
+  emit(insts, tOpPush, new_TValue_with_integer(0));
+  emit(insts, tOpVariableDeclareWithAssign, str("s"));
+  if (variant != SumExternalIndex) {
+    emit(insts, tOpPush, new_TValue_with_integer(0));
+    emit(insts, tOpVariableDeclareWithAssign, str("i"));
+  }
+
+  Inst *header = emit(insts, tOpGetVariable, str("a"));
+  emit(insts, tOpCall, str("len"));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpLtExpression, NULL);
+  Inst *cond = emit(insts, tOpIFStatement, NULL);
+
+  if (variant == SumStoreArray) {
+    emit(insts, tOpGetVariable, str("a"));
+    emit(insts, tOpSetVariablePop, str("a"));
+  }
+  emit(insts, tOpGetVariable, str("s"));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpGetArrayElement, str("a"));
+  emit(insts, tOpAdd, NULL);
+  emit(insts, tOpSetVariablePop, str("s"));
+  emit(insts, tOpPush, new_TValue_with_integer(1));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpAdd, NULL);
+  emit(insts, tOpSetVariablePop, str("i"));
+  emit(insts, tOpJumpRel, NULL)->target = header;
+
+  cond->target = emit(insts, tOpGetVariable, str("s"));
+  return code_encode(insts);
+}
+
+TEST_CASE(test_array_lowering, {
+  Vector *optimized = optimize(sum_array(SumStoreArray),
+                               OptBoundsCheckElimination);
+  assert(count_op(optimized, tOpGetArrayElement) == 0);
+  assert(count_op(optimized, tOpCall) == 0);
+  assert(count_op(optimized, tOpArrayLength) == 1);
+  assert(count_op(optimized, tOpArrayLoad) == 1);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 10);
+
+  /* len is an ordinary builtin without the optimizer */
+  assert(tv_getLong(vm_execute(new_VM(), sum_array(SumPlain))) == 10);
+})
+
+TEST_CASE(test_bounds_check_elimination, {
+  Vector *optimized = optimize(sum_array(SumPlain), OptBoundsCheckElimination);
+  assert(count_op(optimized, tOpArrayLoad) == 0);
+  assert(count_op(optimized, tOpArrayLoadUnchecked) == 1);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 10);
+
+  VM *vm = new_VM();
+  vm->engine = EngineRegister;
+  assert(tv_getLong(vm_run(vm, optimized)) == 10);
+
+  int passes = opt_passes_for_level(OPT_LEVEL_MAX);
+  optimized = optimize(sum_array(SumPlain), passes);
+  assert(count_op(optimized, tOpArrayLoadUnchecked) == 1);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 10);
+})
+
+/* A VM running the sum with i bound to start by the host */
+static VM *sum_from(long long int start, int engine) {
+  VM *vm = vm_open();
+  vm->engine = engine;
+  env_def(vm->env, sdsnew("i"), new_TValue_with_integer(start));
+  return vm;
+}
+
+/* Nothing in the program tells that i is not negative */
+TEST_CASE(test_bounds_external_index, {
+  int passes = opt_passes_for_level(OPT_LEVEL_MAX);
+  Vector *optimized = optimize(sum_array(SumExternalIndex), passes);
+  assert(count_op(optimized, tOpArrayLoadUnchecked) == 1);
+
+  for (int engine = EngineStack; engine <= EngineRegister; engine++) {
+    VM *vm = sum_from(-4, engine);
+    assert(vm_load(vm, sum_array(SumExternalIndex), OPT_LEVEL_MAX) ==
+           VMErrorRuntime);
+    assert(!strcmp(vm->error, "Execute Error Array index out of range"));
+
+    vm = sum_from(1, engine);
+    assert(vm_load(vm, sum_array(SumExternalIndex), OPT_LEVEL_MAX) == VMOk);
+    assert(tv_getLong(env_get(vm->env, sdsnew("s"))) == 9);
+  }
+})
+
+void bounds_test() {
+  test_array_lowering();
+  test_bounds_check_elimination();
+  test_bounds_external_index();
+
+  printf("[bounds_test] All of tests are passed\n");
+}
@@ -0,0 +1,222 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 40
+
+static long long int next_random(unsigned long long int *seed) {
+  *seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (long long int)(*seed >> 33) - (1LL << 30);
+}
+
+/* Every vector width and tail length against plain loops */
+TEST_CASE(test_long_kernels, {
+  unsigned long long int seed = 42;
+  long long int xs[MAX_LEN + 1];
+  long long int ys[MAX_LEN + 1];
+  for (long long int n = 0; n <= MAX_LEN; n++) {
+    long long int sum = 0;
+    for (long long int i = 0; i < n; i++) {
+      xs[i] = next_random(&seed);
+      sum += xs[i];
+    }
+    assert(longs_sum(xs, n) == sum);
+
+    if (n > 0) {
+      long long int min = xs[0];
+      long long int max = xs[0];
+      for (long long int i = 0; i < n; i++) {
+        min = xs[i] < min ? xs[i] : min;
+        max = xs[i] > max ? xs[i] : max;
+      }
+      assert(longs_extreme(xs, n, false) == min);
+      assert(longs_extreme(xs, n, true) == max);
+    }
+
+    for (long long int i = 0; i < n; i++) {
+      long long int first = 0;
+      while (xs[first] != xs[i]) {
+        first++;
+      }
+      assert(longs_index_of(xs, n, xs[i]) == first);
+    }
+    assert(longs_index_of(xs, n, 1LL << 40) == -1);
+
+    memcpy(ys, xs, sizeof(long long int) * n);
+    assert(longs_equal(xs, ys, n));
+    for (long long int i = 0; i < n; i++) {
+      ys[i]++;
+      assert(!longs_equal(xs, ys, n));
+      ys[i]--;
+    }
+
+    xs[n] = 7;
+    longs_fill(xs, n, -3);
+    for (long long int i = 0; i < n; i++) {
+      assert(xs[i] == -3);
+    }
+    assert(xs[n] == 7);
+  }
+})
+
+static int compare_longs(const void *a, const void *b) {
+  long long int x = *(const long long int *)a;
+  long long int y = *(const long long int *)b;
+  return (x > y) - (x < y);
+}
+
+static int compare_strings(const void *a, const void *b) {
+  return strcmp((*(TValue **)a)->value.str, (*(TValue **)b)->value.str);
+}
+
+static long long int sort_lens[] = {0, 1, 2, 31, 32, 33, 200, 5000};
+
+/* Both sorts against qsort, below and above the insertion sort cutoff */
+TEST_CASE(test_sort, {
+  unsigned long long int seed = 7;
+  for (int t = 0; t < (int)(sizeof(sort_lens) / sizeof(sort_lens[0])); t++) {
+    long long int n = sort_lens[t];
+    long long int *xs = xmalloc(sizeof(long long int) * (n + 1));
+    long long int *ys = xmalloc(sizeof(long long int) * (n + 1));
+    TValue **vs = xmalloc(sizeof(TValue *) * (n + 1));
+    TValue **ws = xmalloc(sizeof(TValue *) * (n + 1));
+    for (long long int i = 0; i < n; i++) {
+      /* wide values, narrow ones that skip passes and duplicates */
+      long long int r = next_random(&seed);
+      xs[i] = t % 2 ? r * (1LL << 32) + r : r % 100;
+      ys[i] = xs[i];
+
+      char buf[32];
+      snprintf(buf, sizeof(buf), "%s%lld", t % 2 ? "key" : "", r % 500);
+      vs[i] = new_TValue_with_str(sdsnew(buf));
+      ws[i] = vs[i];
+    }
+    longs_sort(xs, n);
+    qsort(ys, n, sizeof(long long int), compare_longs);
+    assert(n == 0 || memcmp(xs, ys, sizeof(long long int) * n) == 0);
+
+    strings_sort(vs, n);
+    qsort(ws, n, sizeof(TValue *), compare_strings);
+    for (long long int i = 0; i < n; i++) {
+      assert(!strcmp(vs[i]->value.str, ws[i]->value.str));
+    }
+  }
+})
+
+/* [elems...] and the optional second argument passed to the builtin */
+static TValue *call(char *name, long long int *elems, long long int n,
+                    TValue *arg) {
+  Vector *insts = new_vec();
+  for (long long int i = 0; i < n; i++) {
+    vec_push(insts, new_Inst(tOpPush, new_TValue_with_integer(elems[i])));
+  }
+  vec_push(insts, new_Inst(tOpMakeArray, new_TValue_with_integer(n)));
+  if (arg != NULL) {
+    vec_push(insts, new_Inst(tOpPush, arg));
+  }
+  vec_push(insts, new_Inst(tOpCall, new_TValue_with_str(sdsnew(name))));
+  return vm_execute(new_VM(), code_encode(insts));
+}
+
+static long long int elems[] = {3, 1, 4, 1, 5, 9, 2, 6};
+static long long int zeros[8];
+
+TEST_CASE(test_builtin_calls, {
+  assert(tv_getLong(call("sum", elems, 8, NULL)) == 31);
+  assert(tv_getLong(call("min", elems, 8, NULL)) == 1);
+  assert(tv_getLong(call("max", elems, 8, NULL)) == 9);
+  assert(tv_getLong(call("index_of", elems, 8, new_TValue_with_integer(1))) ==
+         1);
+  assert(tv_getLong(call("index_of", elems, 8, new_TValue_with_integer(7))) ==
+         -1);
+  assert(tv_getLong(call("sum", elems, 0, NULL)) == 0);
+
+  TValue *filled = call("fill", elems, 8, new_TValue_with_integer(0));
+  assert(tv_getTArray(filled)->kind == ArrayLong);
+  assert(tv_getLong(ta_get(tv_getTArray(filled), 7)) == 0);
+  assert(tv_getBool(call("equals", elems, 8, filled)) == false);
+  assert(tv_getBool(call("equals", zeros, 8, filled)) == true);
+  assert(tv_getBool(call("equals", zeros, 7, filled)) == false);
+
+  TValue *sorted = call("sort", elems, 8, NULL);
+  assert(tv_getLong(ta_get(tv_getTArray(sorted), 0)) == 1);
+  assert(tv_getLong(ta_get(tv_getTArray(sorted), 7)) == 9);
+})
+
+/* A value of another type boxes the array, the builtins still work on it */
+TEST_CASE(test_builtin_boxed, {
+  TValue *s = new_TValue_with_str(sdsnew("s"));
+  TValue *filled = call("fill", elems, 3, s);
+  assert(tv_getTArray(filled)->kind == ArrayBoxed);
+  assert(!strcmp(tv_getString(ta_get(tv_getTArray(filled), 2)), "s"));
+
+  Vector *mixed = new_vec();
+  vec_push(mixed, new_TValue_with_integer(4));
+  vec_push(mixed, s);
+  vec_push(mixed, new_TValue_with_integer(5));
+  TValue *array = new_TValue_with_array(mixed);
+  VM *vm = new_VM();
+  vec_push(vm->stack, array);
+  vec_push(vm->stack, s);
+  assert(tv_getLong(vm_call(vm, sdsnew("index_of"))) == 1);
+  vec_push(vm->stack, array);
+  vec_push(vm->stack, new_TValue_with_integer(5));
+  assert(tv_getLong(vm_call(vm, sdsnew("index_of"))) == 2);
+
+  /* Strings sort among themselves, other arrays by tv_cmp */
+  Vector *strs = new_vec();
+  vec_push(strs, new_TValue_with_str(sdsnew("pear")));
+  vec_push(strs, new_TValue_with_str(sdsnew("apple")));
+  vec_push(strs, new_TValue_with_str(sdsnew("app")));
+  vec_push(vm->stack, new_TValue_with_array(strs));
+  TArray *sorted = tv_getTArray(vm_call(vm, sdsnew("sort")));
+  assert(!strcmp(tv_getString(ta_get(sorted, 0)), "app"));
+  assert(!strcmp(tv_getString(ta_get(sorted, 2)), "pear"));
+
+  TValue *boxed = call("fill", elems, 3, new_TValue_with_integer(2));
+  ta_set(tv_getTArray(boxed), 1, s);
+  ta_set(tv_getTArray(boxed), 1, new_TValue_with_integer(1));
+  vec_push(vm->stack, boxed);
+  sorted = tv_getTArray(vm_call(vm, sdsnew("sort")));
+  assert(sorted->kind == ArrayBoxed);
+  assert(tv_getLong(ta_get(sorted, 0)) == 1);
+})
+
+static TValue *twice(VM *vm) {
+  long long int x = tv_getLong((TValue *)vec_pop(vm->stack));
+  TValue *ret = new_TValue_with_integer(2 * x);
+  vec_push(vm->stack, ret);
+  return ret;
+}
+
+/* Natives are called by tOpCall on the caller's stack */
+TEST_CASE(test_native_functions, {
+  VM *vm = new_VM();
+  assert(env_get(vm->env, sdsnew("println"))->tt == Native);
+
+  env_def_native(vm->env, "twice", 1, twice);
+  Vector *insts = new_vec();
+  vec_push(insts, new_Inst(tOpPush, new_TValue_with_integer(21)));
+  vec_push(insts, new_Inst(tOpCall, new_TValue_with_str(sdsnew("twice"))));
+  Vector *code = code_encode(insts);
+  assert(tv_getLong(vm_execute(vm, code)) == 42);
+
+  vm->engine = EngineRegister;
+  assert(tv_getLong(vm_run(vm, code)) == 42);
+
+  TValue *native = env_get(vm->env, sdsnew("twice"));
+  assert(tv_dup(native) == native);
+})
+
+void builtins_test() {
+  test_long_kernels();
+  test_sort();
+  test_builtin_calls();
+  test_builtin_boxed();
+  test_native_functions();
+
+  printf("[builtins_test] All of tests are passed\n");
+}
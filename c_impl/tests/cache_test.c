@@ -0,0 +1,198 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void push_string(Vector *words, char *s) {
+  vec_pushi(words, String);
+  vec_pushi(words, strlen(s));
+  for (size_t i = 0; i < strlen(s); i++) {
+    vec_pushi(words, s[i]);
+  }
+}
+
+static void write_words(char *path, Vector *words) {
+  FILE *fp = fopen(path, "wb");
+  for (long long int i = 0; i < words->len; i++) {
+    long long int w = (long long int)words->data[i];
+    fwrite(&w, sizeof(w), 1, fp);
+  }
+  fclose(fp);
+}
+
+static Vector *read_words(char *path) {
+  FILE *fp = fopen(path, "rb");
+  assert(fp != NULL);
+  Vector *words = new_vec();
+  long long int w;
+  while (fread(&w, sizeof(w), 1, fp) == 1) {
+    vec_push(words, (void *)w);
+  }
+  fclose(fp);
+  return words;
+}
+
+/* Serialized `x = 2 + 3; println(x); println(label);` */
+static void write_program(char *path, char *label) {
+  Vector *words = new_vec();
+  vec_pushi(words, tOpPush);
+  vec_pushi(words, Long);
+  vec_pushi(words, 3);
+  vec_pushi(words, tOpPush);
+  vec_pushi(words, Long);
+  vec_pushi(words, 2);
+  vec_pushi(words, tOpAdd);
+  vec_pushi(words, tOpVariableDeclareWithAssign);
+  push_string(words, "x");
+  vec_pushi(words, tOpGetVariable);
+  push_string(words, "x");
+  vec_pushi(words, tOpPrintln);
+  vec_pushi(words, tOpPush);
+  push_string(words, label);
+  vec_pushi(words, tOpPrintln);
+  write_words(path, words);
+}
+
+static bool same_code(Vector *a, Vector *b) {
+  if (a->len != b->len) {
+    return false;
+  }
+  for (long long int pc = 0; pc < a->len;) {
+    Opcode op = (Opcode)a->data[pc];
+    if (op != (Opcode)b->data[pc++]) {
+      return false;
+    }
+    for (long long int i = 0; i < op_operand_count(op); i++, pc++) {
+      if (!tv_equals(a->data[pc], b->data[pc])) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static int entries(char *dir) {
+  DIR *d = opendir(dir);
+  int n = 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    n += e->d_name[0] != '.';
+  }
+  closedir(d);
+  return n;
+}
+
+/* The path of the one entry in dir */
+static sds only_entry(char *dir) {
+  assert(entries(dir) == 1);
+  DIR *d = opendir(dir);
+  struct dirent *e;
+  while ((e = readdir(d))->d_name[0] == '.') {
+  }
+  sds path = sdscatprintf(sdsempty(), "%s/%s", dir, e->d_name);
+  closedir(d);
+  return path;
+}
+
+/* The output of running the code of path through the cache */
+static sds run(char *path) {
+  char *buf = NULL;
+  size_t len = 0;
+  VM *vm = vm_open();
+  vm->out = open_memstream(&buf, &len);
+  assert(vm_load_file(vm, path, OPT_LEVEL_MAX) == VMOk);
+  fclose(vm->out);
+  sds output = sdsnewlen(buf, len);
+  free(buf);
+  return output;
+}
+
+TEST_CASE(test_cache_entries, {
+  char dir[] = "/tmp/tinyvm_cache_testXXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  char path[] = "/tmp/tinyvm_cache_programXXXXXX";
+  close(mkstemp(path));
+  write_program(path, "first");
+
+  Vector *plain = cache_load_file(path, OPT_LEVEL_MAX);
+  assert(cache_set_dir(dir));
+  Vector *stored = cache_load_file(path, OPT_LEVEL_MAX);
+  assert(entries(dir) == 1);
+  Vector *cached = cache_load_file(path, OPT_LEVEL_MAX);
+  assert(same_code(plain, stored));
+  assert(same_code(plain, cached));
+  assert(!strcmp(run(path), "5\nfirst\n"));
+
+  /* other bytes or another level are other entries */
+  cache_load_file(path, 0);
+  assert(entries(dir) == 2);
+  write_program(path, "second");
+  assert(!strcmp(run(path), "5\nsecond\n"));
+  assert(entries(dir) == 3);
+
+  /* a damaged entry is written again */
+  DIR *d = opendir(dir);
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (e->d_name[0] != '.') {
+      sds entry = sdscatprintf(sdsempty(), "%s/%s", dir, e->d_name);
+      assert(truncate(entry, 60) == 0);
+    }
+  }
+  closedir(d);
+  assert(!strcmp(run(path), "5\nsecond\n"));
+  assert(!strcmp(run(path), "5\nsecond\n"));
+
+  assert(cache_load_file("no/such/file.compiled", OPT_LEVEL_MAX) == NULL);
+  assert(!cache_set_dir(path));
+  assert(cache_set_dir(NULL));
+  unlink(path);
+})
+
+/* Entries are checked against the source and decoded before they are used */
+TEST_CASE(test_cache_validation, {
+  char dir[] = "/tmp/tinyvm_cache_testXXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  assert(cache_set_dir(dir));
+  char path[] = "/tmp/tinyvm_cache_programXXXXXX";
+  close(mkstemp(path));
+
+  /* the entry of other bytes of the same length under the same hash */
+  write_program(path, "first");
+  assert(!strcmp(run(path), "5\nfirst\n"));
+  sds first = only_entry(dir);
+  Vector *words = read_words(first);
+  unlink(first);
+  write_program(path, "other");
+  assert(!strcmp(run(path), "5\nother\n"));
+  sds other = only_entry(dir);
+  words->data[5] = read_words(other)->data[5]; /* the hash of the header */
+  write_words(other, words);
+  assert(!strcmp(run(path), "5\nother\n"));
+
+  /* code jumping out of itself, after the header and the source */
+  words = read_words(other);
+  long long int slots = 7 + ((long long int)words->data[4] + 7) / 8;
+  assert((long long int)words->data[slots] == tOpPush);
+  words->data[slots] = (void *)tOpJumpAbs;
+  words->data[slots + 2] = (void *)1000;
+  write_words(other, words);
+  assert(!strcmp(run(path), "5\nother\n"));
+  assert(!strcmp(run(path), "5\nother\n"));
+
+  assert(cache_set_dir(NULL));
+  unlink(other);
+  rmdir(dir);
+  unlink(path);
+})
+
+void cache_test() {
+  test_cache_entries();
+  test_cache_validation();
+
+  printf("[cache_test] All of tests are passed\n");
+}
@@ -0,0 +1,163 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define ITEMS 20000
+
+static VM *owner;
+static long long int ch;
+
+static void *produce(void *arg) {
+  long long int first = *(long long int *)arg;
+  for (long long int i = 0; i < ITEMS; i++) {
+    assert(channel_send(owner, ch, new_TValue_with_integer(first + i)));
+  }
+  return NULL;
+}
+
+static void *consume(void *arg) {
+  long long int *sum = arg;
+  TValue *v;
+  while ((v = channel_recv(owner, ch)) != NULL) {
+    *sum += tv_getLong(v);
+  }
+  return NULL;
+}
+
+/* Four senders and four receivers through a ring much smaller than them */
+TEST_CASE(test_channel_threads, {
+  owner = vm_open();
+  ch = channel_open(owner, 8);
+  pthread_t producers[4];
+  pthread_t consumers[4];
+  long long int firsts[4];
+  long long int sums[4];
+  for (int i = 0; i < 4; i++) {
+    firsts[i] = i * ITEMS;
+    sums[i] = 0;
+    pthread_create(&producers[i], NULL, produce, &firsts[i]);
+    pthread_create(&consumers[i], NULL, consume, &sums[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(producers[i], NULL);
+  }
+  channel_close(owner, ch);
+  long long int sum = 0;
+  for (int i = 0; i < 4; i++) {
+    pthread_join(consumers[i], NULL);
+    sum += sums[i];
+  }
+  long long int n = 4 * ITEMS;
+  assert(sum == n * (n - 1) / 2);
+  assert(!channel_send(owner, ch, new_TValue()));
+})
+
+static TValue *call(VM *vm, char *name, TValue **args, int argc) {
+  TValue *ret;
+  assert(vm_invoke(vm, vm_lookup(vm, name), args, argc, &ret) == VMOk);
+  return ret;
+}
+
+/* Values go through as they are, arrays are not copied */
+TEST_CASE(test_channel_builtins, {
+  VM *vm = vm_open();
+  TValue *args[2];
+  args[0] = new_TValue_with_integer(2);
+  TValue *id = call(vm, "channel", args, 1);
+
+  args[0] = id;
+  args[1] = new_TValue_with_array(new_vec());
+  call(vm, "send", args, 2);
+  TValue *array = args[1];
+  assert(call(vm, "recv", args, 1) == array);
+
+  call(vm, "close", args, 1);
+  assert(call(vm, "recv", args, 1)->tt == Null);
+  assert(vm_invoke(vm, vm_lookup(vm, "send"), args, 2, NULL) ==
+         VMErrorRuntime);
+
+  args[0] = new_TValue_with_integer(1LL << 40);
+  assert(vm_invoke(vm, vm_lookup(vm, "recv"), args, 1, NULL) ==
+         VMErrorRuntime);
+})
+
+static void assert_bad_capacity(VM *vm, long long int capacity) {
+  TValue *args[1];
+  args[0] = new_TValue_with_integer(capacity);
+  assert(vm_invoke(vm, vm_lookup(vm, "channel"), args, 1, NULL) ==
+         VMErrorRuntime);
+  assert(!strcmp(vm->error, "Execute Error channel capacity out of range"));
+  assert(channel_open(vm, capacity) == -1);
+}
+
+/* A channel holds at least one value and at most CHANNEL_CAPACITY_MAX */
+TEST_CASE(test_channel_capacity, {
+  VM *vm = vm_open();
+  assert_bad_capacity(vm, 0);
+  assert_bad_capacity(vm, -1);
+  assert_bad_capacity(vm, CHANNEL_CAPACITY_MAX + 1);
+  assert_bad_capacity(vm, 1LL << 62);
+
+  long long int id = channel_open(vm, 1);
+  assert(id >= 0);
+  assert(channel_send(vm, id, new_TValue_with_integer(1)));
+  assert(channel_close(vm, id));
+  assert(channel_open(vm, CHANNEL_CAPACITY_MAX) >= 0);
+})
+
+/* A channel closed and drained is freed, its id reads as closed */
+TEST_CASE(test_channel_free, {
+  VM *vm = vm_open();
+  long long int id = channel_open(vm, 2);
+  assert(channel_send(vm, id, new_TValue_with_integer(7)));
+  assert(channel_close(vm, id));
+  assert(tv_getLong(channel_recv(vm, id)) == 7);
+  assert(channel_recv(vm, id) == NULL);
+
+  long long int next = channel_open(vm, 2);
+  assert(next != id && (next & 0xffffffff) == (id & 0xffffffff));
+  assert(channel_recv(vm, id) == NULL);
+  assert(!channel_send(vm, id, new_TValue()));
+  assert(channel_close(vm, id));
+  assert(channel_send(vm, next, new_TValue_with_integer(8)));
+  assert(tv_getLong(channel_recv(vm, next)) == 8);
+  assert(!channel_close(vm, next + (1LL << 32)));
+
+  /* opening and closing forever never runs out of channels */
+  for (long long int i = 0; i <= CHANNELS_MAX; i++) {
+    long long int ch = channel_open(vm, 1);
+    assert(ch >= 0);
+    assert(channel_close(vm, ch));
+  }
+})
+
+/* VMs only reach the channels of their table */
+TEST_CASE(test_channel_tables, {
+  VM *vm = vm_open();
+  VM *other = vm_open();
+  long long int id = channel_open(vm, 2);
+  assert(!channel_send(other, id, new_TValue()));
+  assert(!channel_close(other, id));
+  TValue *args[1];
+  args[0] = new_TValue_with_integer(id);
+  assert(vm_invoke(other, vm_lookup(other, "recv"), args, 1, NULL) ==
+         VMErrorRuntime);
+  assert(!strcmp(other->error, "Execute Error No such a channel"));
+
+  vm_share_channels(other, vm);
+  assert(channel_send(other, id, new_TValue_with_integer(3)));
+  assert(tv_getLong(channel_recv(vm, id)) == 3);
+})
+
+void channel_test() {
+  test_channel_threads();
+  test_channel_builtins();
+  test_channel_capacity();
+  test_channel_free();
+  test_channel_tables();
+
+  printf("[channel_test] All of tests are passed\n");
+}
@@ -0,0 +1,423 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void declare(Vector *code, char *name, Vector *body) {
+  emit1(code, tOpFunctionDeclare, str(name));
+  vec_push(code, num(body->len));
+  for (int i = 0; i < body->len; i++) {
+    vec_push(code, body->data[i]);
+  }
+}
+
+/* func spin(n) { while (ticks < n) { ticks = ticks + 1; } return ticks; } */
+static Vector *spin(void) {
+  Vector *body = new_vec();
+  emit1(body, tOpVariableDeclareWithAssign, str("n"));
+  emit1(body, tOpGetVariable, str("n")); /* 2 */
+  emit1(body, tOpGetVariable, str("ticks"));
+  emit0(body, tOpLtExpression);
+  emit1(body, tOpIFStatement, num(9));
+  emit1(body, tOpPush, num(1));
+  emit1(body, tOpGetVariable, str("ticks"));
+  emit0(body, tOpAdd);
+  emit1(body, tOpSetVariablePop, str("ticks"));
+  emit1(body, tOpJumpAbs, num(1));
+  emit1(body, tOpGetVariable, str("ticks"));
+  emit0(body, tOpReturn);
+  return body;
+}
+
+/**
+ * ticks = 0;
+ * func worker(n) {
+ *   i = 0;
+ *   while (i < n) { println(i); yield(i); i = i + 1; }
+ *   return n * 10;
+ * }
+ * and spin
+ */
+static VM *program(void) {
+  Vector *body = new_vec();
+  emit1(body, tOpVariableDeclareWithAssign, str("n"));
+  emit1(body, tOpPush, num(0));
+  emit1(body, tOpVariableDeclareWithAssign, str("i"));
+  emit1(body, tOpGetVariable, str("n")); /* 6 */
+  emit1(body, tOpGetVariable, str("i"));
+  emit0(body, tOpLtExpression);
+  emit1(body, tOpIFStatement, num(17));
+  emit1(body, tOpGetVariable, str("i"));
+  emit0(body, tOpPrintln);
+  emit1(body, tOpGetVariable, str("i"));
+  emit1(body, tOpCall, str("yield"));
+  emit0(body, tOpPop);
+  emit1(body, tOpPush, num(1));
+  emit1(body, tOpGetVariable, str("i"));
+  emit0(body, tOpAdd);
+  emit1(body, tOpSetVariablePop, str("i"));
+  emit1(body, tOpJumpAbs, num(5));
+  emit1(body, tOpPush, num(10));
+  emit1(body, tOpGetVariable, str("n"));
+  emit0(body, tOpMul);
+  emit0(body, tOpReturn);
+
+  Vector *code = new_vec();
+  emit1(code, tOpPush, num(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("ticks"));
+  declare(code, "worker", body);
+  declare(code, "spin", spin());
+
+  VM *vm = vm_open();
+  assert(vm_load(vm, code, OPT_LEVEL_MAX) == VMOk);
+  return vm;
+}
+
+static TValue *call(VM *vm, char *name, TValue *a, TValue *b) {
+  TValue *args[2];
+  args[0] = a;
+  args[1] = b;
+  TValue *ret;
+  int argc = a == NULL ? 0 : b == NULL ? 1 : 2;
+  assert(vm_invoke(vm, vm_lookup(vm, name), args, argc, &ret) == VMOk);
+  return ret;
+}
+
+TEST_CASE(test_coroutine_resume, {
+  VM *vm = program();
+  vm->out = fopen("/dev/null", "w");
+  TValue *task = call(vm, "spawn", vm_lookup(vm, "worker"), num(3));
+  for (long long int i = 0; i < 3; i++) {
+    assert(tv_getLong(call(vm, "resume", task, NULL)) == i);
+    assert(!tv_getBool(call(vm, "finished", task, NULL)));
+  }
+  assert(tv_getLong(call(vm, "resume", task, NULL)) == 30);
+  assert(tv_getBool(call(vm, "finished", task, NULL)));
+  assert(vm->stack->len == 0);
+
+  TValue *args[1];
+  args[0] = task;
+  assert(vm_invoke(vm, vm_lookup(vm, "resume"), args, 1, NULL) ==
+         VMErrorRuntime);
+  args[0] = num(1);
+  assert(vm_invoke(vm, vm_lookup(vm, "yield"), args, 1, NULL) ==
+         VMErrorRuntime);
+})
+
+/* Tasks take turns a yield at a time */
+TEST_CASE(test_coroutine_scheduler, {
+  VM *vm = program();
+  char *buf = NULL;
+  size_t len = 0;
+  vm->out = open_memstream(&buf, &len);
+  for (long long int n = 1; n <= 3; n++) {
+    call(vm, "spawn", vm_lookup(vm, "worker"), num(n));
+  }
+  call(vm, "run_tasks", NULL, NULL);
+  fclose(vm->out);
+  assert(!strcmp(buf, "0\n0\n0\n1\n1\n2\n"));
+  free(buf);
+
+  /* thousands of tasks */
+  vm->out = fopen("/dev/null", "w");
+  for (long long int i = 0; i < 5000; i++) {
+    call(vm, "spawn", vm_lookup(vm, "worker"), num(4));
+  }
+  call(vm, "run_tasks", NULL, NULL);
+  for (long long int i = 3; i < 5003; i++) {
+    assert(tv_getBool(call(vm, "finished", num(i), NULL)));
+  }
+})
+
+/* An error ends the task and returns to the host */
+TEST_CASE(test_coroutine_errors, {
+  VM *vm = program();
+  vm->out = fopen("/dev/null", "w");
+  TValue *task = call(vm, "spawn", vm_lookup(vm, "worker"), str("x"));
+  TValue *args[1];
+  args[0] = task;
+  assert(vm_invoke(vm, vm_lookup(vm, "resume"), args, 1, NULL) ==
+         VMErrorRuntime);
+  assert(tv_getBool(call(vm, "finished", task, NULL)));
+  assert(vm->stack->len == 0);
+})
+
+static long long int ticks(VM *vm) {
+  return tv_getLong(env_get(vm->env, sdsnew("ticks")));
+}
+
+/* A task out of fuel stops at a backward jump and carries on from there */
+TEST_CASE(test_coroutine_fuel, {
+  VM *vm = program();
+  vm->out = fopen("/dev/null", "w");
+  TValue *arg = num(1000000);
+  long long int task = vm_spawn(vm, vm_lookup(vm, "spin"), &arg, 1);
+  assert(task >= 0);
+  TValue *ret = arg;
+  assert(vm_resume(vm, task, 100, &ret) == VMSuspended);
+  assert(ret == NULL);
+  assert(ticks(vm) == 101);
+  assert(vm->fuel == -1);
+  assert(vm_resume(vm, task, 50, &ret) == VMSuspended);
+  assert(ticks(vm) == 152);
+
+  /* other tasks run in between, a call takes fuel too */
+  arg = num(2);
+  long long int other = vm_spawn(vm, vm_lookup(vm, "worker"), &arg, 1);
+  assert(vm_resume(vm, other, 0, &ret) == VMSuspended);
+  assert(ret == NULL);
+  assert(vm_resume(vm, other, 1, &ret) == VMSuspended);
+  assert(tv_getLong(ret) == 0);
+  assert(vm_resume(vm, other, -1, &ret) == VMSuspended);
+  assert(tv_getLong(ret) == 1);
+  assert(vm_resume(vm, other, -1, &ret) == VMOk);
+  assert(tv_getLong(ret) == 20);
+  assert(vm_resume(vm, other, -1, &ret) == VMErrorRuntime);
+  assert(ret == NULL);
+
+  assert(vm_resume(vm, task, -1, &ret) == VMOk);
+  assert(tv_getLong(ret) == 1000000);
+  assert(vm_spawn(vm, vm_lookup(vm, "len"), NULL, 0) == -1);
+  assert(vm->stack->len == 0);
+})
+
+/* run_tasks takes turns with a task that never yields */
+TEST_CASE(test_coroutine_slices, {
+  VM *vm = program();
+  char *buf = NULL;
+  size_t len = 0;
+  vm->out = open_memstream(&buf, &len);
+  TValue *task = call(vm, "spawn", vm_lookup(vm, "spin"), num(5 * TASK_SLICE));
+  call(vm, "spawn", vm_lookup(vm, "worker"), num(3));
+  call(vm, "run_tasks", NULL, NULL);
+  fclose(vm->out);
+  assert(!strcmp(buf, "0\n1\n2\n"));
+  free(buf);
+  assert(tv_getBool(call(vm, "finished", task, NULL)));
+  assert(ticks(vm) == 5 * TASK_SLICE);
+})
+
+/**
+ * flag = 0; x = 0;
+ * func wait() { flag = 0; while (flag == 0) {} return 1; }
+ * func release() { flag = 1; }
+ * func count(n) { x = 0; i = 0; while (i < n) { x = x + 1; i = i + 1; }
+ *                 return x; }
+ * func spoil() { x = "oops"; }
+ * func latch() { func open() { ready = 1; } opener = open; ready = 0;
+ *                while (ready == 0) {} return 2; }
+ */
+static VM *shared_program(void) {
+  Vector *wait = new_vec();
+  emit1(wait, tOpPush, num(0));
+  emit1(wait, tOpSetVariablePop, str("flag"));
+  emit1(wait, tOpPush, num(0)); /* 4 */
+  emit1(wait, tOpGetVariable, str("flag"));
+  emit0(wait, tOpEqualExpression);
+  emit1(wait, tOpIFStatement, num(2));
+  emit1(wait, tOpJumpAbs, num(3));
+  emit1(wait, tOpPush, num(1));
+  emit0(wait, tOpReturn);
+
+  Vector *release = new_vec();
+  emit1(release, tOpPush, num(1));
+  emit1(release, tOpSetVariablePop, str("flag"));
+
+  Vector *count = new_vec();
+  emit1(count, tOpVariableDeclareWithAssign, str("n"));
+  emit1(count, tOpPush, num(0));
+  emit1(count, tOpSetVariablePop, str("x"));
+  emit1(count, tOpPush, num(0));
+  emit1(count, tOpVariableDeclareWithAssign, str("i"));
+  emit1(count, tOpGetVariable, str("n")); /* 10 */
+  emit1(count, tOpGetVariable, str("i"));
+  emit0(count, tOpLtExpression);
+  emit1(count, tOpIFStatement, num(16));
+  emit1(count, tOpPush, num(1));
+  emit1(count, tOpGetVariable, str("x"));
+  emit0(count, tOpAdd);
+  emit1(count, tOpSetVariablePop, str("x"));
+  emit1(count, tOpPush, num(1));
+  emit1(count, tOpGetVariable, str("i"));
+  emit0(count, tOpAdd);
+  emit1(count, tOpSetVariablePop, str("i"));
+  emit1(count, tOpJumpAbs, num(9));
+  emit1(count, tOpGetVariable, str("x"));
+  emit0(count, tOpReturn);
+
+  Vector *spoil = new_vec();
+  emit1(spoil, tOpPush, str("oops"));
+  emit1(spoil, tOpSetVariablePop, str("x"));
+
+  Vector *latch = new_vec();
+  Inst *open = emit(latch, tOpFunctionDeclare, str("open"));
+  open->body = new_vec();
+  emit(open->body, tOpPush, num(1));
+  emit(open->body, tOpSetVariablePop, str("ready"));
+  emit(latch, tOpGetVariable, str("open"));
+  emit(latch, tOpSetVariablePop, str("opener"));
+  emit(latch, tOpPush, num(0));
+  emit(latch, tOpVariableDeclareWithAssign, str("ready"));
+  Inst *header = emit(latch, tOpPush, num(0));
+  emit(latch, tOpGetVariable, str("ready"));
+  emit(latch, tOpEqualExpression, NULL);
+  Inst *cond = emit(latch, tOpIFStatement, NULL);
+  emit(latch, tOpJumpRel, NULL)->target = header;
+  cond->target = emit(latch, tOpPush, num(2));
+  emit(latch, tOpReturn, NULL);
+
+  Vector *code = new_vec();
+  emit1(code, tOpPush, num(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("flag"));
+  emit1(code, tOpPush, num(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("x"));
+  emit1(code, tOpPush, num(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("opener"));
+  declare(code, "wait", wait);
+  declare(code, "release", release);
+  declare(code, "count", count);
+  declare(code, "spoil", spoil);
+  declare(code, "latch", code_encode(latch));
+
+  VM *vm = vm_open();
+  assert(vm_load(vm, code, OPT_LEVEL_MAX) == VMOk);
+  return vm;
+}
+
+/* Loops see the globals other tasks write while they are preempted */
+TEST_CASE(test_coroutine_shared_globals, {
+  VM *vm = shared_program();
+  TValue *ret;
+  long long int wait = vm_spawn(vm, vm_lookup(vm, "wait"), NULL, 0);
+  assert(vm_resume(vm, wait, 100, &ret) == VMSuspended);
+  long long int release = vm_spawn(vm, vm_lookup(vm, "release"), NULL, 0);
+  assert(vm_resume(vm, release, -1, &ret) == VMOk);
+  assert(vm_resume(vm, wait, 100, &ret) == VMOk);
+  assert(tv_getLong(ret) == 1);
+
+  TValue *arg = num(1000);
+  long long int count = vm_spawn(vm, vm_lookup(vm, "count"), &arg, 1);
+  assert(vm_resume(vm, count, 100, &ret) == VMSuspended);
+  long long int spoil = vm_spawn(vm, vm_lookup(vm, "spoil"), NULL, 0);
+  assert(vm_resume(vm, spoil, -1, &ret) == VMOk);
+  assert(vm_resume(vm, count, -1, &ret) == VMErrorRuntime);
+  assert(vm->stack->len == 0);
+})
+
+/* and the locals their closures assign */
+TEST_CASE(test_coroutine_captured_locals, {
+  VM *vm = shared_program();
+  TValue *ret;
+  long long int latch = vm_spawn(vm, vm_lookup(vm, "latch"), NULL, 0);
+  assert(vm_resume(vm, latch, 100, &ret) == VMSuspended);
+  long long int open = vm_spawn(vm, vm_lookup(vm, "opener"), NULL, 0);
+  assert(vm_resume(vm, open, -1, &ret) == VMOk);
+  assert(vm_resume(vm, latch, 100, &ret) == VMOk);
+  assert(tv_getLong(ret) == 2);
+})
+
+/* func <name>(ch) { i = 0; while (i < n) { <op>; i = i + 1 } <end> } */
+static Vector *channel_loop(bool producer, long long int n) {
+  Vector *insts = new_vec();
+  emit(insts, tOpVariableDeclareWithAssign, str("ch"));
+  emit(insts, tOpPush, num(0));
+  emit(insts, tOpVariableDeclareWithAssign, str("i"));
+  Inst *header = emit(insts, tOpPush, num(n));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpLtExpression, NULL);
+  Inst *cond = emit(insts, tOpIFStatement, NULL);
+  emit(insts, tOpGetVariable, str("ch"));
+  if (producer) {
+    emit(insts, tOpGetVariable, str("i"));
+    emit(insts, tOpCall, str("send"));
+    emit(insts, tOpPop, NULL);
+  } else {
+    emit(insts, tOpCall, str("recv"));
+    emit(insts, tOpPrintln, NULL);
+  }
+  emit(insts, tOpPush, num(1));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpAdd, NULL);
+  emit(insts, tOpSetVariablePop, str("i"));
+  emit(insts, tOpJumpRel, NULL)->target = header;
+  cond->target = emit(insts, tOpPush, num(0));
+  if (producer) {
+    emit(insts, tOpGetVariable, str("ch"));
+    emit(insts, tOpCall, str("close"));
+  }
+  emit(insts, tOpReturn, NULL);
+  return code_encode(insts);
+}
+
+static VM *fed;
+static long long int feed_ch;
+
+static void *feed(void *arg) {
+  (void)arg;
+  for (long long int i = 0; i < 50; i++) {
+    assert(channel_send(fed, feed_ch, num(i)));
+  }
+  return NULL;
+}
+
+/* A send or recv that would wait suspends the task, not the thread */
+TEST_CASE(test_coroutine_channels, {
+  Vector *code = new_vec();
+  declare(code, "producer", channel_loop(true, 50));
+  declare(code, "consumer", channel_loop(false, 50));
+  VM *vm = vm_open();
+  assert(vm_load(vm, code, OPT_LEVEL_MAX) == VMOk);
+
+  char *buf = NULL;
+  size_t len = 0;
+  vm->out = open_memstream(&buf, &len);
+  TValue *ch = call(vm, "channel", num(1), NULL);
+  call(vm, "spawn", vm_lookup(vm, "consumer"), ch);
+  call(vm, "spawn", vm_lookup(vm, "producer"), ch);
+  call(vm, "run_tasks", NULL, NULL);
+  fclose(vm->out);
+  sds expected = sdsempty();
+  for (int i = 0; i < 50; i++) {
+    expected = sdscatprintf(expected, "%d\n", i);
+  }
+  assert(!strcmp(buf, expected));
+  free(buf);
+
+  /* a task only another thread can serve waits for it */
+  vm->out = fopen("/dev/null", "w");
+  ch = call(vm, "channel", num(1), NULL);
+  call(vm, "spawn", vm_lookup(vm, "consumer"), ch);
+  fed = vm;
+  feed_ch = tv_getLong(ch);
+  pthread_t thread;
+  pthread_create(&thread, NULL, feed, NULL);
+  call(vm, "run_tasks", NULL, NULL);
+  pthread_join(thread, NULL);
+
+  /* hosts see it suspended until the channel is ready */
+  ch = call(vm, "channel", num(1), NULL);
+  long long int task = vm_spawn(vm, vm_lookup(vm, "consumer"), &ch, 1);
+  TValue *ret;
+  assert(vm_resume(vm, task, -1, &ret) == VMSuspended);
+  assert(ret == NULL);
+  for (long long int i = 0; i < 50; i++) {
+    assert(channel_send(vm, tv_getLong(ch), num(i)));
+    assert(vm_resume(vm, task, -1, &ret) == (i < 49 ? VMSuspended : VMOk));
+  }
+})
+
+void coroutine_test() {
+  test_coroutine_resume();
+  test_coroutine_scheduler();
+  test_coroutine_errors();
+  test_coroutine_fuel();
+  test_coroutine_slices();
+  test_coroutine_shared_globals();
+  test_coroutine_captured_locals();
+  test_coroutine_channels();
+
+  printf("[coroutine_test] All of tests are passed\n");
+}
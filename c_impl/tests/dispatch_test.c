@@ -0,0 +1,51 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+
+static int dispatches[] = {DispatchSwitch, DispatchGoto,
+#ifdef VM_MUSTTAIL
+                           DispatchTail
+#endif
+};
+
+TEST_CASE(test_dispatch_strategies, {
+  /* i = 0; while (i < 100) { i = inc(i); } with inc(x) = 1 + x */
+  Vector *inc = new_vec();
+  emit1(inc, tOpPush, new_TValue_with_integer(1));
+  emit0(inc, tOpAdd);
+  emit0(inc, tOpReturn);
+
+  Vector *code = new_vec();
+  emit1(code, tOpFunctionDeclare, str("inc"));
+  vec_push(code, new_TValue_with_integer(inc->len));
+  for (int i = 0; i < inc->len; i++) {
+    vec_push(code, inc->data[i]);
+  }
+  emit1(code, tOpPush, new_TValue_with_integer(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("i"));
+  emit1(code, tOpPush, new_TValue_with_integer(100));
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpLtExpression);
+  emit1(code, tOpIFStatement, new_TValue_with_integer(8));
+  emit1(code, tOpGetVariable, str("i"));
+  emit1(code, tOpCall, str("inc"));
+  emit1(code, tOpSetVariablePop, str("i"));
+  emit1(code, tOpJumpRel, new_TValue_with_integer(-15));
+  emit1(code, tOpGetVariable, str("i"));
+
+  for (size_t i = 0; i < sizeof(dispatches) / sizeof(dispatches[0]); i++) {
+    VM *vm = new_VM();
+    vm->dispatch = dispatches[i];
+    vm->jit_threshold = -1;
+    vm->trace_threshold = -1;
+    assert(tv_getLong(vm_execute(vm, code)) == 100);
+    assert(vm->stack->len == 1);
+  }
+})
+
+void dispatch_test() {
+  test_dispatch_strategies();
+
+  printf("[dispatch_test] All of tests are passed\n");
+}
@@ -0,0 +1,88 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* r = [3, 4]; r[0] = 10; r[0] - r[1], with `extra` appended to the end */
+static Vector *pair(Opcode extra) {
+  Vector *code = new_vec();
+  emit_push(code, 3);
+  emit_push(code, 4);
+  emit1(code, tOpMakeArray, new_TValue_with_integer(2));
+  emit1(code, tOpVariableDeclareWithAssign, str("r"));
+  emit_push(code, 10);
+  emit_push(code, 0);
+  emit1(code, tOpSetArrayElement, str("r"));
+  emit_push(code, 1);
+  emit1(code, tOpGetArrayElement, str("r"));
+  emit_push(code, 0);
+  emit1(code, tOpGetArrayElement, str("r"));
+  emit0(code, tOpSub);
+  if (extra != tOpNop) {
+    emit1(code, extra, str("r"));
+  }
+  return code;
+}
+
+TEST_CASE(test_scalar_replacement, {
+  Vector *code = code_encode(scalar_replace_arrays(code_decode(pair(tOpNop))));
+  assert(count_op(code, tOpMakeArray) == 0);
+  assert(count_op(code, tOpGetArrayElement) == 0);
+  assert(count_op(code, tOpSetArrayElement) == 0);
+  assert(tv_getLong(vm_execute(new_VM(), code)) == 6);
+
+  /* reading r itself lets the array escape */
+  code = code_encode(scalar_replace_arrays(code_decode(pair(tOpGetVariable))));
+  assert(count_op(code, tOpMakeArray) == 1);
+  assert(count_op(code, tOpGetArrayElement) == 2);
+})
+
+TEST_CASE(test_scalar_replacement_after_inlining, {
+  /* function divmod(a, b) { return [a / b, a % b]; } */
+  Vector *body = new_vec();
+  emit1(body, tOpSetVariablePop, str("b"));
+  emit1(body, tOpSetVariablePop, str("a"));
+  emit1(body, tOpGetVariable, str("b"));
+  emit1(body, tOpGetVariable, str("a"));
+  emit0(body, tOpDiv);
+  emit1(body, tOpGetVariable, str("b"));
+  emit1(body, tOpGetVariable, str("a"));
+  emit0(body, tOpMod);
+  emit1(body, tOpMakeArray, new_TValue_with_integer(2));
+  emit0(body, tOpReturn);
+
+  Vector *code = new_vec();
+  emit1(code, tOpFunctionDeclare, str("divmod"));
+  vec_push(code, new_TValue_with_integer(body->len));
+  for (int i = 0; i < body->len; i++) {
+    vec_push(code, body->data[i]);
+  }
+  emit_push(code, 7);
+  emit_push(code, 2);
+  emit1(code, tOpCall, str("divmod"));
+  emit1(code, tOpVariableDeclareWithAssign, str("r"));
+  emit_push(code, 1);
+  emit1(code, tOpGetArrayElement, str("r"));
+  emit_push(code, 0);
+  emit1(code, tOpGetArrayElement, str("r"));
+  emit0(code, tOpAdd);
+
+  Vector *optimized = optimize(code, opt_passes_for_level(OPT_LEVEL_MAX));
+  /* the call is inlined and the array it returned is never built */
+  assert(count_op(optimized, tOpCall) == 0);
+  assert(count_op(optimized, tOpMakeArray) == 0);
+  assert(count_op(optimized, tOpGetArrayElement) == 0);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 4);
+
+  optimized = optimize(code, opt_passes_for_level(OPT_LEVEL_MAX) &
+                                 ~OptScalarReplacement);
+  assert(count_op(optimized, tOpMakeArray) == 1);
+})
+
+void escape_test() {
+  test_scalar_replacement();
+  test_scalar_replacement_after_inlining();
+
+  printf("[escape_test] All of tests are passed\n");
+}
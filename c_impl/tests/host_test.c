@@ -0,0 +1,204 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* calls = 0; func add(a, b) { calls = calls + 1; return a + b; } */
+static Vector *program(void) {
+  Vector *body = new_vec();
+  emit1(body, tOpVariableDeclareWithAssign, str("b"));
+  emit1(body, tOpVariableDeclareWithAssign, str("a"));
+  emit1(body, tOpPush, new_TValue_with_integer(1));
+  emit1(body, tOpGetVariable, str("calls"));
+  emit0(body, tOpAdd);
+  emit1(body, tOpSetVariablePop, str("calls"));
+  emit1(body, tOpGetVariable, str("b"));
+  emit1(body, tOpGetVariable, str("a"));
+  emit0(body, tOpAdd);
+  emit0(body, tOpReturn);
+
+  Vector *code = new_vec();
+  emit1(code, tOpPush, new_TValue_with_integer(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("calls"));
+  emit1(code, tOpFunctionDeclare, str("add"));
+  vec_push(code, new_TValue_with_integer(body->len));
+  for (int i = 0; i < body->len; i++) {
+    vec_push(code, body->data[i]);
+  }
+  return code;
+}
+
+TEST_CASE(test_host_invoke, {
+  VM *vm = vm_open();
+  assert(vm_load(vm, program(), OPT_LEVEL_MAX) == VMOk);
+  TValue *add = vm_lookup(vm, "add");
+  assert(add != NULL);
+  assert(vm_lookup(vm, "calls") == NULL);
+  assert(vm_lookup(vm, "missing") == NULL);
+
+  /* past the JIT threshold, the stack stays where it was */
+  for (long long int i = 0; i < 3 * JIT_THRESHOLD; i++) {
+    TValue *args[2];
+    args[0] = new_TValue_with_integer(i);
+    args[1] = new_TValue_with_integer(10);
+    TValue *ret;
+    assert(vm_invoke(vm, add, args, 2, &ret) == VMOk);
+    assert(tv_getLong(ret) == i + 10);
+    assert(vm->stack->len == 0);
+  }
+  TValue *calls = env_get(vm->env, sdsnew("calls"));
+  assert(tv_getLong(calls) == 3 * JIT_THRESHOLD);
+
+  TValue *array = new_TValue_with_array(new_vec());
+  TValue *len;
+  assert(vm_invoke(vm, vm_lookup(vm, "len"), &array, 1, &len) == VMOk);
+  assert(tv_getLong(len) == 0);
+})
+
+/* Errors return to the host, which keeps using the VM */
+TEST_CASE(test_host_errors, {
+  VM *vm = vm_open();
+  assert(vm_load(vm, program(), OPT_LEVEL_MAX) == VMOk);
+  TValue *add = vm_lookup(vm, "add");
+  TValue *args[2];
+  args[0] = new_TValue_with_integer(1);
+  args[1] = new_TValue_with_str(sdsnew("x"));
+  TValue *ret;
+  assert(vm_invoke(vm, add, args, 2, &ret) == VMErrorRuntime);
+  assert(ret == NULL);
+  assert(vm->error != NULL);
+  assert(vm->stack->len == 0);
+
+  TValue *array = new_TValue_with_array(new_vec());
+  assert(vm_invoke(vm, vm_lookup(vm, "min"), &array, 1, NULL) ==
+         VMErrorRuntime);
+  assert(!strcmp(vm->error, "Execute Error min/max of an empty array"));
+
+  args[1] = new_TValue_with_integer(2);
+  assert(vm_invoke(vm, add, args, 2, &ret) == VMOk);
+  assert(tv_getLong(ret) == 3);
+})
+
+static void *run_adds(void *arg) {
+  long long int *sum = arg;
+  vm_register_thread();
+  VM *vm = vm_open();
+  vm_load(vm, program(), OPT_LEVEL_MAX);
+  TValue *add = vm_lookup(vm, "add");
+  for (long long int i = 0; i < 1000; i++) {
+    TValue *args[2];
+    args[0] = new_TValue_with_integer(*sum);
+    args[1] = new_TValue_with_integer(i);
+    TValue *ret;
+    vm_invoke(vm, add, args, 2, &ret);
+    *sum = tv_getLong(ret);
+  }
+  vm_unregister_thread();
+  return NULL;
+}
+
+/* One VM per thread, each past the JIT threshold */
+TEST_CASE(test_host_threads, {
+  pthread_t threads[4];
+  long long int sums[4];
+  for (int i = 0; i < 4; i++) {
+    sums[i] = i;
+    pthread_create(&threads[i], NULL, run_adds, &sums[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    assert(sums[i] == i + 999 * 1000 / 2);
+  }
+})
+
+static void *run_module(void *arg) {
+  Module *module = arg;
+  vm_register_thread();
+  VM *vm = vm_open();
+  assert(vm_load_module(vm, module) == VMOk);
+  TValue *add = vm_lookup(vm, "add");
+  for (long long int i = 0; i < 1000; i++) {
+    TValue *args[2];
+    args[0] = new_TValue_with_integer(i);
+    args[1] = new_TValue_with_integer(i);
+    TValue *ret;
+    assert(vm_invoke(vm, add, args, 2, &ret) == VMOk);
+    assert(tv_getLong(ret) == 2 * i);
+  }
+  assert(tv_getLong(env_get(vm->env, sdsnew("calls"))) == 1000);
+  vm_close(vm);
+  vm_unregister_thread();
+  return NULL;
+}
+
+/* VMs on four threads run one module, each with globals of its own */
+TEST_CASE(test_host_module, {
+  Module *module = module_new(program(), OPT_LEVEL_MAX);
+  assert(module != NULL);
+
+  VM *vm = vm_open();
+  assert(vm_load_module(vm, module) == VMOk);
+  assert(module->refs == 2);
+  Vector *body = tv_getFunction(vm_lookup(vm, "add"))->func_body;
+  Vector *code = module->code;
+  assert(body->data > code->data && body->data < code->data + code->len);
+  vm_close(vm);
+  assert(module->refs == 1);
+
+  pthread_t threads[4];
+  for (int i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, run_module, module);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  assert(module->refs == 1);
+  module_release(module);
+
+  assert(module_load_file("no/such/file.compiled", OPT_LEVEL_MAX) == NULL);
+})
+
+TEST_CASE(test_host_load_file, {
+  VM *vm = vm_open();
+  assert(vm_load_file(vm, "no/such/file.compiled", OPT_LEVEL_MAX) ==
+         VMErrorLoad);
+  assert(vm_lookup(vm, "println") != NULL);
+  assert(vm_load(vm, program(), OPT_LEVEL_MAX) == VMOk);
+})
+
+/* A VM runs one program, the optimizer saw it as the whole program */
+TEST_CASE(test_host_load_once, {
+  VM *vm = vm_open();
+  assert(vm_load(vm, program(), OPT_LEVEL_MAX) == VMOk);
+  assert(vm_load(vm, program(), OPT_LEVEL_MAX) == VMErrorLoad);
+  assert(!strcmp(vm->error, "The VM has loaded a program already"));
+  assert(vm_load_file(vm, "no/such/file.compiled", OPT_LEVEL_MAX) ==
+         VMErrorLoad);
+  assert(!strcmp(vm->error, "The VM has loaded a program already"));
+
+  Module *module = module_new(program(), OPT_LEVEL_MAX);
+  assert(vm_load_module(vm, module) == VMErrorLoad);
+  assert(module->refs == 1);
+  module_release(module);
+
+  TValue *args[2];
+  args[0] = new_TValue_with_integer(1);
+  args[1] = new_TValue_with_integer(2);
+  TValue *ret;
+  assert(vm_invoke(vm, vm_lookup(vm, "add"), args, 2, &ret) == VMOk);
+  assert(tv_getLong(ret) == 3);
+  assert(tv_getLong(env_get(vm->env, sdsnew("calls"))) == 1);
+})
+
+void host_test() {
+  test_host_invoke();
+  test_host_load_file();
+  test_host_load_once();
+  test_host_errors();
+  test_host_threads();
+  test_host_module();
+
+  printf("[host_test] All of tests are passed\n");
+}
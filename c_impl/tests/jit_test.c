@@ -0,0 +1,154 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __ENABLE_JIT__
+
+TEST_CASE(test_jit_arith, {
+  Vector *code = new_vec();
+  emit1(code, tOpPush, new_TValue_with_integer(4));
+  emit1(code, tOpPush, new_TValue_with_integer(10));
+  emit0(code, tOpSub);
+  emit0(code, tOpReturn);
+  emit1(code, tOpPush, new_TValue_with_integer(100));
+
+  VM *vm = new_VM();
+  JITCode native = jit_compile(vm, code);
+  assert(native != NULL);
+  assert(tv_getLong(native(vm)) == 6);
+})
+
+TEST_CASE(test_jit_loop, {
+  /* i = 0; while (i < 10) { i = i + 1 } */
+  Vector *code = new_vec();
+  emit1(code, tOpPush, new_TValue_with_integer(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("i"));
+  emit1(code, tOpPush, new_TValue_with_integer(10)); /* 4 */
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpLtExpression);
+  emit1(code, tOpIFStatement, new_TValue_with_integer(9));
+  emit1(code, tOpPush, new_TValue_with_integer(1));
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpAdd);
+  emit1(code, tOpSetVariablePop, str("i"));
+  emit1(code, tOpJumpAbs, new_TValue_with_integer(3));
+  emit1(code, tOpGetVariable, str("i"));
+
+  VM *vm = new_VM();
+  JITCode native = jit_compile(vm, code);
+  assert(native != NULL);
+  assert(tv_getLong(native(vm)) == 10);
+  assert(tv_equals(vm_execute(new_VM(), code), new_TValue_with_integer(10)));
+})
+
+TEST_CASE(test_jit_threshold, {
+  Vector *body = new_vec();
+  emit1(body, tOpSetVariablePop, str("x"));
+  emit1(body, tOpGetVariable, str("x"));
+  emit1(body, tOpGetVariable, str("x"));
+  emit0(body, tOpMul);
+  emit0(body, tOpReturn);
+
+  VM *vm = new_VM();
+  vm->jit_threshold = 2;
+  VMFunction *func = new_VMFunction(sdsnew("sq"), body, vm->env);
+  env_def(vm->env, sdsnew("sq"), new_TValue_with_func(func));
+
+  for (int i = 1; i <= 4; i++) {
+    vec_push(vm->stack, new_TValue_with_integer(i));
+    assert(tv_getLong(vm_call(vm, sdsnew("sq"))) == i * i);
+    vec_pop(vm->stack);
+    assert((func->jit_code != NULL) == (i > 2));
+  }
+
+  /* functions declaring other functions stay interpreted */
+  Vector *decl = new_vec();
+  emit1(decl, tOpFunctionDeclare, str("f"));
+  vec_push(decl, new_TValue_with_integer(0));
+  assert(jit_compile(vm, decl) == NULL);
+})
+
+TEST_CASE(test_trace_side_exit, {
+  /* s = 0; i = 0;
+   * while (i < 10) { if (i < 5) { s = s + 1 } else { s = s + 100 } i = i + 1 }
+   */
+  Vector *code = new_vec();
+  emit1(code, tOpPush, new_TValue_with_integer(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("s"));
+  emit1(code, tOpPush, new_TValue_with_integer(0));
+  emit1(code, tOpVariableDeclareWithAssign, str("i"));
+  emit1(code, tOpPush, new_TValue_with_integer(10)); /* 8 */
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpLtExpression);
+  emit1(code, tOpIFStatement, new_TValue_with_integer(32));
+  emit1(code, tOpPush, new_TValue_with_integer(5));
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpLtExpression);
+  emit1(code, tOpIFStatement, new_TValue_with_integer(9));
+  emit1(code, tOpPush, new_TValue_with_integer(1));
+  emit1(code, tOpGetVariable, str("s"));
+  emit0(code, tOpAdd);
+  emit1(code, tOpSetVariablePop, str("s"));
+  emit1(code, tOpJumpRel, new_TValue_with_integer(7));
+  emit1(code, tOpPush, new_TValue_with_integer(100)); /* 31 */
+  emit1(code, tOpGetVariable, str("s"));
+  emit0(code, tOpAdd);
+  emit1(code, tOpSetVariablePop, str("s"));
+  emit1(code, tOpPush, new_TValue_with_integer(1)); /* 38 */
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpAdd);
+  emit1(code, tOpSetVariablePop, str("i"));
+  emit1(code, tOpJumpAbs, new_TValue_with_integer(7));
+  emit1(code, tOpGetVariable, str("s"));
+
+  for (int threshold = -1; threshold <= 6; threshold++) {
+    VM *vm = new_VM();
+    vm->trace_threshold = threshold;
+    assert(tv_getLong(vm_execute(vm, code)) == 505);
+    assert((vm->loops != NULL) == (threshold >= 0));
+    assert((vm->native != NULL) == (threshold >= 0));
+  }
+})
+
+/* Closing a VM unmaps its functions and traces */
+TEST_CASE(test_jit_release, {
+  Vector *body = new_vec();
+  emit1(body, tOpPush, new_TValue_with_integer(1));
+  emit0(body, tOpReturn);
+
+  long long int before = 0;
+  for (int i = 0; i < 200; i++) {
+    VM *vm = vm_open();
+    vm->jit_threshold = 0;
+    vm->trace_threshold = 0;
+    VMFunction *func = new_VMFunction(sdsnew("one"), body, vm->env);
+    env_def(vm->env, sdsnew("one"), new_TValue_with_func(func));
+    assert(tv_getLong(vm_call(vm, sdsnew("one"))) == 1);
+    assert(func->jit_code != NULL);
+    assert(vm->native->len == 1);
+    vm_close(vm);
+    assert(vm->native == NULL);
+    if (i == 0) {
+      before = native_bytes();
+    }
+  }
+  assert(native_bytes() <= before);
+})
+
+void jit_test() {
+  test_jit_arith();
+  test_jit_loop();
+  test_jit_threshold();
+  test_trace_side_exit();
+  test_jit_release();
+
+  printf("[jit_test] All of tests are passed\n");
+}
+
+#else
+
+void jit_test() { printf("[jit_test] JIT is disabled on this platform\n"); }
+
+#endif
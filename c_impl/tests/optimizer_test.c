@@ -0,0 +1,219 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+static void emit_function(Vector *code, char *name, Vector *body) {
+  emit1(code, tOpFunctionDeclare, new_TValue_with_str(sdsnew(name)));
+  vec_push(code, new_TValue_with_integer(body->len));
+  for (int i = 0; i < body->len; i++) {
+    vec_push(code, body->data[i]);
+  }
+}
+
+TEST_CASE(test_decode_encode, {
+  Vector *code = new_vec();
+  emit_push(code, 1);
+  emit1(code, tOpJumpRel, new_TValue_with_integer(2));
+  emit_push(code, 2);
+  emit0(code, tOpAdd);
+
+  Vector *insts = code_decode(code);
+  assert(insts->len == 4);
+  assert(((Inst *)insts->data[1])->target == insts->data[3]);
+
+  Vector *encoded = code_encode(insts);
+  assert(encoded->len == code->len);
+  assert(tv_getLong(encoded->data[3]) == 2);
+
+  /* a branch into an operand slot is rejected */
+  Vector *bad = new_vec();
+  emit1(bad, tOpJumpRel, new_TValue_with_integer(-1));
+  emit_push(bad, 1);
+  assert(code_decode(bad) == NULL);
+})
+
+TEST_CASE(test_constant_folding, {
+  Vector *code = new_vec();
+  /* (1 + 2) * 3, operands are pushed right to left */
+  emit_push(code, 2);
+  emit_push(code, 1);
+  emit0(code, tOpAdd);
+  emit_push(code, 3);
+  emit0(code, tOpMul);
+
+  Vector *optimized = optimize(code, OptConstantFolding);
+  assert(optimized->len == 2);
+  assert(tv_getLong(optimized->data[1]) == 9);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 9);
+
+  /* division by zero stays a runtime error */
+  code = new_vec();
+  emit_push(code, 0);
+  emit_push(code, 1);
+  emit0(code, tOpDiv);
+  assert(optimize(code, OptConstantFolding)->len == code->len);
+})
+
+TEST_CASE(test_nop_and_push_pop, {
+  Vector *code = new_vec();
+  emit0(code, tOpNop);
+  emit_push(code, 1);
+  emit0(code, tOpNop);
+  emit_push(code, 7);
+  emit0(code, tOpPop);
+
+  Vector *optimized = optimize(code, OptNopElimination);
+  assert(count_op(optimized, tOpNop) == 0);
+  assert(count_op(optimized, tOpPush) == 2);
+
+  optimized = optimize(code, OptNopElimination | OptConstantFolding);
+  assert(optimized->len == 2);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 1);
+})
+
+TEST_CASE(test_jump_threading, {
+  Vector *code = new_vec();
+  /* 0: jump -> 4: jump -> 8 */
+  emit1(code, tOpJumpRel, new_TValue_with_integer(2));
+  emit_push(code, 1);
+  emit1(code, tOpJumpRel, new_TValue_with_integer(2));
+  emit_push(code, 2);
+  emit_push(code, 3);
+
+  Vector *insts = code_decode(optimize(code, OptJumpThreading));
+  Inst *first = insts->data[0];
+  assert(first->op == tOpJumpRel);
+  assert(first->target == insts->data[insts->len - 1]);
+
+  /* with dead code elimination only the last push survives */
+  Vector *optimized =
+      optimize(code, OptJumpThreading | OptDeadCodeElimination);
+  assert(optimized->len == 2);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 3);
+})
+
+TEST_CASE(test_dead_code_in_function, {
+  Vector *body = new_vec();
+  emit1(body, tOpSetVariablePop, new_TValue_with_str(sdsnew("x")));
+  emit1(body, tOpGetVariable, new_TValue_with_str(sdsnew("x")));
+  emit0(body, tOpReturn);
+  emit_push(body, 100);
+  emit0(body, tOpReturn);
+
+  Vector *code = new_vec();
+  emit_function(code, "id", body);
+  emit_push(code, 42);
+  emit1(code, tOpCall, new_TValue_with_str(sdsnew("id")));
+
+  Vector *optimized = optimize(code, OptDeadCodeElimination);
+  assert(optimized->len == code->len - 3);
+  assert(tv_getLong(optimized->data[2]) == body->len - 3);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 42);
+})
+
+TEST_CASE(test_constant_condition, {
+  Vector *code = new_vec();
+  /* if (false) { push 1 } push 2 */
+  emit1(code, tOpPush, new_TValue_with_bool(false));
+  emit1(code, tOpIFStatement, new_TValue_with_integer(2));
+  emit_push(code, 1);
+  emit_push(code, 2);
+
+  Vector *optimized = optimize(code, opt_passes_for_level(OPT_LEVEL_MAX));
+  assert(optimized->len == 2);
+  assert(tv_getLong(optimized->data[1]) == 2);
+})
+
+TEST_CASE(test_inlining, {
+  /* function sq(x) { return x * x; } */
+  Vector *sq = new_vec();
+  emit1(sq, tOpSetVariablePop, new_TValue_with_str(sdsnew("x")));
+  emit1(sq, tOpGetVariable, new_TValue_with_str(sdsnew("x")));
+  emit1(sq, tOpGetVariable, new_TValue_with_str(sdsnew("x")));
+  emit0(sq, tOpMul);
+  emit0(sq, tOpReturn);
+
+  /* function loop(n) { return loop(n); } */
+  Vector *loop = new_vec();
+  emit1(loop, tOpCall, new_TValue_with_str(sdsnew("loop")));
+  emit0(loop, tOpReturn);
+
+  Vector *code = new_vec();
+  emit_function(code, "sq", sq);
+  emit_function(code, "loop", loop);
+  emit_push(code, 3);
+  emit1(code, tOpCall, new_TValue_with_str(sdsnew("sq")));
+  emit1(code, tOpCall, new_TValue_with_str(sdsnew("sq")));
+
+  Vector *optimized = optimize(code, opt_passes_for_level(OPT_LEVEL_MAX));
+  /* only the recursive call inside loop is left */
+  assert(count_op(optimized, tOpCall) == 0);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 81);
+
+  Vector *insts = code_decode(optimized);
+  Inst *decl = insts->data[1];
+  assert(((Inst *)decl->body->data[0])->op == tOpCall);
+
+  /* a body writing a global keeps its call */
+  Vector *setter = new_vec();
+  emit1(setter, tOpSetVariablePop, new_TValue_with_str(sdsnew("g")));
+  code = new_vec();
+  emit_push(code, 1);
+  emit1(code, tOpVariableDeclareWithAssign,
+        new_TValue_with_str(sdsnew("g")));
+  emit_function(code, "set_g", setter);
+  emit_push(code, 2);
+  emit1(code, tOpCall, new_TValue_with_str(sdsnew("set_g")));
+  assert(count_op(optimize(code, OptInlining), tOpCall) == 1);
+})
+
+/**
+ * x = 100; function h() { return x; }
+ * function f() { var x = 7; function g() { return h(); } return g(); }
+ * f();
+ */
+TEST_CASE(test_inlining_nested_scopes, {
+  Vector *h = new_vec();
+  emit1(h, tOpGetVariable, new_TValue_with_str(sdsnew("x")));
+  emit0(h, tOpReturn);
+
+  Vector *g = new_vec();
+  emit1(g, tOpCall, new_TValue_with_str(sdsnew("h")));
+  emit0(g, tOpReturn);
+
+  Vector *f = new_vec();
+  emit_push(f, 7);
+  emit1(f, tOpVariableDeclareWithAssign, new_TValue_with_str(sdsnew("x")));
+  emit_function(f, "g", g);
+  emit1(f, tOpCall, new_TValue_with_str(sdsnew("g")));
+  emit0(f, tOpReturn);
+
+  Vector *code = new_vec();
+  emit_push(code, 100);
+  emit1(code, tOpVariableDeclareWithAssign,
+        new_TValue_with_str(sdsnew("x")));
+  emit_function(code, "h", h);
+  emit_function(code, "f", f);
+  emit1(code, tOpCall, new_TValue_with_str(sdsnew("f")));
+
+  /* h's x is the global one, not the x of f around g */
+  for (int level = 0; level <= OPT_LEVEL_MAX; level++) {
+    Vector *optimized = optimize(code, opt_passes_for_level(level));
+    assert(tv_getLong(vm_execute(new_VM(), optimized)) == 100);
+  }
+})
+
+void optimizer_test() {
+  test_decode_encode();
+  test_constant_folding();
+  test_nop_and_push_pop();
+  test_jump_threading();
+  test_dead_code_in_function();
+  test_constant_condition();
+  test_inlining();
+  test_inlining_nested_scopes();
+
+  printf("[optimizer_test] All of tests are passed\n");
+}
@@ -0,0 +1,115 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+static void declare(Vector *code, char *name, Vector *body) {
+  emit1(code, tOpFunctionDeclare, str(name));
+  vec_push(code, new_TValue_with_integer(body->len));
+  for (int i = 0; i < body->len; i++) {
+    vec_push(code, body->data[i]);
+  }
+}
+
+/* func sq(x) { return x * x; } func add(a, b) { return a + b; } */
+static VM *program(void) {
+  Vector *sq = new_vec();
+  emit1(sq, tOpVariableDeclareWithAssign, str("x"));
+  emit1(sq, tOpGetVariable, str("x"));
+  emit1(sq, tOpGetVariable, str("x"));
+  emit0(sq, tOpMul);
+  emit0(sq, tOpReturn);
+
+  Vector *add = new_vec();
+  emit1(add, tOpVariableDeclareWithAssign, str("b"));
+  emit1(add, tOpVariableDeclareWithAssign, str("a"));
+  emit1(add, tOpGetVariable, str("b"));
+  emit1(add, tOpGetVariable, str("a"));
+  emit0(add, tOpAdd);
+  emit0(add, tOpReturn);
+
+  Vector *code = new_vec();
+  declare(code, "sq", sq);
+  declare(code, "add", add);
+
+  VM *vm = vm_open();
+  vm->workers = 4;
+  assert(vm_load(vm, code, OPT_LEVEL_MAX) == VMOk);
+  return vm;
+}
+
+static TValue *longs(long long int n) {
+  Vector *xs = new_vec();
+  for (long long int i = 0; i < n; i++) {
+    vec_push(xs, new_TValue_with_integer(i));
+  }
+  return new_TValue_with_array(xs);
+}
+
+static long long int lens[] = {0, 1, 100, 5000};
+
+/* Below the grain on the caller, above it on four threads */
+TEST_CASE(test_parallel_map_reduce, {
+  VM *vm = program();
+  for (int t = 0; t < 4; t++) {
+    long long int n = lens[t];
+    TValue *args[3];
+    args[0] = vm_lookup(vm, "sq");
+    args[1] = longs(n);
+    TValue *squares;
+    assert(vm_invoke(vm, vm_lookup(vm, "parallel_map"), args, 2, &squares) ==
+           VMOk);
+    TArray *array = tv_getTArray(squares);
+    assert(array->len == n);
+    long long int sum = 0;
+    for (long long int i = 0; i < n; i++) {
+      assert(tv_getLong(ta_get(array, i)) == i * i);
+      sum += i * i;
+    }
+
+    args[0] = vm_lookup(vm, "add");
+    args[1] = squares;
+    args[2] = new_TValue_with_integer(7);
+    TValue *ret;
+    assert(vm_invoke(vm, vm_lookup(vm, "parallel_reduce"), args, 3, &ret) ==
+           VMOk);
+    assert(tv_getLong(ret) == sum + 7);
+  }
+
+  /* natives work too */
+  TValue *args[2];
+  args[0] = vm_lookup(vm, "len");
+  Vector *arrays = new_vec();
+  vec_push(arrays, longs(3));
+  args[1] = new_TValue_with_array(arrays);
+  TValue *lens_of;
+  assert(vm_invoke(vm, vm_lookup(vm, "parallel_map"), args, 2, &lens_of) ==
+         VMOk);
+  assert(tv_getLong(ta_get(tv_getTArray(lens_of), 0)) == 3);
+})
+
+/* An error on a worker comes back to the caller */
+TEST_CASE(test_parallel_errors, {
+  VM *vm = program();
+  TValue *xs = longs(5000);
+  ta_set(tv_getTArray(xs), 4000, str("x"));
+  TValue *args[2];
+  args[0] = vm_lookup(vm, "sq");
+  args[1] = xs;
+  assert(vm_invoke(vm, vm_lookup(vm, "parallel_map"), args, 2, NULL) ==
+         VMErrorRuntime);
+  assert(vm->error != NULL);
+
+  args[0] = new_TValue_with_integer(1);
+  args[1] = longs(3);
+  assert(vm_invoke(vm, vm_lookup(vm, "parallel_map"), args, 2, NULL) ==
+         VMErrorRuntime);
+})
+
+void parallel_test() {
+  test_parallel_map_reduce();
+  test_parallel_errors();
+
+  printf("[parallel_test] All of tests are passed\n");
+}
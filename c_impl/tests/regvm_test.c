@@ -0,0 +1,91 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+static TValue *run(Vector *code) {
+  VM *vm = new_VM();
+  vm->engine = EngineRegister;
+  vm->jit_threshold = -1;
+  vm->trace_threshold = -1;
+  return vm_run(vm, code);
+}
+
+TEST_CASE(test_reg_loop, {
+  /* s = 0; i = 0; while (i < 10) { s = i + s; i = 1 + i; } */
+  Vector *code = new_vec();
+  emit_push(code, 0);
+  emit1(code, tOpVariableDeclareWithAssign, str("s"));
+  emit_push(code, 0);
+  emit1(code, tOpVariableDeclareWithAssign, str("i"));
+  emit_push(code, 10);
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpLtExpression);
+  emit1(code, tOpIFStatement, new_TValue_with_integer(16));
+  emit1(code, tOpGetVariable, str("s"));
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpAdd);
+  emit1(code, tOpSetVariablePop, str("s"));
+  emit_push(code, 1);
+  emit1(code, tOpGetVariable, str("i"));
+  emit0(code, tOpAdd);
+  emit1(code, tOpSetVariablePop, str("i"));
+  emit1(code, tOpJumpAbs, new_TValue_with_integer(7));
+  emit1(code, tOpGetVariable, str("s"));
+
+  RegCode *reg_code = reg_translate(code);
+  assert(reg_code != NULL);
+  assert(reg_code->len < reg_code->stack_len);
+  assert(tv_getLong(run(code)) == 45);
+  assert(tv_getLong(vm_execute(new_VM(), code)) == 45);
+})
+
+TEST_CASE(test_reg_values_across_blocks, {
+  /* 5 + (cond ? 10 : 20), the 5 stays on the stack over the branch */
+  for (int cond = 0; cond < 2; cond++) {
+    Vector *code = new_vec();
+    emit_push(code, 5);
+    emit1(code, tOpPush, new_TValue_with_bool(cond));
+    emit1(code, tOpIFStatement, new_TValue_with_integer(4));
+    emit_push(code, 10);
+    emit1(code, tOpJumpRel, new_TValue_with_integer(2));
+    emit_push(code, 20);
+    emit0(code, tOpAdd);
+    assert(tv_getLong(run(code)) == (cond ? 15 : 25));
+  }
+})
+
+TEST_CASE(test_reg_call, {
+  /* twice pops its argument from the caller's stack */
+  Vector *body = new_vec();
+  emit_push(body, 2);
+  emit0(body, tOpMul);
+  emit0(body, tOpReturn);
+
+  Vector *code = new_vec();
+  emit1(code, tOpFunctionDeclare, str("twice"));
+  vec_push(code, new_TValue_with_integer(body->len));
+  for (int i = 0; i < body->len; i++) {
+    vec_push(code, body->data[i]);
+  }
+  emit_push(code, 3);
+  emit_push(code, 21);
+  emit1(code, tOpCall, str("twice"));
+  emit0(code, tOpAdd);
+  assert(tv_getLong(run(code)) == 45);
+
+  /* a branch into an operand slot is rejected */
+  Vector *bad = new_vec();
+  emit1(bad, tOpJumpRel, new_TValue_with_integer(-1));
+  emit_push(bad, 1);
+  assert(reg_translate(bad) == NULL);
+})
+
+void regvm_test() {
+  test_reg_loop();
+  test_reg_values_across_blocks();
+  test_reg_call();
+
+  printf("[regvm_test] All of tests are passed\n");
+}
@@ -0,0 +1,286 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef struct {
+  Server *server;
+  int fd;
+} Session;
+
+static void *serve(void *arg) {
+  Session *session = arg;
+  server_session(session->server, session->fd);
+  return NULL;
+}
+
+/* Serialized words of `println(name)` */
+static Vector *print_variable(char *name) {
+  Vector *words = new_vec();
+  vec_pushi(words, tOpGetVariable);
+  vec_pushi(words, String);
+  vec_pushi(words, strlen(name));
+  for (size_t i = 0; i < strlen(name); i++) {
+    vec_pushi(words, name[i]);
+  }
+  vec_pushi(words, tOpPrintln);
+  return words;
+}
+
+/* Serialized `i = 0; while (i < n) { i = i + 1 } println(i)` */
+static Vector *count_to(long long int n) {
+  long long int words[] = {
+      tOpPush, Long, 0, tOpVariableDeclareWithAssign, String, 1, 'i',
+      tOpPush, Long, n, tOpGetVariable, String, 1, 'i', tOpLtExpression,
+      tOpIFStatement, Long, 9, tOpPush, Long, 1, tOpGetVariable, String, 1,
+      'i', tOpAdd, tOpSetVariablePop, String, 1, 'i', tOpJumpAbs, Long, 3,
+      tOpGetVariable, String, 1, 'i', tOpPrintln,
+  };
+  Vector *v = new_vec();
+  for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+    vec_push(v, (void *)words[i]);
+  }
+  return v;
+}
+
+static sds bytes_of(Vector *words) {
+  sds bytes = sdsempty();
+  for (long long int i = 0; i < words->len; i++) {
+    long long int word = (long long int)words->data[i];
+    bytes = sdscatlen(bytes, &word, sizeof(word));
+  }
+  return bytes;
+}
+
+static void write_file(char *path, sds bytes) {
+  FILE *fp = fopen(path, "wb");
+  fwrite(bytes, 1, sdslen(bytes), fp);
+  fclose(fp);
+}
+
+/* Send a request and read the answer, its header line and its output */
+static sds request(int fd, FILE *in, sds req, sds *output) {
+  assert(write(fd, req, sdslen(req)) == (ssize_t)sdslen(req));
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len = getline(&line, &cap, in);
+  assert(len > 0 && line[len - 1] == '\n');
+  sds header = sdsnewlen(line, len - 1);
+  free(line);
+
+  size_t size = strtoull(strchr(header, ' ') + 1, NULL, 10);
+  char *buf = xmalloc(size + 1);
+  assert(fread(buf, 1, size, in) == size);
+  *output = sdsnewlen(buf, size);
+  return header;
+}
+
+static Server *server(void) {
+  BatchConfig config = {
+      .opt_level = OPT_LEVEL_MAX,
+      .jit_threshold = JIT_THRESHOLD,
+      .trace_threshold = TRACE_THRESHOLD,
+      .engine = EngineStack,
+      .dispatch = DispatchGoto,
+      .workers = 0,
+  };
+  return server_new(&config);
+}
+
+/* A session of server on a thread, returns the client's end */
+static int connect_to(Server *server, Session *session, pthread_t *thread) {
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  session->server = server;
+  session->fd = fds[1];
+  pthread_create(thread, NULL, serve, session);
+  return fds[0];
+}
+
+TEST_CASE(test_server_session, {
+  Session session;
+  pthread_t thread;
+  int fd = connect_to(server(), &session, &thread);
+  FILE *in = fdopen(fd, "r");
+
+  char path[] = "/tmp/tinyvm_server_testXXXXXX";
+  close(mkstemp(path));
+  write_file(path, bytes_of(print_variable("args")));
+  sds run = sdscatprintf(sdsempty(), "RUN %s 1 x\n", path);
+  sds output;
+  for (int i = 0; i < 2; i++) {
+    assert(!strcmp(request(fd, in, run, &output), "OK 7"));
+    assert(!strcmp(output, "[1, x]\n"));
+  }
+
+  /* a changed file is loaded again */
+  write_file(path, bytes_of(print_variable("missing")));
+  sds header = request(fd, in, run, &output);
+  assert(!strncmp(header, "ERROR 0 ", 8));
+  unlink(path);
+  header = request(fd, in, run, &output);
+  assert(!strcmp(header, "ERROR 0 The program can not be loaded"));
+
+  sds program = bytes_of(print_variable("args"));
+  sds exec = sdscatprintf(sdsempty(), "EXEC %zu\n", sdslen(program));
+  exec = sdscatlen(exec, program, sdslen(program));
+  assert(!strcmp(request(fd, in, exec, &output), "OK 3"));
+  assert(!strcmp(output, "[]\n"));
+
+  header = request(fd, in, sdsnew("HELLO there\n"), &output);
+  assert(!strcmp(header, "ERROR 0 Bad request"));
+  header = request(fd, in, sdsnew("CALL println 1\n"), &output);
+  assert(!strcmp(header, "ERROR 0 Bad request"));
+
+  /* the session ends with the connection */
+  fclose(in);
+  pthread_join(thread, NULL);
+})
+
+/* The program a forking server runs once, whose functions CALL calls */
+TEST_CASE(test_server_preload, {
+  Server *s = server();
+  assert(server_preload(s, "no/such/file.compiled") == VMErrorLoad);
+  char path[] = "/tmp/tinyvm_server_testXXXXXX";
+  close(mkstemp(path));
+  assert(server_preload(s, path) == VMOk);
+  unlink(path);
+
+  Session session;
+  pthread_t thread;
+  int fd = connect_to(s, &session, &thread);
+  FILE *in = fdopen(fd, "r");
+  sds output;
+  sds header = request(fd, in, sdsnew("CALL println hello\n"), &output);
+  assert(!strcmp(header, "OK 6"));
+  assert(!strcmp(output, "hello\n"));
+  header = request(fd, in, sdsnew("CALL channel 4\n"), &output);
+  assert(!strncmp(header, "OK ", 3));
+  sds close = sdscatprintf(sdsempty(), "CALL close %s", output);
+  assert(!strcmp(request(fd, in, close, &output), "OK 0"));
+  header = request(fd, in, sdsnew("CALL missing 1\n"), &output);
+  assert(!strcmp(header, "ERROR 0 No such a function"));
+  header = request(fd, in, sdsnew("CALL len 1\n"), &output);
+  assert(!strncmp(header, "ERROR 0 ", 8));
+  fclose(in);
+  pthread_join(thread, NULL);
+})
+
+/* Every request runs on a fresh VM, whose native code goes with it */
+TEST_CASE(test_server_native, {
+  Session session;
+  pthread_t thread;
+  int fd = connect_to(server(), &session, &thread);
+  FILE *in = fdopen(fd, "r");
+
+  sds program = bytes_of(count_to(1000));
+  sds exec = sdscatprintf(sdsempty(), "EXEC %zu\n", sdslen(program));
+  exec = sdscatlen(exec, program, sdslen(program));
+  long long int before = 0;
+  for (int i = 0; i < 100; i++) {
+    sds output;
+    assert(!strcmp(request(fd, in, exec, &output), "OK 5"));
+    assert(!strcmp(output, "1000\n"));
+    if (i == 0) {
+      before = native_bytes();
+    }
+  }
+  assert(native_bytes() <= before);
+  fclose(in);
+  pthread_join(thread, NULL);
+})
+
+/* A paused collector runs again as soon as a loop finds the heap full */
+TEST_CASE(test_server_heap_limit, {
+  char *buf = NULL;
+  size_t len = 0;
+  VM *vm = vm_open();
+  vm->out = open_memstream(&buf, &len);
+  vm_pause_collection(0);
+  assert(vm_heap_limit == 0);
+  assert(vm_load(vm, deserialize(count_to(10)), 0) == VMOk);
+  assert(vm_heap_limit == -1);
+  vm_close(vm);
+  fclose(vm->out);
+  assert(!strcmp(buf, "10\n"));
+  free(buf);
+})
+
+/* A connection to the socket at path, waiting for it to be listened on */
+static int connect_path(char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  for (int i = 0; i < 500; i++) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+    close(fd);
+    usleep(10000);
+  }
+  assert(false);
+  return -1;
+}
+
+/* A forked child hangs up after its share of requests, the next one serves */
+TEST_CASE(test_server_fork_limit, {
+  char path[] = "/tmp/tinyvm_server_testXXXXXX";
+  close(mkstemp(path));
+  unlink(path);
+  fflush(stdout);
+  pid_t pid = fork();
+  assert(pid >= 0);
+  if (pid == 0) {
+    setpgid(0, 0);
+    char program[] = "/tmp/tinyvm_server_testXXXXXX";
+    close(mkstemp(program));
+    Server *s = server();
+    server_preload(s, program);
+    unlink(program);
+    server_fork(s, path, 1);
+    _exit(EXIT_FAILURE);
+  }
+  setpgid(pid, pid);
+
+  int fd = connect_path(path);
+  FILE *in = fdopen(fd, "r");
+  sds output;
+  for (long long int i = 0; i < SERVER_CHILD_REQUESTS; i++) {
+    sds header = request(fd, in, sdsnew("CALL println 1\n"), &output);
+    assert(!strcmp(header, "OK 2"));
+  }
+  assert(fgetc(in) == EOF);
+  fclose(in);
+
+  fd = connect_path(path);
+  in = fdopen(fd, "r");
+  assert(!strcmp(request(fd, in, sdsnew("CALL println 2\n"), &output),
+                 "OK 2"));
+  assert(!strcmp(output, "2\n"));
+  fclose(in);
+
+  kill(-pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  unlink(path);
+})
+
+void server_test() {
+  test_server_session();
+  test_server_preload();
+  test_server_native();
+  test_server_heap_limit();
+  test_server_fork_limit();
+
+  printf("[server_test] All of tests are passed\n");
+}
@@ -0,0 +1,235 @@
+#include "tests.h"
+#include "tinyvm.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+/**
+ * s = 0; for (i = 0; i < n - 1; i = i + 1) { s = i + s; } with n = 10.
+ * store_n adds an `n = n` to the body, so that n is no longer invariant.
+ */
+static Vector *sum_loop(bool store_n) {
+  Vector *insts = new_vec();
+  emit(insts, tOpPush, new_TValue_with_integer(10));
+  emit(insts, tOpVariableDeclareWithAssign, str("n"));
+  emit(insts, tOpPush, new_TValue_with_integer(0));
+  emit(insts, tOpVariableDeclareWithAssign, str("i"));
+  emit(insts, tOpPush, new_TValue_with_integer(0));
+  emit(insts, tOpVariableDeclareWithAssign, str("s"));
+
+  Inst *header = emit(insts, tOpPush, new_TValue_with_integer(1));
+  emit(insts, tOpGetVariable, str("n"));
+  emit(insts, tOpSub, NULL);
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpLtExpression, NULL);
+  Inst *cond = emit(insts, tOpIFStatement, NULL);
+
+  emit(insts, tOpGetVariable, str("s"));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpAdd, NULL);
+  emit(insts, tOpSetVariablePop, str("s"));
+  emit(insts, tOpPush, new_TValue_with_integer(1));
+  emit(insts, tOpGetVariable, str("i"));
+  emit(insts, tOpAdd, NULL);
+  emit(insts, tOpSetVariablePop, str("i"));
+  if (store_n) {
+    emit(insts, tOpGetVariable, str("n"));
+    emit(insts, tOpSetVariablePop, str("n"));
+  }
+  emit(insts, tOpJumpRel, NULL)->target = header;
+
+  cond->target = emit(insts, tOpGetVariable, str("s"));
+  return code_encode(insts);
+}
+
+TEST_CASE(test_type_inference, {
+  Vector *insts = code_decode(sum_loop(false));
+  SSAFunction *f = ssa_build(insts, true);
+  ssa_infer_types(f);
+
+  /* the header joins the entry with the back edge */
+  assert(f->blocks->len == 4);
+  BasicBlock *header = f->blocks->data[1];
+  assert(header->preds->len == 2);
+  for (int i = 0; i < insts->len; i++) {
+    Opcode op = ((Inst *)insts->data[i])->op;
+    if (op == tOpAdd || op == tOpSub) {
+      assert(f->nodes[i]->types == TYPE_OF(Long));
+    } else if (op == tOpLtExpression) {
+      assert(f->nodes[i]->args[0]->types == TYPE_OF(Long));
+      assert(f->nodes[i]->types == TYPE_OF(Bool));
+    }
+  }
+
+  /* a call may change any variable */
+  Vector *code = new_vec();
+  vec_pushi(code, tOpPush);
+  vec_push(code, new_TValue_with_integer(1));
+  vec_pushi(code, tOpVariableDeclareWithAssign);
+  vec_push(code, str("x"));
+  vec_pushi(code, tOpCall);
+  vec_push(code, str("f"));
+  vec_pushi(code, tOpGetVariable);
+  vec_push(code, str("x"));
+  f = ssa_build(code_decode(code), true);
+  ssa_infer_types(f);
+  assert(f->nodes[3]->types == TYPE_ANY);
+})
+
+TEST_CASE(test_type_specialization, {
+  Vector *code = sum_loop(false);
+  Vector *optimized = optimize(code, OptTypeSpecialization);
+  assert(count_op(optimized, tOpAdd) == 0);
+  assert(count_op(optimized, tOpAddLong) == 2);
+  assert(count_op(optimized, tOpSubLong) == 1);
+  assert(count_op(optimized, tOpLtLong) == 1);
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 36);
+
+  /* strings keep the checked opcode */
+  code = new_vec();
+  vec_pushi(code, tOpPush);
+  vec_push(code, str("a"));
+  vec_pushi(code, tOpPush);
+  vec_push(code, new_TValue_with_integer(1));
+  vec_pushi(code, tOpAdd);
+  assert(count_op(optimize(code, OptTypeSpecialization), tOpAdd) == 1);
+})
+
+TEST_CASE(test_loop_invariant_code_motion, {
+  Vector *optimized = optimize(sum_loop(false), OptLoopInvariantCodeMotion);
+  Vector *insts = code_decode(optimized);
+  assert(count_op(optimized, tOpSub) == 1);
+
+  /* n - 1 is computed once before the loop */
+  long long int sub = -1;
+  long long int jump = -1;
+  for (int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    if (inst->op == tOpSub) {
+      sub = i;
+    } else if (inst->op == tOpJumpRel) {
+      jump = i;
+    }
+  }
+  Inst *header = ((Inst *)insts->data[jump])->target;
+  assert(sub < header->idx);
+  assert(header->op == tOpGetVariable);
+  assert(!strncmp(tv_getString(header->operand), "$licm.", 6));
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 36);
+
+  /* n is stored in the loop */
+  optimized = optimize(sum_loop(true), OptLoopInvariantCodeMotion);
+  insts = code_decode(optimized);
+  for (int i = 0; i < insts->len; i++) {
+    Inst *inst = insts->data[i];
+    assert(inst->op != tOpVariableDeclareWithAssign ||
+           strncmp(tv_getString(inst->operand), "$licm.", 6));
+  }
+  assert(tv_getLong(vm_execute(new_VM(), optimized)) == 36);
+})
+
+/* Append func name(a) { body } */
+static void declare(Vector *insts, char *name, Vector *body) {
+  Inst *decl = emit(insts, tOpFunctionDeclare, str(name));
+  decl->body = new_vec();
+  emit(decl->body, tOpVariableDeclareWithAssign, str("a"));
+  for (long long int i = 0; i < body->len; i++) {
+    vec_push(decl->body, body->data[i]);
+  }
+}
+
+/* spawn(name, 0) */
+static void spawn(Vector *insts, char *name) {
+  emit(insts, tOpGetVariable, str(name));
+  emit(insts, tOpPush, num(0));
+  emit(insts, tOpCall, str("spawn"));
+  emit(insts, tOpPop, NULL);
+}
+
+/**
+ * func main(a) { func other(a) { x = value; } spawn(other, 0); x = init;
+ *                loop }
+ * spawn(main, 0); run_tasks();
+ * run at level, returns the status and stores what it printed to *output.
+ */
+static int run_main(TValue *init, TValue *value, Vector *loop, int level,
+                    char **output) {
+  Vector *other = new_vec();
+  emit(other, tOpPush, value);
+  emit(other, tOpSetVariablePop, str("x"));
+
+  Vector *main = new_vec();
+  declare(main, "other", other);
+  spawn(main, "other");
+  emit(main, tOpPush, init);
+  emit(main, tOpVariableDeclareWithAssign, str("x"));
+  for (long long int i = 0; i < loop->len; i++) {
+    vec_push(main, loop->data[i]);
+  }
+
+  Vector *insts = new_vec();
+  declare(insts, "main", main);
+  spawn(insts, "main");
+  emit(insts, tOpCall, str("run_tasks"));
+  emit(insts, tOpPop, NULL);
+
+  size_t len;
+  VM *vm = vm_open();
+  vm->out = open_memstream(output, &len);
+  int status = vm_load(vm, code_encode(insts), level);
+  fclose(vm->out);
+  return status;
+}
+
+/* Tasks write the locals a closure captured while a loop is preempted */
+TEST_CASE(test_captured_locals, {
+  for (int level = 0; level <= OPT_LEVEL_MAX; level++) {
+    /* while (x == 0) {} println("released"); */
+    Vector *wait = new_vec();
+    Inst *header = emit(wait, tOpPush, num(0));
+    emit(wait, tOpGetVariable, str("x"));
+    emit(wait, tOpEqualExpression, NULL);
+    Inst *cond = emit(wait, tOpIFStatement, NULL);
+    emit(wait, tOpJumpRel, NULL)->target = header;
+    cond->target = emit(wait, tOpPush, str("released"));
+    emit(wait, tOpPrintln, NULL);
+
+    char *output;
+    assert(run_main(num(0), num(1), wait, level, &output) == VMOk);
+    assert(!strcmp(output, "released\n"));
+
+    /* for (i = 0; i < 3 * TASK_SLICE; i = i + 1) { x = x + 1; } println(x);
+     * raises once x is a String */
+    Vector *count = new_vec();
+    emit(count, tOpPush, num(0));
+    emit(count, tOpVariableDeclareWithAssign, str("i"));
+    header = emit(count, tOpPush, num(3 * TASK_SLICE));
+    emit(count, tOpGetVariable, str("i"));
+    emit(count, tOpLtExpression, NULL);
+    cond = emit(count, tOpIFStatement, NULL);
+    emit(count, tOpPush, num(1));
+    emit(count, tOpGetVariable, str("x"));
+    emit(count, tOpAdd, NULL);
+    emit(count, tOpSetVariablePop, str("x"));
+    emit(count, tOpPush, num(1));
+    emit(count, tOpGetVariable, str("i"));
+    emit(count, tOpAdd, NULL);
+    emit(count, tOpSetVariablePop, str("i"));
+    emit(count, tOpJumpRel, NULL)->target = header;
+    cond->target = emit(count, tOpGetVariable, str("x"));
+    emit(count, tOpPrintln, NULL);
+
+    assert(run_main(num(0), str("oops"), count, level, &output) ==
+           VMErrorRuntime);
+    assert(!strcmp(output, ""));
+  }
+})
+
+void ssa_test() {
+  test_type_inference();
+  test_type_specialization();
+  test_loop_invariant_code_motion();
+  test_captured_locals();
+
+  printf("[ssa_test] All of tests are passed\n");
+}
@@ -3,4 +3,20 @@
 int main(int argc, char **argv) {
   value_test();
   env_test();
+  optimizer_test();
+  jit_test();
+  aot_test();
+  ssa_test();
+  regvm_test();
+  dispatch_test();
+  escape_test();
+  bounds_test();
+  builtins_test();
+  host_test();
+  batch_test();
+  parallel_test();
+  coroutine_test();
+  channel_test();
+  server_test();
+  cache_test();
 }
\ No newline at end of file
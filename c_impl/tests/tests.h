@@ -1,7 +1,10 @@
 #ifndef __TVM_TESTS_INCLUDED__
 #define __TVM_TESTS_INCLUDED__
 
+#include "tinyvm.h"
+#include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #define TEST_CASE(test_name, test_body)                                        \
   void test_name() {                                                           \
@@ -9,6 +12,75 @@
     printf("[Test - OK] " #test_name "\n");                                    \
   }
 
+/* Fixtures building code by hand */
+
+static inline void emit0(Vector *code, Opcode op) { vec_pushi(code, op); }
+
+static inline void emit1(Vector *code, Opcode op, TValue *operand) {
+  vec_pushi(code, op);
+  vec_push(code, operand);
+}
+
+static inline void emit_push(Vector *code, long long int v) {
+  emit1(code, tOpPush, new_TValue_with_integer(v));
+}
+
+static inline TValue *str(char *s) {
+  return new_TValue_with_str(sdsnew(s));
+}
+
+static inline TValue *num(long long int x) {
+  return new_TValue_with_integer(x);
+}
+
+static inline Inst *emit(Vector *insts, Opcode op, TValue *operand) {
+  Inst *inst = new_Inst(op, operand);
+  vec_push(insts, inst);
+  return inst;
+}
+
+static inline long long int count_op(Vector *code, Opcode op) {
+  Vector *insts = code_decode(code);
+  long long int n = 0;
+  for (int i = 0; i < insts->len; i++) {
+    n += ((Inst *)insts->data[i])->op == op;
+  }
+  return n;
+}
+
+/* Bytes of anonymous executable memory, where native code lives */
+static inline long long int native_bytes(void) {
+  FILE *maps = fopen("/proc/self/maps", "r");
+  assert(maps != NULL);
+  long long int bytes = 0;
+  unsigned long long int begin, end, inode;
+  char perms[5];
+  while (fscanf(maps, "%llx-%llx %4s %*s %*s %llu%*[^\n]", &begin, &end,
+                perms, &inode) == 4) {
+    if (!strcmp(perms, "r-xp") && inode == 0) {
+      bytes += end - begin;
+    }
+  }
+  fclose(maps);
+  return bytes;
+}
+
 void value_test();
 void env_test();
+void optimizer_test();
+void jit_test();
+void aot_test();
+void ssa_test();
+void regvm_test();
+void dispatch_test();
+void escape_test();
+void bounds_test();
+void builtins_test();
+void host_test();
+void batch_test();
+void parallel_test();
+void coroutine_test();
+void channel_test();
+void server_test();
+void cache_test();
 #endif
\ No newline at end of file
@@ -56,6 +56,41 @@ TEST_CASE(test_array, {
   }
 })
 
+TEST_CASE(test_typed_array, {
+  Vector *vec = new_vec();
+  for (int i = 0; i < 10; i++) {
+    vec_push(vec, new_TValue_with_integer(i));
+  }
+
+  TValue *array = new_TValue_with_array(vec);
+  TArray *ta = tv_getTArray(array);
+  assert(ta->kind == ArrayLong);
+  assert(ta->len == 10);
+  assert(tv_getLong(ta_get(ta, 3)) == 3);
+  assert(tv_equals(array, tv_dup(array)));
+
+  ta_set(ta, 3, new_TValue_with_integer(30));
+  assert(ta->kind == ArrayLong);
+  assert(tv_getLong(ta_get(ta, 3)) == 30);
+
+  /* a store of another type boxes the array */
+  TValue *copy = tv_dup(array);
+  ta_set(tv_getTArray(copy), 4, new_TValue_with_str(sdsnew("abc")));
+  assert(tv_getTArray(copy)->kind == ArrayBoxed);
+  assert(tv_getLong(ta_get(tv_getTArray(copy), 3)) == 30);
+  assert(tv_equals(ta_get(tv_getTArray(copy), 4),
+                   new_TValue_with_str(sdsnew("abc"))));
+  assert(ta->kind == ArrayLong);
+
+  TValue *flags[2];
+  flags[0] = new_TValue_with_bool(true);
+  flags[1] = new_TValue_with_bool(false);
+  array = new_TValue_with_elements(flags, 2);
+  assert(tv_getTArray(array)->kind == ArrayBool);
+  assert(tv_getBool(tv_getArray(array)->data[0]) == true);
+  assert(tv_getTArray(array)->kind == ArrayBoxed);
+})
+
 TEST_CASE(test_eq, {
   TValue *a = new_TValue_with_integer(1);
   TValue *b = new_TValue_with_integer(1);
@@ -171,6 +206,7 @@ void value_test() {
   test_str();
   test_bool();
   test_array();
+  test_typed_array();
   test_eq();
   test_cmp();
   test_cmps();
@@ -7,23 +7,246 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static void usage(void) {
+  fprintf(stderr, "usage: tinyvm [options] <file>\n");
+  fprintf(stderr, "       tinyvm --batch [options] <file>...\n");
+  fprintf(stderr, "       tinyvm --batch [options] --input=<records> "
+                  "<file>\n");
+  fprintf(stderr, "       tinyvm --serve=<socket> [options]\n");
+  fprintf(stderr, "       tinyvm --serve=<socket> --fork[=<n>] [options] "
+                  "<file>\n");
+  fprintf(stderr, "  -O<level>             optimization level 0-%d "
+                  "(default: %d)\n",
+          OPT_LEVEL_MAX, OPT_LEVEL_MAX);
+  fprintf(stderr, "  --jit-threshold=<n>   calls before a function is "
+                  "compiled (default: %d)\n",
+          JIT_THRESHOLD);
+  fprintf(stderr, "  --trace-threshold=<n> loop iterations before a loop is "
+                  "traced (default: %d)\n",
+          TRACE_THRESHOLD);
+  fprintf(stderr, "  --no-jit              never compile to native code\n");
+  fprintf(stderr, "  --engine=<name>       interpreter, stack or register "
+                  "(default: stack)\n");
+  fprintf(stderr, "  --dispatch=<name>     dispatch of the stack interpreter, "
+                  "switch, goto or tail\n"
+                  "                        (default: goto)\n");
+  fprintf(stderr, "  --emit-c              translate to C instead of running, "
+                  "see aot_runtime.h\n");
+  fprintf(stderr, "  -o <file>             output of --emit-c (default: "
+                  "<file>.c)\n");
+  fprintf(stderr, "  --batch               run every file, or the file once "
+                  "per line of --input,\n"
+                  "                        on a pool of threads, see "
+                  "batch.c\n");
+  fprintf(stderr, "  --input=<records>     lines bound to the global input "
+                  "of the batch's jobs\n");
+  fprintf(stderr, "  --jobs=<n>            threads of --batch and of the "
+                  "parallel builtins\n"
+                  "                        (default: one per core)\n");
+  fprintf(stderr, "  --serve=<socket>      run programs on request over a "
+                  "Unix domain socket,\n"
+                  "                        see server.c\n");
+  fprintf(stderr, "  --fork[=<n>]          serve each connection in a child "
+                  "forked from the loaded\n"
+                  "                        file (default: one per core)\n");
+  fprintf(stderr, "  --cache=<dir>         keep optimized code in dir, "
+                  "see cache.c\n");
+  exit(EXIT_FAILURE);
+}
+
+/* Jobs of --batch, one per file or one per line of input */
+static int run_batch(BatchConfig *config, Vector *files, char *input) {
+  Module *module = NULL;
+  Vector *inputs = NULL;
+  if (input != NULL) {
+    inputs = batch_read_inputs(input);
+    if (inputs == NULL) {
+      perror(input);
+      return EXIT_FAILURE;
+    }
+    module = module_load_file(files->data[0], config->opt_level);
+    if (module == NULL) {
+      fprintf(stderr, "%s can not be loaded\n", (char *)files->data[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  long long int n = inputs != NULL ? inputs->len : files->len;
+  BatchJob *jobs = xmalloc(sizeof(BatchJob) * (n > 0 ? n : 1));
+  for (long long int i = 0; i < n; i++) {
+    jobs[i].filename = inputs != NULL ? NULL : files->data[i];
+    jobs[i].input = inputs != NULL ? inputs->data[i] : NULL;
+  }
+  long long int failed = batch_run(config, module, jobs, n, stdout, stderr);
+  return failed == 0 ? 0 : EXIT_FAILURE;
+}
 
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
+  int opt_level = OPT_LEVEL_MAX;
+  long long int jit_threshold = JIT_THRESHOLD;
+  long long int trace_threshold = TRACE_THRESHOLD;
+  int engine = EngineStack;
+  int dispatch = DispatchGoto;
+  bool emit_c = false;
+  char *output = NULL;
+  bool batch = false;
+  char *input = NULL;
+  int jobs = 0;
+  char *serve = NULL;
+  int children = -1;
+  char *cache = NULL;
+  Vector *files = new_vec();
+
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "-O", 2)) {
+      opt_level = atoi(argv[i] + 2);
+      if (opt_level < 0 || opt_level > OPT_LEVEL_MAX) {
+        usage();
+      }
+    } else if (!strncmp(argv[i], "--jit-threshold=", 16)) {
+      jit_threshold = atoll(argv[i] + 16);
+    } else if (!strncmp(argv[i], "--trace-threshold=", 18)) {
+      trace_threshold = atoll(argv[i] + 18);
+    } else if (!strcmp(argv[i], "--no-jit")) {
+      jit_threshold = -1;
+      trace_threshold = -1;
+    } else if (!strcmp(argv[i], "--engine=stack")) {
+      engine = EngineStack;
+    } else if (!strcmp(argv[i], "--engine=register")) {
+      engine = EngineRegister;
+    } else if (!strcmp(argv[i], "--dispatch=switch")) {
+      dispatch = DispatchSwitch;
+    } else if (!strcmp(argv[i], "--dispatch=goto")) {
+      dispatch = DispatchGoto;
+    } else if (!strcmp(argv[i], "--dispatch=tail")) {
+#ifdef VM_MUSTTAIL
+      dispatch = DispatchTail;
+#else
+      fprintf(stderr, "tail-call dispatch needs a compiler supporting "
+                      "musttail, using goto\n");
+#endif
+    } else if (!strcmp(argv[i], "--emit-c")) {
+      emit_c = true;
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (!strcmp(argv[i], "--batch")) {
+      batch = true;
+    } else if (!strncmp(argv[i], "--input=", 8)) {
+      input = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--jobs=", 7)) {
+      jobs = atoi(argv[i] + 7);
+    } else if (!strncmp(argv[i], "--serve=", 8)) {
+      serve = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--cache=", 8)) {
+      cache = argv[i] + 8;
+    } else if (!strcmp(argv[i], "--fork")) {
+      children = 0;
+    } else if (!strncmp(argv[i], "--fork=", 7)) {
+      children = atoi(argv[i] + 7);
+      if (children <= 0) {
+        usage();
+      }
+    } else if (argv[i][0] == '-') {
+      usage();
+    } else {
+      vec_push(files, argv[i]);
+    }
+  }
+
+  if (serve != NULL && (batch || files->len != (children >= 0 ? 1 : 0))) {
+    usage();
+  }
+  if (serve == NULL && children >= 0) {
+    usage();
+  }
+  if (files->len == 0 && serve == NULL) {
     fprintf(stderr, "too few arguments\n");
-    exit(EXIT_FAILURE);
+    usage();
+  }
+  if (files->len > 1 && (!batch || input != NULL)) {
+    usage();
   }
 #ifdef __USE_BOEHM_GC__
+  if (children >= 0) {
+    GC_set_handle_fork(1);
+  }
   GC_INIT();
 #endif
+  if (cache != NULL && !cache_set_dir(cache)) {
+    perror(cache);
+    return EXIT_FAILURE;
+  }
+
+  BatchConfig config = {
+      .opt_level = opt_level,
+      .jit_threshold = jit_threshold,
+      .trace_threshold = trace_threshold,
+      .engine = engine,
+      .dispatch = dispatch,
+      .workers = jobs,
+  };
+  if (serve != NULL && children >= 0) {
+    Server *server = server_new(&config);
+    if (server_preload(server, files->data[0]) != VMOk) {
+      fprintf(stderr, "%s can not be loaded\n", (char *)files->data[0]);
+      return EXIT_FAILURE;
+    }
+    server_fork(server, serve, children);
+    perror(serve);
+    return EXIT_FAILURE;
+  }
+  if (serve != NULL) {
+    server_listen(server_new(&config), serve);
+    perror(serve);
+    return EXIT_FAILURE;
+  }
+  if (batch) {
+    return run_batch(&config, files, input);
+  }
+
+  char *filename = files->data[0];
 
-  Vector *code = readFromFile(argv[1]);
+  Vector *code;
+  if (cache != NULL) {
+    code = cache_load_file(filename, opt_level);
+    if (code == NULL) {
+      fprintf(stderr, "Failed to open the file - %s\n", filename);
+      return EXIT_FAILURE;
+    }
+  } else {
+    code = readFromFile(filename);
+    code = optimize(code, opt_passes_for_level(opt_level));
+  }
+
+  if (emit_c) {
+    if (output == NULL) {
+      output = sdscat(sdsnew(filename), ".c");
+    }
+    FILE *out = fopen(output, "w");
+    if (out == NULL) {
+      perror(output);
+      return EXIT_FAILURE;
+    }
+    if (!aot_emit_c(code, out, filename)) {
+      fprintf(stderr, "%s can not be compiled to C\n", filename);
+      return EXIT_FAILURE;
+    }
+    fclose(out);
+    return 0;
+  }
 
   printf("code : \n");
   code_printer(code);
 
   VM *vm = new_VM();
-  vm_execute(vm, code);
+  vm->jit_threshold = jit_threshold;
+  vm->trace_threshold = trace_threshold;
+  vm->engine = engine;
+  vm->dispatch = dispatch;
+  vm->workers = jobs;
+  vm_run(vm, code);
 
   return 0;
 }
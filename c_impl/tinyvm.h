@@ -3,10 +3,19 @@
 
 #define __USE_BOEHM_GC__
 
+// VMs may run on several threads, see vm_register_thread
+#define GC_THREADS
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define __ENABLE_JIT__
+#endif
+
 #include "avl.h"
 #include "sds/sds.h"
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 //////////////////    Vector     //////////////////
 
@@ -27,6 +36,7 @@ bool vec_containss(Vector *v, sds key);
 bool vec_union1(Vector *v, void *elem);
 void *vec_get(Vector *v, long long int idx);
 Vector *vec_dup(Vector *v);
+Vector *vec_view(Vector *v, long long int start, long long int len);
 
 //////////////////      Map      //////////////////
 
@@ -43,6 +53,7 @@ bool map_exists(Map *map, sds key);
 //////////////////    env    //////////////////
 
 typedef struct TValue_t TValue;
+typedef struct VM_t VM;
 
 typedef struct VariableStore {
   struct VariableStore *super;
@@ -86,14 +97,44 @@ typedef struct {
   sds func_name;
   Vector *func_body;
   Env *env;
+  long long int call_count;
+  void *jit_code; // native code compiled from func_body, see jit.c
+  bool jit_failed;
+  void *reg_code; // func_body translated to registers, see regvm.c
+  bool reg_failed;
 } VMFunction;
 
+// Storage of an array. Arrays made of Longs only or Bools only keep them
+// unboxed; storing an element of another type boxes the whole array.
+enum { ArrayBoxed, ArrayLong, ArrayBool };
+
+typedef struct {
+  int kind;
+  long long int len;
+  union {
+    Vector *boxed; // TValue* per element
+    long long int *longs;
+    bool *bools;
+  } elems;
+} TArray;
+
+// A function implemented in C, called by tOpCall without a new scope. It
+// pops its arity arguments and returns its result, pushed if it has one.
+typedef TValue *(*NativeFunc)(VM *vm);
+
+typedef struct {
+  sds name;
+  long long int arity;
+  NativeFunc func;
+} NativeFunction;
+
 typedef union {
   sds str;
   long long int integer;
   bool boolean;
-  Vector *array;
+  TArray *array;
   VMFunction *func;
+  NativeFunction *native;
 } Value;
 
 struct TValue_t {
@@ -107,12 +148,16 @@ TValue *new_TValue_with_integer(long long int value);
 TValue *new_TValue_with_str(sds sb);
 TValue *new_TValue_with_bool(bool value);
 TValue *new_TValue_with_array(Vector *array);
+TValue *new_TValue_with_elements(TValue **elems, long long int len);
 TValue *new_TValue_with_func(VMFunction *func);
+TValue *new_TValue_with_native(NativeFunction *native);
 long long int tv_getLong(TValue *tv);
 sds tv_getString(TValue *tv);
 bool tv_getBool(TValue *tv);
 Vector *tv_getArray(TValue *tv);
+TArray *tv_getTArray(TValue *tv);
 VMFunction *tv_getFunction(TValue *tv);
+NativeFunction *tv_getNative(TValue *tv);
 bool tv_equals(TValue *this, TValue *that);
 int tv_cmp(TValue *this, TValue *that);
 TValue *tv_dup(TValue *tv);
@@ -125,18 +170,28 @@ bool tv_and(TValue *a, TValue *b);
 bool tv_or(TValue *a, TValue *b);
 
 void tv_print(TValue *v);
+void tv_fprint(FILE *out, TValue *v);
+
+TValue *ta_get(TArray *array, long long int idx);
+void ta_set(TArray *array, long long int idx, TValue *v);
+Vector *ta_box(TArray *array);
+TArray *ta_dup(TArray *array);
 
 VMFunction *new_VMFunction(sds func_name, Vector *func_body, Env *env);
 
 VMFunction *vmf_dup(VMFunction *func);
 
+NativeFunction *new_NativeFunction(sds name, long long int arity,
+                                   NativeFunc func);
+
 //////////////////    others     //////////////////
 
 void *xmalloc(size_t size);
+void *xmalloc_atomic(size_t size);
 void xfree(void *ptr);
 
 // ValueType
-enum { Long, String, Bool, Array, Function, Null };
+enum { Long, String, Bool, Array, Function, Null, Native };
 
 // Opcode
 enum {
@@ -174,7 +229,29 @@ enum {
   tOpIFStatement,
   tOpAssignExpression,
   tOpAssert,
-  tIValue
+  tIValue,
+  // Specialized by the optimizer for operands proven to be Longs, never
+  // serialized
+  tOpAddLong,
+  tOpSubLong,
+  tOpMulLong,
+  tOpDivLong,
+  tOpModLong,
+  tOpEqualLong,
+  tOpNotEqualLong,
+  tOpLtLong,
+  tOpLteLong,
+  tOpGtLong,
+  tOpGteLong,
+  // Array indexing on an array value from the stack, lowered from the named
+  // forms by the optimizer. The unchecked forms only check that the index is
+  // not negative, an enclosing loop condition proves the upper bound.
+  tOpArrayLength,
+  tOpArrayLoad,
+  tOpArrayStore,
+  tOpArrayLoadUnchecked,
+  tOpArrayStoreUnchecked,
+  tOpCount // number of opcodes
 };
 
 typedef long long int Opcode;
@@ -182,15 +259,355 @@ typedef long long int Opcode;
 /////////////// loader ///////////////
 Vector *deserialize(Vector *serialized);
 Vector *readFromFile(sds filename);
+Vector *loadFromFile(char *filename);
+Vector *wordsFromBytes(const char *bytes, size_t len);
+
+// On-disk cache of optimized code, see cache.c
+bool cache_set_dir(char *dir);
+Vector *cache_load_file(char *filename, int opt_level);
+
+/////////////// optimizer ///////////////
+
+// Decoded instruction. Branch targets are resolved to instructions so that
+// passes can insert and delete freely; code_encode recomputes the offsets.
+typedef struct Inst_t {
+  Opcode op;
+  TValue *operand;
+  Vector *body;           // decoded body of tOpFunctionDeclare
+  struct Inst_t *target;  // branch target, NULL means the end of code
+  struct Inst_t *forward; // first live instruction at or after this one
+  long long int idx;
+  bool dead;
+} Inst;
+
+// Optimization passes
+enum {
+  OptNopElimination = 1 << 0,
+  OptConstantFolding = 1 << 1,
+  OptJumpThreading = 1 << 2,
+  OptDeadCodeElimination = 1 << 3,
+  OptInlining = 1 << 4,
+  OptTypeSpecialization = 1 << 5,
+  OptLoopInvariantCodeMotion = 1 << 6,
+  OptScalarReplacement = 1 << 7,
+  OptBoundsCheckElimination = 1 << 8,
+};
+
+#define OPT_LEVEL_MAX 9
+
+Inst *new_Inst(Opcode op, TValue *operand);
+long long int op_operand_count(Opcode op);
+bool op_is_branch(Opcode op);
+Opcode op_generic(Opcode op);
+Opcode op_specialize_long(Opcode op);
+Vector *code_decode(Vector *code);
+Vector *code_encode(Vector *insts);
+int opt_passes_for_level(int level);
+Vector *optimize(Vector *code, int passes);
+Vector *inline_functions(Vector *insts);
+Vector *scalar_replace_arrays(Vector *insts);
+Vector *eliminate_bounds_checks(Vector *insts);
+
+/////////////// SSA ///////////////
+
+// Sets of ValueTypes
+#define TYPE_OF(tt) (1 << (tt))
+#define TYPE_ANY (TYPE_OF(Native + 1) - 1)
+
+typedef struct BasicBlock_t BasicBlock;
+
+// A value pushed by an instruction, a phi or an opaque slot below the stack
+// the body can see.
+typedef struct SSAValue_t {
+  Inst *inst; // defining instruction, NULL for phis and opaque slots
+  BasicBlock *block;
+  struct SSAValue_t *args[2]; // popped operands, the top of the stack first
+  Vector *incoming;           // operands of a phi, one per predecessor
+  int types;                  // set of ValueTypes the value may have
+  long long int var;          // variable the value was loaded from or -1
+  long long int version;      // stores to var in the block before the load
+  long long int first;        // first instruction of its expression or -1
+} SSAValue;
+
+struct BasicBlock_t {
+  long long int id;
+  long long int first; // instructions [first, last)
+  long long int last;
+  Vector *preds;
+  Vector *succs;
+  Vector *phis; // stack slots known on entry, bottom first
+  Vector *exit; // known stack at the end, bottom first
+  int *vars_in; // types of every variable on entry
+  int *vars_out;
+  bool *locals_in; // variables the body defined itself on every path here
+};
 
-///////////////   VM   ///////////////
 typedef struct {
+  Vector *insts;
+  Vector *blocks;
+  Vector *names;         // variable names, index = variable id
+  Map *var_ids;          // name -> variable id + 1
+  SSAValue **nodes;      // value of every instruction
+  BasicBlock **block_of; // block of every instruction
+  bool builtins;         // print and println are never redefined
+} SSAFunction;
+
+SSAFunction *ssa_build(Vector *insts, bool builtins);
+void ssa_infer_types(SSAFunction *f);
+Vector *ssa_optimize(Vector *insts, int passes);
+
+///////////////   VM   ///////////////
+typedef struct LoopProfile_t LoopProfile;
+typedef struct Module_t Module;
+typedef struct Scheduler_t Scheduler;
+typedef struct Channels_t Channels;
+
+// Interpreters of bytecode
+enum { EngineStack, EngineRegister };
+
+// Dispatch strategies of the stack interpreter
+enum { DispatchSwitch, DispatchGoto, DispatchTail };
+
+// Guaranteed tail calls, needed by DispatchTail
+#if defined(__has_attribute) && !defined(VM_MUSTTAIL)
+#if __has_attribute(musttail)
+#define VM_MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+struct VM_t {
   Env *env;
   Vector *stack;
-} VM;
+  int engine;
+  int dispatch;
+  long long int jit_threshold;
+  long long int trace_threshold;
+  LoopProfile **loops; // hash table of loop headers, see jit.c
+  Vector *native;      // mappings of the native code it compiled, likewise
+  jmp_buf *error_handler; // where VM_ERROR returns to, exits if NULL
+  sds error;              // message of the last error
+  Vector *modules;        // modules it loaded, see host.c
+  FILE *out;              // where print and println write
+  int workers;            // threads of the parallel builtins, 0 for all cores
+  Scheduler *scheduler;   // coroutines, see coroutine.c
+  long long int fuel;     // backward jumps and calls left to tasks, -1 for
+                          // no limit
+  Channels *channels;     // table of the channel ids, see channel.c
+  bool loaded;            // ran the top level of its program, see host.c
+};
+
+// Status of the host API
+enum { VMOk, VMErrorLoad, VMErrorRuntime, VMSuspended };
+
+/**
+ * Report an error of vm, or of the VM running host calls on this thread if
+ * vm is NULL. Returns to the host through vm->error_handler when one is set,
+ * otherwise prints msg and exits.
+ */
+__attribute__((noreturn)) void vm_error(VM *vm, const char *msg);
+VM *vm_swap_current(VM *vm);
+
+#define VM_ERROR(msg) vm_error(vm, msg)
+
+#define VM_ASSERT(expr, msg)                                                   \
+  {                                                                            \
+    if (!(expr)) {                                                             \
+      VM_ERROR(msg);                                                           \
+    }                                                                          \
+  }
+
+#define VM_ASSERT0(expr)                                                       \
+  {                                                                            \
+    if (!(expr)) {                                                             \
+      VM_ERROR("");                                                            \
+    }                                                                          \
+  }
+
+#define VM_CHECK_INDEX(array, idx)                                             \
+  VM_ASSERT((idx) >= 0 && (idx) < (array)->len,                                \
+            "Execute Error Array index out of range")
+
+// The index of an unchecked access, whose upper bound is proven
+#define VM_CHECK_INDEX_LOW(idx)                                                \
+  VM_ASSERT((idx) >= 0, "Execute Error Array index out of range")
+
+/**
+ * Heap bytes at which the collector paused by vm_pause_collection runs
+ * again, -1 while it runs. The interpreters check it at backward jumps and
+ * calls, where tasks take fuel.
+ */
+extern long long int vm_heap_limit;
+void vm_pause_collection(long long int limit);
+void vm_check_heap(void);
+
+#define VM_CHECK_HEAP()                                                        \
+  if (__atomic_load_n(&vm_heap_limit, __ATOMIC_RELAXED) >= 0) {                \
+    vm_check_heap();                                                           \
+  }
 
 VM *new_VM();
+VM *new_bare_VM(void);
 TValue *vm_execute(VM *vm, Vector *code);
+TValue *vm_run(VM *vm, Vector *code);
+TValue *vm_call(VM *vm, sds fname);
+TValue *vm_apply(VM *vm, TValue *func_tv);
+TValue *vm_stackPeekTop(VM *vm);
+
+/////////////// Register VM ///////////////
+
+typedef struct RegInst_t RegInst;
+
+typedef struct {
+  RegInst *insts;
+  long long int len;
+  long long int max_depth; // registers above the base of a block
+  long long int stack_len; // instructions of the bytecode it came from
+} RegCode;
+
+RegCode *reg_translate(Vector *code);
+TValue *reg_execute(VM *vm, RegCode *code);
+
+///////////////   JIT   ///////////////
+
+// Calls before a function is compiled to native code
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 100
+#endif
+
+// Backward jumps to a loop header before the loop is traced
+#ifndef TRACE_THRESHOLD
+#define TRACE_THRESHOLD 50
+#endif
+
+typedef TValue *(*JITCode)(VM *vm);
+
+// Returns the bytecode position where the interpreter continues
+typedef long long int (*TraceCode)(VM *vm);
+
+void *jit_compile(VM *vm, Vector *code);
+void jit_release(VM *vm);
+long long int trace_loop(VM *vm, Vector *code, long long int header);
+
+///////////////   host API   ///////////////
+
+// libtinyvm, see host.c
+VM *vm_open(void);
+int vm_load(VM *vm, Vector *code, int opt_level);
+int vm_load_file(VM *vm, char *filename, int opt_level);
+TValue *vm_lookup(VM *vm, char *name);
+int vm_invoke(VM *vm, TValue *func, TValue **args, long long int argc,
+              TValue **ret);
+bool vm_register_thread(void);
+void vm_unregister_thread(void);
+
+// Preemptible tasks, see coroutine.c
+#ifndef TASK_SLICE
+#define TASK_SLICE 10000 // fuel of a task for a turn of run_tasks
+#endif
+
+long long int vm_spawn(VM *vm, TValue *func, TValue **args,
+                       long long int argc);
+int vm_resume(VM *vm, long long int task, long long int fuel, TValue **ret);
+
+// Optimized code shared by VMs on any number of threads
+struct Module_t {
+  Vector *code; // never written once loaded
+  int refs;
+};
+
+Module *module_new(Vector *code, int opt_level);
+Module *module_load_file(char *filename, int opt_level);
+Module *module_load_bytes(const char *bytes, size_t len, int opt_level);
+Module *module_retain(Module *module);
+void module_release(Module *module);
+int vm_load_module(VM *vm, Module *module);
+void vm_close(VM *vm);
+
+// Channels between VMs, see channel.c
+#ifndef CHANNEL_CAPACITY_MAX
+#define CHANNEL_CAPACITY_MAX (1 << 20) // values a channel can hold
+#endif
+#define CHANNELS_MAX (1 << 20) // channels open at once in a table
+Channels *new_Channels(void);
+void vm_share_channels(VM *vm, VM *from);
+long long int channel_open(VM *vm, long long int capacity);
+bool channel_send(VM *vm, long long int id, TValue *v);
+TValue *channel_recv(VM *vm, long long int id);
+bool channel_close(VM *vm, long long int id);
+bool channel_would_wait(VM *vm, NativeFunction *native);
+
+///////////////   batch   ///////////////
+
+// Settings of the VMs running a batch, see batch.c
+typedef struct {
+  int opt_level;
+  long long int jit_threshold;
+  long long int trace_threshold;
+  int engine;
+  int dispatch;
+  int workers; // threads, one per core if 0
+} BatchConfig;
+
+typedef struct {
+  char *filename; // program of the job, NULL to run the module of the batch
+  TValue *input;  // bound to the global input if not NULL
+  sds output;     // what the job printed
+  sds error;      // NULL if it ran to the end
+  bool done;
+} BatchJob;
+
+long long int batch_run(BatchConfig *config, Module *module, BatchJob *jobs,
+                        long long int n, FILE *out, FILE *err);
+VM *batch_open_vm(BatchConfig *config, FILE *out);
+TValue *batch_parse_input(char *s, size_t len);
+Vector *batch_read_inputs(char *filename);
+
+///////////////   server   ///////////////
+
+// Programs run on request over a Unix domain socket, see server.c
+typedef struct Server_t Server;
+
+// Requests and heap bytes after which a forked child ends its session
+#ifndef SERVER_CHILD_REQUESTS
+#define SERVER_CHILD_REQUESTS 1000
+#endif
+#ifndef SERVER_CHILD_HEAP
+#define SERVER_CHILD_HEAP (256 << 20)
+#endif
+
+Server *server_new(BatchConfig *config);
+void server_session(Server *server, int fd);
+int server_listen(Server *server, char *path);
+int server_preload(Server *server, char *filename);
+int server_fork(Server *server, char *path, int children);
+
+///////////////   builtins   ///////////////
+
+// Binds print, println, len and the array builtins as natives
+void env_def_builtins(Env *env);
+void env_def_native(Env *env, char *name, long long int arity,
+                    NativeFunc func);
+// parallel_map and parallel_reduce, see parallel.c
+void env_def_parallel(Env *env);
+// spawn, yield, resume, finished and run_tasks, see coroutine.c
+void env_def_coroutines(Env *env);
+// channel, send, recv and close, see channel.c
+void env_def_channels(Env *env);
+
+long long int longs_sum(const long long int *xs, long long int n);
+long long int longs_extreme(const long long int *xs, long long int n,
+                            bool max);
+void longs_fill(long long int *xs, long long int n, long long int v);
+long long int longs_index_of(const long long int *xs, long long int n,
+                             long long int v);
+bool longs_equal(const long long int *xs, const long long int *ys,
+                 long long int n);
+void longs_sort(long long int *xs, long long int n);
+void strings_sort(TValue **vs, long long int n);
+
+///////////////   AOT   ///////////////
+
+bool aot_emit_c(Vector *code, FILE *out, const char *source);
 
 void type_print(int type);
 void code_printer(Vector *code);
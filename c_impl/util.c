@@ -89,6 +89,15 @@ Vector *vec_dup(Vector *v) {
   return vec;
 }
 
+/* len elements of v from start, sharing its storage, so it must not grow */
+Vector *vec_view(Vector *v, long long int start, long long int len) {
+  Vector *view = xmalloc(sizeof(Vector));
+  view->data = v->data + start;
+  view->capacity = len;
+  view->len = len;
+  return view;
+}
+
 Map *new_map(void) {
   Map *map = xmalloc(sizeof(Map));
   map->tree = new_AVLTree();
@@ -133,6 +142,22 @@ inline void *xmalloc(size_t size) {
   return ptr;
 }
 
+/* Memory holding no pointers, the collector does not scan it */
+inline void *xmalloc_atomic(size_t size) {
+#ifdef __USE_BOEHM_GC__
+  void *ptr = GC_MALLOC_ATOMIC(size);
+#else
+  void *ptr = malloc(size);
+#endif
+
+  if (ptr == NULL) {
+    fprintf(stderr, "Failed to allocate memory <size:%ld>\n", size);
+    exit(EXIT_FAILURE);
+  }
+
+  return ptr;
+}
+
 inline void xfree(void *ptr) {
   if (ptr != NULL) {
 #ifdef __USE_BOEHM_GC__
@@ -146,6 +171,79 @@ inline void xfree(void *ptr) {
   }
 }
 
+/**
+ * A VM with its fields set up and nothing bound, new_VM and aot_new_VM
+ * bind the builtins they link with.
+ */
+VM *new_bare_VM(void) {
+  VM *vm = xmalloc(sizeof(VM));
+  vm->env = new_env();
+  vm->stack = new_vec();
+  vm->engine = EngineStack;
+  vm->dispatch = DispatchGoto;
+  vm->jit_threshold = JIT_THRESHOLD;
+  vm->trace_threshold = TRACE_THRESHOLD;
+  vm->loops = NULL;
+  vm->native = NULL;
+  vm->error_handler = NULL;
+  vm->error = NULL;
+  vm->modules = NULL;
+  vm->out = stdout;
+  vm->workers = 0;
+  vm->scheduler = NULL;
+  vm->fuel = -1;
+  vm->channels = new_Channels();
+  vm->loaded = false;
+  return vm;
+}
+
+long long int vm_heap_limit = -1;
+
+/* Stop collecting until the heap reaches limit bytes */
+void vm_pause_collection(long long int limit) {
+#ifdef __USE_BOEHM_GC__
+  GC_disable();
+#endif
+  __atomic_store_n(&vm_heap_limit, limit, __ATOMIC_RELAXED);
+}
+
+/* Collect again if the heap reached vm_heap_limit */
+void vm_check_heap(void) {
+  long long int limit = __atomic_load_n(&vm_heap_limit, __ATOMIC_RELAXED);
+#ifdef __USE_BOEHM_GC__
+  if (limit < 0 || GC_get_heap_size() < (size_t)limit) {
+    return;
+  }
+  if (__atomic_compare_exchange_n(&vm_heap_limit, &limit, -1, false,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    GC_enable();
+  }
+#else
+  (void)limit;
+#endif
+}
+
+/* The VM running host calls on this thread, for errors raised by values */
+static _Thread_local VM *current_vm;
+
+VM *vm_swap_current(VM *vm) {
+  VM *prev = current_vm;
+  current_vm = vm;
+  return prev;
+}
+
+void vm_error(VM *vm, const char *msg) {
+  if (vm == NULL) {
+    vm = current_vm;
+  }
+  if (vm == NULL || vm->error_handler == NULL) {
+    fprintf(stderr, "<VM-ERROR> %s\n", msg);
+    exit(EXIT_FAILURE);
+  }
+  vm->error = sdsnew(msg);
+  longjmp(*vm->error_handler, 1);
+}
+
 #define case_printer(case_name)                                                \
   case case_name:                                                              \
     printf(#case_name);                                                        \
@@ -188,5 +286,21 @@ void type_print(int type) {
     case_printer(tOpAssignExpression);
     case_printer(tOpAssert);
     case_printer(tIValue);
+    case_printer(tOpAddLong);
+    case_printer(tOpSubLong);
+    case_printer(tOpMulLong);
+    case_printer(tOpDivLong);
+    case_printer(tOpModLong);
+    case_printer(tOpEqualLong);
+    case_printer(tOpNotEqualLong);
+    case_printer(tOpLtLong);
+    case_printer(tOpLteLong);
+    case_printer(tOpGtLong);
+    case_printer(tOpGteLong);
+    case_printer(tOpArrayLength);
+    case_printer(tOpArrayLoad);
+    case_printer(tOpArrayStore);
+    case_printer(tOpArrayLoadUnchecked);
+    case_printer(tOpArrayStoreUnchecked);
   }
 }
@@ -1,5 +1,4 @@
 #include "tinyvm.h"
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,8 +33,73 @@ TValue *new_TValue_with_bool(bool value) {
   return tv;
 }
 
+/* The unboxed kind elems can be stored as, ArrayBoxed if there is none */
+static int array_kind(TValue **elems, long long int len) {
+  if (len == 0 || (elems[0]->tt != Long && elems[0]->tt != Bool)) {
+    return ArrayBoxed;
+  }
+  for (long long int i = 1; i < len; i++) {
+    if (elems[i]->tt != elems[0]->tt) {
+      return ArrayBoxed;
+    }
+  }
+  return elems[0]->tt == Long ? ArrayLong : ArrayBool;
+}
+
+static TArray *new_TArray(int kind, long long int len) {
+  TArray *array = xmalloc(sizeof(TArray));
+  array->kind = kind;
+  array->len = len;
+  switch (kind) {
+  case ArrayLong:
+    array->elems.longs = xmalloc_atomic(sizeof(long long int) * (len + 1));
+    break;
+  case ArrayBool:
+    array->elems.bools = xmalloc_atomic(sizeof(bool) * (len + 1));
+    break;
+  default:
+    array->elems.boxed = NULL;
+  }
+  return array;
+}
+
+/**
+ * Wrap array, whose elements are kept unboxed if they allow it. Otherwise
+ * the value shares the Vector.
+ */
 TValue *new_TValue_with_array(Vector *array) {
   TValue *tv = new_TValue_with_tt(Array);
+  if (array_kind((TValue **)array->data, array->len) == ArrayBoxed) {
+    tv->value.array = new_TArray(ArrayBoxed, array->len);
+    tv->value.array->elems.boxed = array;
+  } else {
+    tv->value.array = tv_getTArray(
+        new_TValue_with_elements((TValue **)array->data, array->len));
+  }
+  return tv;
+}
+
+/**
+ * An array of copies of the len values at elems.
+ */
+TValue *new_TValue_with_elements(TValue **elems, long long int len) {
+  TValue *tv = new_TValue_with_tt(Array);
+  TArray *array = new_TArray(array_kind(elems, len), len);
+  for (long long int i = 0; i < len; i++) {
+    switch (array->kind) {
+    case ArrayLong:
+      array->elems.longs[i] = elems[i]->value.integer;
+      break;
+    case ArrayBool:
+      array->elems.bools[i] = elems[i]->value.boolean;
+      break;
+    }
+  }
+  if (array->kind == ArrayBoxed) {
+    array->elems.boxed = new_vec();
+    vec_expand(array->elems.boxed, len);
+    memcpy(array->elems.boxed->data, elems, sizeof(TValue *) * len);
+  }
   tv->value.array = array;
   return tv;
 }
@@ -46,36 +110,56 @@ TValue *new_TValue_with_func(VMFunction *func) {
   return tv;
 }
 
+TValue *new_TValue_with_native(NativeFunction *native) {
+  TValue *tv = new_TValue_with_tt(Native);
+  tv->value.native = native;
+  return tv;
+}
+
+#define TV_CHECK_TYPE(tv, type)                                                \
+  if ((tv)->tt != (type)) {                                                    \
+    vm_error(NULL, "Type error, expected " #type);                             \
+  }
+
 long long int tv_getLong(TValue *tv) {
-  assert(tv->tt == Long);
+  TV_CHECK_TYPE(tv, Long);
   return tv->value.integer;
 }
 
 sds tv_getString(TValue *tv) {
-  assert(tv->tt == String);
+  TV_CHECK_TYPE(tv, String);
   return tv->value.str;
 }
 
 bool tv_getBool(TValue *tv) {
-  assert(tv->tt == Bool);
+  TV_CHECK_TYPE(tv, Bool);
   return tv->value.boolean;
 }
 
+/**
+ * The elements as TValues. An unboxed array is boxed for good.
+ */
 Vector *tv_getArray(TValue *tv) {
-  assert(tv->tt == Array);
+  TV_CHECK_TYPE(tv, Array);
+  return ta_box(tv->value.array);
+}
+
+TArray *tv_getTArray(TValue *tv) {
+  TV_CHECK_TYPE(tv, Array);
   return tv->value.array;
 }
 
 VMFunction *tv_getFunction(TValue *tv) {
-  assert(tv->tt == Function);
+  TV_CHECK_TYPE(tv, Function);
   return tv->value.func;
 }
 
-#define TV_COMPARISON_ERROR(msg)                                               \
-  {                                                                            \
-    fprintf(stderr, "<TValue Comparison ERROR> %s\n", msg);                    \
-    exit(EXIT_FAILURE);                                                        \
-  }
+NativeFunction *tv_getNative(TValue *tv) {
+  TV_CHECK_TYPE(tv, Native);
+  return tv->value.native;
+}
+
+#define TV_COMPARISON_ERROR(msg) vm_error(NULL, msg)
 
 bool tv_equals(TValue *this, TValue *that) {
   if (this->tt != that->tt) {
@@ -90,15 +174,24 @@ bool tv_equals(TValue *this, TValue *that) {
   case Bool:
     return this->value.boolean == that->value.boolean;
   case Array: {
-    Vector *this_array = this->value.array;
-    Vector *that_array = that->value.array;
+    TArray *this_array = this->value.array;
+    TArray *that_array = that->value.array;
 
     if (this_array->len != that_array->len) {
       return false;
     }
 
-    for (int i = 0; i < this_array->len; i++) {
-      if (!tv_equals(this_array->data[i], that_array->data[i])) {
+    if (this_array->kind == ArrayLong && that_array->kind == ArrayLong) {
+      return !memcmp(this_array->elems.longs, that_array->elems.longs,
+                     sizeof(long long int) * this_array->len);
+    }
+    if (this_array->kind == ArrayBool && that_array->kind == ArrayBool) {
+      return !memcmp(this_array->elems.bools, that_array->elems.bools,
+                     sizeof(bool) * this_array->len);
+    }
+
+    for (long long int i = 0; i < this_array->len; i++) {
+      if (!tv_equals(ta_get(this_array, i), ta_get(that_array, i))) {
         return false;
       }
     }
@@ -106,6 +199,7 @@ bool tv_equals(TValue *this, TValue *that) {
     return true;
   }
   case Function:
+  case Native:
     TV_COMPARISON_ERROR("Con't compare with Function");
   case Null:
     TV_COMPARISON_ERROR("Can't compare with Null");
@@ -149,6 +243,7 @@ int tv_cmp(TValue *this, TValue *that) {
   case Array:
     TV_COMPARISON_ERROR("Can't compare with Array");
   case Function:
+  case Native:
     TV_COMPARISON_ERROR("Can't compare with Function");
   case Null:
     TV_COMPARISON_ERROR("Can't compare with Null");
@@ -166,10 +261,15 @@ TValue *tv_dup(TValue *tv) {
     return new_TValue_with_str(sdsdup(tv->value.str));
   case Bool:
     return new_TValue_with_bool(tv->value.boolean);
-  case Array:
-    return new_TValue_with_array(vec_dup(tv->value.array));
+  case Array: {
+    TValue *dup = new_TValue_with_tt(Array);
+    dup->value.array = ta_dup(tv->value.array);
+    return dup;
+  }
   case Function:
     return new_TValue_with_func(vmf_dup(tv->value.func));
+  case Native:
+    return tv;
   default:
     return new_TValue();
   }
@@ -186,46 +286,106 @@ bool tv_gte(TValue *a, TValue *b) {
   return v == 1 || v == 0;
 }
 bool tv_and(TValue *a, TValue *b) {
-  assert(a->tt == b->tt && a->tt == Bool);
+  TV_CHECK_TYPE(a, Bool);
+  TV_CHECK_TYPE(b, Bool);
   return tv_getBool(a) && tv_getBool(b);
 }
 bool tv_or(TValue *a, TValue *b) {
-  assert(a->tt == b->tt && a->tt == Bool);
+  TV_CHECK_TYPE(a, Bool);
+  TV_CHECK_TYPE(b, Bool);
   return tv_getBool(a) || tv_getBool(b);
 }
 
-void tv_print(TValue *v) {
+void tv_fprint(FILE *out, TValue *v) {
   switch (v->tt) {
   case Long:
-    printf("%lld", tv_getLong(v));
+    fprintf(out, "%lld", tv_getLong(v));
     break;
   case String:
-    printf("%s", tv_getString(v));
+    fprintf(out, "%s", tv_getString(v));
     break;
   case Bool:
-    printf("%s", tv_getBool(v) ? "true" : "false");
+    fprintf(out, "%s", tv_getBool(v) ? "true" : "false");
     break;
   case Array: {
-    Vector *array = tv_getArray(v);
-    printf("[");
-    for (int i = 0; i < array->len; i++) {
+    TArray *array = tv_getTArray(v);
+    fprintf(out, "[");
+    for (long long int i = 0; i < array->len; i++) {
       if (i > 0) {
-        printf(", ");
+        fprintf(out, ", ");
       }
-      tv_print(array->data[i]);
+      tv_fprint(out, ta_get(array, i));
     }
-    printf("]");
+    fprintf(out, "]");
     break;
   }
   case Function: {
     VMFunction *vmf = tv_getFunction(v);
-    printf("Function<%s>", vmf->func_name);
+    fprintf(out, "Function<%s>", vmf->func_name);
     break;
   }
+  case Native:
+    fprintf(out, "Native<%s>", tv_getNative(v)->name);
+    break;
   case Null:
-    printf("null");
+    fprintf(out, "null");
+    break;
+  }
+}
+
+void tv_print(TValue *v) { tv_fprint(stdout, v); }
+
+TValue *ta_get(TArray *array, long long int idx) {
+  switch (array->kind) {
+  case ArrayLong:
+    return new_TValue_with_integer(array->elems.longs[idx]);
+  case ArrayBool:
+    return new_TValue_with_bool(array->elems.bools[idx]);
+  default:
+    return array->elems.boxed->data[idx];
+  }
+}
+
+void ta_set(TArray *array, long long int idx, TValue *v) {
+  if (array->kind == ArrayLong && v->tt == Long) {
+    array->elems.longs[idx] = v->value.integer;
+  } else if (array->kind == ArrayBool && v->tt == Bool) {
+    array->elems.bools[idx] = v->value.boolean;
+  } else {
+    ta_box(array)->data[idx] = v;
+  }
+}
+
+/**
+ * Switch array to boxed storage and return its elements.
+ */
+Vector *ta_box(TArray *array) {
+  if (array->kind != ArrayBoxed) {
+    Vector *boxed = new_vec();
+    vec_expand(boxed, array->len);
+    for (long long int i = 0; i < array->len; i++) {
+      boxed->data[i] = ta_get(array, i);
+    }
+    array->kind = ArrayBoxed;
+    array->elems.boxed = boxed;
+  }
+  return array->elems.boxed;
+}
+
+TArray *ta_dup(TArray *array) {
+  TArray *dup = new_TArray(array->kind, array->len);
+  switch (array->kind) {
+  case ArrayLong:
+    memcpy(dup->elems.longs, array->elems.longs,
+           sizeof(long long int) * array->len);
     break;
+  case ArrayBool:
+    memcpy(dup->elems.bools, array->elems.bools, sizeof(bool) * array->len);
+    break;
+  default:
+    dup->elems.boxed = vec_dup(array->elems.boxed);
   }
+  return dup;
 }
 
 VMFunction *new_VMFunction(sds func_name, Vector *func_body, Env *env) {
@@ -233,9 +393,30 @@ VMFunction *new_VMFunction(sds func_name, Vector *func_body, Env *env) {
   func->func_name = func_name;
   func->func_body = func_body;
   func->env = env;
+  func->call_count = 0;
+  func->jit_code = NULL;
+  func->jit_failed = false;
+  func->reg_code = NULL;
+  func->reg_failed = false;
   return func;
 }
 
 VMFunction *vmf_dup(VMFunction *func) {
-  return new_VMFunction(func->func_name, func->func_body, env_dup(func->env));
-}
\ No newline at end of file
+  VMFunction *dup =
+      new_VMFunction(func->func_name, func->func_body, env_dup(func->env));
+  /* translated code only depends on the body */
+  dup->jit_code = func->jit_code;
+  dup->jit_failed = func->jit_failed;
+  dup->reg_code = func->reg_code;
+  dup->reg_failed = func->reg_failed;
+  return dup;
+}
+
+NativeFunction *new_NativeFunction(sds name, long long int arity,
+                                   NativeFunc func) {
+  NativeFunction *native = xmalloc(sizeof(NativeFunction));
+  native->name = name;
+  native->arity = arity;
+  native->func = func;
+  return native;
+}
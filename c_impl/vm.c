@@ -5,30 +5,13 @@
 #include <stdlib.h>
 
 VM *new_VM() {
-  VM *vm = xmalloc(sizeof(VM));
-  vm->env = new_env();
-  vm->stack = new_vec();
+  VM *vm = new_bare_VM();
 
   /* builtin funcs */
-
-  TValue *func_tv;
-  Vector *func_body;
-
-  /* print */
-  func_body = new_vec();
-  vec_pushi(func_body, tOpPrint);
-
-  func_tv =
-      new_TValue_with_func(new_VMFunction(sdsnew("print"), func_body, vm->env));
-  env_def(vm->env, sdsnew("print"), func_tv);
-
-  /* println */
-  func_body = new_vec();
-  vec_pushi(func_body, tOpPrintln);
-
-  func_tv = new_TValue_with_func(
-      new_VMFunction(sdsnew("println"), func_body, vm->env));
-  env_def(vm->env, sdsnew("println"), func_tv);
+  env_def_builtins(vm->env);
+  env_def_parallel(vm->env);
+  env_def_coroutines(vm->env);
+  env_def_channels(vm->env);
 
   return vm;
 }
@@ -41,25 +24,77 @@ TValue *vm_stackPeekTop(VM *vm) {
   }
 }
 
-#define VM_ERROR(msg)                                                          \
-  {                                                                            \
-    fprintf(stderr, "<VM-ERROR> %s\n", msg);                                   \
-    exit(EXIT_FAILURE);                                                        \
+/**
+ * Execute code with the interpreter selected by vm->engine.
+ */
+TValue *vm_run(VM *vm, Vector *code) {
+  if (vm->engine == EngineRegister) {
+    RegCode *reg_code = reg_translate(code);
+    if (reg_code != NULL) {
+      return reg_execute(vm, reg_code);
+    }
   }
+  return vm_execute(vm, code);
+}
 
-#define VM_ASSERT(expr, msg)                                                   \
-  {                                                                            \
-    if (!(expr)) {                                                             \
-      VM_ERROR(msg);                                                           \
-    }                                                                          \
+static TValue *vm_interpret(VM *vm, VMFunction *func) {
+  if (vm->engine == EngineRegister && !func->reg_failed) {
+    if (func->reg_code == NULL) {
+      func->reg_code = reg_translate(func->func_body);
+      func->reg_failed = func->reg_code == NULL;
+    }
+    if (func->reg_code != NULL) {
+      return reg_execute(vm, func->reg_code);
+    }
   }
+  return vm_execute(vm, func->func_body);
+}
 
-#define VM_ASSERT0(expr)                                                       \
-  {                                                                            \
-    if (!(expr)) {                                                             \
-      VM_ERROR("");                                                            \
-    }                                                                          \
+/* Call the function bound to fname with the arguments on the stack */
+TValue *vm_call(VM *vm, sds fname) {
+  return vm_apply(vm, env_get(vm->env, fname));
+}
+
+/**
+ * Call a function value with the arguments on the stack. Functions are
+ * compiled to native code once they have been called jit_threshold times; a
+ * negative threshold disables the JIT.
+ */
+TValue *vm_apply(VM *vm, TValue *func_tv) {
+  VM_ASSERT(func_tv != NULL &&
+                (func_tv->tt == Function || func_tv->tt == Native),
+            "Execute Error on tOpCall");
+  if (func_tv->tt == Native) {
+    NativeFunction *native = tv_getNative(func_tv);
+    VM_ASSERT(vm->stack->len >= native->arity,
+              "Execute Error Too few arguments");
+    return native->func(vm);
+  }
+  VMFunction *func = tv_getFunction(func_tv);
+  VM_CHECK_HEAP();
+
+  Env *cpyEnv = vm->env;
+  vm->env = env_dup(func->env);
+
+  TValue *ret;
+#ifdef __ENABLE_JIT__
+  if (func->jit_code == NULL && !func->jit_failed && vm->jit_threshold >= 0 &&
+      ++func->call_count > vm->jit_threshold) {
+    func->jit_code = jit_compile(vm, func->func_body);
+    func->jit_failed = func->jit_code == NULL;
+  }
+  if (func->jit_code != NULL) {
+    ret = ((JITCode)func->jit_code)(vm);
+  } else {
+    ret = vm_interpret(vm, func);
   }
+#else
+  ret = vm_interpret(vm, func);
+#endif
+
+  vm->env = cpyEnv;
+  return ret;
+}
 
 //#define __TINYVM_DEBUG__
 
@@ -92,583 +127,159 @@ TValue *vm_stackPeekTop(VM *vm) {
 #define VM_DEBUG_PRINT(vm, op)
 #endif
 
-#define __ENABLE_DIRECT_THREADED_CODE__
+/**
+ * Called after a jump from `from` has set pc to the instruction before its
+ * destination. A backward jump enters the loop trace, which runs until a
+ * guard fails and tells where to continue.
+ */
+#ifdef __ENABLE_JIT__
+#define TRACE_BACKWARD_JUMP(from)                                              \
+  if (pc + 1 <= from && vm->trace_threshold >= 0) {                            \
+    long long int exit_pc = trace_loop(vm, code, pc + 1);                      \
+    if (exit_pc >= 0) {                                                        \
+      pc = exit_pc - 1;                                                        \
+    }                                                                          \
+  }
+#else
+#define TRACE_BACKWARD_JUMP(from) (void)(from)
+#endif
 
-#ifdef __ENABLE_DIRECT_THREADED_CODE__
-TValue *vm_execute(VM *vm, Vector *code) {
-  size_t pc = 0;
-  long long int op = 0;
-
-  static void *table[] = {&&L_tOpVariableDeclareOnlySymbol,
-                          &&L_tOpVariableDeclareWithAssign,
-                          &&L_tOpPop,
-                          &&L_tOpPush,
-                          &&L_tOpAdd,
-                          &&L_tOpSub,
-                          &&L_tOpMul,
-                          &&L_tOpDiv,
-                          &&L_tOpMod,
-                          &&L_tOpReturn,
-                          &&L_tOpGetVariable,
-                          &&L_tOpSetVariablePop,
-                          &&L_tOpSetArrayElement,
-                          &&L_tOpGetArrayElement,
-                          &&L_tOpMakeArray,
-                          &&L_tOpCall,
-                          &&L_tOpNop,
-                          &&L_tOpFunctionDeclare,
-                          &&L_tOpEqualExpression,
-                          &&L_tOpNotEqualExpression,
-                          &&L_tOpLtExpression,
-                          &&L_tOpLteExpression,
-                          &&L_tOpGtExpression,
-                          &&L_tOpGteExpression,
-                          &&L_tOpAndExpression,
-                          &&L_tOpOrExpression,
-                          &&L_tOpXorExpression,
-                          &&L_tOpJumpRel,
-                          &&L_tOpJumpAbs,
-                          &&L_tOpPrint,
-                          &&L_tOpPrintln,
-                          &&L_tOpIFStatement,
-                          &&L_tOpAssignExpression,
-                          &&L_tOpAssert,
-                          &&L_tIValue};
-
-  long long int table_len = sizeof(table) / sizeof(table[0]);
+//////////////////  switch dispatch  //////////////////
+
+static TValue *vm_execute_switch(VM *vm, Vector *code) {
+  for (long long int pc = 0; pc < code->len; pc++) {
+    Opcode op = (Opcode)code->data[pc];
+
+    VM_DEBUG_PRINT(vm, op);
+
+    switch (op) {
+#define VM_HANDLER(op_name, ...)                                               \
+  case op_name: {                                                              \
+    __VA_ARGS__;                                                               \
+    break;                                                                     \
+  }
+#include "vm_handlers.h"
+#undef VM_HANDLER
+    default:
+      fprintf(stderr, "<VM error> Invalid op\n");
+    }
+  }
+  return vm_stackPeekTop(vm);
+}
+
+//////////////////  computed goto dispatch  //////////////////
+
+static TValue *vm_execute_goto(VM *vm, Vector *code) {
+  long long int pc = 0;
+
+  static void *const table[tOpCount] = {
+#define VM_HANDLER(op_name, ...) [op_name] = &&L_##op_name,
+#include "vm_handlers.h"
+#undef VM_HANDLER
+  };
 
   void **ops_ptr = xmalloc(sizeof(void *) * (code->len + 1));
   for (int j = 0; j < code->len; j++) {
     long long int idx = (long long int)code->data[j];
-    if (idx < table_len) {
+    if (idx >= 0 && idx < tOpCount) {
       ops_ptr[j] = table[idx];
     }
   }
   ops_ptr[code->len] = &&L_end;
 
-#define DTHC_CASE(op_name, proc_code)                                          \
+  /* L_start */
+  goto *ops_ptr[pc];
+
+#define VM_HANDLER(op_name, ...)                                               \
   L_##op_name : {                                                              \
-    VM_DEBUG_PRINT(vm, op);                                                    \
-    proc_code;                                                                 \
+    VM_DEBUG_PRINT(vm, (long long int)code->data[pc]);                         \
+    __VA_ARGS__;                                                               \
     pc++;                                                                      \
     goto *ops_ptr[pc];                                                         \
   }
-
-  /* L_start */
-  op = (long long int)code->data[0];
-  goto *table[op];
-
-  DTHC_CASE(tOpVariableDeclareOnlySymbol, {
-    TValue *symbol = (TValue *)code->data[pc++ + 1];
-    env_def(vm->env, tv_getString(symbol), new_TValue());
-  })
-
-  DTHC_CASE(tOpVariableDeclareWithAssign, {
-    TValue *symbol = (TValue *)code->data[pc++ + 1];
-    TValue *v = (TValue *)vec_pop(vm->stack);
-    env_def(vm->env, tv_getString(symbol), v);
-  })
-
-  DTHC_CASE(tOpAssignExpression, {
-    TValue *symbol = (TValue *)code->data[pc++ + 1];
-    TValue *v = (TValue *)vec_pop(vm->stack);
-    env_def(vm->env, tv_getString(symbol), v);
-  })
-
-  DTHC_CASE(tOpPush, {
-    TValue *v = (TValue *)code->data[pc++ + 1];
-    VM_ASSERT(v != NULL, "Execute Error on tOpPush");
-    vec_push(vm->stack, v);
-  })
-
-  DTHC_CASE(tOpPop, { vec_pop(vm->stack); })
-
-  DTHC_CASE(tOpAdd, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    VM_ASSERT0(a->tt == b->tt && a->tt == Long);
-    vec_push(vm->stack,
-             new_TValue_with_integer(a->value.integer + b->value.integer));
-  })
-
-  DTHC_CASE(tOpSub, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    assert(a->tt == b->tt && a->tt == Long);
-    vec_push(vm->stack,
-             new_TValue_with_integer(a->value.integer - b->value.integer));
-  })
-
-  DTHC_CASE(tOpMul, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    assert(a->tt == b->tt && a->tt == Long);
-    vec_push(vm->stack,
-             new_TValue_with_integer(a->value.integer * b->value.integer));
-  })
-
-  DTHC_CASE(tOpDiv, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    assert(a->tt == b->tt && a->tt == Long);
-    vec_push(vm->stack,
-             new_TValue_with_integer(a->value.integer / b->value.integer));
-  })
-
-  DTHC_CASE(tOpMod, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    assert(a->tt == b->tt && a->tt == Long);
-    vec_push(vm->stack,
-             new_TValue_with_integer(a->value.integer % b->value.integer));
-  })
-
-  DTHC_CASE(tOpReturn, { return vm_stackPeekTop(vm); })
-
-  DTHC_CASE(tOpGetVariable, {
-    TValue *v = (TValue *)code->data[pc++ + 1];
-    VM_ASSERT(v != NULL, "Execute Error on tOpGetVariable");
-    HasPtrResult *ptr = env_has_ptr(vm->env, tv_getString(v));
-    if (ptr->tv != NULL) {
-      vec_push(vm->stack, ptr->tv);
-    } else {
-      fprintf(stderr, "No such a variable %s", tv_getString(v));
-      exit(EXIT_FAILURE);
-    }
-  })
-
-  DTHC_CASE(tOpSetVariablePop, {
-    TValue *dst = (TValue *)code->data[pc++ + 1];
-    TValue *v = (TValue *)vec_pop(vm->stack);
-    env_set(vm->env, tv_getString(dst), v);
-  })
-
-  DTHC_CASE(tOpCall, {
-    TValue *func = (TValue *)code->data[pc++ + 1];
-    sds fname = tv_getString(func);
-    Env *cpyEnv = vm->env;
-    vm->env = env_dup(tv_getFunction(env_get(vm->env, fname))->env);
-    vm_execute(vm, tv_getFunction(env_get(cpyEnv, fname))->func_body);
-    vm->env = cpyEnv;
-  })
-
-  DTHC_CASE(tOpNop, {})
-
-  DTHC_CASE(tOpFunctionDeclare, {
-    TValue *symbol = (TValue *)code->data[pc++ + 1];
-    sds func_name = tv_getString(symbol);
-    TValue *op_blocks_length = (TValue *)code->data[pc++ + 1];
-    Vector *func_body = new_vec();
-    for (int i = 0; i < tv_getLong(op_blocks_length); i++) {
-      vec_push(func_body, code->data[pc++ + 1]);
-    }
-    env_def(vm->env, func_name,
-            new_TValue_with_func(
-                new_VMFunction(func_name, func_body, env_dup(vm->env))));
-  })
-
-  DTHC_CASE(tOpEqualExpression, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    vec_push(vm->stack, new_TValue_with_bool(tv_equals(a, b)));
-  })
-
-  DTHC_CASE(tOpNotEqualExpression, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    vec_push(vm->stack, new_TValue_with_bool(!tv_equals(a, b)));
-  })
-
-  DTHC_CASE(tOpLtExpression, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    vec_push(vm->stack, new_TValue_with_bool(tv_lt(a, b)));
-  })
-  DTHC_CASE(tOpLteExpression, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    vec_push(vm->stack, new_TValue_with_bool(tv_lte(a, b)));
-  })
-
-  DTHC_CASE(tOpGtExpression, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    vec_push(vm->stack, new_TValue_with_bool(tv_gt(a, b)));
-  })
-
-  DTHC_CASE(tOpGteExpression, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    vec_push(vm->stack, new_TValue_with_bool(tv_gte(a, b)));
-  })
-
-  DTHC_CASE(tOpAndExpression, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    vec_push(vm->stack, new_TValue_with_bool(tv_and(a, b)));
-  })
-
-  DTHC_CASE(tOpOrExpression, {
-    TValue *a = (TValue *)vec_pop(vm->stack);
-    TValue *b = (TValue *)vec_pop(vm->stack);
-    vec_push(vm->stack, new_TValue_with_bool(tv_or(a, b)));
-  })
-
-  DTHC_CASE(tOpXorExpression, { VM_ERROR("Not implemented <XOR>"); })
-
-  DTHC_CASE(tOpPrint, {
-    TValue *v = (TValue *)vec_pop(vm->stack);
-    tv_print(v);
-  })
-
-  DTHC_CASE(tOpPrintln, {
-    TValue *v = (TValue *)vec_pop(vm->stack);
-    tv_print(v);
-    printf("\n");
-  })
-
-  DTHC_CASE(tOpJumpRel, {
-    TValue *v = (TValue *)code->data[pc++ + 1];
-    pc += tv_getLong(v);
-  })
-
-  DTHC_CASE(tOpJumpAbs, {
-    TValue *v = (TValue *)code->data[pc++ + 1];
-    pc = tv_getLong(v);
-  })
-
-  DTHC_CASE(tOpIFStatement, {
-    TValue *cond = (TValue *)vec_pop(vm->stack);
-    bool condResult;
-    switch (cond->tt) {
-    case Long:
-      condResult = tv_getLong(cond) != 0;
-      break;
-    case Bool:
-      condResult = tv_getBool(cond);
-      break;
-    case String:
-      VM_ERROR("Execute Error Invalid Condition <string>");
-    case Array:
-      VM_ERROR("Execute Error Invalid Condition <array>");
-    case Function:
-      VM_ERROR("Execute Error Invalid Condition <function>");
-    case Null:
-      condResult = false;
-      break;
-    }
-
-    long long int trueBlockLength = tv_getLong((TValue *)code->data[pc++ + 1]);
-
-    if (!condResult) {
-      pc += trueBlockLength;
-    }
-  })
-
-  DTHC_CASE(tOpSetArrayElement, {
-    sds variable = tv_getString((TValue *)code->data[pc++ + 1]);
-    long long int idx = tv_getLong((TValue *)vec_pop(vm->stack));
-    TValue *val = (TValue *)vec_pop(vm->stack);
-    Vector *array = tv_getArray(env_get(vm->env, variable));
-    array->data[idx] = val;
-  })
-
-  DTHC_CASE(tOpGetArrayElement, {
-    sds variable = tv_getString((TValue *)code->data[pc++ + 1]);
-    long long int idx = tv_getLong((TValue *)vec_pop(vm->stack));
-    vec_push(vm->stack, vec_get(tv_getArray(env_get(vm->env, variable)), idx));
-  })
-
-  DTHC_CASE(tOpMakeArray, {
-    long long int array_size = tv_getLong((TValue *)code->data[pc++ + 1]);
-    Vector *array = new_vec();
-    vec_expand(array, array_size);
-    for (int i = array_size - 1; i >= 0; i--) {
-      array->data[i] = (TValue *)vec_pop(vm->stack);
-    }
-    vec_push(vm->stack, new_TValue_with_array(array));
-  })
-
-  DTHC_CASE(tIValue, { VM_ERROR("TValue* should not peek directly"); })
-
-  DTHC_CASE(tOpAssert, {
-    sds msg = tv_getString((TValue *)vec_pop(vm->stack));
-    bool result = tv_getBool((TValue *)vec_pop(vm->stack));
-    if (!result) {
-      VM_ERROR(msg);
-    }
-  })
+#include "vm_handlers.h"
+#undef VM_HANDLER
 
 L_end:
   return vm_stackPeekTop(vm);
 }
-#else
-TValue *vm_execute(VM *vm, Vector *code) {
-  for (long long int pc = 0; pc < code->len; pc++) {
-    int op = (int)code->data[pc];
-
-    VM_DEBUG_PRINT(vm, op);
 
-    switch (op) {
-    case tOpVariableDeclareOnlySymbol: {
-      TValue *symbol = (TValue *)code->data[pc++ + 1];
-      env_def(vm->env, tv_getString(symbol), new_TValue());
-      break;
-    }
-    case tOpVariableDeclareWithAssign: {
-      TValue *symbol = (TValue *)code->data[pc++ + 1];
-      TValue *v = (TValue *)vec_pop(vm->stack);
-      env_def(vm->env, tv_getString(symbol), v);
-      break;
-    }
-    case tOpAssignExpression: {
-      TValue *symbol = (TValue *)code->data[pc++ + 1];
-      TValue *v = (TValue *)vec_pop(vm->stack);
-      env_def(vm->env, tv_getString(symbol), v);
-      break;
-    }
-    case tOpPush: {
-      TValue *v = (TValue *)code->data[pc++ + 1];
-      VM_ASSERT(v != NULL, "Execute Error on tOpPush");
-      vec_push(vm->stack, v);
-      break;
-    }
-    case tOpPop: {
-      vec_pop(vm->stack);
-      break;
-    }
-    case tOpAdd: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      VM_ASSERT0(a->tt == b->tt && a->tt == Long);
-      vec_push(vm->stack,
-               new_TValue_with_integer(a->value.integer + b->value.integer));
-      break;
-    }
-    case tOpSub: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      assert(a->tt == b->tt && a->tt == Long);
-      vec_push(vm->stack,
-               new_TValue_with_integer(a->value.integer - b->value.integer));
-      break;
-    }
-    case tOpMul: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      assert(a->tt == b->tt && a->tt == Long);
-      vec_push(vm->stack,
-               new_TValue_with_integer(a->value.integer * b->value.integer));
-      break;
-    }
-    case tOpDiv: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      assert(a->tt == b->tt && a->tt == Long);
-      vec_push(vm->stack,
-               new_TValue_with_integer(a->value.integer / b->value.integer));
-      break;
-    }
-    case tOpMod: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      assert(a->tt == b->tt && a->tt == Long);
-      vec_push(vm->stack,
-               new_TValue_with_integer(a->value.integer % b->value.integer));
-      break;
-    }
-    case tOpReturn: {
-      return vm_stackPeekTop(vm);
-    }
-    case tOpGetVariable: {
-      TValue *v = (TValue *)code->data[pc++ + 1];
-      VM_ASSERT(v != NULL, "Execute Error on tOpGetVariable");
-      HasPtrResult *ptr = env_has_ptr(vm->env, tv_getString(v));
-      if (ptr->tv != NULL) {
-        vec_push(vm->stack, ptr->tv);
-      } else {
-        fprintf(stderr, "No such a variable %s", tv_getString(v));
-        exit(EXIT_FAILURE);
-      }
-      break;
-    }
-    case tOpSetVariablePop: {
-      TValue *dst = (TValue *)code->data[pc++ + 1];
-      TValue *v = (TValue *)vec_pop(vm->stack);
-      env_set(vm->env, tv_getString(dst), v);
-      break;
-    }
-    case tOpCall: {
-      TValue *func = (TValue *)code->data[pc++ + 1];
-      sds fname = tv_getString(func);
-      Env *cpyEnv = vm->env;
-      vm->env = env_dup(tv_getFunction(env_get(vm->env, fname))->env);
-      vm_execute(vm, tv_getFunction(env_get(cpyEnv, fname))->func_body);
-      vm->env = cpyEnv;
-      break;
-    }
-    case tOpNop: {
-      break;
-    }
-    case tOpFunctionDeclare: {
-      TValue *symbol = (TValue *)code->data[pc++ + 1];
-      sds func_name = tv_getString(symbol);
-      TValue *op_blocks_length = (TValue *)code->data[pc++ + 1];
-      Vector *func_body = new_vec();
-      for (int i = 0; i < tv_getLong(op_blocks_length); i++) {
-        vec_push(func_body, code->data[pc++ + 1]);
-      }
-      env_def(vm->env, func_name,
-              new_TValue_with_func(
-                  new_VMFunction(func_name, func_body, env_dup(vm->env))));
-      break;
-    }
-    case tOpEqualExpression: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      vec_push(vm->stack, new_TValue_with_bool(tv_equals(a, b)));
-      break;
-    }
-    case tOpNotEqualExpression: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      vec_push(vm->stack, new_TValue_with_bool(!tv_equals(a, b)));
-      break;
-    }
-    case tOpLtExpression: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      vec_push(vm->stack, new_TValue_with_bool(tv_lt(a, b)));
-      break;
-    }
-    case tOpLteExpression: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      vec_push(vm->stack, new_TValue_with_bool(tv_lte(a, b)));
-      break;
-    }
-    case tOpGtExpression: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      vec_push(vm->stack, new_TValue_with_bool(tv_gt(a, b)));
-      break;
-    }
-    case tOpGteExpression: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      vec_push(vm->stack, new_TValue_with_bool(tv_gte(a, b)));
-      break;
-    }
-    case tOpAndExpression: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      vec_push(vm->stack, new_TValue_with_bool(tv_and(a, b)));
-      break;
-    }
-    case tOpOrExpression: {
-      TValue *a = (TValue *)vec_pop(vm->stack),
-             *b = (TValue *)vec_pop(vm->stack);
-      vec_push(vm->stack, new_TValue_with_bool(tv_or(a, b)));
-      break;
-    }
-    case tOpXorExpression: {
-      VM_ERROR("Not implemented <XOR>");
-    }
-    case tOpPrint: {
-      TValue *v = (TValue *)vec_pop(vm->stack);
-      tv_print(v);
-      break;
-    }
-    case tOpPrintln: {
-      TValue *v = (TValue *)vec_pop(vm->stack);
-      tv_print(v);
-      printf("\n");
-      break;
-    }
-    case tOpJumpRel: {
-      TValue *v = (TValue *)code->data[pc++ + 1];
-      pc += tv_getLong(v);
-      break;
-    }
-    case tOpJumpAbs: {
-      TValue *v = (TValue *)code->data[pc++ + 1];
-      pc = tv_getLong(v);
-      break;
-    }
-    case tOpIFStatement: {
-      TValue *cond = (TValue *)vec_pop(vm->stack);
-      bool condResult;
-      switch (cond->tt) {
-      case Long:
-        condResult = tv_getLong(cond) != 0;
-        break;
-      case Bool:
-        condResult = tv_getBool(cond);
-        break;
-      case String:
-        VM_ERROR("Execute Error Invalid Condition <string>");
-      case Array:
-        VM_ERROR("Execute Error Invalid Condition <array>");
-      case Function:
-        VM_ERROR("Execute Error Invalid Condition <function>");
-      case Null:
-        condResult = false;
-        break;
-      }
-
-      long long int trueBlockLength =
-          tv_getLong((TValue *)code->data[pc++ + 1]);
-
-      if (condResult) {
-        break;
-      } else {
-        pc += trueBlockLength;
-      }
-      break;
-    }
-    case tOpSetArrayElement: {
-      sds variable = tv_getString((TValue *)code->data[pc++ + 1]);
-      long long int idx = tv_getLong((TValue *)vec_pop(vm->stack));
-      TValue *val = (TValue *)vec_pop(vm->stack);
-      Vector *array = tv_getArray(env_get(vm->env, variable));
-      array->data[idx] = val;
-      break;
-    }
-    case tOpGetArrayElement: {
-      sds variable = tv_getString((TValue *)code->data[pc++ + 1]);
-      long long int idx = tv_getLong((TValue *)vec_pop(vm->stack));
-      vec_push(vm->stack,
-               vec_get(tv_getArray(env_get(vm->env, variable)), idx));
-      break;
-    }
-    case tOpMakeArray: {
-      long long int array_size = tv_getLong((TValue *)code->data[pc++ + 1]);
-      Vector *array = new_vec();
-      vec_expand(array, array_size);
-      for (int i = array_size - 1; i >= 0; i--) {
-        array->data[i] = (TValue *)vec_pop(vm->stack);
-      }
-      vec_push(vm->stack, new_TValue_with_array(array));
-      break;
-    }
-    case tIValue:
-      VM_ERROR("TValue* should not peek directly");
-    case tOpAssert: {
-      sds msg = tv_getString((TValue *)vec_pop(vm->stack));
-      bool result = tv_getBool((TValue *)vec_pop(vm->stack));
-      if (!result) {
-        VM_ERROR(msg);
-      }
-      break;
-    }
-    default:
-      fprintf(stderr, "<VM error> Invalid op\n");
-    }
+//////////////////  tail-call dispatch  //////////////////
+
+#ifdef VM_MUSTTAIL
+
+/**
+ * Every handler is a function ending in a guaranteed tail call of the next
+ * one, so the compiler keeps vm, code and pc in registers across handlers.
+ */
+typedef struct TailOp_t TailOp;
+typedef TValue *(*TailHandler)(VM *vm, Vector *code, const TailOp *ops,
+                               long long int pc);
+struct TailOp_t {
+  TailHandler handler;
+};
+
+#define VM_HANDLER(op_name, ...)                                               \
+  static TValue *tail_##op_name(VM *vm, Vector *code, const TailOp *ops,       \
+                                long long int pc) {                            \
+    VM_DEBUG_PRINT(vm, (long long int)code->data[pc]);                         \
+    __VA_ARGS__;                                                               \
+    pc++;                                                                      \
+    VM_MUSTTAIL return ops[pc].handler(vm, code, ops, pc);                     \
   }
+#include "vm_handlers.h"
+#undef VM_HANDLER
+
+static TValue *tail_end(VM *vm, Vector *code, const TailOp *ops,
+                        long long int pc) {
+  (void)code;
+  (void)ops;
+  (void)pc;
   return vm_stackPeekTop(vm);
 }
+
+static TValue *tail_invalid(VM *vm, Vector *code, const TailOp *ops,
+                            long long int pc) {
+  fprintf(stderr, "<VM error> Invalid op\n");
+  pc++;
+  VM_MUSTTAIL return ops[pc].handler(vm, code, ops, pc);
+}
+
+static TValue *vm_execute_tail(VM *vm, Vector *code) {
+  static const TailHandler table[tOpCount] = {
+#define VM_HANDLER(op_name, ...) [op_name] = tail_##op_name,
+#include "vm_handlers.h"
+#undef VM_HANDLER
+  };
+
+  TailOp *ops = xmalloc(sizeof(TailOp) * (code->len + 1));
+  for (long long int j = 0; j < code->len; j++) {
+    long long int idx = (long long int)code->data[j];
+    ops[j].handler =
+        idx >= 0 && idx < tOpCount && table[idx] ? table[idx] : tail_invalid;
+  }
+  ops[code->len].handler = tail_end;
+  return ops[0].handler(vm, code, ops, 0);
+}
 #endif
 
+/**
+ * Execute code on the stack interpreter with the dispatch strategy selected
+ * by vm->dispatch.
+ */
+TValue *vm_execute(VM *vm, Vector *code) {
+  switch (vm->dispatch) {
+  case DispatchSwitch:
+    return vm_execute_switch(vm, code);
+#ifdef VM_MUSTTAIL
+  case DispatchTail:
+    return vm_execute_tail(vm, code);
+#endif
+  default:
+    return vm_execute_goto(vm, code);
+  }
+}
+
 void code_printer(Vector *code) {
   printf("=====================================================\n");
   for (int idx = 0; idx < code->len;) {
@@ -732,6 +343,22 @@ void code_printer(Vector *code) {
     case tOpAndExpression:
     case tOpOrExpression:
     case tOpXorExpression:
+    case tOpAddLong:
+    case tOpSubLong:
+    case tOpMulLong:
+    case tOpDivLong:
+    case tOpModLong:
+    case tOpEqualLong:
+    case tOpNotEqualLong:
+    case tOpLtLong:
+    case tOpLteLong:
+    case tOpGtLong:
+    case tOpGteLong:
+    case tOpArrayLength:
+    case tOpArrayLoad:
+    case tOpArrayStore:
+    case tOpArrayLoadUnchecked:
+    case tOpArrayStoreUnchecked:
       type_print(type);
       printf("\n");
       break;
@@ -0,0 +1,331 @@
+/**
+ * Handlers of the stack interpreter, one per opcode.
+ *
+ * This file has no include guard: vm.c includes it once per dispatch
+ * strategy with VM_HANDLER(opcode, body) defined to turn every body into a
+ * switch case, a computed goto label or a function, and coroutine.c once
+ * more. A body runs with vm, code and pc in scope, pc at the opcode; it
+ * leaves pc at the last slot it consumed and the engine advances it. The
+ * includer defines TRACE_BACKWARD_JUMP.
+ *
+ * Opcodes that move pc, return or call are declared with VM_CONTROL instead,
+ * which is VM_HANDLER unless the includer defines it. The other bodies only
+ * touch code and pc through VM_OPERAND(), their operand, so jit.c and
+ * aot_runtime.h turn each of them into a helper function taking the operand
+ * and leave VM_CONTROL out, compiling those opcodes themselves.
+ */
+
+#ifndef VM_CONTROL
+#define VM_CONTROL VM_HANDLER
+#endif
+
+#ifndef VM_OPERAND
+#define VM_OPERAND() ((TValue *)code->data[pc++ + 1])
+#endif
+
+/**
+ * Body of the opcodes the optimizer specialized for Long operands, see ssa.c.
+ * The types are proven, so no check is left.
+ */
+#ifndef LONG_BINARY
+#define LONG_BINARY(make, operator)                                            \
+  {                                                                            \
+    TValue *a = (TValue *)vec_pop(vm->stack);                                  \
+    TValue *b = (TValue *)vec_pop(vm->stack);                                  \
+    vec_push(vm->stack, make(a->value.integer operator b->value.integer));     \
+  }
+#endif
+
+/* Set taken to whether a tOpIFStatement popping cond enters its block */
+#ifndef VM_CONDITION
+#define VM_CONDITION(taken, cond)                                              \
+  switch ((cond)->tt) {                                                        \
+  case Long:                                                                   \
+    taken = tv_getLong(cond) != 0;                                             \
+    break;                                                                     \
+  case Bool:                                                                   \
+    taken = tv_getBool(cond);                                                  \
+    break;                                                                     \
+  case String:                                                                 \
+    VM_ERROR("Execute Error Invalid Condition <string>");                      \
+  case Array:                                                                  \
+    VM_ERROR("Execute Error Invalid Condition <array>");                       \
+  case Function:                                                               \
+  case Native:                                                                 \
+    VM_ERROR("Execute Error Invalid Condition <function>");                    \
+  case Null:                                                                   \
+    taken = false;                                                             \
+    break;                                                                     \
+  }
+#endif
+
+VM_HANDLER(tOpVariableDeclareOnlySymbol, {
+  TValue *symbol = VM_OPERAND();
+  env_def(vm->env, tv_getString(symbol), new_TValue());
+})
+
+VM_HANDLER(tOpVariableDeclareWithAssign, {
+  TValue *symbol = VM_OPERAND();
+  TValue *v = (TValue *)vec_pop(vm->stack);
+  env_def(vm->env, tv_getString(symbol), v);
+})
+
+VM_HANDLER(tOpAssignExpression, {
+  TValue *symbol = VM_OPERAND();
+  TValue *v = (TValue *)vec_pop(vm->stack);
+  env_def(vm->env, tv_getString(symbol), v);
+})
+
+VM_HANDLER(tOpPush, {
+  TValue *v = VM_OPERAND();
+  VM_ASSERT(v != NULL, "Execute Error on tOpPush");
+  vec_push(vm->stack, v);
+})
+
+VM_HANDLER(tOpPop, { vec_pop(vm->stack); })
+
+VM_HANDLER(tOpAdd, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  VM_ASSERT0(a->tt == b->tt && a->tt == Long);
+  vec_push(vm->stack,
+           new_TValue_with_integer(a->value.integer + b->value.integer));
+})
+
+VM_HANDLER(tOpSub, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  VM_ASSERT0(a->tt == b->tt && a->tt == Long);
+  vec_push(vm->stack,
+           new_TValue_with_integer(a->value.integer - b->value.integer));
+})
+
+VM_HANDLER(tOpMul, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  VM_ASSERT0(a->tt == b->tt && a->tt == Long);
+  vec_push(vm->stack,
+           new_TValue_with_integer(a->value.integer * b->value.integer));
+})
+
+VM_HANDLER(tOpDiv, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  VM_ASSERT0(a->tt == b->tt && a->tt == Long);
+  vec_push(vm->stack,
+           new_TValue_with_integer(a->value.integer / b->value.integer));
+})
+
+VM_HANDLER(tOpMod, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  VM_ASSERT0(a->tt == b->tt && a->tt == Long);
+  vec_push(vm->stack,
+           new_TValue_with_integer(a->value.integer % b->value.integer));
+})
+
+VM_CONTROL(tOpReturn, { return vm_stackPeekTop(vm); })
+
+VM_HANDLER(tOpGetVariable, {
+  TValue *v = VM_OPERAND();
+  VM_ASSERT(v != NULL, "Execute Error on tOpGetVariable");
+  HasPtrResult *ptr = env_has_ptr(vm->env, tv_getString(v));
+  if (ptr->tv != NULL) {
+    vec_push(vm->stack, ptr->tv);
+  } else {
+    VM_ERROR(sdscatprintf(sdsempty(), "No such a variable %s",
+                          tv_getString(v)));
+  }
+})
+
+VM_HANDLER(tOpSetVariablePop, {
+  TValue *dst = VM_OPERAND();
+  TValue *v = (TValue *)vec_pop(vm->stack);
+  env_set(vm->env, tv_getString(dst), v);
+})
+
+VM_CONTROL(tOpCall, {
+  TValue *func = VM_OPERAND();
+  vm_call(vm, tv_getString(func));
+})
+
+VM_HANDLER(tOpNop, {})
+
+VM_CONTROL(tOpFunctionDeclare, {
+  TValue *symbol = VM_OPERAND();
+  sds func_name = tv_getString(symbol);
+  long long int body_len = tv_getLong(VM_OPERAND());
+  /* the body runs in place, code is never written */
+  Vector *func_body = vec_view(code, pc + 1, body_len);
+  pc += body_len;
+  env_def(vm->env, func_name,
+          new_TValue_with_func(
+              new_VMFunction(func_name, func_body, env_dup(vm->env))));
+})
+
+VM_HANDLER(tOpEqualExpression, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  vec_push(vm->stack, new_TValue_with_bool(tv_equals(a, b)));
+})
+
+VM_HANDLER(tOpNotEqualExpression, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  vec_push(vm->stack, new_TValue_with_bool(!tv_equals(a, b)));
+})
+
+VM_HANDLER(tOpLtExpression, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  vec_push(vm->stack, new_TValue_with_bool(tv_lt(a, b)));
+})
+VM_HANDLER(tOpLteExpression, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  vec_push(vm->stack, new_TValue_with_bool(tv_lte(a, b)));
+})
+
+VM_HANDLER(tOpGtExpression, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  vec_push(vm->stack, new_TValue_with_bool(tv_gt(a, b)));
+})
+
+VM_HANDLER(tOpGteExpression, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  vec_push(vm->stack, new_TValue_with_bool(tv_gte(a, b)));
+})
+
+VM_HANDLER(tOpAndExpression, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  vec_push(vm->stack, new_TValue_with_bool(tv_and(a, b)));
+})
+
+VM_HANDLER(tOpOrExpression, {
+  TValue *a = (TValue *)vec_pop(vm->stack);
+  TValue *b = (TValue *)vec_pop(vm->stack);
+  vec_push(vm->stack, new_TValue_with_bool(tv_or(a, b)));
+})
+
+VM_HANDLER(tOpXorExpression, { VM_ERROR("Not implemented <XOR>"); })
+
+VM_HANDLER(tOpPrint, {
+  TValue *v = (TValue *)vec_pop(vm->stack);
+  tv_fprint(vm->out, v);
+})
+
+VM_HANDLER(tOpPrintln, {
+  TValue *v = (TValue *)vec_pop(vm->stack);
+  tv_fprint(vm->out, v);
+  fputc('\n', vm->out);
+})
+
+VM_CONTROL(tOpJumpRel, {
+  long long int from = pc;
+  TValue *v = VM_OPERAND();
+  pc += tv_getLong(v);
+  VM_CHECK_HEAP();
+  TRACE_BACKWARD_JUMP(from);
+})
+
+VM_CONTROL(tOpJumpAbs, {
+  long long int from = pc;
+  TValue *v = VM_OPERAND();
+  pc = tv_getLong(v);
+  VM_CHECK_HEAP();
+  TRACE_BACKWARD_JUMP(from);
+})
+
+VM_CONTROL(tOpIFStatement, {
+  TValue *cond = (TValue *)vec_pop(vm->stack);
+  bool condResult = false;
+  VM_CONDITION(condResult, cond);
+  long long int trueBlockLength = tv_getLong(VM_OPERAND());
+
+  if (!condResult) {
+    pc += trueBlockLength;
+  }
+})
+
+VM_HANDLER(tOpSetArrayElement, {
+  sds variable = tv_getString(VM_OPERAND());
+  long long int idx = tv_getLong((TValue *)vec_pop(vm->stack));
+  TValue *val = (TValue *)vec_pop(vm->stack);
+  TArray *array = tv_getTArray(env_get(vm->env, variable));
+  VM_CHECK_INDEX(array, idx);
+  ta_set(array, idx, val);
+})
+
+VM_HANDLER(tOpGetArrayElement, {
+  sds variable = tv_getString(VM_OPERAND());
+  long long int idx = tv_getLong((TValue *)vec_pop(vm->stack));
+  TArray *array = tv_getTArray(env_get(vm->env, variable));
+  VM_CHECK_INDEX(array, idx);
+  vec_push(vm->stack, ta_get(array, idx));
+})
+
+VM_HANDLER(tOpMakeArray, {
+  long long int array_size = tv_getLong(VM_OPERAND());
+  vm->stack->len -= array_size;
+  vec_push(vm->stack,
+           new_TValue_with_elements((TValue **)vm->stack->data + vm->stack->len,
+                                    array_size));
+})
+
+VM_HANDLER(tIValue, { VM_ERROR("TValue* should not peek directly"); })
+
+VM_HANDLER(tOpAddLong, LONG_BINARY(new_TValue_with_integer, +))
+VM_HANDLER(tOpSubLong, LONG_BINARY(new_TValue_with_integer, -))
+VM_HANDLER(tOpMulLong, LONG_BINARY(new_TValue_with_integer, *))
+VM_HANDLER(tOpDivLong, LONG_BINARY(new_TValue_with_integer, /))
+VM_HANDLER(tOpModLong, LONG_BINARY(new_TValue_with_integer, %))
+VM_HANDLER(tOpEqualLong, LONG_BINARY(new_TValue_with_bool, ==))
+VM_HANDLER(tOpNotEqualLong, LONG_BINARY(new_TValue_with_bool, !=))
+VM_HANDLER(tOpLtLong, LONG_BINARY(new_TValue_with_bool, <))
+VM_HANDLER(tOpLteLong, LONG_BINARY(new_TValue_with_bool, <=))
+VM_HANDLER(tOpGtLong, LONG_BINARY(new_TValue_with_bool, >))
+VM_HANDLER(tOpGteLong, LONG_BINARY(new_TValue_with_bool, >=))
+
+VM_HANDLER(tOpArrayLength, {
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  vec_push(vm->stack, new_TValue_with_integer(array->len));
+})
+
+VM_HANDLER(tOpArrayLoad, {
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  long long int idx = tv_getLong((TValue *)vec_pop(vm->stack));
+  VM_CHECK_INDEX(array, idx);
+  vec_push(vm->stack, ta_get(array, idx));
+})
+
+VM_HANDLER(tOpArrayStore, {
+  TArray *array = tv_getTArray((TValue *)vec_pop(vm->stack));
+  long long int idx = tv_getLong((TValue *)vec_pop(vm->stack));
+  VM_CHECK_INDEX(array, idx);
+  ta_set(array, idx, vec_pop(vm->stack));
+})
+
+VM_HANDLER(tOpArrayLoadUnchecked, {
+  TArray *array = ((TValue *)vec_pop(vm->stack))->value.array;
+  long long int idx = ((TValue *)vec_pop(vm->stack))->value.integer;
+  VM_CHECK_INDEX_LOW(idx);
+  vec_push(vm->stack, ta_get(array, idx));
+})
+
+VM_HANDLER(tOpArrayStoreUnchecked, {
+  TArray *array = ((TValue *)vec_pop(vm->stack))->value.array;
+  long long int idx = ((TValue *)vec_pop(vm->stack))->value.integer;
+  VM_CHECK_INDEX_LOW(idx);
+  ta_set(array, idx, vec_pop(vm->stack));
+})
+
+VM_HANDLER(tOpAssert, {
+  sds msg = tv_getString((TValue *)vec_pop(vm->stack));
+  bool result = tv_getBool((TValue *)vec_pop(vm->stack));
+  if (!result) {
+    VM_ERROR(msg);
+  }
+})